@@ -0,0 +1,640 @@
+#include <apetag.h>
+#include <apetool.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Maximum number of files opened and waiting to be edited, per thread */
+#define APEEDIT_QUEUE_PER_THREAD 8
+
+/* Maximum number of threads */
+#define APEEDIT_MAX_THREADS 1024
+
+/* Number of files updated before each group commit, which are kept open
+   until the commit */
+#define APEEDIT_GROUP_SIZE 256
+
+/* Edit operations */
+#define APEEDIT_SET 0
+#define APEEDIT_REMOVE 1
+#define APEEDIT_CLEAR 2
+
+/* A single edit operation from the manifest */
+struct ApeEdit_op {
+    int type;
+    char *key;
+    char *value;
+    u_int32_t size;
+};
+
+/* All of the edits for a single file, applied with a single update.  Files
+   that exist are identified by device and inode, so all paths to a file
+   share a job. */
+struct ApeEdit_job {
+    char *path;
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    size_t line;
+    struct ApeTag *tag;
+    struct ApeEdit_op *ops;
+    size_t num_ops;
+    size_t ops_capacity;
+    struct ApeEdit_job *next;
+};
+
+/* Queue of opened files waiting for a worker thread */
+struct ApeEdit_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    size_t num_threads;
+    struct ApeEdit_job *head;
+    struct ApeEdit_job *tail;
+    size_t queued;
+    size_t capacity;
+    int done;
+    int ret;
+};
+
+/* Updates added to a group for -s group.  Once full, the batch is replaced
+   by a new one, and committed by the thread finishing the last update
+   being added to it. */
+struct ApeEdit_batch {
+    struct ApeTag_group *group;
+    struct ApeEdit_job *jobs;
+    size_t count;
+    size_t pending;
+};
+
+int ApeEdit_read_manifest(FILE *manifest, const char *name);
+int ApeEdit_parse_line(char *line, size_t lineno, const char *name);
+struct ApeEdit_job *ApeEdit_find_job(char *path, size_t lineno);
+u_int32_t ApeEdit_job_hash(const struct ApeEdit_job *job);
+int ApeEdit_submit(struct ApeEdit_job *job);
+int ApeEdit_run(struct ApeEdit_job *job);
+int ApeEdit_apply(struct ApeEdit_job *job, struct ApeEdit_op *op);
+int ApeEdit_update(struct ApeEdit_job *job);
+struct ApeEdit_batch *ApeEdit_batch_new(void);
+int ApeEdit_commit(struct ApeEdit_batch *b);
+void ApeEdit_job_free(struct ApeEdit_job *job);
+int ApeEdit_pool_start(size_t num_threads);
+int ApeEdit_pool_finish(void);
+void *ApeEdit_pool_worker(void *arg);
+
+/* Jobs read from the manifest, in the order their files first appear, and
+   an open addressing hash table of them by path */
+static struct ApeEdit_job *jobs_head = NULL;
+static struct ApeEdit_job *jobs_tail = NULL;
+static struct ApeEdit_job **jobs_by_path = NULL;
+static size_t jobs_capacity = 0;
+static size_t num_jobs = 0;
+
+/* Thread pool used when -j is greater than 1, NULL otherwise */
+static struct ApeEdit_pool *pool = NULL;
+
+/* Whether -s was given, and the journaled update sync policy it gave */
+static int atomic = 0;
+static enum ApeTag_sync sync_policy = APE_SYNC_NONE;
+
+/* Batch being added to for -s group, NULL otherwise */
+static struct ApeEdit_batch *batch = NULL;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Edit the files listed in the manifest */
+int main(int argc, char *argv[]) {
+    FILE *manifest = stdin;
+    const char *name = "stdin";
+    long jobs = 1;
+    int ret;
+    int ch;
+    char *end;
+
+    while ((ch = getopt(argc, argv, "j:s:")) != -1) {
+        switch (ch) {
+        case 'j':
+            jobs = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || jobs < 1 || jobs > APEEDIT_MAX_THREADS) {
+                errx(1, "invalid number of jobs: %s", optarg);
+            }
+            break;
+        case 's':
+            atomic = 1;
+            if (strcmp(optarg, "none") == 0) {
+                sync_policy = APE_SYNC_NONE;
+            } else if (strcmp(optarg, "file") == 0) {
+                sync_policy = APE_SYNC_FILE;
+            } else if (strcmp(optarg, "group") == 0) {
+                sync_policy = APE_SYNC_GROUP;
+            } else {
+                errx(1, "invalid sync policy: %s", optarg);
+            }
+            break;
+        default:
+            printf("usage: %s [-j jobs] [-s none|file|group] [manifest]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc > optind + 1) {
+        printf("usage: %s [-j jobs] [-s none|file|group] [manifest]\n", argv[0]);
+        return 1;
+    }
+    if (argc == optind + 1 && strcmp(argv[optind], "-") != 0) {
+        name = argv[optind];
+        if ((manifest = fopen(name, "r")) == NULL) {
+            err(1, "%s", name);
+        }
+    }
+
+    if (ApeTag_mt_init() != 0) {
+        errx(1, "unable to initialize genre table");
+    }
+    if (sync_policy == APE_SYNC_GROUP && (batch = ApeEdit_batch_new()) == NULL) {
+        err(1, NULL);
+    }
+    if (jobs > 1 && ApeEdit_pool_start((size_t)jobs) != 0) {
+        err(1, NULL);
+    }
+
+    ret = ApeEdit_read_manifest(manifest, name);
+
+    if (pool != NULL && ApeEdit_pool_finish() != 0) {
+        ret = 1;
+    }
+    if (batch != NULL && ApeEdit_commit(batch) != 0) {
+        ret = 1;
+    }
+    if (manifest != stdin) {
+        fclose(manifest);
+    }
+
+    return ret;
+}
+
+/*
+Reads the manifest, grouping all lines for the same file into a single
+job, so that each file is only updated once, then submits the jobs.
+*/
+int ApeEdit_read_manifest(FILE *manifest, const char *name) {
+    struct ApeEdit_job *job;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    size_t lineno = 0;
+    ssize_t length;
+    int ret = 0;
+
+    while ((length = getline(&line, &line_capacity, manifest)) != -1) {
+        lineno++;
+        if (length > 0 && line[length-1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+        if (ApeEdit_parse_line(line, lineno, name) != 0) {
+            ret = 1;
+        }
+    }
+    if (ferror(manifest)) {
+        warn("%s", name);
+        ret = 1;
+    }
+    free(line);
+    free(jobs_by_path);
+    jobs_by_path = NULL;
+
+    while ((job = jobs_head) != NULL) {
+        jobs_head = job->next;
+        job->next = NULL;
+        if (ApeEdit_submit(job) != 0) {
+            ret = 1;
+        }
+    }
+    jobs_tail = NULL;
+
+    return ret;
+}
+
+/*
+Parses a manifest line, which has the file, operation, key, and value
+separated by tabs, and adds the operation to the file's job.
+*/
+int ApeEdit_parse_line(char *line, size_t lineno, const char *name) {
+    struct ApeEdit_job *job;
+    struct ApeEdit_op op;
+    struct ApeEdit_op *ops;
+    char *fields[4];
+    size_t num_fields = 0;
+    size_t capacity;
+    char *c = line;
+
+    while (num_fields < 4) {
+        fields[num_fields++] = c;
+        if ((c = strchr(c, '\t')) == NULL) {
+            break;
+        }
+        *c++ = '\0';
+    }
+
+    memset(&op, 0, sizeof(op));
+    if (num_fields == 4 && strcmp(fields[1], "set") == 0) {
+        op.type = APEEDIT_SET;
+    } else if (num_fields == 3 && strcmp(fields[1], "remove") == 0) {
+        op.type = APEEDIT_REMOVE;
+    } else if (num_fields == 2 && strcmp(fields[1], "clear") == 0) {
+        op.type = APEEDIT_CLEAR;
+    } else {
+        warnx("%s:%lu: invalid manifest line", name, (unsigned long)lineno);
+        return 1;
+    }
+
+    job = ApeEdit_find_job(fields[0], lineno);
+
+    if (op.type != APEEDIT_CLEAR && (op.key = strdup(fields[2])) == NULL) {
+        err(1, NULL);
+    }
+    if (op.type == APEEDIT_SET && (op.value = ApeTool_unescape(fields[3], &op.size)) == NULL) {
+        err(1, NULL);
+    }
+
+    if (job->num_ops == job->ops_capacity) {
+        capacity = job->ops_capacity ? job->ops_capacity * 2 : 8;
+        if ((ops = realloc(job->ops, capacity * sizeof(struct ApeEdit_op))) == NULL) {
+            err(1, NULL);
+        }
+        job->ops = ops;
+        job->ops_capacity = capacity;
+    }
+    job->ops[job->num_ops++] = op;
+
+    return 0;
+}
+
+/*
+Returns the job for the given path's file, creating it if this is the first
+line for the file.  Jobs are kept in an open addressing hash table, which is
+resized when it is half full.
+*/
+struct ApeEdit_job *ApeEdit_find_job(char *path, size_t lineno) {
+    struct ApeEdit_job **table;
+    struct ApeEdit_job *job;
+    struct ApeEdit_job key;
+    struct stat sb;
+    size_t capacity;
+    size_t i;
+    size_t j;
+
+    if (num_jobs * 2 >= jobs_capacity) {
+        capacity = jobs_capacity ? jobs_capacity * 2 : 256;
+        if ((table = calloc(capacity, sizeof(struct ApeEdit_job *))) == NULL) {
+            err(1, NULL);
+        }
+        for (i=0; i < jobs_capacity; i++) {
+            if (jobs_by_path[i] == NULL) {
+                continue;
+            }
+            for (j = ApeEdit_job_hash(jobs_by_path[i]) & (capacity - 1); table[j] != NULL; j = (j + 1) & (capacity - 1)) {
+                /* Left Blank */
+            }
+            table[j] = jobs_by_path[i];
+        }
+        free(jobs_by_path);
+        jobs_by_path = table;
+        jobs_capacity = capacity;
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.path = path;
+    if (stat(path, &sb) == 0) {
+        key.exists = 1;
+        key.dev = sb.st_dev;
+        key.ino = sb.st_ino;
+    }
+    for (i = ApeEdit_job_hash(&key) & (jobs_capacity - 1); (job = jobs_by_path[i]) != NULL; i = (i + 1) & (jobs_capacity - 1)) {
+        if (job->exists == key.exists && (key.exists ? job->dev == key.dev && job->ino == key.ino :
+                                          strcmp(job->path, path) == 0)) {
+            return job;
+        }
+    }
+
+    if ((job = calloc(1, sizeof(struct ApeEdit_job))) == NULL ||
+        (job->path = strdup(path)) == NULL) {
+        err(1, NULL);
+    }
+    job->exists = key.exists;
+    job->dev = key.dev;
+    job->ino = key.ino;
+    job->line = lineno;
+    jobs_by_path[i] = job;
+    num_jobs++;
+    if (jobs_tail == NULL) {
+        jobs_head = job;
+    } else {
+        jobs_tail->next = job;
+    }
+    jobs_tail = job;
+
+    return job;
+}
+
+/* FNV-1a of the job's device and inode if its file exists, or its path */
+u_int32_t ApeEdit_job_hash(const struct ApeEdit_job *job) {
+    u_int32_t hash = 2166136261U;
+    u_int64_t id[2];
+    const unsigned char *c;
+    const unsigned char *end;
+
+    if (job->exists) {
+        id[0] = (u_int64_t)job->dev;
+        id[1] = (u_int64_t)job->ino;
+        c = (const unsigned char *)id;
+        end = c + sizeof(id);
+    } else {
+        c = (const unsigned char *)job->path;
+        end = c + strlen(job->path);
+    }
+    for (; c < end; c++) {
+        hash = (hash ^ *c) * 16777619U;
+    }
+
+    return hash;
+}
+
+/*
+Opens the job's file, which starts reading the end of the file where the
+tag is, then edits the file immediately if not using a thread pool, or
+queues it for a worker thread.  Waits if the queue is full, which limits
+how far ahead files are opened.
+*/
+int ApeEdit_submit(struct ApeEdit_job *job) {
+    if ((job->tag = ApeTag_open(job->path, O_RDWR, 0)) == NULL) {
+        warn("%s", job->path);
+        ApeEdit_job_free(job);
+        return 1;
+    }
+
+    if (pool == NULL) {
+        return ApeEdit_run(job);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued >= pool->capacity) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if (pool->tail == NULL) {
+        pool->head = job;
+    } else {
+        pool->tail->next = job;
+    }
+    pool->tail = job;
+    pool->queued++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/* Parses the job's tag, applies all edits, and writes the tag once */
+int ApeEdit_run(struct ApeEdit_job *job) {
+    int ret = 1;
+    size_t i;
+
+    if (ApeTag_parse(job->tag) != 0) {
+        warnx("%s: %s", job->path, ApeTag_error(job->tag));
+        goto apeedit_run_error;
+    }
+    for (i=0; i < job->num_ops; i++) {
+        if (ApeEdit_apply(job, &job->ops[i]) != 0) {
+            goto apeedit_run_error;
+        }
+    }
+    return ApeEdit_update(job);
+
+    apeedit_run_error:
+    ApeEdit_job_free(job);
+    return ret;
+}
+
+/*
+Writes the job's tag, using a journaled update if -s was given.  With
+-s group, the job is kept until its update is committed along with the
+updates of other files, which is done once enough files are waiting.
+batch_lock is only held while taking a place in the batch and adding the
+job to it, so other threads add their updates at the same time.
+*/
+int ApeEdit_update(struct ApeEdit_job *job) {
+    struct ApeEdit_batch *b;
+    int full;
+    int ret = 0;
+
+    if (sync_policy == APE_SYNC_GROUP) {
+        pthread_mutex_lock(&batch_lock);
+        b = batch;
+        b->pending++;
+        if (++b->count >= APEEDIT_GROUP_SIZE && (batch = ApeEdit_batch_new()) == NULL) {
+            err(1, NULL);
+        }
+        pthread_mutex_unlock(&batch_lock);
+
+        if (ApeTag_update_atomic(job->tag, APE_SYNC_GROUP, b->group) != 0) {
+            warnx("%s: %s", job->path, ApeTag_error(job->tag));
+            ApeEdit_job_free(job);
+            job = NULL;
+            ret = 1;
+        }
+
+        pthread_mutex_lock(&batch_lock);
+        if (job != NULL) {
+            job->next = b->jobs;
+            b->jobs = job;
+        }
+        full = --b->pending == 0 && b != batch;
+        pthread_mutex_unlock(&batch_lock);
+
+        if (full && ApeEdit_commit(b) != 0) {
+            ret = 1;
+        }
+        return ret;
+    }
+
+    if ((atomic ? ApeTag_update_atomic(job->tag, sync_policy, NULL) : ApeTag_update(job->tag)) != 0) {
+        warnx("%s: %s", job->path, ApeTag_error(job->tag));
+        ret = 1;
+    }
+    ApeEdit_job_free(job);
+    return ret;
+}
+
+/* Creates an empty batch, returning NULL on error */
+struct ApeEdit_batch *ApeEdit_batch_new(void) {
+    struct ApeEdit_batch *b;
+
+    if ((b = calloc(1, sizeof(struct ApeEdit_batch))) == NULL) {
+        return NULL;
+    }
+    if ((b->group = ApeTag_group_new()) == NULL) {
+        free(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+/*
+Commits the updates in the batch and frees it and its jobs, warning for
+each file whose update failed.  Must only be called once no updates are
+being added to the batch.
+*/
+int ApeEdit_commit(struct ApeEdit_batch *b) {
+    struct ApeEdit_job *job;
+    int ret = 0;
+
+    if (ApeTag_group_commit(b->group) != 0) {
+        ret = 1;
+    }
+    while ((job = b->jobs) != NULL) {
+        b->jobs = job->next;
+        if (ret != 0 && ApeTag_error_code(job->tag) != APETAG_NOERR) {
+            warnx("%s: %s", job->path, ApeTag_error(job->tag));
+        }
+        ApeEdit_job_free(job);
+    }
+    ApeTag_group_free(b->group);
+    free(b);
+
+    return ret;
+}
+
+/* Applies a single edit to the job's tag */
+int ApeEdit_apply(struct ApeEdit_job *job, struct ApeEdit_op *op) {
+    struct ApeItem *item;
+
+    switch (op->type) {
+    case APEEDIT_CLEAR:
+        if (ApeTag_clear_items(job->tag) != 0) {
+            break;
+        }
+        return 0;
+    case APEEDIT_REMOVE:
+        if (ApeTag_remove_item(job->tag, op->key) < 0) {
+            break;
+        }
+        return 0;
+    default:
+        if ((item = malloc(sizeof(struct ApeItem))) == NULL) {
+            err(1, NULL);
+        }
+        item->key = op->key;
+        item->value = op->value;
+        item->size = op->size;
+        item->flags = 0;
+        if (ApeTag_replace_item(job->tag, item) < 0) {
+            free(item);
+            break;
+        }
+        /* The tag now owns the key and value */
+        op->key = NULL;
+        op->value = NULL;
+        return 0;
+    }
+
+    warnx("%s: %s", job->path, ApeTag_error(job->tag));
+    return -1;
+}
+
+void ApeEdit_job_free(struct ApeEdit_job *job) {
+    size_t i;
+
+    if (job->tag != NULL && ApeTag_free(job->tag) != 0) {
+        warn("%s", job->path);
+    }
+    for (i=0; i < job->num_ops; i++) {
+        free(job->ops[i].key);
+        free(job->ops[i].value);
+    }
+    free(job->ops);
+    free(job->path);
+    free(job);
+}
+
+/* Creates the thread pool and starts the worker threads */
+int ApeEdit_pool_start(size_t num_threads) {
+    size_t i;
+
+    if ((pool = calloc(1, sizeof(struct ApeEdit_pool))) == NULL ||
+        (pool->threads = calloc(num_threads, sizeof(pthread_t))) == NULL) {
+        return -1;
+    }
+    pool->capacity = num_threads * APEEDIT_QUEUE_PER_THREAD;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (i=0; i < num_threads; i++) {
+        if ((errno = pthread_create(&pool->threads[i], NULL, ApeEdit_pool_worker, NULL)) != 0) {
+            return -1;
+        }
+        pool->num_threads++;
+    }
+
+    return 0;
+}
+
+/* Waits for all queued files to be edited, and frees the pool */
+int ApeEdit_pool_finish(void) {
+    size_t i;
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i=0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    ret = pool->ret;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->threads);
+    free(pool);
+    pool = NULL;
+
+    return ret;
+}
+
+/* Worker thread, editing queued files until the manifest has been read */
+void *ApeEdit_pool_worker(void *arg) {
+    struct ApeEdit_job *job;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == NULL && !pool->done) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if ((job = pool->head) == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        if ((pool->head = job->next) == NULL) {
+            pool->tail = NULL;
+        }
+        pool->queued--;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (ApeEdit_run(job) != 0) {
+            pthread_mutex_lock(&pool->lock);
+            pool->ret = 1;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+}
@@ -1,129 +1,1301 @@
 #include <apetag.h>
 #include <err.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-int ApeInfo_process(char *);
-void ApeTag_print(struct ApeTag *tag);
-void ApeItem_print(struct ApeItem *item);
+/* Maximum number of files queued or waiting to be printed, per thread */
+#define APEINFO_JOBS_PER_THREAD 256
+
+/* Maximum number of threads */
+#define APEINFO_MAX_THREADS 1024
+
+/* Initial size of each thread's output buffer */
+#define APEINFO_BUF_SIZE 65536
+
+/* Output formats */
+#define APEINFO_FORMAT_HUMAN 0
+#define APEINFO_FORMAT_NDJSON 1
+#define APEINFO_FORMAT_TSV 2
+#define APEINFO_FORMAT_RAW0 3
+
+/* Number of buckets in the power of two histograms, enough for 32 bit sizes */
+#define APEINFO_STATS_BUCKETS 33
+
+/* Number of error codes, and the number of most common keys to print */
+#define APEINFO_STATS_ERRCODES (APETAG_NOTPRESENT + 1)
+#define APEINFO_STATS_TOP_KEYS 50
+
+/* Reusable output buffer, written with a single fwrite per file */
+struct ApeInfo_buf {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+/* Number of items with a given key, keys are compared case insensitively */
+struct ApeInfo_key_count {
+    char *key;
+    uint64_t count;
+};
+
+/* Statistics for --stats.  Each thread has its own, which are merged when
+   all files have been processed, so they are updated without locking. */
+struct ApeInfo_stats {
+    uint64_t files;
+    uint64_t open_errors;
+    uint64_t errors[APEINFO_STATS_ERRCODES];
+    uint64_t tags;
+    uint64_t id3_tags;
+    uint64_t tag_bytes;
+    uint64_t items;
+    uint64_t type_items[4];
+    uint64_t type_bytes[4];
+    uint64_t tag_sizes[APEINFO_STATS_BUCKETS];
+    uint64_t item_counts[APEINFO_STATS_BUCKETS];
+    uint64_t value_sizes[APEINFO_STATS_BUCKETS];
+    struct ApeInfo_key_count *keys;
+    size_t num_keys;
+    size_t keys_capacity;
+};
+
+/* Everything reused between files by a thread */
+struct ApeInfo_state {
+    struct ApeTag *tag;
+    struct ApeInfo_buf buf;
+    struct ApeInfo_stats stats;
+};
+
+/* A single file to process, and the output from processing it */
+struct ApeInfo_job {
+    size_t seq;
+    int status;
+    char *path;
+    char *output;
+    size_t output_size;
+};
+
+/* Double ended queue of jobs owned by a worker thread.  The owner takes jobs
+   from the tail, other workers steal jobs from the head. */
+struct ApeInfo_deque {
+    pthread_mutex_t lock;
+    struct ApeInfo_job **jobs;
+    size_t head;
+    size_t count;
+};
+
+struct ApeInfo_worker {
+    pthread_t thread;
+    size_t id;
+    struct ApeInfo_deque deque;
+    struct ApeInfo_state state;
+};
+
+/* Shared state for the thread pool */
+struct ApeInfo_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ApeInfo_worker *workers;
+    struct ApeInfo_job **pending;
+    size_t num_workers;
+    size_t capacity;
+    size_t produced;
+    size_t printed;
+    size_t queued;
+    int done;
+    int ordered;
+    int ret;
+};
+
+int ApeInfo_process(const char *filename, struct ApeInfo_state *state);
+void ApeInfo_state_free(struct ApeInfo_state *state);
+int ApeInfo_submit(const char *filename);
+int ApeInfo_walk(const char *filename, const struct stat *sb, int typeflag, struct FTW *ftwbuf);
+int ApeInfo_pool_start(size_t num_workers, int ordered);
+int ApeInfo_pool_finish(void);
+void *ApeInfo_pool_worker(void *arg);
+struct ApeInfo_job *ApeInfo_pool_take(struct ApeInfo_worker *worker);
+void ApeInfo_pool_complete(struct ApeInfo_job *job);
+void ApeInfo_job_run(struct ApeInfo_job *job, struct ApeInfo_state *state);
+void ApeInfo_job_free(struct ApeInfo_job *job);
+void ApeTag_print(struct ApeTag *tag, const char *filename, struct ApeInfo_buf *buf);
+void ApeItem_print(struct ApeItem *item, struct ApeInfo_buf *buf);
+void ApeItem_print_ndjson(struct ApeItem *item, struct ApeInfo_buf *buf);
+void ApeItem_print_tsv(struct ApeItem *item, const char *filename, struct ApeInfo_buf *buf);
+void ApeItem_print_raw0(struct ApeItem *item, const char *filename, struct ApeInfo_buf *buf);
+const char *ApeItem_type(struct ApeItem *item);
+int ApeItem_is_text(struct ApeItem *item);
+void ApeInfo_buf_reserve(struct ApeInfo_buf *buf, size_t size);
+void ApeInfo_buf_write(struct ApeInfo_buf *buf, const char *data, size_t size);
+void ApeInfo_buf_str(struct ApeInfo_buf *buf, const char *str);
+void ApeInfo_buf_char(struct ApeInfo_buf *buf, char c);
+void ApeInfo_buf_uint(struct ApeInfo_buf *buf, u_int32_t n);
+void ApeInfo_buf_escape(struct ApeInfo_buf *buf, const char *data, size_t size);
+void ApeInfo_buf_json(struct ApeInfo_buf *buf, const char *data, size_t size);
+void ApeInfo_buf_tsv(struct ApeInfo_buf *buf, const char *data, size_t size);
+void ApeInfo_buf_base64(struct ApeInfo_buf *buf, const char *data, size_t size);
+void ApeInfo_stats_add(struct ApeInfo_stats *stats, struct ApeTag *tag);
+void ApeInfo_stats_add_key(struct ApeInfo_stats *stats, const char *key, uint64_t count);
+void ApeInfo_stats_merge(struct ApeInfo_stats *dst, struct ApeInfo_stats *src);
+void ApeInfo_stats_print(struct ApeInfo_stats *stats);
+void ApeInfo_verify_print(struct ApeInfo_stats *stats);
+void ApeInfo_profile_print(void);
+void ApeInfo_report(struct ApeInfo_state *state, const char *filename, const char *error);
+void ApeInfo_stats_print_histogram(const char *name, uint64_t *buckets);
+void ApeInfo_stats_free(struct ApeInfo_stats *stats);
+size_t ApeInfo_stats_bucket(u_int32_t n);
+int ApeInfo_key_count_compare(const void *a, const void *b);
+
+/* Thread pool used when -j is greater than 1, NULL otherwise */
+static struct ApeInfo_pool *pool = NULL;
+
+/* State used when not using a thread pool, and for the merged statistics */
+static struct ApeInfo_state main_state;
+
+/* Output format, whether to only print the length of binary items,
+   whether to only print statistics, and whether to print library counters */
+static int format = APEINFO_FORMAT_HUMAN;
+static int binary_length = 0;
+static int stats_only = 0;
+static int verify_only = 0;
+static int profile = 0;
+
+/* Scan cache shared by all tags, if --cache was given */
+static struct ApeTag_cache *cache = NULL;
+
+/* Index snapshot writer shared by all threads, if --index was given */
+static struct ApeTag_index_writer *index_writer = NULL;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Names of the error codes, used for the --stats and --verify summaries */
+static const char *errcode_names[APEINFO_STATS_ERRCODES] = {
+    "APETAG_NOERR", "APETAG_FILEERR", "APETAG_MEMERR", "APETAG_INTERNALERR",
+    "APETAG_LIMITEXCEEDED", "APETAG_DUPLICATEITEM", "APETAG_CORRUPTTAG",
+    "APETAG_INVALIDITEM", "APETAG_ARGERR", "APETAG_NOTPRESENT"
+};
+
+static const struct option long_options[] = {
+    {"format", required_argument, NULL, 'f'},
+    {"binary", required_argument, NULL, 'b'},
+    {"stats", no_argument, NULL, 's'},
+    {"verify", no_argument, NULL, 'v'},
+    {"profile", no_argument, NULL, 'p'},
+    {"cache", required_argument, NULL, 'c'},
+    {"index", required_argument, NULL, 'i'},
+    {NULL, 0, NULL, 0}
+};
+
+/* Whether any file could not be processed */
+static int main_ret = 0;
 
 /* Process all files on the command line */
 int main(int argc, char *argv[]) {
-    int ret = 0;
+    struct stat sb;
+    long jobs = 1;
+    int recursive = 0;
+    int ordered = 1;
+    int ch;
     int i;
-    
-    if (argc > 1) {
-        for (i=1; i<argc; i++) {
-            if (ApeInfo_process(argv[i]) != 0) {
-                ret = 1;
+    char *end;
+    const char *cache_path = NULL;
+    const char *index_path = NULL;
+
+    while ((ch = getopt_long(argc, argv, "j:ru", long_options, NULL)) != -1) {
+        switch (ch) {
+        case 'f':
+            if (strcmp(optarg, "human") == 0) {
+                format = APEINFO_FORMAT_HUMAN;
+            } else if (strcmp(optarg, "ndjson") == 0) {
+                format = APEINFO_FORMAT_NDJSON;
+            } else if (strcmp(optarg, "tsv") == 0) {
+                format = APEINFO_FORMAT_TSV;
+            } else if (strcmp(optarg, "raw0") == 0) {
+                format = APEINFO_FORMAT_RAW0;
+            } else {
+                errx(1, "invalid format: %s", optarg);
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "base64") == 0) {
+                binary_length = 0;
+            } else if (strcmp(optarg, "length") == 0) {
+                binary_length = 1;
+            } else {
+                errx(1, "invalid binary output: %s", optarg);
             }
+            break;
+        case 'j':
+            jobs = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || jobs < 1 || jobs > APEINFO_MAX_THREADS) {
+                errx(1, "invalid number of jobs: %s", optarg);
+            }
+            break;
+        case 'r':
+            recursive = 1;
+            break;
+        case 's':
+            stats_only = 1;
+            break;
+        case 'v':
+            verify_only = 1;
+            break;
+        case 'p':
+            profile = 1;
+            break;
+        case 'c':
+            cache_path = optarg;
+            break;
+        case 'i':
+            index_path = optarg;
+            break;
+        case 'u':
+            ordered = 0;
+            break;
+        default:
+            argc = 0;
+            break;
         }
     }
-    else {
-        printf("usage: %s file [...]\n", argv[0]);
+
+    if (argc <= optind) {
+        printf("usage: %s [-ru] [-j jobs] [--format=human|ndjson|tsv|raw0]\n"
+               "       [--binary=base64|length] [--stats | --verify] [--profile]\n"
+               "       [--cache=file] [--index=file] file [...]\n", argv[0]);
+        return 0;
     }
-    
-    return ret;
+    if (verify_only && index_path != NULL) {
+        errx(1, "--verify and --index are mutually exclusive");
+    }
+
+    if (ApeTag_mt_init() != 0) {
+        errx(1, "unable to initialize genre table");
+    }
+    if (cache_path != NULL && (cache = ApeTag_cache_open(cache_path)) == NULL) {
+        err(1, "%s", cache_path);
+    }
+    if (index_path != NULL && (index_writer = ApeTag_index_writer_new()) == NULL) {
+        err(1, NULL);
+    }
+    if (jobs > 1 && ApeInfo_pool_start((size_t)jobs, ordered) != 0) {
+        err(1, NULL);
+    }
+
+    for (i=optind; i<argc; i++) {
+        if (recursive && stat(argv[i], &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            if (nftw(argv[i], ApeInfo_walk, 64, FTW_PHYS) != 0) {
+                warn("%s", argv[i]);
+                main_ret = 1;
+            }
+        } else if (ApeInfo_submit(argv[i]) != 0) {
+            main_ret = 1;
+        }
+    }
+
+    if (pool != NULL && ApeInfo_pool_finish() != 0) {
+        main_ret = 1;
+    }
+    if (verify_only) {
+        ApeInfo_verify_print(&main_state.stats);
+    } else if (stats_only) {
+        ApeInfo_stats_print(&main_state.stats);
+    }
+    if (index_writer != NULL) {
+        if (ApeTag_index_writer_write(index_writer, index_path) != 0) {
+            warn("%s", index_path);
+            main_ret = 1;
+        }
+        ApeTag_index_writer_free(index_writer);
+    }
+    ApeInfo_state_free(&main_state);
+    if (profile) {
+        ApeInfo_profile_print();
+    }
+    if (ApeTag_cache_close(cache) != 0) {
+        warn("%s", cache_path);
+        main_ret = 1;
+    }
+
+    return main_ret;
 }
 
-/* Print out the items in the file */
-int ApeInfo_process(char *filename) {
+/* nftw callback submitting all regular files under a directory */
+int ApeInfo_walk(const char *filename, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)ftwbuf;
+
+    if (typeflag == FTW_DNR || typeflag == FTW_NS) {
+        warnx("%s: unable to read", filename);
+        main_ret = 1;
+    } else if (typeflag == FTW_F && S_ISREG(sb->st_mode)) {
+        if (ApeInfo_submit(filename) != 0) {
+            main_ret = 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+Processes the file immediately if not using a thread pool, otherwise queues
+it for one of the worker threads.  Waits if too many files are queued or
+waiting to be printed, so memory use is bounded for very large directories.
+*/
+int ApeInfo_submit(const char *filename) {
+    struct ApeInfo_job *job;
+    struct ApeInfo_deque *deque;
+    size_t i;
     int ret;
-    int status;
-    FILE *file;
-    struct ApeTag *tag = NULL;
-    
-    if ((file = fopen(filename, "r")) == NULL) {
+
+    if (pool == NULL) {
+        main_state.buf.size = 0;
+        ret = ApeInfo_process(filename, &main_state);
+        fwrite(main_state.buf.data, 1, main_state.buf.size, stdout);
+        return ret;
+    }
+
+    if ((job = calloc(1, sizeof(struct ApeInfo_job))) == NULL ||
+        (job->path = strdup(filename)) == NULL) {
         warn("%s", filename);
-        ret = 1;
-        goto apeinfo_process_error;
+        free(job);
+        return 1;
     }
-    
-    if ((tag = ApeTag_new(file, 0)) == NULL) {
-        warn(NULL);
-        ret = 1;
-        goto apeinfo_process_error;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->produced - pool->printed >= pool->capacity) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
     }
-    
-    status = ApeTag_parse(tag);
-    if (status == -1) {
-        warnx("%s: %s", filename, ApeTag_error(tag));
-        ret = 1;
-        goto apeinfo_process_error;
-    }
-    
-    if (ApeTag_exists(tag)) {
-        printf("%s (%i items):\n", filename, ApeTag_item_count(tag));
-        ApeTag_print(tag);
+    job->seq = pool->produced++;
+
+    /* Counted before it is pushed, so a worker that takes it at once can't
+       make the count wrap */
+    pool->queued++;
+    pthread_mutex_unlock(&pool->lock);
+
+    /* Jobs are assigned round robin, skipping full deques.  Fewer than
+       capacity jobs are in flight, so at least one deque has room. */
+    for (i = job->seq; ; i++) {
+        deque = &pool->workers[i % pool->num_workers].deque;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->count < APEINFO_JOBS_PER_THREAD) {
+            break;
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+    deque->jobs[(deque->head + deque->count++) % APEINFO_JOBS_PER_THREAD] = job;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/* Creates the thread pool and starts the worker threads */
+int ApeInfo_pool_start(size_t num_workers, int ordered) {
+    size_t i;
+
+    if ((pool = calloc(1, sizeof(struct ApeInfo_pool))) == NULL) {
+        return -1;
+    }
+    pool->num_workers = num_workers;
+    pool->capacity = num_workers * APEINFO_JOBS_PER_THREAD;
+    pool->ordered = ordered;
+    if ((pool->workers = calloc(num_workers, sizeof(struct ApeInfo_worker))) == NULL ||
+        (pool->pending = calloc(pool->capacity, sizeof(struct ApeInfo_job *))) == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (i=0; i < num_workers; i++) {
+        pool->workers[i].id = i;
+        pthread_mutex_init(&pool->workers[i].deque.lock, NULL);
+        if ((pool->workers[i].deque.jobs = calloc(APEINFO_JOBS_PER_THREAD, sizeof(struct ApeInfo_job *))) == NULL) {
+            return -1;
+        }
+    }
+    for (i=0; i < num_workers; i++) {
+        if ((errno = pthread_create(&pool->workers[i].thread, NULL, ApeInfo_pool_worker, &pool->workers[i])) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Waits for all queued files to be processed and printed, and frees the pool */
+int ApeInfo_pool_finish(void) {
+    size_t i;
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i=0; i < pool->num_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (i=0; i < pool->num_workers; i++) {
+        ApeInfo_stats_merge(&main_state.stats, &pool->workers[i].state.stats);
+        ApeInfo_state_free(&pool->workers[i].state);
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.jobs);
+    }
+
+    ret = pool->ret;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->workers);
+    free(pool->pending);
+    free(pool);
+    pool = NULL;
+
+    return ret;
+}
+
+/* Worker thread, processing jobs with its own state reused for every file */
+void *ApeInfo_pool_worker(void *arg) {
+    struct ApeInfo_worker *worker = arg;
+    struct ApeInfo_job *job;
+
+    while ((job = ApeInfo_pool_take(worker)) != NULL) {
+        ApeInfo_job_run(job, &worker->state);
+        ApeInfo_pool_complete(job);
+    }
+
+    return NULL;
+}
+
+/*
+Takes the most recently queued job from the worker's own deque, or steals
+the oldest job from another worker's deque if its own is empty.  Returns
+NULL when all jobs have been taken and no more will be submitted.
+*/
+struct ApeInfo_job *ApeInfo_pool_take(struct ApeInfo_worker *worker) {
+    struct ApeInfo_deque *deque;
+    struct ApeInfo_job *job;
+    size_t i;
+
+    for (;;) {
+        job = NULL;
+        deque = &worker->deque;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->count > 0) {
+            job = deque->jobs[(deque->head + --deque->count) % APEINFO_JOBS_PER_THREAD];
+        }
+        pthread_mutex_unlock(&deque->lock);
+
+        for (i=1; job == NULL && i < pool->num_workers; i++) {
+            deque = &pool->workers[(worker->id + i) % pool->num_workers].deque;
+            pthread_mutex_lock(&deque->lock);
+            if (deque->count > 0) {
+                job = deque->jobs[deque->head];
+                deque->head = (deque->head + 1) % APEINFO_JOBS_PER_THREAD;
+                deque->count--;
+            }
+            pthread_mutex_unlock(&deque->lock);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (job != NULL) {
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+            return job;
+        }
+        while (pool->queued == 0 && !pool->done) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->queued == 0 && pool->done) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*
+Prints the output for a completed job.  If output is ordered, the output is
+held until the output for all earlier jobs has been printed.
+*/
+void ApeInfo_pool_complete(struct ApeInfo_job *job) {
+    pthread_mutex_lock(&pool->lock);
+    if (job->status != 0) {
+        pool->ret = 1;
+    }
+    if (!pool->ordered) {
+        fwrite(job->output, 1, job->output_size, stdout);
+        ApeInfo_job_free(job);
+        pool->printed++;
     } else {
-        printf("%s: no ape tag\n\n", filename);
+        pool->pending[job->seq % pool->capacity] = job;
+        while ((job = pool->pending[pool->printed % pool->capacity]) != NULL) {
+            pool->pending[pool->printed % pool->capacity] = NULL;
+            fwrite(job->output, 1, job->output_size, stdout);
+            ApeInfo_job_free(job);
+            pool->printed++;
+        }
     }
-    
-    ret = 0;
-    
-    apeinfo_process_error:
-    ApeTag_free(tag);
-    if (file != NULL) {
-        if (fclose(file) != 0) {
-            warn("%s", filename);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Processes the job's file, copying the output from the thread's buffer */
+void ApeInfo_job_run(struct ApeInfo_job *job, struct ApeInfo_state *state) {
+    struct ApeInfo_buf *buf = &state->buf;
+
+    buf->size = 0;
+    job->status = ApeInfo_process(job->path, state);
+    if (buf->size == 0) {
+        return;
+    }
+    if ((job->output = malloc(buf->size)) == NULL) {
+        warn("%s", job->path);
+        job->status = 1;
+        return;
+    }
+    memcpy(job->output, buf->data, buf->size);
+    job->output_size = buf->size;
+}
+
+void ApeInfo_job_free(struct ApeInfo_job *job) {
+    free(job->path);
+    free(job->output);
+    free(job);
+}
+
+/*
+Print out the items in the file to the state's buffer, or add them to the
+state's statistics.  The tag is opened on the first call and reset to each
+later file, so the same tag can be used for all files.  The tag owns the
+file's descriptor, which is closed when the tag is reset or freed.
+*/
+int ApeInfo_process(const char *filename, struct ApeInfo_state *state) {
+    struct ApeTag **tag = &state->tag;
+    int ret = 0;
+    int status;
+
+    state->stats.files++;
+    if (*tag == NULL) {
+        if ((*tag = ApeTag_open(filename, O_RDONLY, 0)) == NULL) {
+            ApeInfo_report(state, filename, strerror(errno));
+            if (errno == ENOMEM) {
+                state->stats.errors[APETAG_MEMERR]++;
+            } else {
+                state->stats.open_errors++;
+            }
+            return 1;
+        }
+        /* The cache is kept when the tag is reset */
+        ApeTag_set_cache(*tag, cache);
+    } else if (ApeTag_reset_open(*tag, filename, O_RDONLY, 0) != 0) {
+        if (ApeTag_error_code(*tag) == APETAG_FILEERR) {
+            ApeInfo_report(state, filename, strerror(errno));
+            state->stats.open_errors++;
+        } else {
+            ApeInfo_report(state, filename, ApeTag_error(*tag));
+            state->stats.errors[ApeTag_error_code(*tag)]++;
+        }
+        return 1;
+    }
+
+    /* Verifying checks the tag without copying the items out of it */
+    status = verify_only ? ApeTag_verify(*tag) : ApeTag_parse(*tag);
+    if (status == -1) {
+        ApeInfo_report(state, filename, ApeTag_error(*tag));
+        state->stats.errors[ApeTag_error_code(*tag)]++;
+        return 1;
+    }
+
+    if (index_writer != NULL) {
+        pthread_mutex_lock(&index_lock);
+        status = ApeTag_index_writer_add(index_writer, filename, *tag);
+        pthread_mutex_unlock(&index_lock);
+        if (status != 0) {
+            ApeInfo_report(state, filename, ApeTag_error(*tag));
+            ret = 1;
         }
     }
-    
+
+    if (verify_only) {
+        /* Nothing is printed for valid files */
+    } else if (stats_only) {
+        ApeInfo_stats_add(&state->stats, *tag);
+    } else if (index_writer == NULL) {
+        ApeTag_print(*tag, filename, &state->buf);
+    }
+
     return ret;
 }
 
-int ApeTag_iter_print(struct ApeTag *tag, struct ApeItem *item, void *data) {
-    ApeItem_print(item);
+/*
+Reports a file that could not be processed.  When verifying, this is part of
+the output, otherwise it is a warning.
+*/
+void ApeInfo_report(struct ApeInfo_state *state, const char *filename, const char *error) {
+    if (verify_only) {
+        ApeInfo_buf_str(&state->buf, filename);
+        ApeInfo_buf_str(&state->buf, ": ");
+        ApeInfo_buf_str(&state->buf, error);
+        ApeInfo_buf_char(&state->buf, '\n');
+    } else {
+        warnx("%s: %s", filename, error);
+    }
 }
 
-/* Prints all items in the tag, one per line. */
-void ApeTag_print(struct ApeTag *tag) {
+void ApeInfo_state_free(struct ApeInfo_state *state) {
+    if (state->tag != NULL && ApeTag_free(state->tag) != 0) {
+        warn(NULL);
+    }
+    state->tag = NULL;
+    free(state->buf.data);
+    state->buf.data = NULL;
+    ApeInfo_stats_free(&state->stats);
+}
+
+/* Prints all items in the tag in the selected format. */
+void ApeTag_print(struct ApeTag *tag, const char *filename, struct ApeInfo_buf *buf) {
+    struct ApeTag_item_cursor cursor;
+    struct ApeItem *item;
+    int exists;
+
     assert(tag != NULL);
 
-    if (ApeTag_iter_items(tag, ApeTag_iter_print, NULL) < 0) {
-       printf("Error getting items: %s", ApeTag_error(tag));
+    exists = ApeTag_exists(tag);
+    if (format == APEINFO_FORMAT_HUMAN) {
+        ApeInfo_buf_str(buf, filename);
+        if (exists) {
+            ApeInfo_buf_str(buf, " (");
+            ApeInfo_buf_uint(buf, ApeTag_item_count(tag));
+            ApeInfo_buf_str(buf, " items):\n");
+        } else {
+            ApeInfo_buf_str(buf, ": no ape tag\n\n");
+            return;
+        }
+    } else if (format == APEINFO_FORMAT_NDJSON) {
+        ApeInfo_buf_str(buf, "{\"file\":\"");
+        ApeInfo_buf_json(buf, filename, strlen(filename));
+        ApeInfo_buf_str(buf, exists ? "\",\"exists\":true,\"items\":[" : "\",\"exists\":false,\"items\":[");
+    }
+
+    if (exists) {
+        for (item = ApeTag_item_cursor_first(&cursor, tag, APE_CURSOR_FILE_ORDER); 
+             item != NULL; item = ApeTag_item_cursor_next(&cursor)) {
+            switch (format) {
+            case APEINFO_FORMAT_NDJSON:
+                if (cursor.index > 1) {
+                    ApeInfo_buf_char(buf, ',');
+                }
+                ApeItem_print_ndjson(item, buf);
+                break;
+            case APEINFO_FORMAT_TSV:
+                ApeItem_print_tsv(item, filename, buf);
+                break;
+            case APEINFO_FORMAT_RAW0:
+                ApeItem_print_raw0(item, filename, buf);
+                break;
+            default:
+                ApeItem_print(item, buf);
+                break;
+            }
+        }
     }
 
-    printf("\n");
+    if (format == APEINFO_FORMAT_HUMAN) {
+        ApeInfo_buf_char(buf, '\n');
+    } else if (format == APEINFO_FORMAT_NDJSON) {
+        ApeInfo_buf_str(buf, "]}\n");
+    }
 }
 
-/* 
+/*
 Prints a line with the key and value of the item separated by a colon. Includes
 information about the tags flags unless they are the default (read-write UTF8).
 */
-void ApeItem_print(struct ApeItem *item) {
-    u_int32_t i;
-    char c;
-    
+void ApeItem_print(struct ApeItem *item, struct ApeInfo_buf *buf) {
+    u_int32_t cursor = 0;
+    u_int32_t length;
+    const char *value;
+
     assert(item != NULL);
     assert(item->key != NULL);
     assert(item->value != NULL);
 
-    printf("%s: ", item->key);
+    ApeInfo_buf_str(buf, item->key);
+    ApeInfo_buf_str(buf, ": ");
     if ((item->flags & APE_ITEM_TYPE_FLAGS) == APE_ITEM_BINARY) {
-        printf("[BINARY DATA]");
+        ApeInfo_buf_str(buf, "[BINARY DATA]");
     } else if ((item->flags & APE_ITEM_TYPE_FLAGS) == APE_ITEM_RESERVED) {
-        printf("[RESERVED]");
+        ApeInfo_buf_str(buf, "[RESERVED]");
     } else {
         if ((item->flags & APE_ITEM_TYPE_FLAGS) == APE_ITEM_EXTERNAL) {
-            printf("[EXTERNAL LOCATION] ");
-        }
-        for (i=0; i < item->size; i++) {
-            c = *((char *)(item->value)+i);
-            if (c == '\0') {
-                printf(", ");
-            } else if (c < '\40') {
-                printf("\\%o", c);
-            } else if (c == '\\') {
-                printf("\\\\");
-            } else {
-                printf("%c", c);
+            ApeInfo_buf_str(buf, "[EXTERNAL LOCATION] ");
+        }
+        while (ApeItem_next_value(item, &cursor, &value, &length) == 1) {
+            if (value != item->value) {
+                ApeInfo_buf_str(buf, ", ");
             }
+            ApeInfo_buf_escape(buf, value, length);
         }
     }
     if (item->flags & APE_ITEM_READ_ONLY) {
-        printf(" [READ_ONLY]");
+        ApeInfo_buf_str(buf, " [READ_ONLY]");
+    }
+    ApeInfo_buf_char(buf, '\n');
+}
+
+/*
+Prints the item as a JSON object.  Text values are an array of strings,
+binary values are base64 encoded unless only the length was requested.
+*/
+void ApeItem_print_ndjson(struct ApeItem *item, struct ApeInfo_buf *buf) {
+    u_int32_t cursor = 0;
+    u_int32_t length;
+    const char *value;
+
+    ApeInfo_buf_str(buf, "{\"key\":\"");
+    ApeInfo_buf_json(buf, item->key, strlen(item->key));
+    ApeInfo_buf_str(buf, "\",\"type\":\"");
+    ApeInfo_buf_str(buf, ApeItem_type(item));
+    ApeInfo_buf_str(buf, (item->flags & APE_ITEM_READ_ONLY) ? "\",\"read_only\":true," : "\",\"read_only\":false,");
+    if (ApeItem_is_text(item)) {
+        ApeInfo_buf_str(buf, "\"values\":[");
+        while (ApeItem_next_value(item, &cursor, &value, &length) == 1) {
+            if (value != item->value) {
+                ApeInfo_buf_char(buf, ',');
+            }
+            ApeInfo_buf_char(buf, '"');
+            ApeInfo_buf_json(buf, value, length);
+            ApeInfo_buf_char(buf, '"');
+        }
+        ApeInfo_buf_char(buf, ']');
+    } else if (binary_length) {
+        ApeInfo_buf_str(buf, "\"length\":");
+        ApeInfo_buf_uint(buf, item->size);
+    } else {
+        ApeInfo_buf_str(buf, "\"base64\":\"");
+        ApeInfo_buf_base64(buf, item->value, item->size);
+        ApeInfo_buf_char(buf, '"');
+    }
+    ApeInfo_buf_char(buf, '}');
+}
+
+/*
+Prints a line with the file, key, type, and value of the item separated by
+tabs.  Multiple values are separated by \0, and binary values are base64
+encoded unless only the length was requested.
+*/
+void ApeItem_print_tsv(struct ApeItem *item, const char *filename, struct ApeInfo_buf *buf) {
+    ApeInfo_buf_tsv(buf, filename, strlen(filename));
+    ApeInfo_buf_char(buf, '\t');
+    ApeInfo_buf_tsv(buf, item->key, strlen(item->key));
+    ApeInfo_buf_char(buf, '\t');
+    ApeInfo_buf_str(buf, ApeItem_type(item));
+    ApeInfo_buf_char(buf, '\t');
+    if (ApeItem_is_text(item)) {
+        ApeInfo_buf_tsv(buf, item->value, item->size);
+    } else if (binary_length) {
+        ApeInfo_buf_uint(buf, item->size);
+    } else {
+        ApeInfo_buf_base64(buf, item->value, item->size);
+    }
+    ApeInfo_buf_char(buf, '\n');
+}
+
+/*
+Prints the file, key, type, and value length of the item, each terminated by
+a NUL byte, followed by the unescaped value and a NUL byte.  If only the
+length of binary values was requested, their value is not printed.
+*/
+void ApeItem_print_raw0(struct ApeItem *item, const char *filename, struct ApeInfo_buf *buf) {
+    ApeInfo_buf_write(buf, filename, strlen(filename) + 1);
+    ApeInfo_buf_write(buf, item->key, strlen(item->key) + 1);
+    ApeInfo_buf_write(buf, ApeItem_type(item), strlen(ApeItem_type(item)) + 1);
+    ApeInfo_buf_uint(buf, item->size);
+    ApeInfo_buf_char(buf, '\0');
+    if (ApeItem_is_text(item) || !binary_length) {
+        ApeInfo_buf_write(buf, item->value, item->size);
+    }
+    ApeInfo_buf_char(buf, '\0');
+}
+
+/* Returns the name of the item's type */
+const char *ApeItem_type(struct ApeItem *item) {
+    switch (item->flags & APE_ITEM_TYPE_FLAGS) {
+    case APE_ITEM_BINARY:
+        return "binary";
+    case APE_ITEM_EXTERNAL:
+        return "external";
+    case APE_ITEM_RESERVED:
+        return "reserved";
+    default:
+        return "utf8";
+    }
+}
+
+/* Returns whether the item's value is text (UTF8 or an external location) */
+int ApeItem_is_text(struct ApeItem *item) {
+    return (item->flags & APE_ITEM_TYPE_FLAGS) == APE_ITEM_UTF8 || 
+           (item->flags & APE_ITEM_TYPE_FLAGS) == APE_ITEM_EXTERNAL;
+}
+
+/*
+Makes sure the buffer has room for size more bytes.  The buffer is reused
+for every file, so it only grows until it fits the largest output.
+*/
+void ApeInfo_buf_reserve(struct ApeInfo_buf *buf, size_t size) {
+    size_t capacity;
+    char *data;
+
+    if (buf->size + size <= buf->capacity) {
+        return;
+    }
+    for (capacity = buf->capacity ? buf->capacity : APEINFO_BUF_SIZE; capacity < buf->size + size; capacity *= 2) {
+        /* Left Blank */
+    }
+    if ((data = realloc(buf->data, capacity)) == NULL) {
+        err(1, NULL);
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+}
+
+void ApeInfo_buf_write(struct ApeInfo_buf *buf, const char *data, size_t size) {
+    ApeInfo_buf_reserve(buf, size);
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+void ApeInfo_buf_str(struct ApeInfo_buf *buf, const char *str) {
+    ApeInfo_buf_write(buf, str, strlen(str));
+}
+
+void ApeInfo_buf_char(struct ApeInfo_buf *buf, char c) {
+    ApeInfo_buf_reserve(buf, 1);
+    buf->data[buf->size++] = c;
+}
+
+void ApeInfo_buf_uint(struct ApeInfo_buf *buf, u_int32_t n) {
+    char digits[10];
+    size_t i = sizeof(digits);
+
+    do {
+        digits[--i] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+    ApeInfo_buf_write(buf, digits + i, sizeof(digits) - i);
+}
+
+/*
+Escapes the data for the human readable format, using octal escapes for
+control characters.  Runs of characters that don't need escaping are
+copied at once.
+*/
+void ApeInfo_buf_escape(struct ApeInfo_buf *buf, const char *data, size_t size) {
+    const char *end = data + size;
+    const char *start;
+    unsigned char c;
+
+    while (data < end) {
+        for (start = data; data < end && (unsigned char)*data >= '\40' && *data != '\\'; data++) {
+            /* Left Blank */
+        }
+        ApeInfo_buf_write(buf, start, (size_t)(data - start));
+        if (data == end) {
+            break;
+        }
+        c = (unsigned char)*data++;
+        ApeInfo_buf_char(buf, '\\');
+        if (c == '\\') {
+            ApeInfo_buf_char(buf, '\\');
+        } else {
+            if (c >= 010) {
+                if (c >= 0100) {
+                    ApeInfo_buf_char(buf, (char)('0' + (c >> 6)));
+                }
+                ApeInfo_buf_char(buf, (char)('0' + ((c >> 3) & 7)));
+            }
+            ApeInfo_buf_char(buf, (char)('0' + (c & 7)));
+        }
+    }
+}
+
+/* Escapes the data for use inside a JSON string */
+void ApeInfo_buf_json(struct ApeInfo_buf *buf, const char *data, size_t size) {
+    static const char hex[] = "0123456789abcdef";
+    const char *end = data + size;
+    const char *start;
+    unsigned char c;
+
+    while (data < end) {
+        for (start = data; data < end && (unsigned char)*data >= '\40' && *data != '"' && *data != '\\'; data++) {
+            /* Left Blank */
+        }
+        ApeInfo_buf_write(buf, start, (size_t)(data - start));
+        if (data == end) {
+            break;
+        }
+        c = (unsigned char)*data++;
+        ApeInfo_buf_char(buf, '\\');
+        switch (c) {
+        case '"':
+        case '\\':
+            ApeInfo_buf_char(buf, (char)c);
+            break;
+        case '\n':
+            ApeInfo_buf_char(buf, 'n');
+            break;
+        case '\r':
+            ApeInfo_buf_char(buf, 'r');
+            break;
+        case '\t':
+            ApeInfo_buf_char(buf, 't');
+            break;
+        default:
+            ApeInfo_buf_str(buf, "u00");
+            ApeInfo_buf_char(buf, hex[c >> 4]);
+            ApeInfo_buf_char(buf, hex[c & 15]);
+            break;
+        }
+    }
+}
+
+/* Escapes tabs, newlines, carriage returns, NULs, and backslashes for TSV */
+void ApeInfo_buf_tsv(struct ApeInfo_buf *buf, const char *data, size_t size) {
+    const char *end = data + size;
+    const char *start;
+    char c;
+
+    while (data < end) {
+        for (start = data; data < end && *data != '\t' && *data != '\n' && *data != '\r' && *data != '\0' && *data != '\\'; data++) {
+            /* Left Blank */
+        }
+        ApeInfo_buf_write(buf, start, (size_t)(data - start));
+        if (data == end) {
+            break;
+        }
+        c = *data++;
+        ApeInfo_buf_char(buf, '\\');
+        switch (c) {
+        case '\t':
+            ApeInfo_buf_char(buf, 't');
+            break;
+        case '\n':
+            ApeInfo_buf_char(buf, 'n');
+            break;
+        case '\r':
+            ApeInfo_buf_char(buf, 'r');
+            break;
+        case '\0':
+            ApeInfo_buf_char(buf, '0');
+            break;
+        default:
+            ApeInfo_buf_char(buf, '\\');
+            break;
+        }
+    }
+}
+
+void ApeInfo_buf_base64(struct ApeInfo_buf *buf, const char *data, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *d = (const unsigned char *)data;
+    char *out;
+    size_t i;
+
+    ApeInfo_buf_reserve(buf, (size + 2) / 3 * 4);
+    out = buf->data + buf->size;
+    for (i=0; i + 2 < size; i += 3) {
+        *out++ = alphabet[d[i] >> 2];
+        *out++ = alphabet[((d[i] & 3) << 4) | (d[i+1] >> 4)];
+        *out++ = alphabet[((d[i+1] & 15) << 2) | (d[i+2] >> 6)];
+        *out++ = alphabet[d[i+2] & 63];
+    }
+    if (i < size) {
+        *out++ = alphabet[d[i] >> 2];
+        if (i + 1 < size) {
+            *out++ = alphabet[((d[i] & 3) << 4) | (d[i+1] >> 4)];
+            *out++ = alphabet[(d[i+1] & 15) << 2];
+        } else {
+            *out++ = alphabet[(d[i] & 3) << 4];
+            *out++ = '=';
+        }
+        *out++ = '=';
+    }
+    buf->size = (size_t)(out - buf->data);
+}
+
+/*
+Adds the tag to the statistics.  Only the sizes, flags, and keys of the
+items are used, the values are never looked at.
+*/
+void ApeInfo_stats_add(struct ApeInfo_stats *stats, struct ApeTag *tag) {
+    struct ApeTag_item_cursor cursor;
+    struct ApeItem *item;
+    u_int32_t type;
+
+    if (ApeTag_exists_id3(tag) == 1) {
+        stats->id3_tags++;
+    }
+    if (!ApeTag_exists(tag)) {
+        return;
+    }
+
+    stats->tags++;
+    stats->tag_bytes += ApeTag_size(tag);
+    stats->tag_sizes[ApeInfo_stats_bucket(ApeTag_size(tag))]++;
+    stats->item_counts[ApeInfo_stats_bucket(ApeTag_item_count(tag))]++;
+    for (item = ApeTag_item_cursor_first(&cursor, tag, APE_CURSOR_FILE_ORDER); 
+         item != NULL; item = ApeTag_item_cursor_next(&cursor)) {
+        type = (item->flags & APE_ITEM_TYPE_FLAGS) >> 1;
+        stats->items++;
+        stats->type_items[type]++;
+        stats->type_bytes[type] += item->size;
+        stats->value_sizes[ApeInfo_stats_bucket(item->size)]++;
+        ApeInfo_stats_add_key(stats, item->key, 1);
+    }
+}
+
+/*
+Adds count to the number of items with the given key.  Keys are kept in an
+open addressing hash table using FNV-1a of the lowercased key, which is
+resized when it is half full.
+*/
+void ApeInfo_stats_add_key(struct ApeInfo_stats *stats, const char *key, uint64_t count) {
+    struct ApeInfo_key_count *keys;
+    struct ApeInfo_key_count *kc;
+    u_int32_t hash = 2166136261U;
+    size_t capacity;
+    size_t i;
+    size_t j;
+    const char *c;
+    char *k;
+
+    if (stats->num_keys * 2 >= stats->keys_capacity) {
+        capacity = stats->keys_capacity ? stats->keys_capacity * 2 : 256;
+        if ((keys = calloc(capacity, sizeof(struct ApeInfo_key_count))) == NULL) {
+            err(1, NULL);
+        }
+        for (i=0; i < stats->keys_capacity; i++) {
+            if (stats->keys[i].key == NULL) {
+                continue;
+            }
+            for (hash = 2166136261U, c = stats->keys[i].key; *c != '\0'; c++) {
+                hash = (hash ^ (unsigned char)*c) * 16777619U;
+            }
+            for (j = hash & (capacity - 1); keys[j].key != NULL; j = (j + 1) & (capacity - 1)) {
+                /* Left Blank */
+            }
+            keys[j] = stats->keys[i];
+        }
+        free(stats->keys);
+        stats->keys = keys;
+        stats->keys_capacity = capacity;
+    }
+
+    for (hash = 2166136261U, c = key; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)(*c >= 'A' && *c <= 'Z' ? *c | 0x20 : *c)) * 16777619U;
+    }
+    for (i = hash & (stats->keys_capacity - 1); ; i = (i + 1) & (stats->keys_capacity - 1)) {
+        kc = &stats->keys[i];
+        if (kc->key == NULL) {
+            if ((kc->key = strdup(key)) == NULL) {
+                err(1, NULL);
+            }
+            for (k = kc->key; *k != '\0'; k++) {
+                if (*k >= 'A' && *k <= 'Z') {
+                    *k |= 0x20;
+                }
+            }
+            stats->num_keys++;
+            break;
+        }
+        if (strcasecmp(kc->key, key) == 0) {
+            break;
+        }
+    }
+    kc->count += count;
+}
+
+/* Adds the statistics in src to dst */
+void ApeInfo_stats_merge(struct ApeInfo_stats *dst, struct ApeInfo_stats *src) {
+    size_t i;
+
+    dst->files += src->files;
+    dst->open_errors += src->open_errors;
+    dst->tags += src->tags;
+    dst->id3_tags += src->id3_tags;
+    dst->tag_bytes += src->tag_bytes;
+    dst->items += src->items;
+    for (i=0; i < APEINFO_STATS_ERRCODES; i++) {
+        dst->errors[i] += src->errors[i];
+    }
+    for (i=0; i < 4; i++) {
+        dst->type_items[i] += src->type_items[i];
+        dst->type_bytes[i] += src->type_bytes[i];
+    }
+    for (i=0; i < APEINFO_STATS_BUCKETS; i++) {
+        dst->tag_sizes[i] += src->tag_sizes[i];
+        dst->item_counts[i] += src->item_counts[i];
+        dst->value_sizes[i] += src->value_sizes[i];
+    }
+    for (i=0; i < src->keys_capacity; i++) {
+        if (src->keys[i].key != NULL) {
+            ApeInfo_stats_add_key(dst, src->keys[i].key, src->keys[i].count);
+        }
+    }
+}
+
+/* Prints the library's counters for all tags to stderr, for --profile.  This
+   must be called after all tags have been freed, as a tag's counters are only
+   added to the totals when it is reset or freed. */
+void ApeInfo_profile_print(void) {
+    struct ApeTag_stats stats;
+
+    if (ApeTag_get_global_stats(&stats) != 0) {
+        warnx("profiling counters not compiled into libapetag");
+        return;
+    }
+
+    fprintf(stderr, "bytes read: %" PRIu64 "\n", stats.bytes_read);
+    fprintf(stderr, "bytes written: %" PRIu64 "\n", stats.bytes_written);
+    fprintf(stderr, "reads: %" PRIu64 "\n", stats.reads);
+    fprintf(stderr, "seeks: %" PRIu64 "\n", stats.seeks);
+    fprintf(stderr, "writes: %" PRIu64 "\n", stats.writes);
+    fprintf(stderr, "allocations: %" PRIu64 "\n", stats.allocations);
+    fprintf(stderr, "cache hits: %" PRIu64 "\n", stats.cache_hits);
+    fprintf(stderr, "cache misses: %" PRIu64 "\n", stats.cache_misses);
+    fprintf(stderr, "\ntime (ns):\n");
+    fprintf(stderr, "  get_tag_information: %" PRIu64 "\n", stats.get_tag_information_ns);
+    fprintf(stderr, "  parse_items: %" PRIu64 "\n", stats.parse_items_ns);
+    fprintf(stderr, "  update_ape: %" PRIu64 "\n", stats.update_ape_ns);
+    fprintf(stderr, "  update_id3: %" PRIu64 "\n", stats.update_id3_ns);
+    fprintf(stderr, "  write_tag: %" PRIu64 "\n", stats.write_tag_ns);
+}
+
+void ApeInfo_stats_print(struct ApeInfo_stats *stats) {
+    static const char *types[4] = {"utf8", "binary", "external", "reserved"};
+    struct ApeInfo_key_count *keys;
+    size_t i;
+    size_t j;
+
+    printf("files: %" PRIu64 "\n", stats->files);
+    printf("ape tags: %" PRIu64 "\n", stats->tags);
+    printf("id3 tags: %" PRIu64 "\n", stats->id3_tags);
+    printf("ape tag bytes: %" PRIu64 "\n", stats->tag_bytes);
+    printf("items: %" PRIu64 "\n", stats->items);
+
+    printf("\nerrors:\n");
+    printf("  open: %" PRIu64 "\n", stats->open_errors);
+    for (i=1; i < APEINFO_STATS_ERRCODES; i++) {
+        if (stats->errors[i] > 0) {
+            printf("  %s: %" PRIu64 "\n", errcode_names[i], stats->errors[i]);
+        }
+    }
+
+    printf("\nitem types (items, value bytes):\n");
+    for (i=0; i < 4; i++) {
+        printf("  %s: %" PRIu64 ", %" PRIu64 "\n", types[i], stats->type_items[i], stats->type_bytes[i]);
+    }
+
+    ApeInfo_stats_print_histogram("ape tag size", stats->tag_sizes);
+    ApeInfo_stats_print_histogram("item count", stats->item_counts);
+    ApeInfo_stats_print_histogram("value size", stats->value_sizes);
+
+    printf("\nmost common keys:\n");
+    if (stats->num_keys > 0) {
+        if ((keys = malloc(stats->num_keys * sizeof(struct ApeInfo_key_count))) == NULL) {
+            err(1, NULL);
+        }
+        for (i=0, j=0; i < stats->keys_capacity; i++) {
+            if (stats->keys[i].key != NULL) {
+                keys[j++] = stats->keys[i];
+            }
+        }
+        qsort(keys, stats->num_keys, sizeof(struct ApeInfo_key_count), ApeInfo_key_count_compare);
+        for (i=0; i < stats->num_keys && i < APEINFO_STATS_TOP_KEYS; i++) {
+            printf("  %s: %" PRIu64 "\n", keys[i].key, keys[i].count);
+        }
+        free(keys);
+    }
+}
+
+/* Prints the number of files that failed verification for each error code */
+void ApeInfo_verify_print(struct ApeInfo_stats *stats) {
+    uint64_t failed = stats->open_errors;
+    size_t i;
+
+    for (i=1; i < APEINFO_STATS_ERRCODES; i++) {
+        failed += stats->errors[i];
+    }
+
+    printf("\nverified: %" PRIu64 "\n", stats->files);
+    printf("failed: %" PRIu64 "\n", failed);
+    if (stats->open_errors > 0) {
+        printf("  open: %" PRIu64 "\n", stats->open_errors);
+    }
+    for (i=1; i < APEINFO_STATS_ERRCODES; i++) {
+        if (stats->errors[i] > 0) {
+            printf("  %s: %" PRIu64 "\n", errcode_names[i], stats->errors[i]);
+        }
+    }
+}
+
+/* Prints the non-empty buckets of a histogram, bucket i holds [2^(i-1), 2^i) */
+void ApeInfo_stats_print_histogram(const char *name, uint64_t *buckets) {
+    size_t i;
+
+    printf("\n%s:\n", name);
+    for (i=0; i < APEINFO_STATS_BUCKETS; i++) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+        if (i < 2) {
+            printf("  %lu: %" PRIu64 "\n", (unsigned long)i, buckets[i]);
+        } else {
+            printf("  %" PRIu64 "-%" PRIu64 ": %" PRIu64 "\n", (uint64_t)1 << (i - 1), ((uint64_t)1 << i) - 1, buckets[i]);
+        }
+    }
+}
+
+void ApeInfo_stats_free(struct ApeInfo_stats *stats) {
+    size_t i;
+
+    for (i=0; i < stats->keys_capacity; i++) {
+        free(stats->keys[i].key);
+    }
+    free(stats->keys);
+    stats->keys = NULL;
+    stats->num_keys = 0;
+    stats->keys_capacity = 0;
+}
+
+/* Returns the histogram bucket for n, 0 for 0, otherwise 1 + floor(log2(n)) */
+size_t ApeInfo_stats_bucket(u_int32_t n) {
+    size_t bucket = 0;
+
+    while (n > 0) {
+        bucket++;
+        n >>= 1;
+    }
+    return bucket;
+}
+
+/* Sorts keys by descending count, then by key */
+int ApeInfo_key_count_compare(const void *a, const void *b) {
+    const struct ApeInfo_key_count *kc_a = a;
+    const struct ApeInfo_key_count *kc_b = b;
+
+    if (kc_a->count != kc_b->count) {
+        return kc_a->count > kc_b->count ? -1 : 1;
     }
-    printf("\n");
+    return strcmp(kc_a->key, kc_b->key);
 }
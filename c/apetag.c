@@ -3,9 +3,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #ifdef USE_DB_185
 #include <db_185.h>
@@ -13,19 +19,113 @@
 #include <db.h>
 #endif
 
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
 /* Macros */
 
 #define APE_DEFAULT_FLAGS      0
-#define APE_CHECKED_APE        1 << 0
-#define APE_CHECKED_OFFSET     1 << 1
-#define APE_CHECKED_FIELDS     1 << 2
-#define APE_HAS_APE            1 << 3
-#define APE_HAS_ID3            1 << 4
+#define APE_CHECKED_APE        (1 << 0)
+#define APE_CHECKED_OFFSET     (1 << 1)
+#define APE_CHECKED_FIELDS     (1 << 2)
+#define APE_HAS_APE            (1 << 3)
+#define APE_HAS_ID3            (1 << 4)
+#define APE_FD_HINTS           (1 << 6)
+#define APE_CLOSE_FD           (1 << 7)
+#define APE_DISK_TAIL          (1 << 9)
+#define APE_JOURNAL_VIEW       (1 << 10)
 
 #define APE_PREAMBLE "APETAGEX\320\07\0\0"
 #define APE_HEADER_FLAGS "\0\0\240"
 #define APE_FOOTER_FLAGS "\0\0\200"
 
+/* Bytes at the end of a file that may contain a tag of maximum size */
+#define APE_TAIL_WINDOW        (APE_MAXIMUM_TAG_SIZE + 128)
+
+/* posix_fadvise advice, if supported */
+#ifdef POSIX_FADV_WILLNEED
+#define APE_FADV_WILLNEED      POSIX_FADV_WILLNEED
+#define APE_FADV_DONTNEED      POSIX_FADV_DONTNEED
+#else
+#define APE_FADV_WILLNEED      0
+#define APE_FADV_DONTNEED      0
+#endif
+
+/* Instrumentation counters, compiled out if APE_NO_STATS is defined.  The
+   process-wide totals are only updated when a tag is reset or freed, using
+   relaxed atomic adds where the compiler supports them. */
+#ifndef APE_NO_STATS
+#define APE_STAT_ADD(TAG, FIELD, N) ((TAG)->stats.FIELD += (N))
+#define APE_STAT_PTR(TAG, FIELD)    (&(TAG)->stats.FIELD)
+#else
+#define APE_STAT_ADD(TAG, FIELD, N) ((void)(TAG))
+#define APE_STAT_PTR(TAG, FIELD)    NULL
+#endif
+#ifdef __ATOMIC_RELAXED
+#define APE_ATOMIC_ADD(P, N)   __atomic_fetch_add((P), (N), __ATOMIC_RELAXED)
+#define APE_ATOMIC_LOAD(P)     __atomic_load_n((P), __ATOMIC_RELAXED)
+#else
+#define APE_ATOMIC_ADD(P, N)   (*(P) += (N))
+#define APE_ATOMIC_LOAD(P)     (*(P))
+#endif
+
+/* Snapshot reference counts.  Dropping a reference must make the dropping
+   thread's reads happen before the snapshot is freed by the last thread. */
+#ifdef __ATOMIC_ACQ_REL
+#define APE_ATOMIC_INCREF(P)   __atomic_add_fetch((P), 1, __ATOMIC_RELAXED)
+#define APE_ATOMIC_DECREF(P)   __atomic_sub_fetch((P), 1, __ATOMIC_ACQ_REL)
+#else
+#define APE_ATOMIC_INCREF(P)   __sync_add_and_fetch((P), 1)
+#define APE_ATOMIC_DECREF(P)   __sync_sub_and_fetch((P), 1)
+#endif
+
+/* io_uring, used through the system calls so liburing isn't needed.  The
+   kernel reads the submission ring's tail and writes the completion ring's
+   tail, so they are accessed with acquire and release ordering. */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+    defined(__NR_io_uring_enter) && defined(__ATOMIC_ACQUIRE)
+#define APE_URING              1
+#define APE_URING_ENTRIES      64
+#define APE_LOAD_ACQUIRE(P)    __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define APE_STORE_RELEASE(P, V) __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+#endif
+
+/* Scan cache file header: magic, format version, and a byte order mark, as
+   records are stored in native byte order */
+#define APE_CACHE_MAGIC        "APECACHE"
+#define APE_CACHE_VERSION      1
+#define APE_CACHE_BYTE_ORDER   0x01020304
+#define APE_CACHE_HEADER_SIZE  16
+
+/* Flags stored in cache records */
+#define APE_CACHE_RECORD_FLAGS (APE_NO_ID3 | APE_HAS_APE | APE_HAS_ID3)
+
+/* Library index snapshot magic, format version, and byte order mark */
+#define APE_INDEX_MAGIC        "APEINDEX"
+#define APE_INDEX_VERSION      1
+#define APE_INDEX_BYTE_ORDER   0x01020304
+
+/* Key table index of interned strings not used as case folded keys */
+#define APE_INDEX_NO_KEY       UINT32_MAX
+
+/* Snapshot cache shards, and hash buckets each shard starts with */
+#define APE_LRU_DEFAULT_SHARDS 16
+#define APE_LRU_MAXIMUM_SHARDS 1024
+#define APE_LRU_MINIMUM_BUCKETS 16
+
+/* Changed bytes of a delta write closer together than this are written
+   with one write, along with the unchanged bytes between them */
+#define APE_DELTA_GAP          64
+
+/* Update journal footer, with the magic last so it is seen by the reads of
+   the end of the file done to find tags.  Footers are aligned to their size
+   so they are never split across disk sectors. */
+#define APE_JOURNAL_MAGIC      "APEJOURN"
+#define APE_JOURNAL_VERSION    1
+#define APE_JOURNAL_FOOTER_SIZE 64
+
 /* True minimum values */
 #define APE_MINIMUM_TAG_SIZE   64
 #define APE_ITEM_MINIMUM_SIZE  11
@@ -71,6 +171,15 @@
 static DB *ID3_GENRES = NULL;
 static uint32_t APE_MAXIMUM_TAG_SIZE = 8192;
 static uint32_t APE_MAXIMUM_ITEM_COUNT = 64;
+#ifndef APE_NO_STATS
+static struct ApeTag_stats APE_GLOBAL_STATS;
+#endif
+static void *ApeTag__default_malloc(void *ctx, size_t size);
+static void *ApeTag__default_realloc(void *ctx, void *ptr, size_t size);
+static void ApeTag__default_free(void *ctx, void *ptr);
+static struct ApeTag_allocator APE_ALLOCATOR = {
+    ApeTag__default_malloc, ApeTag__default_realloc, ApeTag__default_free, NULL
+};
 
 static const unsigned char charmap[] = {
     '\000', '\001', '\002', '\003', '\004', '\005', '\006', '\007',
@@ -110,14 +219,27 @@ static const unsigned char charmap[] = {
 /* Private Structure */
 
 struct ApeTag {
-    FILE *file;                  /* file containing tag */
+    FILE *file;                  /* file containing tag, if using stdio */
+    const struct ApeTag_io *io;  /* I/O callbacks for file containing tag */
+    void *io_ctx;                /* Context passed to I/O callbacks */
+    void *owned_io_ctx;          /* I/O context to free with the tag */
+    int fd;                      /* file descriptor, if using ApeTag_new_fd */
     DB *items;                   /* DB_HASH format database */
                                  /* Keys are NULL-terminated */
                                  /* Values are ApeItem** */
     char *tag_header;            /* Tag Header data */
     char *tag_data;              /* Tag body data */
     char *tag_footer;            /* Tag footer data */
+    uint32_t data_capacity;      /* Allocated size of tag_data */
     char *id3;                   /* ID3 data, if any */
+    char *disk_tail;             /* Copy of the tags in the file, for delta writes */
+    uint32_t disk_capacity;      /* Allocated size of disk_tail */
+    uint32_t disk_length;        /* Length of the tags in disk_tail */
+    char *padding_key;           /* Key of the hidden padding item, if any */
+    uint32_t padding_size;       /* Value size of new padding items */
+    struct ApeItem **item_order; /* Items in the order they were added */
+    struct ApeItem **sorted_items; /* Items in the order they are written */
+    uint32_t item_capacity;      /* Allocated size of both item arrays */
     char *error;                 /* String for last error */
     enum ApeTag_errcode errcode; /* Error code for last error */
     uint32_t flags;              /* Internal tag flags */
@@ -125,24 +247,346 @@ struct ApeTag {
     uint32_t file_item_count;    /* On disk item count */
     uint32_t item_count;         /* In database item count */
     off_t offset;                /* Start of tag in file */
+    struct ApeTag_allocator allocator; /* Used for everything but the tag itself */
+    struct ApeTag_cache *cache;  /* Scan cache, if any */
+    off_t journal_end;           /* File size before a journaled update */
+    off_t journal_start;         /* Start of the journal's copy of the tag */
+    off_t view_shift;            /* Added to offsets of the tags when reading
+                                    the copy of an interrupted update */
+#ifndef APE_NO_STATS
+    struct ApeTag_stats stats;   /* Counters since created or last reset */
+    off_t stats_position;        /* End of last read or write, to count seeks */
+#endif
+};
+
+/* Pieces of a new tag being compared to the tag in the file for a delta
+   write, and the run of changed bytes found that hasn't been written yet */
+
+struct ApeTag__delta {
+    const char *pieces[4];
+    uint32_t sizes[4];
+    uint32_t count;
+    uint32_t start;              /* Run of changed bytes, empty if start == end */
+    uint32_t end;
+};
+
+/* Immutable copy of a tag's items and raw tag, stored in a single allocation
+   with the items, the items sorted by key, the raw tag, and the items' keys
+   and values following the struct.  Nothing is modified after it is created
+   except the reference count. */
+
+struct ApeTag_snapshot {
+    uint32_t refcount;           /* Changed atomically */
+    uint32_t item_count;
+    uint32_t raw_size;
+    size_t size;                 /* Bytes allocated, including the struct */
+    struct ApeTag_allocator allocator; /* Allocator of the tag it was taken from */
+    struct ApeItem *items;       /* Items in the order they were added */
+    struct ApeItem **by_key;     /* Items sorted case insensitively by key */
+    char *raw;                   /* Raw APE and ID3 tags */
+};
+
+/* In-memory copies of ranges of a file, used by ApeTag_new_from_ranges */
+
+struct ApeTag__ranges {
+    off_t file_size;             /* Size of the whole file */
+    size_t count;                /* Number of ranges */
+    struct ApeTag_range *ranges; /* Ranges, stored after this struct */
+    char *data;                  /* Concatenated data for all ranges */
+};
+
+/* On-disk scan cache.  The file is APE_CACHE_HEADER_SIZE bytes of header
+   followed by records, each a struct ApeTag__cache_record followed by length
+   bytes of tag data (the ape tag, then the id3 tag), padded to a multiple of
+   8 bytes.  Records are only appended, and later records for the same file
+   replace earlier ones. */
+
+struct ApeTag__cache_record {
+    uint32_t length;             /* Bytes of tag data following the record */
+    uint32_t checksum;           /* FNV-1a of the rest of the record and data */
+    uint64_t dev;                /* File identity when the tag was read */
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mtime_nsec;
+    uint32_t flags;              /* APE_CACHE_RECORD_FLAGS */
+    uint32_t tag_size;           /* Size of the ape tag, if any */
+    uint32_t item_count;         /* Item count of the ape tag, if any */
+};
+
+struct ApeTag_cache {
+    int fd;                      /* Cache file, opened for appending if writable */
+    int writable;                /* Whether new records can be appended */
+    pthread_mutex_t lock;        /* Serializes appends within the process */
+    const char *map;             /* Records present when the cache was opened */
+    size_t map_size;
+    size_t *index;               /* Hash of record offsets, 0 for empty slots */
+    size_t index_mask;           /* Number of slots - 1 */
+};
+
+/* Snapshot cache entry, in both a shard's hash chains and its list of
+   entries from most to least recently used */
+
+struct ApeTag__lru_entry {
+    struct ApeTag__lru_entry *next;     /* Next entry in the hash chain */
+    struct ApeTag__lru_entry *newer;
+    struct ApeTag__lru_entry *older;
+    struct ApeTag_snapshot *snapshot;   /* Reference held by the cache */
+    struct ApeTag__cache_record identity; /* File identity when parsed */
+    size_t size;                        /* Bytes charged to the shard */
+    uint32_t hash;                      /* FNV-1a of path */
+    char path[];
+};
+
+/* Independently locked part of a snapshot cache, holding the paths that hash
+   to it */
+
+struct ApeTag__lru_shard {
+    pthread_mutex_t lock;
+    struct ApeTag__lru_entry **buckets;
+    size_t bucket_mask;                 /* Number of buckets - 1 */
+    size_t count;
+    size_t bytes;
+    struct ApeTag__lru_entry *newest;
+    struct ApeTag__lru_entry *oldest;
+    struct ApeTag_lru_stats stats;      /* entries and bytes are not used */
+};
+
+/* Tag with a journaled update waiting for a group commit */
+
+struct ApeTag__group_member {
+    struct ApeTag *tag;
+    dev_t dev;                          /* Device, so each is synced once */
+    int failed;                         /* Skipped by later phases if set */
+    int written;                        /* Tail written by ApeTag__group_uring */
+    int queued;                         /* Write on the ring not yet completed */
+};
+
+struct ApeTag_group {
+    struct ApeTag__group_member *members;
+    size_t count;
+    size_t capacity;
+    size_t reserved;                    /* Updates in progress, with room kept */
+    pthread_mutex_t lock;               /* Serializes adding updates */
+};
+
+#ifdef APE_URING
+/* io_uring with its submission and completion rings mapped */
+
+struct ApeTag__uring {
+    int fd;
+    unsigned entries;                   /* Submission ring size */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct ApeTag_lru {
+    size_t max_bytes;                   /* Budget of each shard */
+    uint32_t shard_mask;                /* Number of shards - 1 */
+    struct ApeTag_allocator allocator;
+    struct ApeTag__lru_shard shards[];
+};
+
+/* Library index snapshot.  The file is a struct ApeTag__index_header followed
+   by the file table, the key table, the item table, and the string table, at
+   the offsets given in the header.  Files are sorted by filename and the key
+   table (string table offsets of case folded keys) is sorted by key, so both
+   can be binary searched.  Each file's items are contiguous in the item table,
+   in file order.  Strings other than item values are NUL terminated.  The
+   snapshot is memory mapped and used in place, so opening it only checks the
+   header, and records are checked as they are accessed. */
+
+struct ApeTag__index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t file_count;
+    uint32_t key_count;
+    uint64_t item_count;
+    uint64_t files_offset;
+    uint64_t keys_offset;
+    uint64_t items_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct ApeTag__index_file {
+    uint64_t filename;           /* String table offset of the filename */
+    uint64_t first_item;         /* Item table index of the file's first item */
+    uint32_t item_count;
+    uint32_t reserved;
+};
+
+struct ApeTag__index_item {
+    uint64_t key;                /* String table offset of the key */
+    uint64_t value;              /* String table offset of the value */
+    uint32_t size;               /* Size of the value */
+    uint32_t flags;              /* Flags on the item */
+    uint32_t key_id;             /* Key table index of the case folded key */
+    uint32_t reserved;
+};
+
+struct ApeTag_index {
+    char *map;
+    size_t map_size;
+    struct ApeTag__index_header header;
+};
+
+/* Entry in the writer's hash of interned keys */
+struct ApeTag__index_string {
+    uint64_t offset;             /* String table offset + 1, 0 for empty slots */
+    uint32_t hash;
+    uint32_t key_id;             /* Key table index, or APE_INDEX_NO_KEY */
+    size_t length;               /* Length without the NUL terminator */
+};
+
+/* Entry sorted when writing a snapshot */
+struct ApeTag__index_sort {
+    const char *string;
+    size_t index;
+};
+
+struct ApeTag_index_writer {
+    struct ApeTag__index_file *files;
+    struct ApeTag__index_item *items;
+    uint64_t *keys;              /* Key table, in the order keys were added */
+    char *strings;
+    struct ApeTag__index_string *interned;
+    size_t file_count;
+    size_t file_capacity;
+    size_t item_count;
+    size_t item_capacity;
+    size_t key_count;
+    size_t key_capacity;
+    size_t strings_size;
+    size_t strings_capacity;
+    size_t interned_count;
+    size_t interned_mask;        /* Number of slots - 1 */
 };
 
 /* Private function prototypes */
 
+static ssize_t ApeTag__stdio_read(void *ctx, void *buf, size_t size, off_t offset);
+static ssize_t ApeTag__stdio_write(void *ctx, const void *buf, size_t size, off_t offset);
+static int ApeTag__stdio_truncate(void *ctx, off_t length);
+static off_t ApeTag__stdio_size(void *ctx);
+static ssize_t ApeTag__fd_read(void *ctx, void *buf, size_t size, off_t offset);
+static ssize_t ApeTag__fd_write(void *ctx, const void *buf, size_t size, off_t offset);
+static int ApeTag__fd_truncate(void *ctx, off_t length);
+static off_t ApeTag__fd_size(void *ctx);
+static ssize_t ApeTag__ranges_read(void *ctx, void *buf, size_t size, off_t offset);
+static off_t ApeTag__ranges_size(void *ctx);
+static ssize_t ApeTag__empty_read(void *ctx, void *buf, size_t size, off_t offset);
+static off_t ApeTag__empty_size(void *ctx);
+static int ApeTag__read(struct ApeTag *tag, void *buf, size_t size, off_t offset);
+static int ApeTag__write(struct ApeTag *tag, const void *buf, size_t size, off_t offset);
+static int ApeTag__truncate(struct ApeTag *tag, off_t length);
+static void ApeTag__fadvise(struct ApeTag *tag, off_t offset, off_t length, int advice);
+static void *ApeTag__malloc(struct ApeTag *tag, size_t size);
+static void *ApeTag__realloc(struct ApeTag *tag, void *ptr, size_t size);
+static void ApeTag__free(struct ApeTag *tag, void *ptr);
+static void ApeTag__global_free(void *ptr);
+static int ApeTag__timed(struct ApeTag *tag, int phase(struct ApeTag *tag), uint64_t *ns);
+static void ApeTag__flush_stats(struct ApeTag *tag);
+
 static int ApeTag__get_tag_information(struct ApeTag *tag);
+static int ApeTag__read_tag_information(struct ApeTag *tag);
+static int ApeTag__read_tags(struct ApeTag *tag, off_t file_size);
+static int ApeTag__load_tag_information(struct ApeTag *tag);
+static int ApeTag__file_identity(struct ApeTag *tag, struct stat *sb);
+static int ApeTag__cache_scan(struct ApeTag_cache *cache, size_t *count);
+static int ApeTag__cache_index(struct ApeTag_cache *cache, size_t count);
+static size_t ApeTag__cache_slot(struct ApeTag_cache *cache, uint64_t dev, uint64_t ino, uint32_t flags);
+static int ApeTag__cache_lookup(struct ApeTag *tag, const struct stat *sb);
+static void ApeTag__cache_store(struct ApeTag *tag, const struct stat *sb);
+static void ApeTag__cache_identity(struct ApeTag__cache_record *record, const struct stat *sb, uint32_t flags);
+static uint32_t ApeTag__fnv1a(uint32_t hash, const void *data, size_t size);
+static int ApeTag__index_add_item(struct ApeTag *tag, struct ApeItem *item, void *data);
+static struct ApeTag_snapshot * ApeTag__lru_parse(const char *path, uint32_t flags, struct ApeTag__cache_record *identity, enum ApeTag_errcode *errcode, const char **error);
+static struct ApeTag__lru_entry ** ApeTag__lru_find(struct ApeTag__lru_shard *shard, const char *path, uint32_t hash);
+static void ApeTag__lru_insert(struct ApeTag_lru *lru, struct ApeTag__lru_shard *shard, struct ApeTag__lru_entry *entry);
+static void ApeTag__lru_remove(struct ApeTag_lru *lru, struct ApeTag__lru_shard *shard, struct ApeTag__lru_entry **link);
+static void ApeTag__lru_unlink(struct ApeTag__lru_shard *shard, struct ApeTag__lru_entry *entry);
+static void ApeTag__lru_push(struct ApeTag__lru_shard *shard, struct ApeTag__lru_entry *entry);
+static void ApeTag__lru_grow(struct ApeTag_lru *lru, struct ApeTag__lru_shard *shard);
+static int ApeTag__index_grow(void **array, size_t *capacity, size_t count, size_t element_size);
+static int ApeTag__index_append(struct ApeTag_index_writer *writer, const char *data, size_t size, uint64_t *offset);
+static struct ApeTag__index_string * ApeTag__index_intern(struct ApeTag_index_writer *writer, const char *key, size_t length);
+static int ApeTag__index_compare(const void *a, const void *b);
+static int ApeTag__index_write(struct ApeTag_index_writer *writer, FILE *file);
+static int ApeTag__index_file(struct ApeTag_index *index, uint32_t file, struct ApeTag__index_file *record);
+static int ApeTag__index_item(struct ApeTag_index *index, uint64_t item, struct ApeItem *view);
+static char * ApeTag__index_string(struct ApeTag_index *index, uint64_t offset);
+static void ApeTag__index_fold(char *dest, const char *src, size_t length);
+static int ApeTag__check_footer(struct ApeTag *tag, off_t file_size, int id3_length);
+static int ApeTag__is_id3(const char *id3);
 static int ApeTag__parse_items(struct ApeTag *tag);
 static int ApeTag__parse_item(struct ApeTag *tag, uint32_t *offset);
+static int ApeTag__read_item(struct ApeTag *tag, uint32_t *offset, struct ApeItem *item);
+static int ApeTag__verify_items(struct ApeTag *tag);
 static int ApeTag__update_id3(struct ApeTag *tag);
+static int ApeTag__render_id3(struct ApeTag *tag, char *id3);
 static int ApeTag__update_ape(struct ApeTag *tag);
+static int ApeTag__prepare_ape(struct ApeTag *tag, struct ApeItem ***items, uint32_t *num_items, uint32_t *tag_size);
+static uint32_t ApeTag__padded_size(struct ApeTag *tag, uint32_t size);
+static int ApeTag__render_ape(struct ApeTag *tag, struct ApeItem **items, uint32_t num_items, uint32_t tag_size, char *header, char *data, char *footer);
 static int ApeTag__write_tag(struct ApeTag *tag);
+static int ApeTag__write_tail(struct ApeTag *tag, off_t offset);
+static int ApeTag__truncate_tag(struct ApeTag *tag);
+static void ApeTag__wrote_tag(struct ApeTag *tag);
+static int ApeTag__save_tail(struct ApeTag *tag);
+static int ApeTag__write_delta(struct ApeTag *tag);
+static int ApeTag__delta_mark(struct ApeTag *tag, struct ApeTag__delta *delta, uint32_t start, uint32_t end);
+static int ApeTag__delta_flush(struct ApeTag *tag, struct ApeTag__delta *delta);
+static int ApeTag__copy_range(struct ApeTag *src, struct ApeTag *dst, uint32_t length);
+static uint32_t ApeTag__write_length(struct ApeTag *tag);
+static int ApeTag__journal_begin(struct ApeTag *tag);
+static int ApeTag__journal_copy(struct ApeTag *tag);
+static int ApeTag__journal_apply(struct ApeTag *tag);
+static int ApeTag__is_journal(const char *tail_end);
+static int ApeTag__journal_recover(struct ApeTag *tag, off_t *file_size);
+static int ApeTag__read_only(struct ApeTag *tag);
+static int ApeTag__fileno(struct ApeTag *tag);
+static int ApeTag__sync(struct ApeTag *tag);
+static int ApeTag__group_sync(struct ApeTag_group *group);
+static int ApeTag__group_phase(struct ApeTag_group *group, int phase(struct ApeTag *tag));
+static int ApeTag__group_compare(const void *a, const void *b);
+static int ApeTag__group_journal(struct ApeTag_group *group, int sync);
+#ifdef APE_URING
+static void ApeTag__group_uring(struct ApeTag_group *group);
+static int ApeTag__uring_init(struct ApeTag__uring *ring, unsigned entries);
+static void ApeTag__uring_free(struct ApeTag__uring *ring);
+#endif
 static uint32_t ApeTag__tag_length(struct ApeTag *tag);
 static uint32_t ApeTag__id3_length(struct ApeTag *tag);
+static int ApeTag__writes_id3(struct ApeTag *tag);
 static struct ApeItem * ApeTag__get_item(struct ApeTag *tag, const char *key);
 static struct ApeItem **ApeTag__get_items(struct ApeTag *tag, uint32_t *item_count);
+static int ApeTag__reserve_items(struct ApeTag *tag, uint32_t count);
+static void ApeTag__unorder_item(struct ApeTag *tag, struct ApeItem *item);
+static struct ApeItem **ApeTag__sort_items(struct ApeTag *tag);
 static int ApeTag__iter_items(struct ApeTag *tag, int iterator(struct ApeTag *tag, struct ApeItem *item, void *data), void *data);
 
-static void ApeItem__free(struct ApeItem **item);
-static char * ApeTag__strcasecpy(const char *src, size_t size);
+static int ApeTag__alloc_buffers(struct ApeTag *tag, uint32_t data_size);
+static int ApeTag__empty_items(struct ApeTag *tag);
+static int ApeTag__reset(struct ApeTag *tag, uint32_t flags);
+static int ApeTag__open_path(const char *path, int oflag);
+static void ApeTag__use_fd(struct ApeTag *tag, int fd);
+static void ApeItem__free(struct ApeTag *tag, struct ApeItem **item);
+static char * ApeTag__strcasecpy(struct ApeTag *tag, const char *src, size_t size);
 static unsigned char ApeItem__parse_track(uint32_t size, char *value);
 static int ApeItem__check_validity(struct ApeTag *tag, struct ApeItem *item);
 static int ApeTag__check_valid_utf8(unsigned char *utf8_string, uint32_t size);
@@ -150,27 +594,243 @@ static int ApeItem__compare(const void *a, const void *b);
 static int ApeTag__lookup_genre(struct ApeTag *tag, struct ApeItem *item, unsigned char *genre_id);
 static int ApeTag__load_ID3_GENRES(struct ApeTag *tag);
 static int ApeTag__strncasecmp(const char *s1, const char *s2, size_t n);
+static void ApeTag__copy_raw(struct ApeTag *tag, char *raw);
+static int ApeItem__compare_keys(const void *a, const void *b);
+
+/* I/O Backends */
+
+const struct ApeTag_io ApeTag_stdio_io = {
+    ApeTag__stdio_read,
+    ApeTag__stdio_write,
+    ApeTag__stdio_truncate,
+    ApeTag__stdio_size
+};
+
+const struct ApeTag_io ApeTag_fd_io = {
+    ApeTag__fd_read,
+    ApeTag__fd_write,
+    ApeTag__fd_truncate,
+    ApeTag__fd_size
+};
+
+static const struct ApeTag_io ApeTag__ranges_io = {
+    ApeTag__ranges_read,
+    NULL,
+    NULL,
+    ApeTag__ranges_size
+};
+
+static const struct ApeTag_io ApeTag__empty_io = {
+    ApeTag__empty_read,
+    NULL,
+    NULL,
+    ApeTag__empty_size
+};
 
 /* Public Functions */
 
 struct ApeTag * ApeTag_new(FILE *file, uint32_t flags) {
     struct ApeTag *tag;
     
+    /* Tags without a file are built in memory and serialized */
     if (file == NULL) {
+        return ApeTag_new_io(&ApeTag__empty_io, NULL, flags);
+    }
+    
+    if ((tag = ApeTag_new_io(&ApeTag_stdio_io, file, flags)) != NULL) {
+        tag->file = file;
+    }
+    
+    return tag;
+}
+
+struct ApeTag * ApeTag_new_fd(int fd, uint32_t flags) {
+    struct ApeTag *tag;
+    
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    if ((tag = ApeTag_new_io(&ApeTag_fd_io, NULL, flags | APE_FD_HINTS)) != NULL) {
+        ApeTag__use_fd(tag, fd);
+    }
+    
+    return tag;
+}
+
+struct ApeTag * ApeTag_open(const char *path, int oflag, uint32_t flags) {
+    int fd;
+    int saved_errno;
+    struct ApeTag *tag;
+    
+    if ((fd = ApeTag__open_path(path, oflag)) == -1) {
+        return NULL;
+    }
+    
+    if ((tag = ApeTag_new_fd(fd, flags)) == NULL) {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    tag->flags |= APE_CLOSE_FD;
+    
+    return tag;
+}
+
+struct ApeTag * ApeTag_new_io(const struct ApeTag_io *io, void *ctx, uint32_t flags) {
+    struct ApeTag *tag;
+    
+    if (io == NULL || io->read == NULL || io->size == NULL) {
         return NULL;
     }
     
-    tag = malloc(sizeof(struct ApeTag));
+    tag = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, sizeof(struct ApeTag));
 
     if (tag != NULL) {
         memset(tag, 0, sizeof(struct ApeTag));
-        tag->file = file;
+        APE_STAT_ADD(tag, allocations, 1);
+        tag->allocator = APE_ALLOCATOR;
+        tag->io = io;
+        tag->io_ctx = ctx;
         tag->flags = flags | APE_DEFAULT_FLAGS;
     }
     
     return tag;
 }
 
+void ApeTag_plan_tail(off_t file_size, uint32_t flags, struct ApeTag_range *tail) {
+    off_t size = (flags & APE_NO_ID3) ? 32 : 160;
+
+    if (file_size < APE_MINIMUM_TAG_SIZE) {
+        size = 0;
+    } else if (size > file_size) {
+        size = file_size;
+    }
+
+    tail->offset = file_size - size;
+    tail->size = (size_t)size;
+}
+
+int ApeTag_plan_body(off_t file_size, uint32_t flags, const struct ApeTag_range *tail, const void *tail_data, struct ApeTag_range *body, enum ApeTag_errcode *errcode, const char **error) {
+    int ret;
+    int id3_length = 0;
+    off_t end;
+    char footer[32];
+    const char *tail_end = tail_data;
+    struct ApeTag tag;
+
+    memset(&tag, 0, sizeof(struct ApeTag));
+    
+    if (tail == NULL || body == NULL || (tail_data == NULL && tail->size > 0)) {
+        tag.errcode = APETAG_ARGERR;
+        tag.error = "tail, tail_data, or body is NULL";
+        goto plan_body_error;
+    }
+    if (tail->offset + (off_t)tail->size != file_size) {
+        tag.errcode = APETAG_ARGERR;
+        tag.error = "tail range does not end at end of file";
+        goto plan_body_error;
+    }
+    tail_end += tail->size;
+    body->offset = file_size;
+    body->size = 0;
+    
+    /* No ape tag possible in this size */
+    if (file_size < APE_MINIMUM_TAG_SIZE) {
+        return 0;
+    }
+
+    if (!(flags & APE_NO_ID3) && file_size >= 128) {
+        if (tail->size < 128) {
+            tag.errcode = APETAG_ARGERR;
+            tag.error = "tail range too small";
+            goto plan_body_error;
+        }
+        if (ApeTag__is_id3(tail_end - 128)) {
+            id3_length = 128;
+        }
+        if (file_size < APE_MINIMUM_TAG_SIZE + id3_length) {
+            return 0;
+        }
+    }
+    
+    if (tail->size < (size_t)(32 + id3_length)) {
+        tag.errcode = APETAG_ARGERR;
+        tag.error = "tail range too small";
+        goto plan_body_error;
+    }
+    memcpy(footer, tail_end - id3_length - 32, 32);
+    tag.tag_footer = footer;
+    if ((ret = ApeTag__check_footer(&tag, file_size, id3_length)) < 0) {
+        goto plan_body_error;
+    } else if (ret == 1) {
+        return 0;
+    }
+    
+    /* Header and data, less anything already in the tail */
+    body->offset = file_size - id3_length - tag.size;
+    end = file_size - id3_length - 32;
+    if (end > tail->offset) {
+        end = tail->offset;
+    }
+    body->size = end > body->offset ? (size_t)(end - body->offset) : 0;
+    
+    return 1;
+    
+    plan_body_error:
+    if (errcode != NULL) {
+        *errcode = tag.errcode;
+    }
+    if (error != NULL) {
+        *error = tag.error;
+    }
+    return -1;
+}
+
+struct ApeTag * ApeTag_new_from_ranges(off_t file_size, uint32_t flags, const struct ApeTag_range *ranges, const void * const *data, size_t count) {
+    size_t i;
+    size_t total = 0;
+    char *c;
+    struct ApeTag *tag;
+    struct ApeTag__ranges *r;
+    
+    if (count > 0 && (ranges == NULL || data == NULL)) {
+        return NULL;
+    }
+    for (i=0; i < count; i++) {
+        if ((data[i] == NULL && ranges[i].size > 0) || ranges[i].offset < 0 || 
+            ranges[i].offset + (off_t)ranges[i].size > file_size) {
+            return NULL;
+        }
+        total += ranges[i].size;
+    }
+    
+    /* Keep a private copy of the ranges, so the caller's buffers can be reused */
+    if ((r = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, sizeof(struct ApeTag__ranges) + 
+                    count * sizeof(struct ApeTag_range) + total)) == NULL) {
+        return NULL;
+    }
+    r->file_size = file_size;
+    r->count = count;
+    r->ranges = (struct ApeTag_range *)(void *)(r + 1);
+    r->data = (char *)(r->ranges + count);
+    for (i=0, c=r->data; i < count; i++) {
+        r->ranges[i] = ranges[i];
+        memcpy(c, data[i], ranges[i].size);
+        c += ranges[i].size;
+    }
+    
+    if ((tag = ApeTag_new_io(&ApeTag__ranges_io, r, flags)) == NULL) {
+        APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, r);
+        return NULL;
+    }
+    tag->owned_io_ctx = r;
+    APE_STAT_ADD(tag, allocations, 1);
+    
+    return tag;
+}
+
 int ApeTag_free(struct ApeTag *tag) {
     int ret = 0;
     
@@ -180,22 +840,102 @@ int ApeTag_free(struct ApeTag *tag) {
     
     /* Free the information stored in the database */
     ret = ApeTag_clear_items(tag);
+    ApeTag__flush_stats(tag);
     
     /* Free char* on the heap first, then the tag itself */
-    free(tag->id3);
+    ApeTag__free(tag, tag->id3);
     tag->id3 = NULL;
-    free(tag->tag_header);
+    ApeTag__free(tag, tag->tag_header);
     tag->tag_header = NULL;
-    free(tag->tag_footer);
+    ApeTag__free(tag, tag->tag_footer);
     tag->tag_footer = NULL;
-    free(tag->tag_data);
+    ApeTag__free(tag, tag->tag_data);
     tag->tag_data = NULL;
-    free(tag);
+    ApeTag__free(tag, tag->disk_tail);
+    tag->disk_tail = NULL;
+    ApeTag__free(tag, tag->padding_key);
+    tag->padding_key = NULL;
+    ApeTag__global_free(tag->owned_io_ctx);
+    tag->owned_io_ctx = NULL;
+    ApeTag__free(tag, tag->item_order);
+    tag->item_order = NULL;
+    ApeTag__free(tag, tag->sorted_items);
+    tag->sorted_items = NULL;
+    if (tag->flags & APE_CLOSE_FD && close(tag->fd) != 0) {
+        ret = -1;
+    }
+    APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, tag);
     tag = NULL;
     
     return ret;
 }
 
+int ApeTag_reset(struct ApeTag *tag, FILE *file, uint32_t flags) {
+    int ret;
+    
+    if (tag == NULL) {
+        return -1;
+    }
+    
+    if ((ret = ApeTag__reset(tag, flags)) < 0) {
+        return -1;
+    }
+    /* Without a file, the tag is treated as an empty file, as in ApeTag_new */
+    tag->file = file;
+    tag->io = file != NULL ? &ApeTag_stdio_io : &ApeTag__empty_io;
+    tag->io_ctx = file;
+    
+    return ret != 0 ? -1 : 0;
+}
+
+int ApeTag_reset_fd(struct ApeTag *tag, int fd, uint32_t flags) {
+    int ret;
+    
+    if (tag == NULL) {
+        return -1;
+    }
+    if (fd < 0) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "fd is negative";
+        return -1;
+    }
+    
+    if ((ret = ApeTag__reset(tag, flags | APE_FD_HINTS)) < 0) {
+        return -1;
+    }
+    ApeTag__use_fd(tag, fd);
+    
+    return ret != 0 ? -1 : 0;
+}
+
+int ApeTag_reset_open(struct ApeTag *tag, const char *path, int oflag, uint32_t flags) {
+    int ret;
+    int fd;
+    
+    if (tag == NULL) {
+        return -1;
+    }
+    if (path == NULL) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "path is NULL";
+        return -1;
+    }
+    
+    /* The new file is opened first, so the tag is unchanged if it can't be */
+    if ((fd = ApeTag__open_path(path, oflag)) == -1) {
+        tag->errcode = APETAG_FILEERR;
+        tag->error = "open";
+        return -1;
+    }
+    if ((ret = ApeTag__reset(tag, flags | APE_FD_HINTS | APE_CLOSE_FD)) < 0) {
+        close(fd);
+        return -1;
+    }
+    ApeTag__use_fd(tag, fd);
+    
+    return ret != 0 ? -1 : 0;
+}
+
 int ApeTag_exists(struct ApeTag *tag) {
     if (ApeTag__get_tag_information(tag) != 0) {
         return -1;
@@ -221,15 +961,7 @@ int ApeTag_remove(struct ApeTag *tag) {
         return 1;
     }
 
-    if (fflush(tag->file) != 0) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fflush";
-        return -1;
-    }
-
-    if (ftruncate(fileno(tag->file), tag->offset) != 0) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "ftruncate";
+    if (ApeTag__truncate(tag, tag->offset) != 0) {
         return -1;
     }
     
@@ -261,21 +993,12 @@ int ApeTag_raw(struct ApeTag *tag, char **raw, uint32_t *raw_size) {
     *raw_size = 0;
     r_size = ApeTag__tag_length(tag);
 
-    if ((r = malloc(r_size)) == NULL) {
+    if ((r = ApeTag__malloc(tag, r_size)) == NULL) {
         tag->errcode = APETAG_MEMERR;
         tag->error = "malloc";
         return -1;
     }
-
-    if (tag->flags & APE_HAS_APE) {
-        memcpy(r, tag->tag_header, 32);
-        memcpy(r+32, tag->tag_data, tag->size-64);
-        memcpy(r+tag->size-32, tag->tag_footer, 32);
-    }
-
-    if (tag->flags & APE_HAS_ID3 && !(tag->flags & APE_NO_ID3)) {
-        memcpy(r+tag->size, tag->id3, ApeTag__id3_length(tag));
-    }
+    ApeTag__copy_raw(tag, r);
 
     *raw = r;
     *raw_size = r_size;
@@ -289,66 +1012,397 @@ int ApeTag_parse(struct ApeTag *tag) {
     }
 
     if ((tag->flags & APE_HAS_APE) && !(tag->flags & APE_CHECKED_FIELDS)) {
-        if ((ApeTag__parse_items(tag)) != 0) {
+        if (ApeTag__timed(tag, ApeTag__parse_items, APE_STAT_PTR(tag, parse_items_ns)) != 0) {
             return -1;
         }
     }
     
+    /* Everything needed is now in memory, so the cached tail isn't needed */
+    ApeTag__fadvise(tag, tag->offset, 0, APE_FADV_DONTNEED);
+    
     return 0;
 }
 
-int ApeTag_update(struct ApeTag *tag) {
+int ApeTag_verify(struct ApeTag *tag) {
     if (ApeTag__get_tag_information(tag) != 0) {
         return -1;
     }
-    if (ApeTag__update_id3(tag) != 0) {
-        return -1;
-    }
-    if (ApeTag__update_ape(tag) != 0) {
-        return -1;
-    }
-    if (ApeTag__write_tag(tag) != 0) {
-        return -1;
+
+    if ((tag->flags & APE_HAS_APE) && !(tag->flags & APE_CHECKED_FIELDS)) {
+        if (ApeTag__verify_items(tag) != 0) {
+            return -1;
+        }
     }
     
     return 0;
 }
 
-int ApeTag_add_item(struct ApeTag *tag, struct ApeItem *item) {
-    int ret;
-    DBT key_dbt, value_dbt;
-
+int ApeTag_update(struct ApeTag *tag) {
+    int delta;
+    
     if (ApeTag__get_tag_information(tag) != 0) {
         return -1;
     }
-
-    value_dbt.size = sizeof(struct ApeItem **);
-    value_dbt.data = &item; 
-    key_dbt.size = strlen(item->key)+1;
     
-    if (item == NULL) {
-        tag->errcode = APETAG_INVALIDITEM;
-        tag->error = "item pointer is NULL";
+    /* The tag buffers are replaced when rendering, so a delta write needs
+       a copy of what is in the file */
+    delta = (tag->flags & APE_DELTA_WRITES) && (tag->flags & APE_DISK_TAIL);
+    if (delta && ApeTag__save_tail(tag) != 0) {
         return -1;
     }
-    if (item->key == NULL) {
-        tag->errcode = APETAG_INVALIDITEM;
-        tag->error = "item key is NULL";
+    if (ApeTag__timed(tag, ApeTag__update_id3, APE_STAT_PTR(tag, update_id3_ns)) != 0) {
         return -1;
     }
-    if (item->value == NULL) {
-        tag->errcode = APETAG_INVALIDITEM;
-        tag->error = "item value is NULL";
+    if (ApeTag__timed(tag, ApeTag__update_ape, APE_STAT_PTR(tag, update_ape_ns)) != 0) {
         return -1;
     }
-    
-    /* Don't add invalid items to the database */
-    if (ApeItem__check_validity(tag, item) != 0) {
+    if (ApeTag__timed(tag, delta ? ApeTag__write_delta : ApeTag__write_tag, APE_STAT_PTR(tag, write_tag_ns)) != 0) {
         return -1;
     }
     
-    /* Don't exceed the maximum number of items allowed */
-    if (tag->item_count == APE_MAXIMUM_ITEM_COUNT) {
+    return 0;
+}
+
+int ApeTag_update_atomic(struct ApeTag *tag, enum ApeTag_sync sync, struct ApeTag_group *group) {
+    struct ApeTag__group_member *member;
+    struct stat sb;
+    uint64_t *ns = APE_STAT_PTR(tag, write_tag_ns);
+    int ret = 0;
+    
+    if (tag == NULL) {
+        return -1;
+    }
+    if ((sync == APE_SYNC_GROUP) != (group != NULL) ||
+        (sync != APE_SYNC_NONE && sync != APE_SYNC_FILE && sync != APE_SYNC_GROUP)) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "group must be given only with APE_SYNC_GROUP";
+        return -1;
+    }
+    if (sync != APE_SYNC_NONE && ApeTag__fileno(tag) < 0) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "sync not supported by I/O backend";
+        return -1;
+    }
+    
+    /* Room is kept in the group before writing anything, so other threads
+       can add to the group while this tag is rendered and written */
+    if (group != NULL) {
+        pthread_mutex_lock(&group->lock);
+        if ((ret = ApeTag__index_grow((void **)&group->members, &group->capacity,
+                                      group->count + group->reserved + 1, sizeof(struct ApeTag__group_member))) == 0) {
+            group->reserved++;
+        }
+        pthread_mutex_unlock(&group->lock);
+        if (ret != 0) {
+            tag->errcode = APETAG_MEMERR;
+            tag->error = "malloc";
+            return -1;
+        }
+    }
+    
+    /* Each step must be on disk before the next starts for the journal to
+       be usable after a crash, so the file is synced between them */
+    if (ApeTag__get_tag_information(tag) != 0 ||
+        ApeTag__timed(tag, ApeTag__update_id3, APE_STAT_PTR(tag, update_id3_ns)) != 0 ||
+        ApeTag__timed(tag, ApeTag__update_ape, APE_STAT_PTR(tag, update_ape_ns)) != 0 ||
+        ApeTag__timed(tag, ApeTag__journal_begin, ns) != 0) {
+        ret = -1;
+    }
+    if (group != NULL) {
+        pthread_mutex_lock(&group->lock);
+        group->reserved--;
+        if (ret == 0) {
+            member = &group->members[group->count++];
+            member->tag = tag;
+            member->dev = fstat(ApeTag__fileno(tag), &sb) == 0 ? sb.st_dev : 0;
+            member->failed = 0;
+            member->written = 0;
+            member->queued = 0;
+        }
+        pthread_mutex_unlock(&group->lock);
+        return ret;
+    }
+    if (ret != 0) {
+        return -1;
+    }
+    if ((sync == APE_SYNC_FILE && ApeTag__timed(tag, ApeTag__sync, ns) != 0) ||
+        ApeTag__timed(tag, ApeTag__journal_copy, ns) != 0 ||
+        (sync == APE_SYNC_FILE && ApeTag__timed(tag, ApeTag__sync, ns) != 0) ||
+        ApeTag__timed(tag, ApeTag__journal_apply, ns) != 0 ||
+        (sync == APE_SYNC_FILE && ApeTag__timed(tag, ApeTag__sync, ns) != 0) ||
+        ApeTag__timed(tag, ApeTag__truncate_tag, ns) != 0 ||
+        (sync == APE_SYNC_FILE && ApeTag__timed(tag, ApeTag__sync, ns) != 0)) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+int ApeTag_update_many(struct ApeTag **tags, size_t count, uint32_t flags, int *results) {
+    struct ApeTag_group group;
+    struct ApeTag__group_member *member;
+    struct ApeTag *tag;
+    struct stat sb;
+    size_t i;
+    int ret = 0;
+    
+    if ((tags == NULL && count > 0) || (flags & ~(uint32_t)(APE_UPDATE_SYNC | APE_UPDATE_ATOMIC)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&group, 0, sizeof(struct ApeTag_group));
+    if (count > 0 && ApeTag__index_grow((void **)&group.members, &group.capacity,
+                                        count, sizeof(struct ApeTag__group_member)) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    /* Render every tag before writing to any file, so tags that can't be
+       rendered are found without leaving other files half updated */
+    for (i=0; i < count; i++) {
+        if (results != NULL) {
+            results[i] = -1;
+        }
+        if ((tag = tags[i]) == NULL) {
+            ret = -1;
+            continue;
+        }
+        if ((flags & APE_UPDATE_SYNC) && ApeTag__fileno(tag) < 0) {
+            tag->errcode = APETAG_ARGERR;
+            tag->error = "sync not supported by I/O backend";
+            ret = -1;
+            continue;
+        }
+        if (ApeTag__get_tag_information(tag) != 0 ||
+            ApeTag__timed(tag, ApeTag__update_id3, APE_STAT_PTR(tag, update_id3_ns)) != 0 ||
+            ApeTag__timed(tag, ApeTag__update_ape, APE_STAT_PTR(tag, update_ape_ns)) != 0) {
+            ret = -1;
+            continue;
+        }
+        tag->errcode = APETAG_NOERR;
+        member = &group.members[group.count++];
+        member->tag = tag;
+        member->dev = (flags & APE_UPDATE_SYNC) && fstat(ApeTag__fileno(tag), &sb) == 0 ? sb.st_dev : 0;
+        member->failed = 0;
+        member->written = 0;
+        member->queued = 0;
+    }
+    
+    if (flags & APE_UPDATE_ATOMIC) {
+        ApeTag__group_phase(&group, ApeTag__journal_begin);
+        ApeTag__group_journal(&group, flags & APE_UPDATE_SYNC);
+    } else {
+#ifdef APE_URING
+        ApeTag__group_uring(&group);
+#endif
+        for (i=0; i < group.count; i++) {
+            member = &group.members[i];
+            if (!member->failed && !member->written &&
+                ApeTag__write_tail(member->tag, member->tag->offset) != 0) {
+                member->failed = 1;
+            }
+        }
+        ApeTag__group_phase(&group, ApeTag__truncate_tag);
+        if (flags & APE_UPDATE_SYNC) {
+            qsort(group.members, group.count, sizeof(struct ApeTag__group_member), ApeTag__group_compare);
+            ApeTag__group_sync(&group);
+        }
+    }
+    
+    /* Members are reordered when sorted, so results are found from each
+       tag's error code, which was cleared when it was rendered */
+    for (i=0; i < group.count; i++) {
+        if (group.members[i].failed) {
+            ret = -1;
+        }
+    }
+    if (results != NULL) {
+        for (i=0; i < count; i++) {
+            if (tags[i] != NULL && tags[i]->errcode == APETAG_NOERR) {
+                results[i] = 0;
+            }
+        }
+    }
+    ApeTag__global_free(group.members);
+    
+    return ret;
+}
+
+uint32_t ApeTag_serialized_size(struct ApeTag *tag) {
+    uint32_t tag_size;
+    uint32_t num_items;
+    struct ApeItem **items;
+
+    if (ApeTag__get_tag_information(tag) != 0) {
+        return 0;
+    }
+    if (ApeTag__prepare_ape(tag, &items, &num_items, &tag_size) != 0) {
+        return 0;
+    }
+
+    return tag_size + (ApeTag__writes_id3(tag) ? 128 : 0);
+}
+
+int ApeTag_serialize(struct ApeTag *tag, void *buf, size_t cap) {
+    uint32_t tag_size;
+    uint32_t num_items;
+    struct ApeItem **items;
+    char *b = buf;
+
+    if (ApeTag__get_tag_information(tag) != 0) {
+        return -1;
+    }
+
+    if (buf == NULL) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "buf is NULL";
+        return -1;
+    }
+
+    if (ApeTag__prepare_ape(tag, &items, &num_items, &tag_size) != 0) {
+        return -1;
+    }
+
+    if (cap < (size_t)tag_size + (ApeTag__writes_id3(tag) ? 128 : 0)) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "buffer too small for serialized tag";
+        return -1;
+    }
+
+    if (ApeTag__render_ape(tag, items, num_items, tag_size, b, b+32, b+tag_size-32) != 0) {
+        return -1;
+    }
+    if (ApeTag__writes_id3(tag) && ApeTag__render_id3(tag, b+tag_size) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int ApeTag_set_padding(struct ApeTag *tag, const char *key, uint32_t size) {
+    struct ApeItem item;
+    char *padding_key = NULL;
+    
+    if (tag == NULL) {
+        return -1;
+    }
+    
+    if (key != NULL) {
+        if ((padding_key = ApeTag__malloc(tag, strlen(key) + 1)) == NULL) {
+            tag->errcode = APETAG_MEMERR;
+            tag->error = "malloc";
+            return -1;
+        }
+        strcpy(padding_key, key);
+        item.size = 0;
+        item.flags = APE_ITEM_BINARY;
+        item.key = padding_key;
+        item.value = padding_key;
+        if (ApeItem__check_validity(tag, &item) != 0) {
+            ApeTag__free(tag, padding_key);
+            return -1;
+        }
+        
+        /* A padding item already parsed is hidden like one parsed later */
+        if (tag->items != NULL && ApeTag__get_item(tag, key) != NULL &&
+            ApeTag_remove_item(tag, key) != 0) {
+            ApeTag__free(tag, padding_key);
+            return -1;
+        }
+        tag->errcode = APETAG_NOERR;
+        tag->error = NULL;
+    }
+    
+    ApeTag__free(tag, tag->padding_key);
+    tag->padding_key = padding_key;
+    tag->padding_size = size;
+    
+    return 0;
+}
+
+int ApeTag_copy_tag(struct ApeTag *src, struct ApeTag *dst) {
+    uint32_t length = 0;
+    
+    if (src == NULL || dst == NULL) {
+        return -1;
+    }
+    if (src == dst) {
+        dst->errcode = APETAG_ARGERR;
+        dst->error = "source and destination are the same tag";
+        return -1;
+    }
+    
+    /* The source's tag buffers are written if the file can't be copied
+       directly, so they are read again if they were rendered since */
+    if (!(src->flags & APE_DISK_TAIL)) {
+        src->flags &= ~(APE_CHECKED_APE | APE_CHECKED_OFFSET | APE_CHECKED_FIELDS);
+    }
+    if (ApeTag_verify(src) != 0 || ApeTag__get_tag_information(dst) != 0) {
+        return -1;
+    }
+    if (src->flags & APE_HAS_APE) {
+        length += src->size;
+    }
+    if ((src->flags & APE_HAS_ID3) && !(src->flags & APE_NO_ID3)) {
+        length += 128;
+    }
+    
+    if (ApeTag__copy_range(src, dst, length) != 0) {
+        if ((src->flags & APE_HAS_APE) &&
+            (ApeTag__write(dst, src->tag_header, 32, dst->offset) != 0 ||
+             ApeTag__write(dst, src->tag_data, src->size-64, dst->offset+32) != 0 ||
+             ApeTag__write(dst, src->tag_footer, 32, dst->offset+src->size-32) != 0)) {
+            return -1;
+        }
+        if ((src->flags & APE_HAS_ID3) && !(src->flags & APE_NO_ID3) &&
+            ApeTag__write(dst, src->id3, 128, dst->offset+length-128) != 0) {
+            return -1;
+        }
+    }
+    if (ApeTag__truncate(dst, dst->offset + length) != 0) {
+        return -1;
+    }
+    
+    /* The destination's items and tag information are for its old tags */
+    dst->flags &= ~(APE_CHECKED_APE | APE_CHECKED_OFFSET | APE_HAS_APE | APE_HAS_ID3 | APE_DISK_TAIL);
+    return ApeTag_clear_items(dst);
+}
+
+int ApeTag_add_item(struct ApeTag *tag, struct ApeItem *item) {
+    int ret;
+    DBT key_dbt, value_dbt;
+
+    if (ApeTag__get_tag_information(tag) != 0) {
+        return -1;
+    }
+
+    value_dbt.size = sizeof(struct ApeItem **);
+    value_dbt.data = &item; 
+    key_dbt.size = strlen(item->key)+1;
+    
+    if (item == NULL) {
+        tag->errcode = APETAG_INVALIDITEM;
+        tag->error = "item pointer is NULL";
+        return -1;
+    }
+    if (item->key == NULL) {
+        tag->errcode = APETAG_INVALIDITEM;
+        tag->error = "item key is NULL";
+        return -1;
+    }
+    if (item->value == NULL) {
+        tag->errcode = APETAG_INVALIDITEM;
+        tag->error = "item value is NULL";
+        return -1;
+    }
+    
+    /* Don't add invalid items to the database */
+    if (ApeItem__check_validity(tag, item) != 0) {
+        return -1;
+    }
+    
+    /* Don't exceed the maximum number of items allowed */
+    if (tag->item_count == APE_MAXIMUM_ITEM_COUNT) {
         tag->errcode = APETAG_LIMITEXCEEDED;
         tag->error = "maximum item count exceeded";
         return -1;
@@ -363,8 +1417,13 @@ int ApeTag_add_item(struct ApeTag *tag, struct ApeItem *item) {
         }
     }
     
+    /* Make sure there is room to record the item's order */
+    if (ApeTag__reserve_items(tag, tag->item_count + 1) != 0) {
+        return -1;
+    }
+    
     /* Apetag keys are case insensitive but case preserving */
-    if ((key_dbt.data = ApeTag__strcasecpy(item->key, key_dbt.size)) == NULL) {
+    if ((key_dbt.data = ApeTag__strcasecpy(tag, item->key, key_dbt.size)) == NULL) {
         tag->errcode = APETAG_MEMERR;
         tag->error = "malloc";
         goto add_item_error;
@@ -382,12 +1441,12 @@ int ApeTag_add_item(struct ApeTag *tag, struct ApeItem *item) {
         goto add_item_error;
     }
 
-    tag->item_count++;
-    free(key_dbt.data);
+    tag->item_order[tag->item_count++] = item;
+    ApeTag__free(tag, key_dbt.data);
     return 0;
     
     add_item_error:
-    free(key_dbt.data);
+    ApeTag__free(tag, key_dbt.data);
     return -1;
 }
 
@@ -430,16 +1489,17 @@ int ApeTag_remove_item(struct ApeTag *tag, const char *key) {
 
     key_dbt.size = strlen(key) + 1;
     /* APE item keys are case insensitive but case preserving */
-    if ((key_dbt.data = ApeTag__strcasecpy(key, key_dbt.size)) == NULL)  {
+    if ((key_dbt.data = ApeTag__strcasecpy(tag, key, key_dbt.size)) == NULL)  {
         tag->errcode = APETAG_MEMERR;
         tag->error = "malloc";
         return -1;
     }
     
     /* Free the item and remove it from the database  */
-    ApeItem__free(&item);
+    ApeTag__unorder_item(tag, item);
+    ApeItem__free(tag, &item);
     ret = tag->items->del(tag->items, &key_dbt, 0);
-    free(key_dbt.data);
+    ApeTag__free(tag, key_dbt.data);
     if (ret != 0) {
         if (ret == -1) {
             tag->errcode = APETAG_INTERNALERR;
@@ -451,7 +1511,6 @@ int ApeTag_remove_item(struct ApeTag *tag, const char *key) {
         return -1;
     }
     
-    tag->item_count--;
     return ret;
 }
 
@@ -466,9 +1525,9 @@ int ApeTag_clear_items(struct ApeTag *tag) {
     if (tag->items != NULL) {
         /* Free all items in the database and then close it */
         if (tag->items->seq(tag->items, &key_dbt, &value_dbt, R_FIRST) == 0) {
-            ApeItem__free((struct ApeItem **)(value_dbt.data));
+            ApeItem__free(tag, (struct ApeItem **)(value_dbt.data));
             while (tag->items->seq(tag->items, &key_dbt, &value_dbt, R_NEXT) == 0) {
-                ApeItem__free((struct ApeItem **)(value_dbt.data));
+                ApeItem__free(tag, (struct ApeItem **)(value_dbt.data));
             }
         }
         if (tag->items->close(tag->items) == -1) {
@@ -518,946 +1577,3012 @@ int ApeTag_iter_items(struct ApeTag *tag, int iterator(struct ApeTag *tag, struc
     return ApeTag__iter_items(tag, iterator, data);
 }
 
-int ApeTag_mt_init(void) {
-    struct ApeTag tag;
+struct ApeItem * ApeTag_item_cursor_first(struct ApeTag_item_cursor *cursor, struct ApeTag *tag, uint32_t order) {
+    if (ApeTag__get_tag_information(tag) != 0) {
+        return NULL;
+    }
 
-    return ApeTag__load_ID3_GENRES(&tag);
-}
+    if (cursor == NULL) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "cursor is NULL";
+        return NULL;
+    }
 
-uint32_t ApeTag_size(struct ApeTag *tag) {
-    return tag->size;
+    cursor->tag = tag;
+    cursor->count = tag->item_count;
+    cursor->index = 0;
+    if (order == APE_CURSOR_SORTED) {
+        cursor->items = ApeTag__sort_items(tag);
+    } else if (order == APE_CURSOR_FILE_ORDER) {
+        cursor->items = tag->item_order;
+    } else {
+        cursor->count = 0;
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "invalid cursor order";
+        return NULL;
+    }
+
+    return ApeTag_item_cursor_next(cursor);
 }
 
-uint32_t ApeTag_item_count(struct ApeTag *tag) {
-    return tag->item_count;
+struct ApeItem * ApeTag_item_cursor_next(struct ApeTag_item_cursor *cursor) {
+    if (cursor->index >= cursor->count) {
+        cursor->tag->errcode = APETAG_NOTPRESENT;
+        cursor->tag->error = "no more items";
+        return NULL;
+    }
+
+    return cursor->items[cursor->index++];
 }
 
-uint32_t ApeTag_file_item_count(struct ApeTag *tag) {
-    return tag->file_item_count;
+uint32_t ApeItem_value_count(const struct ApeItem *item) {
+    const char *c;
+    const char *end;
+    uint32_t count = 1;
+
+    if (item->size == 0) {
+        return 0;
+    }
+
+    end = item->value + item->size;
+    for (c = item->value; (c = memchr(c, '\0', (size_t)(end - c))) != NULL; c++) {
+        count++;
+    }
+
+    return count;
 }
 
-const char * ApeTag_error(struct ApeTag *tag){
-    return tag->error;
+int ApeItem_next_value(const struct ApeItem *item, uint32_t *cursor, const char **value, uint32_t *length) {
+    const char *start;
+    const char *sep;
+    uint32_t remaining;
+
+    if (item == NULL || cursor == NULL || value == NULL || length == NULL) {
+        return -1;
+    }
+
+    /* The cursor is one past the last separator, so it equals size when the
+       value ends in a separator and there is one more empty value */
+    if (item->size == 0 || *cursor > item->size) {
+        return 0;
+    }
+
+    start = item->value + *cursor;
+    remaining = item->size - *cursor;
+    if ((sep = memchr(start, '\0', remaining)) != NULL) {
+        *length = (uint32_t)(sep - start);
+    } else {
+        *length = remaining;
+    }
+    *value = start;
+    *cursor += *length + 1;
+
+    return 1;
 }
 
-enum ApeTag_errcode ApeTag_error_code(struct ApeTag *tag) {
-    return tag->errcode;
+struct ApeTag_snapshot * ApeTag_snapshot(struct ApeTag *tag) {
+    struct ApeTag_snapshot *snapshot;
+    struct ApeItem *item;
+    size_t size;
+    char *data;
+    uint32_t raw_size;
+    uint32_t i;
+
+    if (ApeTag_parse(tag) != 0) {
+        return NULL;
+    }
+
+    raw_size = ApeTag__tag_length(tag);
+    size = sizeof(struct ApeTag_snapshot) +
+           tag->item_count * (sizeof(struct ApeItem) + sizeof(struct ApeItem *)) + raw_size;
+    for (i=0; i < tag->item_count; i++) {
+        size += strlen(tag->item_order[i]->key) + 1 + tag->item_order[i]->size;
+    }
+    if ((snapshot = ApeTag__malloc(tag, size)) == NULL) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "malloc";
+        return NULL;
+    }
+
+    snapshot->refcount = 1;
+    snapshot->item_count = tag->item_count;
+    snapshot->raw_size = raw_size;
+    snapshot->size = size;
+    snapshot->allocator = tag->allocator;
+    snapshot->items = (struct ApeItem *)(snapshot + 1);
+    snapshot->by_key = (struct ApeItem **)(snapshot->items + tag->item_count);
+    snapshot->raw = (char *)(snapshot->by_key + tag->item_count);
+    ApeTag__copy_raw(tag, snapshot->raw);
+
+    data = snapshot->raw + raw_size;
+    for (i=0; i < tag->item_count; i++) {
+        item = &snapshot->items[i];
+        *item = *tag->item_order[i];
+        size = strlen(item->key) + 1;
+        item->key = memcpy(data, item->key, size);
+        item->value = memcpy(data + size, item->value, item->size);
+        data += size + item->size;
+        snapshot->by_key[i] = item;
+    }
+    if (tag->item_count > 1) {
+        qsort(snapshot->by_key, tag->item_count, sizeof(struct ApeItem *), ApeItem__compare_keys);
+    }
+
+    return snapshot;
 }
 
-size_t ApeTag_get_max_size(void) {
-    return APE_MAXIMUM_TAG_SIZE;
+struct ApeTag_snapshot * ApeTag_snapshot_ref(struct ApeTag_snapshot *snapshot) {
+    if (snapshot != NULL) {
+        APE_ATOMIC_INCREF(&snapshot->refcount);
+    }
+    return snapshot;
 }
 
-size_t ApeTag_get_max_item_count(void) {
-    return APE_MAXIMUM_ITEM_COUNT;
+void ApeTag_snapshot_unref(struct ApeTag_snapshot *snapshot) {
+    if (snapshot != NULL && APE_ATOMIC_DECREF(&snapshot->refcount) == 0) {
+        snapshot->allocator.free(snapshot->allocator.ctx, snapshot);
+    }
 }
 
-void ApeTag_set_max_size(uint32_t size) {
-    APE_MAXIMUM_TAG_SIZE = size;
+uint32_t ApeTag_snapshot_item_count(const struct ApeTag_snapshot *snapshot) {
+    return snapshot == NULL ? 0 : snapshot->item_count;
 }
 
-void ApeTag_set_max_item_count(uint32_t item_count) {
-    APE_MAXIMUM_ITEM_COUNT = item_count;
+const struct ApeItem * ApeTag_snapshot_item(const struct ApeTag_snapshot *snapshot, uint32_t index) {
+    if (snapshot == NULL || index >= snapshot->item_count) {
+        return NULL;
+    }
+    return &snapshot->items[index];
 }
 
-/* Private Functions */
+const struct ApeItem * ApeTag_snapshot_get_item(const struct ApeTag_snapshot *snapshot, const char *key) {
+    uint32_t low = 0;
+    uint32_t high;
+    uint32_t middle;
+    int cmp;
 
-/*
-Parses the header and footer of the tag to get information about it.
+    if (snapshot == NULL || key == NULL) {
+        return NULL;
+    }
 
-Returns 0 on success, <0 on error;
-*/
-static int ApeTag__get_tag_information(struct ApeTag *tag) {
-    int id3_length = 0;
-    uint32_t header_check;
-    off_t file_size = 0;
+    high = snapshot->item_count;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if ((cmp = ApeTag__strncasecmp(key, snapshot->by_key[middle]->key, 256)) == 0) {
+            return snapshot->by_key[middle];
+        } else if (cmp < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
 
-    if (tag == NULL) {
+    return NULL;
+}
+
+int ApeTag_snapshot_iter_items(const struct ApeTag_snapshot *snapshot, int iterator(const struct ApeItem *item, void *data), void *data) {
+    uint32_t i;
+
+    if (snapshot == NULL || iterator == NULL) {
         return -1;
     }
 
-    if (tag->flags & APE_CHECKED_APE) {
-        return 0;
+    for (i=0; i < snapshot->item_count; i++) {
+        if (iterator(&snapshot->items[i], data) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+const char * ApeTag_snapshot_raw(const struct ApeTag_snapshot *snapshot, uint32_t *raw_size) {
+    if (snapshot == NULL || raw_size == NULL) {
+        return NULL;
     }
+
+    *raw_size = snapshot->raw_size;
+    return snapshot->raw;
+}
+
+struct ApeTag_lru * ApeTag_lru_new(size_t max_bytes, uint32_t shards) {
+    struct ApeTag_lru *lru;
+    struct ApeTag__lru_shard *shard;
+    uint32_t shard_count = 1;
+    uint32_t i;
     
-    /* Get file size */
-    if (fseeko(tag->file, 0, SEEK_END) == -1) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fseeko";
-        return -1;
+    if (max_bytes == 0 || shards > APE_LRU_MAXIMUM_SHARDS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (shards == 0) {
+        shards = APE_LRU_DEFAULT_SHARDS;
+    }
+    while (shard_count < shards) {
+        shard_count <<= 1;
     }
-    if ((file_size = ftello(tag->file)) == -1) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "ftello";
-        return -1;
-    } 
     
-    /* No ape or id3 tag possible in this size */
-    if (file_size < APE_MINIMUM_TAG_SIZE) {
-        tag->offset = file_size;
-        tag->flags |= APE_CHECKED_APE | APE_CHECKED_OFFSET;
-        tag->flags &= ~(APE_HAS_APE | APE_HAS_ID3);
-        return 0;
-    } 
+    if ((lru = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, sizeof(struct ApeTag_lru) +
+                                    shard_count * sizeof(struct ApeTag__lru_shard))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(lru, 0, sizeof(struct ApeTag_lru) + shard_count * sizeof(struct ApeTag__lru_shard));
+    lru->max_bytes = max_bytes / shard_count > 0 ? max_bytes / shard_count : 1;
+    lru->shard_mask = shard_count - 1;
+    lru->allocator = APE_ALLOCATOR;
     
-    if (!(tag->flags & APE_NO_ID3)) {
-        if (file_size < 128) {
-            /* No id3 tag possible in this size */
-            tag->flags &= ~APE_HAS_ID3;
-        } else {
-            /* Check for id3 tag */
-            if ((fseeko(tag->file, -128, SEEK_END)) == -1) {
-                tag->errcode = APETAG_FILEERR;
-                tag->error = "fseeko";
-                return -1;
-            }
-            free(tag->id3);
-            if ((tag->id3 = malloc(128)) == NULL) {
-                tag->errcode = APETAG_MEMERR;
-                tag->error = "malloc";
-                return -1;
-            }
-            if (fread(tag->id3, 1, 128, tag->file) < 128) {
-                tag->errcode = APETAG_FILEERR;
-                tag->error = "fread";
-                return -1;
-            }
-            if (tag->id3[0] == 'T' && tag->id3[1] == 'A' && 
-               tag->id3[2] == 'G' && tag->id3[125] == '\0') {
-                id3_length = 128;
-                tag->flags |= APE_HAS_ID3;
-            } else {
-                free(tag->id3);
-                tag->id3 = NULL;
-                tag->flags &= ~APE_HAS_ID3;
+    for (i=0; i < shard_count; i++) {
+        shard = &lru->shards[i];
+        if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+            while (i-- > 0) {
+                pthread_mutex_destroy(&lru->shards[i].lock);
             }
-        }
-        /* Recheck possibility for ape tag now that id3 presence is known */
-        if (file_size < APE_MINIMUM_TAG_SIZE + id3_length) {
-            tag->flags &= ~APE_HAS_APE;
-            tag->offset = file_size - id3_length;
-            tag->flags |= APE_CHECKED_OFFSET | APE_CHECKED_APE;
-            return 0;
+            APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, lru);
+            errno = ENOMEM;
+            return NULL;
         }
     }
     
-    /* Check for existance of ape tag footer */
-    if (fseeko(tag->file, -32-id3_length, SEEK_END) == -1) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fseeko";
-        return -1;
+    return lru;
+}
+
+void ApeTag_lru_free(struct ApeTag_lru *lru) {
+    struct ApeTag__lru_shard *shard;
+    struct ApeTag__lru_entry *entry;
+    uint32_t i;
+    
+    if (lru == NULL) {
+        return;
     }
-    free(tag->tag_footer);
-    if ((tag->tag_footer = malloc(32)) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
-        return -1;
+    
+    for (i=0; i <= lru->shard_mask; i++) {
+        shard = &lru->shards[i];
+        while ((entry = shard->newest) != NULL) {
+            shard->newest = entry->older;
+            ApeTag_snapshot_unref(entry->snapshot);
+            lru->allocator.free(lru->allocator.ctx, entry);
+        }
+        lru->allocator.free(lru->allocator.ctx, shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
     }
-    if (fread(tag->tag_footer, 1, 32, tag->file) < 32) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fread";
-        return -1;
+    lru->allocator.free(lru->allocator.ctx, lru);
+}
+
+struct ApeTag_snapshot * ApeTag_lru_get(struct ApeTag_lru *lru, const char *path, uint32_t flags, enum ApeTag_errcode *errcode, const char **error) {
+    struct ApeTag__lru_shard *shard;
+    struct ApeTag__lru_entry **link;
+    struct ApeTag__lru_entry *entry;
+    struct ApeTag_snapshot *snapshot = NULL;
+    struct ApeTag__cache_record identity;
+    struct ApeTag__cache_record parsed;
+    struct stat sb;
+    uint32_t hash;
+    size_t length;
+    
+    if (lru == NULL || path == NULL) {
+        if (errcode != NULL) {
+            *errcode = APETAG_ARGERR;
+        }
+        if (error != NULL) {
+            *error = "lru or path is NULL";
+        }
+        return NULL;
     }
-    if (memcmp(APE_PREAMBLE, tag->tag_footer, 12)) {
-        tag->flags &= ~APE_HAS_APE;
-        tag->offset = file_size - id3_length;
-        tag->flags |= APE_CHECKED_OFFSET | APE_CHECKED_APE;
-        return 0;
+    flags &= APE_NO_ID3;
+    
+    if (stat(path, &sb) != 0) {
+        if (errcode != NULL) {
+            *errcode = APETAG_FILEERR;
+        }
+        if (error != NULL) {
+            *error = "stat";
+        }
+        return NULL;
     }
-    if (memcmp(APE_FOOTER_FLAGS, tag->tag_footer+21, 3) || \
-       ((char)*(tag->tag_footer+20) != '\0' && \
-       (char)*(tag->tag_footer+20) != '\1')) {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "bad tag footer flags";
-        return -1;
+    ApeTag__cache_identity(&identity, &sb, flags);
+    length = strlen(path);
+    hash = ApeTag__fnv1a(2166136261U, path, length);
+    shard = &lru->shards[(hash >> 16) & lru->shard_mask];
+    
+    /* Entries for files changed since they were parsed are dropped */
+    pthread_mutex_lock(&shard->lock);
+    if ((link = ApeTag__lru_find(shard, path, hash)) != NULL) {
+        if (memcmp(&(*link)->identity, &identity, sizeof(identity)) == 0) {
+            entry = *link;
+            ApeTag__lru_unlink(shard, entry);
+            ApeTag__lru_push(shard, entry);
+            shard->stats.hits++;
+            snapshot = ApeTag_snapshot_ref(entry->snapshot);
+            pthread_mutex_unlock(&shard->lock);
+            return snapshot;
+        }
+        ApeTag__lru_remove(lru, shard, link);
+        shard->stats.invalidations++;
     }
+    shard->stats.misses++;
+    pthread_mutex_unlock(&shard->lock);
     
-    memcpy(&tag->size, tag->tag_footer+12, 4);
-    memcpy(&tag->file_item_count, tag->tag_footer+16, 4);
-    tag->size = LE2H32(tag->size);
-    tag->file_item_count = LE2H32(tag->file_item_count);
-    tag->size += 32;
+    /* Parse without holding the lock, so other paths in the shard aren't
+       blocked on I/O */
+    if ((snapshot = ApeTag__lru_parse(path, flags, &parsed, errcode, error)) == NULL) {
+        return NULL;
+    }
     
-    /* Check tag footer for validity */
-    if (tag->size < APE_MINIMUM_TAG_SIZE) {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "tag smaller than minimum possible size";
-        return -1;
+    /* Only cache the snapshot if the file wasn't changed while parsing, and
+       the snapshot fits in the shard */
+    if (memcmp(&parsed, &identity, sizeof(identity)) != 0 ||
+        snapshot->size + sizeof(struct ApeTag__lru_entry) + length + 1 > lru->max_bytes ||
+        (entry = lru->allocator.malloc(lru->allocator.ctx, sizeof(struct ApeTag__lru_entry) + length + 1)) == NULL) {
+        return snapshot;
     }
-    if (tag->size > APE_MAXIMUM_TAG_SIZE) {
-        tag->errcode = APETAG_LIMITEXCEEDED;
-        tag->error = "tag larger than maximum allowed size";
+    entry->snapshot = ApeTag_snapshot_ref(snapshot);
+    entry->identity = identity;
+    entry->size = snapshot->size + sizeof(struct ApeTag__lru_entry) + length + 1;
+    entry->hash = hash;
+    memcpy(entry->path, path, length + 1);
+    
+    pthread_mutex_lock(&shard->lock);
+    ApeTag__lru_insert(lru, shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+    
+    return snapshot;
+}
+
+int ApeTag_lru_invalidate(struct ApeTag_lru *lru, const char *path) {
+    struct ApeTag__lru_shard *shard;
+    struct ApeTag__lru_entry **link;
+    uint32_t hash;
+    
+    if (lru == NULL || path == NULL) {
+        errno = EINVAL;
         return -1;
     }
-    if (tag->size + (off_t)id3_length > file_size) {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "tag larger than possible size";
-        return -1;
+    
+    hash = ApeTag__fnv1a(2166136261U, path, strlen(path));
+    shard = &lru->shards[(hash >> 16) & lru->shard_mask];
+    pthread_mutex_lock(&shard->lock);
+    if ((link = ApeTag__lru_find(shard, path, hash)) == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return 1;
     }
-    if (tag->file_item_count > APE_MAXIMUM_ITEM_COUNT) {
-        tag->errcode = APETAG_LIMITEXCEEDED;
-        tag->error = "tag item count larger than allowed";
+    ApeTag__lru_remove(lru, shard, link);
+    shard->stats.invalidations++;
+    pthread_mutex_unlock(&shard->lock);
+    
+    return 0;
+}
+
+int ApeTag_lru_get_stats(struct ApeTag_lru *lru, struct ApeTag_lru_stats *stats) {
+    struct ApeTag__lru_shard *shard;
+    uint32_t i;
+    
+    if (lru == NULL || stats == NULL) {
+        errno = EINVAL;
         return -1;
     }
-    if (tag->file_item_count > (tag->size - APE_MINIMUM_TAG_SIZE)/APE_ITEM_MINIMUM_SIZE) {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "tag item count larger than possible";
-        return -1;
+    
+    memset(stats, 0, sizeof(struct ApeTag_lru_stats));
+    for (i=0; i <= lru->shard_mask; i++) {
+        shard = &lru->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->evictions += shard->stats.evictions;
+        stats->invalidations += shard->stats.invalidations;
+        stats->entries += shard->count;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
     }
-    if (fseeko(tag->file, (-(long)tag->size - id3_length), SEEK_END) == -1) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fseeko";
-        return -1;
+    
+    return 0;
+}
+
+struct ApeTag_group * ApeTag_group_new(void) {
+    struct ApeTag_group *group;
+    
+    if ((group = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, sizeof(struct ApeTag_group))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
     }
-    if ((tag->offset = ftello(tag->file)) == -1) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "ftello";
-        return -1;
+    memset(group, 0, sizeof(struct ApeTag_group));
+    if ((errno = pthread_mutex_init(&group->lock, NULL)) != 0) {
+        APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, group);
+        return NULL;
     }
-    tag->flags |= APE_CHECKED_OFFSET;
     
-    /* Read tag header and data */
-    free(tag->tag_header);
-    if ((tag->tag_header = malloc(32)) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
-        return -1;
-    }
-    if (fread(tag->tag_header, 1, 32, tag->file) < 32) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fread";
+    return group;
+}
+
+int ApeTag_group_commit(struct ApeTag_group *group) {
+    size_t i;
+    int ret = 0;
+    
+    if (group == NULL) {
+        errno = EINVAL;
         return -1;
     }
-    free(tag->tag_data);
-    if ((tag->tag_data = malloc(tag->size-64)) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
-        return -1;
+    if (group->count == 0) {
+        return 0;
     }
-    if (fread(tag->tag_data, 1, tag->size-64, tag->file) < tag->size-64) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fread";
-        return -1;
+    for (i=0; i < group->count; i++) {
+        group->members[i].tag->errcode = APETAG_NOERR;
     }
+    ret = ApeTag__group_journal(group, 1);
+    group->count = 0;
     
-    /* Check tag header for validity */
-    if (memcmp(APE_PREAMBLE, tag->tag_header, 12) || memcmp(APE_HEADER_FLAGS, tag->tag_header+21, 3) \
-      || ((char)*(tag->tag_header+20) != '\0' && (char)*(tag->tag_header+20) != '\1')) {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "missing APE header";
-        return -1;
+    return ret;
+}
+
+void ApeTag_group_free(struct ApeTag_group *group) {
+    if (group != NULL) {
+        pthread_mutex_destroy(&group->lock);
+        ApeTag__global_free(group->members);
+        APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, group);
     }
-    memcpy(&header_check, tag->tag_header+12, 4);
-    if (tag->size != LE2H32(header_check)+32) {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "header and footer size does not match";
+}
+
+int ApeTag_mt_init(void) {
+    struct ApeTag tag;
+
+    return ApeTag__load_ID3_GENRES(&tag);
+}
+
+int ApeTag_get_stats(struct ApeTag *tag, struct ApeTag_stats *stats) {
+    if (tag == NULL) {
         return -1;
     }
-    memcpy(&header_check, tag->tag_header+16, 4);
-    if (tag->file_item_count != LE2H32(header_check)) {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "header and footer item count does not match";
+    if (stats == NULL) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "stats is NULL";
         return -1;
     }
-    
-    tag->flags |= APE_CHECKED_APE | APE_HAS_APE;
+
+#ifndef APE_NO_STATS
+    *stats = tag->stats;
     return 0;
+#else
+    memset(stats, 0, sizeof(struct ApeTag_stats));
+    tag->errcode = APETAG_NOTPRESENT;
+    tag->error = "stats not compiled in";
+    return -1;
+#endif
 }
 
-/* 
-Parses all items from the tag and puts them in the database.
+int ApeTag_get_global_stats(struct ApeTag_stats *stats) {
+#ifndef APE_NO_STATS
+    uint64_t *src = (uint64_t *)(void *)&APE_GLOBAL_STATS;
+    uint64_t *dst = (uint64_t *)(void *)stats;
+    size_t i;
+#endif
 
-Returns 0 on success, <0 on error.
-*/
-static int ApeTag__parse_items(struct ApeTag *tag) {
-    uint32_t i;
-    uint32_t offset = 0;
-    uint32_t last_possible_offset = tag->size - APE_MINIMUM_TAG_SIZE - 
-                               APE_ITEM_MINIMUM_SIZE;
-    
-    assert(tag != NULL);
-    
-    if (tag->items != NULL) {
-        if (ApeTag_clear_items(tag) != 0) {
-            return -1;
-        }
+    if (stats == NULL) {
+        return -1;
     }
-    
-    for (i=0; i < tag->file_item_count; i++) {
-        if (offset > last_possible_offset) {
-            tag->errcode = APETAG_CORRUPTTAG;
-            tag->error = "end of tag reached but more items specified";
-            return -1;
-        }
 
-        if (ApeTag__parse_item(tag, &offset) != 0) {
-            return -1;
-        }
+#ifndef APE_NO_STATS
+    for (i=0; i < sizeof(struct ApeTag_stats)/sizeof(uint64_t); i++) {
+        dst[i] = APE_ATOMIC_LOAD(&src[i]);
     }
-    if (offset != tag->size - APE_MINIMUM_TAG_SIZE) {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "data remaining after specified number of items parsed";
-        return -1;
-    }
-    tag->flags |= APE_CHECKED_FIELDS;
-    
     return 0;
+#else
+    memset(stats, 0, sizeof(struct ApeTag_stats));
+    return -1;
+#endif
 }
 
-/* 
-Parses a single item from the tag at the given offset from the start of the
-tag's data.
+uint32_t ApeTag_size(struct ApeTag *tag) {
+    return tag->size;
+}
 
-Returns 0 on success, <0 on error.
-*/
-static int ApeTag__parse_item(struct ApeTag *tag, uint32_t *offset) {
-    char *data = tag->tag_data;
-    char *value_start = NULL;
-    char *key_start = data+(*offset)+8;
-    uint32_t data_size = tag->size - APE_MINIMUM_TAG_SIZE;
-    uint32_t key_length;
-    struct ApeItem *item = NULL;
-    
-    if ((item = malloc(sizeof(struct ApeItem))) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
+uint32_t ApeTag_item_count(struct ApeTag *tag) {
+    return tag->item_count;
+}
+
+uint32_t ApeTag_file_item_count(struct ApeTag *tag) {
+    return tag->file_item_count;
+}
+
+const char * ApeTag_error(struct ApeTag *tag){
+    return tag->error;
+}
+
+enum ApeTag_errcode ApeTag_error_code(struct ApeTag *tag) {
+    return tag->errcode;
+}
+
+size_t ApeTag_get_max_size(void) {
+    return APE_MAXIMUM_TAG_SIZE;
+}
+
+size_t ApeTag_get_max_item_count(void) {
+    return APE_MAXIMUM_ITEM_COUNT;
+}
+
+void ApeTag_set_max_size(uint32_t size) {
+    APE_MAXIMUM_TAG_SIZE = size;
+}
+
+void ApeTag_set_max_item_count(uint32_t item_count) {
+    APE_MAXIMUM_ITEM_COUNT = item_count;
+}
+
+int ApeTag_set_allocator(const struct ApeTag_allocator *allocator) {
+    if (allocator == NULL) {
+        APE_ALLOCATOR.malloc = ApeTag__default_malloc;
+        APE_ALLOCATOR.realloc = ApeTag__default_realloc;
+        APE_ALLOCATOR.free = ApeTag__default_free;
+        APE_ALLOCATOR.ctx = NULL;
+        return 0;
+    }
+    if (allocator->malloc == NULL || allocator->realloc == NULL || allocator->free == NULL) {
         return -1;
     }
+
+    APE_ALLOCATOR = *allocator;
+    return 0;
+}
+
+int ApeTag_set_tag_allocator(struct ApeTag *tag, const struct ApeTag_allocator *allocator) {
+    if (tag == NULL) {
+        return -1;
+    }
+    if (allocator != NULL && (allocator->malloc == NULL || 
+        allocator->realloc == NULL || allocator->free == NULL)) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "allocator function is NULL";
+        return -1;
+    }
+
+    /* Memory already allocated for the tag must be freed by the same allocator */
+    if (tag->items != NULL || tag->id3 != NULL || tag->tag_header != NULL || 
+        tag->tag_footer != NULL || tag->tag_data != NULL || tag->item_order != NULL ||
+        tag->padding_key != NULL) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "allocator must be set before the tag is used";
+        return -1;
+    }
+
+    tag->allocator = allocator == NULL ? APE_ALLOCATOR : *allocator;
+    return 0;
+}
+
+void ApeTag_get_allocator(struct ApeTag *tag, struct ApeTag_allocator *allocator) {
+    *allocator = tag == NULL ? APE_ALLOCATOR : tag->allocator;
+}
+
+struct ApeTag_cache * ApeTag_cache_open(const char *path) {
+    struct ApeTag_cache *cache;
+    struct stat sb;
+    size_t count = 0;
+    int saved_errno;
+    int cloexec = 0;
+    uint32_t header[2] = {APE_CACHE_VERSION, APE_CACHE_BYTE_ORDER};
+    char expected[APE_CACHE_HEADER_SIZE];
     
-    memcpy(&item->size, data+(*offset), 4);
-    memcpy(&item->flags, data+(*offset)+4, 4);
-    item->size = LE2H32(item->size);
-    item->flags = BE2H32(item->flags);
-    item->key = NULL;
-    item->value = NULL;
-    
-    /* Find and check start of value */
-    if (item->size + *offset + APE_ITEM_MINIMUM_SIZE > data_size) {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "impossible item length (greater than remaining space)";
-        goto parse_error;
+    if (path == NULL) {
+        errno = EINVAL;
+        return NULL;
     }
-    for (value_start=key_start; value_start < key_start+256 && \
-        *value_start != '\0'; value_start++) {
-        /* Left Blank */
+    if ((cache = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, sizeof(struct ApeTag_cache))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
     }
-    if (*value_start != '\0') {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "invalid item key length (too long or no end)";
-        goto parse_error;
+    memset(cache, 0, sizeof(struct ApeTag_cache));
+    memcpy(expected, APE_CACHE_MAGIC, 8);
+    memcpy(expected+8, header, 8);
+    
+#ifdef O_CLOEXEC
+    cloexec = O_CLOEXEC;
+#endif
+    /* Fall back to using the cache read only if it can't be written */
+    cache->writable = 1;
+    if ((cache->fd = open(path, O_RDWR|O_CREAT|O_APPEND|cloexec, 0644)) == -1) {
+        if ((errno != EACCES && errno != EROFS && errno != EPERM) ||
+            (cache->fd = open(path, O_RDONLY|cloexec)) == -1) {
+            goto cache_open_error;
+        }
+        cache->writable = 0;
     }
-    value_start++;
-    key_length = (uint32_t)(value_start - key_start);
-    *offset += 8 + key_length + item->size;
-    if (*offset > data_size) {
-        tag->errcode = APETAG_CORRUPTTAG;
-        tag->error = "invalid item length (longer than remaining data)";
-        goto parse_error;
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        close(cache->fd);
+        goto cache_open_error;
     }
     
-    /* Copy key and value from tag data to item */
-    if ((item->key = malloc(key_length)) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
-        goto parse_error;
+    /* Lock out appends while checking the cache, so an append torn by a
+       crash can be truncated without truncating a new append */
+    if (cache->writable && flock(cache->fd, LOCK_EX) != 0) {
+        goto cache_open_close_error;
     }
-    if ((item->value = malloc(item->size)) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
-        goto parse_error;
+    if (fstat(cache->fd, &sb) != 0) {
+        goto cache_open_close_error;
+    }
+    if (sb.st_size == 0 && cache->writable) {
+        if (write(cache->fd, expected, APE_CACHE_HEADER_SIZE) != APE_CACHE_HEADER_SIZE) {
+            goto cache_open_close_error;
+        }
+        sb.st_size = APE_CACHE_HEADER_SIZE;
+    }
+    if (sb.st_size < APE_CACHE_HEADER_SIZE || (uintmax_t)sb.st_size > SIZE_MAX) {
+        errno = EINVAL;
+        goto cache_open_close_error;
+    }
+    cache->map_size = (size_t)sb.st_size;
+    if ((cache->map = mmap(NULL, cache->map_size, PROT_READ, MAP_SHARED, cache->fd, 0)) == MAP_FAILED) {
+        cache->map = NULL;
+        goto cache_open_close_error;
+    }
+    if (memcmp(cache->map, expected, APE_CACHE_HEADER_SIZE) != 0) {
+        errno = EINVAL;
+        goto cache_open_close_error;
     }
-    memcpy(item->key, key_start, key_length);
-    memcpy(item->value, value_start, item->size);
     
-    /* Add item to the database */
-    if (ApeTag_add_item(tag, item) != 0) {
-        goto parse_error;
+    if (ApeTag__cache_scan(cache, &count) != 0) {
+        goto cache_open_close_error;
+    }
+    if (cache->writable) {
+        flock(cache->fd, LOCK_UN);
+    }
+    if (ApeTag__cache_index(cache, count) != 0) {
+        errno = ENOMEM;
+        goto cache_open_close_error;
     }
-
-    return 0;
     
-    parse_error:
-    free(item->key);
-    free(item->value);
-    free(item);
-    return -1;
-}
-
-/* 
-Updates the id3 tag using the new ape tag values.  Does not merge it with a
-previous id3 tag, it overwrites it completely.
-
-Returns 0 on success, <0 on error.
-*/
-static int ApeTag__update_id3(struct ApeTag *tag) {
-    struct ApeItem *item;
-    char *c;
-    char *end;
-    uint32_t size;
+    return cache;
     
-    assert (tag != NULL);
+    cache_open_close_error:
+    saved_errno = errno;
+    ApeTag_cache_close(cache);
+    errno = saved_errno;
+    return NULL;
     
-    free(tag->id3);
+    cache_open_error:
+    saved_errno = errno;
+    APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, cache);
+    errno = saved_errno;
+    return NULL;
+}
+
+int ApeTag_cache_close(struct ApeTag_cache *cache) {
+    int ret = 0;
     
-    if (tag->flags & APE_NO_ID3 || 
-       (tag->flags & APE_HAS_APE && !(tag->flags & APE_HAS_ID3))) {
-        tag->id3 = NULL;
+    if (cache == NULL) {
         return 0;
     }
     
-    /* Initialize id3 */
-    if ((tag->id3 = malloc(128)) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
-        return -1;
+    if (cache->map != NULL) {
+        munmap((void *)(uintptr_t)cache->map, cache->map_size);
     }
-    memcpy(tag->id3, "TAG", 3);
-    memset(tag->id3+3, 0, 124);
-    *(tag->id3+127) = '\377';
-    
-    if (tag->items == NULL) {
-        return 0;
+    if (cache->index != NULL) {
+        APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, cache->index);
     }
-
-    /* Easier to use a macro than a function in this case */
-    #define APE_FIELD_TO_ID3_FIELD(FIELD, LENGTH, OFFSET) do { \
-        if ((item = ApeTag__get_item(tag, FIELD)) != NULL) { \
-            size = (item->size < (uint32_t)LENGTH ? item->size : (uint32_t)LENGTH); \
-            end = tag->id3 + OFFSET + size; \
-            memcpy(tag->id3 + OFFSET, item->value, size); \
-            for (c=tag->id3 + OFFSET; c < end; c++) { \
-                if (*c == '\0') { \
-                    *c = ','; \
-                } \
-            } \
-        } else if (tag->errcode != APETAG_NOTPRESENT) { \
-            return -1; \
-        } \
-    } while (0);
-
-    
-    /* 
-    ID3v1.1 tag offsets, lengths
-    title - 3, 30
-    artist - 33, 30
-    album - 63, 30
-    year - 93, 4
-    comment - 97, 28
-    track - 126, 1
-    genre - 127, 1
-    */
-    APE_FIELD_TO_ID3_FIELD("title", 30, 3);
-    APE_FIELD_TO_ID3_FIELD("artist", 30, 33);
-    APE_FIELD_TO_ID3_FIELD("album", 30, 63);
-    APE_FIELD_TO_ID3_FIELD("comment", 28, 97);
-    
-    if ((item = ApeTag__get_item(tag, "year")) != NULL) {
-      APE_FIELD_TO_ID3_FIELD("year", 4, 93);
-    } else if ((item = ApeTag__get_item(tag, "date")) != NULL) {
-      char *last;
-      int digits = 0;
-      for(c = item->value, last = c + item->size; c < last; c++) {
-        if(*c >= '0' && *c <= '9') {
-          digits++;
-          if (digits == 4) {
-            memcpy(tag->id3 + 93, c-3, 4);
-            break;
-          }
-        } else if (digits) {
-          digits = 0;
-        }
-      }
+    pthread_mutex_destroy(&cache->lock);
+    if (close(cache->fd) != 0) {
+        ret = -1;
     }
-
-    #undef APE_FIELD_TO_ID3_FIELD
+    APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, cache);
     
-    /* Need to handle the track and genre differently, as they are just bytes */
-    if ((item = ApeTag__get_item(tag, "track")) != NULL) { 
-        *(tag->id3+126) = (char)ApeItem__parse_track(item->size, item->value);
-    } else if (tag->errcode != APETAG_NOTPRESENT) {
-        return -1;
-    }
+    return ret;
+}
 
-    if ((item = ApeTag__get_item(tag, "genre")) != NULL) { 
-        if (ApeTag__lookup_genre(tag, item, (unsigned char *)(tag->id3+127)) != 0) {
-            return -1;
-        }
-    } else if (tag->errcode != APETAG_NOTPRESENT) {
+int ApeTag_set_cache(struct ApeTag *tag, struct ApeTag_cache *cache) {
+    if (tag == NULL) {
         return -1;
     }
     
+    tag->cache = cache;
     return 0;
 }
 
-/* 
-Updates the internal ape tag strings using the value for the database.
+struct ApeTag_index_writer * ApeTag_index_writer_new(void) {
+    struct ApeTag_index_writer *writer;
+    
+    if ((writer = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, sizeof(struct ApeTag_index_writer))) == NULL) {
+        return NULL;
+    }
+    memset(writer, 0, sizeof(struct ApeTag_index_writer));
+    
+    return writer;
+}
 
-Returns 0 on success, <0 on error.
-*/
-static int ApeTag__update_ape(struct ApeTag *tag) {
-    uint32_t i = 0;
-    uint32_t key_size;
-    char *c;
-    uint32_t size;
-    uint32_t flags;
-    uint32_t tag_size = 64 + 9 * tag->item_count;
-    uint32_t num_items;
-    struct ApeItem **items;
+int ApeTag_index_writer_add(struct ApeTag_index_writer *writer, const char *filename, struct ApeTag *tag) {
+    struct ApeTag__index_file *file;
+    size_t item_count;
+    int ret;
     
-    /* Check that the total number of items in the tag is ok */
-    if (tag->item_count > APE_MAXIMUM_ITEM_COUNT) {
+    if (tag == NULL) {
+        return -1;
+    }
+    if (writer == NULL || filename == NULL) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "writer or filename is NULL";
+        return -1;
+    }
+    if (writer->file_count >= UINT32_MAX) {
         tag->errcode = APETAG_LIMITEXCEEDED;
-        tag->error = "tag item count larger than allowed";
+        tag->error = "too many files in index";
+        return -1;
+    }
+    if (ApeTag__index_grow((void **)&writer->files, &writer->file_capacity, 
+                           writer->file_count + 1, sizeof(struct ApeTag__index_file)) != 0) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "realloc";
         return -1;
     }
     
-    /* Get the array of items */
-    items = ApeTag__get_items(tag, &num_items);
-    if (items == NULL) {
+    /* Strings added for a file that fails are left unused in the string table */
+    item_count = writer->item_count;
+    file = &writer->files[writer->file_count];
+    memset(file, 0, sizeof(struct ApeTag__index_file));
+    file->first_item = item_count;
+    if ((ret = ApeTag_iter_items(tag, ApeTag__index_add_item, writer)) != 0 ||
+        ApeTag__index_append(writer, filename, strlen(filename) + 1, &file->filename) != 0) {
+        writer->item_count = item_count;
+        if (ret != -1) {
+            tag->errcode = APETAG_MEMERR;
+            tag->error = "realloc";
+        }
         return -1;
     }
+    file->item_count = (uint32_t)(writer->item_count - item_count);
+    writer->file_count++;
     
-    /* Sort the items */
-    qsort(items, num_items, sizeof(struct ApeItem *), ApeItem__compare);
+    return 0;
+}
 
-    /* Check all of the items for validity and update the total size of the tag*/
-    for (i=0; i < num_items; i++) {
-        if (ApeItem__check_validity(tag, items[i]) != 0) {
-            goto update_ape_error;
-        }
-        tag_size += items[i]->size + (uint32_t)strlen(items[i]->key);
+int ApeTag_index_writer_write(struct ApeTag_index_writer *writer, const char *path) {
+    FILE *file;
+    char *tmp_path;
+    size_t length;
+    int saved_errno;
+    
+    if (writer == NULL || path == NULL) {
+        errno = EINVAL;
+        return -1;
     }
     
-    /* Check that the total size of the tag is ok */
-    tag->size = tag_size;
-    if (tag->size > APE_MAXIMUM_TAG_SIZE) {
-        tag->errcode = APETAG_LIMITEXCEEDED;
-        tag->error = "tag larger than maximum possible size";
-        goto update_ape_error;
+    /* Write to a temporary file and rename it over the snapshot, so readers
+       with the old snapshot mapped keep using it */
+    length = strlen(path);
+    if ((tmp_path = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, length + 5)) == NULL) {
+        errno = ENOMEM;
+        return -1;
     }
+    memcpy(tmp_path, path, length);
+    memcpy(tmp_path + length, ".tmp", 5);
     
-    /* Write all of the tag items to the internal tag item string */
-    free(tag->tag_data);
-    if ((tag->tag_data = malloc(tag->size-64)) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
-        goto update_ape_error;
+    if ((file = fopen(tmp_path, "wb")) == NULL) {
+        goto index_writer_write_error;
     }
-    for (i=0, c=tag->tag_data; i < num_items; i++) {
-        key_size = (uint32_t)strlen(items[i]->key) + 1;
-        size = H2LE32(items[i]->size);
-        flags = H2BE32(items[i]->flags);
-        memcpy(c, &size, 4);
-        memcpy(c+=4, &flags, 4);
-        memcpy(c+=4, items[i]->key, key_size);
-        memcpy(c+=key_size, items[i]->value, items[i]->size);
-        c += items[i]->size;
+    if (ApeTag__index_write(writer, file) != 0 || fflush(file) != 0 || 
+        fsync(fileno(file)) != 0) {
+        saved_errno = errno;
+        fclose(file);
+        unlink(tmp_path);
+        errno = saved_errno;
+        goto index_writer_write_error;
     }
-    if ((uint32_t)(c - tag->tag_data) != tag_size - 64) {
-        tag->errcode = APETAG_INTERNALERR;
-        tag->error = "internal inconsistancy in creating new tag data";
-        goto update_ape_error;
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+        goto index_writer_write_error;
     }
     
-    free(tag->tag_footer);
-    if ((tag->tag_footer = malloc(32)) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
-        goto update_ape_error;
-    }
-    free(tag->tag_header);
-    if ((tag->tag_header = malloc(32)) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
-        goto update_ape_error;
-    }
+    APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, tmp_path);
+    return 0;
     
-    /* Update the internal tag header and footer strings */
-    tag_size = H2LE32(tag_size - 32);
-    num_items = H2LE32(num_items);
-    memcpy(tag->tag_header, APE_PREAMBLE, 12);
-    memcpy(tag->tag_footer, APE_PREAMBLE, 12);
-    memcpy(tag->tag_header+12, &tag_size, 4);
-    memcpy(tag->tag_footer+12, &tag_size, 4);
-    memcpy(tag->tag_header+16, &num_items, 4);
-    memcpy(tag->tag_footer+16, &num_items,  4);
-    *(tag->tag_header+20) = '\0';
-    *(tag->tag_footer+20) = '\0';
-    memcpy(tag->tag_header+21, APE_HEADER_FLAGS, 4);
-    memcpy(tag->tag_footer+21, APE_FOOTER_FLAGS, 4);
-    memset(tag->tag_header+24, 0, 8);
-    memset(tag->tag_footer+24, 0, 8);
-    
-    free(items);
-    return 0;
-    
-    update_ape_error:
-    free(items);
+    index_writer_write_error:
+    saved_errno = errno;
+    APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, tmp_path);
+    errno = saved_errno;
     return -1;
 }
 
-/* 
-Writes the tag to the file using the internal tag strings.
+void ApeTag_index_writer_free(struct ApeTag_index_writer *writer) {
+    if (writer == NULL) {
+        return;
+    }
+    
+    ApeTag__global_free(writer->files);
+    ApeTag__global_free(writer->items);
+    ApeTag__global_free(writer->keys);
+    ApeTag__global_free(writer->strings);
+    ApeTag__global_free(writer->interned);
+    APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, writer);
+}
 
-Returns 0 on success, <0 on error.
-*/
-static int ApeTag__write_tag(struct ApeTag *tag) {
-    assert(tag->tag_header != NULL);
-    assert(tag->tag_data != NULL);
-    assert(tag->tag_footer != NULL);
+struct ApeTag_index * ApeTag_index_open(const char *path) {
+    struct ApeTag_index *index;
+    struct ApeTag__index_header *header;
+    struct stat sb;
+    void *map;
+    int fd;
+    int saved_errno;
+    int cloexec = 0;
     
-    if (fseeko(tag->file, tag->offset, SEEK_SET) == -1) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fseeko";
-        return -1;
+    if (path == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+#ifdef O_CLOEXEC
+    cloexec = O_CLOEXEC;
+#endif
+    if ((fd = open(path, O_RDONLY|cloexec)) == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &sb) != 0) {
+        goto index_open_error;
+    }
+    if (sb.st_size < (off_t)sizeof(struct ApeTag__index_header) || (uintmax_t)sb.st_size > SIZE_MAX) {
+        errno = EINVAL;
+        goto index_open_error;
+    }
+    if ((map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        goto index_open_error;
     }
+    close(fd);
     
-    if (fwrite(tag->tag_header, 1, 32, tag->file) != 32) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fwrite";
-        return -1;
+    if ((index = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, sizeof(struct ApeTag_index))) == NULL) {
+        munmap(map, (size_t)sb.st_size);
+        errno = ENOMEM;
+        return NULL;
     }
-    if (fwrite(tag->tag_data, 1, tag->size-64, tag->file) != tag->size-64) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fwrite";
-        return -1;
+    index->map = map;
+    index->map_size = (size_t)sb.st_size;
+    header = &index->header;
+    memcpy(header, index->map, sizeof(struct ApeTag__index_header));
+    
+    /* Only the header is checked, so opening takes constant time */
+    if (memcmp(header->magic, APE_INDEX_MAGIC, 8) != 0 || 
+        header->version != APE_INDEX_VERSION || header->byte_order != APE_INDEX_BYTE_ORDER ||
+        header->files_offset > index->map_size || header->keys_offset > index->map_size ||
+        header->items_offset > index->map_size || header->strings_offset > index->map_size ||
+        header->file_count > (index->map_size - header->files_offset) / sizeof(struct ApeTag__index_file) ||
+        header->key_count > (index->map_size - header->keys_offset) / sizeof(uint64_t) ||
+        header->item_count > (index->map_size - header->items_offset) / sizeof(struct ApeTag__index_item) ||
+        header->strings_size > index->map_size - header->strings_offset) {
+        ApeTag_index_close(index);
+        errno = EINVAL;
+        return NULL;
     }
-    if (fwrite(tag->tag_footer, 1, 32, tag->file) != 32) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fwrite";
+    
+    return index;
+    
+    index_open_error:
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return NULL;
+}
+
+int ApeTag_index_close(struct ApeTag_index *index) {
+    int ret = 0;
+    
+    if (index == NULL) {
+        return 0;
+    }
+    
+    if (munmap(index->map, index->map_size) != 0) {
+        ret = -1;
+    }
+    APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, index);
+    
+    return ret;
+}
+
+uint32_t ApeTag_index_file_count(struct ApeTag_index *index) {
+    return index == NULL ? 0 : index->header.file_count;
+}
+
+const char * ApeTag_index_filename(struct ApeTag_index *index, uint32_t file) {
+    struct ApeTag__index_file record;
+    
+    if (ApeTag__index_file(index, file, &record) != 0) {
+        return NULL;
+    }
+    
+    return ApeTag__index_string(index, record.filename);
+}
+
+int ApeTag_index_find_file(struct ApeTag_index *index, const char *filename, uint32_t *file) {
+    const char *name;
+    uint32_t low = 0;
+    uint32_t high;
+    uint32_t middle;
+    int cmp;
+    
+    if (index == NULL || filename == NULL || file == NULL) {
+        errno = EINVAL;
         return -1;
     }
-    if (tag->id3 != NULL && !(tag->flags & APE_NO_ID3)) {
-        if (fwrite(tag->id3, 1, 128, tag->file) != 128) {
-            tag->errcode = APETAG_FILEERR;
-            tag->error = "fwrite";
+    
+    high = index->header.file_count;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if ((name = ApeTag_index_filename(index, middle)) == NULL) {
             return -1;
         }
-        tag->flags |= APE_HAS_ID3;
+        if ((cmp = strcmp(filename, name)) == 0) {
+            *file = middle;
+            return 0;
+        } else if (cmp < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
     }
+    
+    return 1;
+}
 
-    if (fflush(tag->file) != 0) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "fflush";
+uint32_t ApeTag_index_item_count(struct ApeTag_index *index, uint32_t file) {
+    struct ApeTag__index_file record;
+    
+    if (ApeTag__index_file(index, file, &record) != 0) {
+        return 0;
+    }
+    
+    return record.item_count;
+}
+
+int ApeTag_index_get_item(struct ApeTag_index *index, uint32_t file, uint32_t item, struct ApeItem *view) {
+    struct ApeTag__index_file record;
+    
+    if (view == NULL || ApeTag__index_file(index, file, &record) != 0) {
+        errno = EINVAL;
         return -1;
     }
-    if (ftruncate(fileno(tag->file), (tag->offset + ApeTag__tag_length(tag))) == -1) {
-        tag->errcode = APETAG_FILEERR;
-        tag->error = "ftruncate";
+    if (item >= record.item_count) {
+        errno = EINVAL;
         return -1;
     }
-    tag->file_item_count = tag->item_count;
-    tag->flags |= APE_HAS_APE;
     
-    return 0;
+    return ApeTag__index_item(index, record.first_item + item, view);
 }
 
-/*
-Frees an struct ApeItem and it's key and value, given a pointer to a pointer to it.
-*/
-static void ApeItem__free(struct ApeItem **item) {
-    assert(item != NULL);
-    if (*item == NULL) {
-        return;
+int ApeTag_index_lookup(struct ApeTag_index *index, uint32_t file, const char *key, struct ApeItem *view) {
+    struct ApeTag__index_file record;
+    struct ApeTag__index_item item;
+    const char *name;
+    char folded[256];
+    size_t length;
+    uint32_t low = 0;
+    uint32_t high;
+    uint32_t middle;
+    uint32_t i;
+    int cmp = 1;
+    
+    if (key == NULL || view == NULL || ApeTag__index_file(index, file, &record) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((length = strlen(key)) > 255) {
+        return 1;
     }
+    ApeTag__index_fold(folded, key, length);
     
-    free((*item)->key);
-    (*item)->key = NULL;
-    free((*item)->value);
-    (*item)->value = NULL;
-    free(*item);
-    *item = NULL;
+    /* Find the case folded key in the key table, then the item with it */
+    high = index->header.key_count;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if ((name = ApeTag_index_key(index, middle)) == NULL) {
+            return -1;
+        }
+        if ((cmp = strcmp(folded, name)) == 0) {
+            break;
+        } else if (cmp < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    if (cmp != 0) {
+        return 1;
+    }
+    
+    for (i=0; i < record.item_count; i++) {
+        memcpy(&item, index->map + index->header.items_offset + 
+               (record.first_item + i) * sizeof(struct ApeTag__index_item), sizeof(item));
+        if (item.key_id == middle) {
+            return ApeTag__index_item(index, record.first_item + i, view);
+        }
+    }
+    
+    return 1;
 }
 
-/*
-Allocates space for a copy of src, copies src to the newly allocated space
-(for the given number of bytes), and converts the copy to lower case.  Size is
-an unsigned char because keys cannot be more than 256 bytes (including
-terminator).
-
-The caller is responsible for freeing the returned pointer.
+uint32_t ApeTag_index_key_count(struct ApeTag_index *index) {
+    return index == NULL ? 0 : index->header.key_count;
+}
 
-Returns pointer to copy on success, NULL pointer on error.
-*/
-static char* ApeTag__strcasecpy(const char *src, size_t size) {
-    char *c, *dest;
-    
-    assert(src != NULL);
+const char * ApeTag_index_key(struct ApeTag_index *index, uint32_t key) {
+    uint64_t offset;
     
-    if ((dest = malloc(size)) == NULL) {
+    if (index == NULL || key >= index->header.key_count) {
         return NULL;
     }
     
-    memcpy(dest, src, size);
-    for (c = dest; size > 0; size--, c++) {
-        if (*c >= 'A' && *c <= 'Z') {
-            *c |= 0x20;
-        }
-    } 
-    
-    return dest;
+    memcpy(&offset, index->map + index->header.keys_offset + key * sizeof(uint64_t), sizeof(offset));
+    return ApeTag__index_string(index, offset);
 }
 
+/* Private Functions */
+
 /*
-This is a very simple atoi-like function that takes the size of the string, and
-a character pointer.  If the character pointer is a string between "0" and
-"255", the unsigned char equivalent is returned; otherwise, 0 is returned.
+Parses the header and footer of the tag to get information about it.
 
-Returns unsigned char.
+Returns 0 on success, <0 on error;
 */
-static unsigned char ApeItem__parse_track(uint32_t size, char *value) {
-    assert(value != NULL);
+static int ApeTag__get_tag_information(struct ApeTag *tag) {
+    if (tag == NULL) {
+        return -1;
+    }
+
+    if (tag->flags & APE_CHECKED_APE) {
+        return 0;
+    }
     
-    if (size != 0 && size < 4) {
-        if (size == 3) {
-            if (*(value) >= '0' && *(value) <= '2' && 
-               *(value+1) >= '0' && *(value+1) <= '9' &&
-               *(value+2) >= '0' && *(value+2) <= '9') {
-                if (*(value) == '2' && ((*(value+1) > '5') ||
-                   (*(value+1) == '5' && *(value+2) > '5'))) {
-                    /* 3 digit number > 255 won't fit in a char */
-                    return 0;
-                }
-                return (unsigned char)(100 * (*(value) & ~0x30) + 
-                       (10 * (*(value+1) & ~0x30)) + 
-                       (*(value+2) & ~0x30));                        
-            }
-        } else if (size == 2) {
-            if (*(value) >= '0' && *(value) <= '9' && 
-               *(value+1) >= '0' && *(value+1) <= '9') {
-                return (unsigned char)(10 * (*(value) & ~0x30) + 
-                       (*(value+1) & ~0x30));
-            }
-        } else if (size == 1) {
-            if (*(value) >= '0' && *(value) <= '9') {
-                 return (unsigned char)(*(value) & ~0x30);
-            }
-        }
+    if (ApeTag__timed(tag, ApeTag__load_tag_information, 
+                      APE_STAT_PTR(tag, get_tag_information_ns)) != 0) {
+        return -1;
     }
+    tag->flags |= APE_DISK_TAIL;
+    
     return 0;
 }
 
 /*
-Checks the given struct ApeItem for validity (checking flags, key, and value).
+Gets the tag information from the tag's scan cache if the cache has a record
+for the file with the same identity, otherwise reads it from the file and
+adds it to the cache.  The file's identity is checked again after reading,
+so a file modified while being read is not cached, and neither is a
+read-only file with an interrupted update.
 
-Returns 0 if valid, <0 otherwise.
+Returns 0 on success, <0 on error;
 */
-static int ApeItem__check_validity(struct ApeTag *tag, struct ApeItem *item) {
-    unsigned long key_length;
-    char *key_end;
-    char *c;
-    
-    assert(tag != NULL);
-    assert(item != NULL);
-    assert(item->key != NULL);
-    assert(item->value != NULL);
-    
-    /* Check valid flags */
-    if (item->flags > 7) {
-        tag->errcode = APETAG_INVALIDITEM;
-        tag->error = "invalid item flags";
-        return -1;
+static int ApeTag__load_tag_information(struct ApeTag *tag) {
+    struct stat before;
+    struct stat after;
+
+    tag->flags &= ~APE_JOURNAL_VIEW;
+    tag->view_shift = 0;
+    if (tag->cache == NULL || ApeTag__file_identity(tag, &before) != 0) {
+        return ApeTag__read_tag_information(tag);
     }
     
-    /* Check valid key */
-    key_length = strlen(item->key);
-    key_end = item->key + (long)key_length;
-    if (key_length < 2) {
-        tag->errcode = APETAG_INVALIDITEM;
-        tag->error = "invalid item key (too short)";
-        return -1;
-    }
-    if (key_length > 255) {
-        tag->errcode = APETAG_INVALIDITEM;
-        tag->error = "invalid item key (too long)";
-        return -1;
+    if (ApeTag__cache_lookup(tag, &before) == 0) {
+        APE_STAT_ADD(tag, cache_hits, 1);
+        return 0;
     }
-    if (key_length == 3 ? ApeTag__strncasecmp(item->key, "id3", 3) == 0 || 
-                         ApeTag__strncasecmp(item->key, "tag", 3) == 0 || 
-                         ApeTag__strncasecmp(item->key, "mp+", 3) == 0
-       : (key_length == 4 ? ApeTag__strncasecmp(item->key, "oggs", 4) == 0 : 0)) {
-        tag->errcode = APETAG_INVALIDITEM;
-        tag->error = "invalid item key (id3|tag|mp+|oggs)";
+    APE_STAT_ADD(tag, cache_misses, 1);
+    
+    if (ApeTag__read_tag_information(tag) != 0) {
         return -1;
     }
-    for (c=item->key; c<key_end; c++) {
-        if ((unsigned char)(*c) < 0x20 || (unsigned char)(*c) > 0x7f) {
-            tag->errcode = APETAG_INVALIDITEM;
-            tag->error = "invalid item key character";
-            return -1;
-        }
+    if (!(tag->flags & APE_JOURNAL_VIEW) &&
+        ApeTag__file_identity(tag, &after) == 0 && before.st_dev == after.st_dev &&
+        before.st_ino == after.st_ino && before.st_size == after.st_size &&
+        before.st_mtime == after.st_mtime) {
+        ApeTag__cache_store(tag, &after);
     }
     
-    /* Check value is utf-8 if flags specify utf8 or external format*/
-    if (((item->flags & APE_ITEM_TYPE_FLAGS) & APE_ITEM_BINARY) == 0 && 
-        ApeTag__check_valid_utf8((unsigned char *)(item->value), item->size) != 0) {
-        tag->errcode = APETAG_INVALIDITEM;
-        tag->error = "invalid utf8 value";
+    return 0;
+}
+
+/*
+Reads the id3 tag and the ape tag's header, footer, and data from the file,
+for ApeTag__get_tag_information.
+
+Returns 0 on success, <0 on error;
+*/
+static int ApeTag__read_tag_information(struct ApeTag *tag) {
+    off_t file_size = 0;
+
+    /* Get file size */
+    if ((file_size = tag->io->size(tag->io_ctx)) == -1) {
+        tag->errcode = APETAG_FILEERR;
+        tag->error = "size";
         return -1;
-    }
+    } 
     
-    return 0;
+    return ApeTag__read_tags(tag, file_size);
 }
 
 /*
-Checks the given UTF8 string for validity.
+Reads the tags from the end of a file of the given size, for
+ApeTag__read_tag_information.  If the file has an interrupted update, it is
+finished first, or for read-only files, the tags are read from the file as
+it would be once the update was finished, with view_shift added to the
+offsets of the reads.
 
-Returns 0 if valid, -1 if not.
+Returns 0 on success, <0 on error;
 */
-static int ApeTag__check_valid_utf8(unsigned char *utf8_string, uint32_t size) {
-    unsigned char *utf_last_char;
-    unsigned char *c = utf8_string;
+static int ApeTag__read_tags(struct ApeTag *tag, off_t file_size) {
+    int ret;
+    int id3_length = 0;
+    uint32_t header_check;
     
-    assert(utf8_string != NULL);
+    /* No ape or id3 tag possible in this size */
+    if (file_size < APE_MINIMUM_TAG_SIZE) {
+        tag->offset = file_size;
+        tag->flags |= APE_CHECKED_APE | APE_CHECKED_OFFSET;
+        tag->flags &= ~(APE_HAS_APE | APE_HAS_ID3);
+        return 0;
+    } 
     
-    for (; c < (utf8_string + size); c++) {
-        if ((*c & 128) != 0) {
-            /* Non ASCII */
-            if ((*c < 194) || (*c > 245)) {
-                /* Outside of UTF8 Range */
-                return -1;
-            }
-            if ((*c & 224) == 192) {
-                /* 2 byte UTF8 char */
-                utf_last_char = c + 1;
-            } else if ((*c & 240) == 224) {
-                /* 3 byte UTF8 char */
-                utf_last_char = c + 2;
-            } else if ((*c & 248) == 240) {
-                /* 4 byte UTF8 char */
-                utf_last_char = c + 3;
-            } else {
+    if (!(tag->flags & APE_NO_ID3)) {
+        if (file_size < 128) {
+            /* No id3 tag possible in this size */
+            tag->flags &= ~APE_HAS_ID3;
+        } else {
+            /* Check for id3 tag */
+            ApeTag__free(tag, tag->id3);
+            if ((tag->id3 = ApeTag__malloc(tag, 128)) == NULL) {
+                tag->errcode = APETAG_MEMERR;
+                tag->error = "malloc";
                 return -1;
             }
-            
-            if (utf_last_char >= (utf8_string + size)) {
+            if (ApeTag__read(tag, tag->id3, 128, file_size-128+tag->view_shift) != 0) {
                 return -1;
             }
-            /* Check remaining bytes of character */
-            for (; c + 1 <= utf_last_char;) {
-                c++;
-                if ((*c & 192) != 128) {
-                    return -1;
+            if (!(tag->flags & APE_JOURNAL_VIEW) && ApeTag__is_journal(tag->id3 + 128)) {
+                if ((ret = ApeTag__journal_recover(tag, &file_size)) != 0) {
+                    return ret < 0 ? -1 : ApeTag__read_tags(tag, file_size);
                 }
             }
+            if (ApeTag__is_id3(tag->id3)) {
+                id3_length = 128;
+                tag->flags |= APE_HAS_ID3;
+            } else {
+                ApeTag__free(tag, tag->id3);
+                tag->id3 = NULL;
+                tag->flags &= ~APE_HAS_ID3;
+            }
+        }
+        /* Recheck possibility for ape tag now that id3 presence is known */
+        if (file_size < APE_MINIMUM_TAG_SIZE + id3_length) {
+            tag->flags &= ~APE_HAS_APE;
+            tag->offset = file_size - id3_length;
+            tag->flags |= APE_CHECKED_OFFSET | APE_CHECKED_APE;
+            return 0;
+        }
+    }
+    
+    /* Check for existance of ape tag footer */
+    if (ApeTag__alloc_buffers(tag, 0) != 0) {
+        return -1;
+    }
+    if (ApeTag__read(tag, tag->tag_footer, 32, file_size-32-id3_length+tag->view_shift) != 0) {
+        return -1;
+    }
+    if (id3_length == 0 && !(tag->flags & APE_JOURNAL_VIEW) && ApeTag__is_journal(tag->tag_footer + 32)) {
+        if ((ret = ApeTag__journal_recover(tag, &file_size)) != 0) {
+            return ret < 0 ? -1 : ApeTag__read_tags(tag, file_size);
         }
     }
+    if ((ret = ApeTag__check_footer(tag, file_size, id3_length)) < 0) {
+        return -1;
+    } else if (ret == 1) {
+        tag->flags &= ~APE_HAS_APE;
+        tag->offset = file_size - id3_length;
+        tag->flags |= APE_CHECKED_OFFSET | APE_CHECKED_APE;
+        return 0;
+    }
+    tag->offset = file_size - tag->size - id3_length;
+    tag->flags |= APE_CHECKED_OFFSET;
+    
+    /* Read tag header and data */
+    if (ApeTag__alloc_buffers(tag, tag->size-64) != 0) {
+        return -1;
+    }
+    if (ApeTag__read(tag, tag->tag_header, 32, tag->offset+tag->view_shift) != 0) {
+        return -1;
+    }
+    if (ApeTag__read(tag, tag->tag_data, tag->size-64, tag->offset+32+tag->view_shift) != 0) {
+        return -1;
+    }
+    
+    /* Check tag header for validity */
+    if (memcmp(APE_PREAMBLE, tag->tag_header, 12) || memcmp(APE_HEADER_FLAGS, tag->tag_header+21, 3) \
+      || ((char)*(tag->tag_header+20) != '\0' && (char)*(tag->tag_header+20) != '\1')) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "missing APE header";
+        return -1;
+    }
+    memcpy(&header_check, tag->tag_header+12, 4);
+    if (tag->size != LE2H32(header_check)+32) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "header and footer size does not match";
+        return -1;
+    }
+    memcpy(&header_check, tag->tag_header+16, 4);
+    if (tag->file_item_count != LE2H32(header_check)) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "header and footer item count does not match";
+        return -1;
+    }
+    
+    tag->flags |= APE_CHECKED_APE | APE_HAS_APE;
     return 0;
 }
 
-/* 
-Comparison function for quicksort.  Sorts first based on size and secondly
-based on key.  Should be a stable sort, as no two items should have the same
-key.
+/*
+Checks the tag footer in tag->tag_footer for validity, given the size of the
+file and the length of any id3 tag following the ape tag.  Sets the tag's size
+and file item count from the footer.
 
-Returns -1 or 1.  Could possibly return 0 if the database has been manually
-modified (don't do that!).
+Returns 0 if the footer is valid, 1 if there is no ape tag, <0 on error.
 */
-static int ApeItem__compare(const void *a, const void *b) {
-    const struct ApeItem *ai_a = *(const struct ApeItem * const *)a;
-    const struct ApeItem *ai_b = *(const struct ApeItem * const *)b;
-    uint32_t size_a;
-    uint32_t size_b;
+static int ApeTag__check_footer(struct ApeTag *tag, off_t file_size, int id3_length) {
+    if (memcmp(APE_PREAMBLE, tag->tag_footer, 12)) {
+        return 1;
+    }
+    if (memcmp(APE_FOOTER_FLAGS, tag->tag_footer+21, 3) || \
+       ((char)*(tag->tag_footer+20) != '\0' && \
+       (char)*(tag->tag_footer+20) != '\1')) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "bad tag footer flags";
+        return -1;
+    }
     
-    size_a = ai_a->size + (uint32_t)strlen(ai_a->key);
-    size_b = ai_b->size + (uint32_t)strlen(ai_b->key);
-    if (size_a < size_b) {
+    memcpy(&tag->size, tag->tag_footer+12, 4);
+    memcpy(&tag->file_item_count, tag->tag_footer+16, 4);
+    tag->size = LE2H32(tag->size);
+    tag->file_item_count = LE2H32(tag->file_item_count);
+    tag->size += 32;
+    
+    /* Check tag footer for validity */
+    if (tag->size < APE_MINIMUM_TAG_SIZE) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "tag smaller than minimum possible size";
         return -1;
     }
-    if (size_a > size_b) {
-        return 1;
+    if (tag->size > APE_MAXIMUM_TAG_SIZE) {
+        tag->errcode = APETAG_LIMITEXCEEDED;
+        tag->error = "tag larger than maximum allowed size";
+        return -1;
+    }
+    if (tag->size + (off_t)id3_length > file_size) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "tag larger than possible size";
+        return -1;
     }
-    return strncmp(ai_a->key, ai_b->key, strlen(ai_a->key));
+    if (tag->file_item_count > APE_MAXIMUM_ITEM_COUNT) {
+        tag->errcode = APETAG_LIMITEXCEEDED;
+        tag->error = "tag item count larger than allowed";
+        return -1;
+    }
+    if (tag->file_item_count > (tag->size - APE_MINIMUM_TAG_SIZE)/APE_ITEM_MINIMUM_SIZE) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "tag item count larger than possible";
+        return -1;
+    }
+    
+    return 0;
 }
 
 /*
-Looks up a genre for the correct ID3 genre code.  The genre string is passed
-in as the ApeItem's value, and pointer to the genre code is passed.  The ApeItem's
-size should not include a terminator for the value, as the entries in the genre
-database are not terminated.
+Checks whether the given 128 bytes are an id3v1 tag.
 
-Returns 0 on success, -1 on error;
+Returns 1 if so, 0 if not.
 */
-static int ApeTag__lookup_genre(struct ApeTag *tag, struct ApeItem *item, unsigned char *genre_id) {
-    int ret = 0;
-    DBT key_dbt, value_dbt;
+static int ApeTag__is_id3(const char *id3) {
+    return id3[0] == 'T' && id3[1] == 'A' && id3[2] == 'G' && id3[125] == '\0';
+}
 
-    key_dbt.size = item->size;
-    key_dbt.data = item->value;
+/* 
+Parses all items from the tag and puts them in the database.
+
+Returns 0 on success, <0 on error.
+*/
+static int ApeTag__parse_items(struct ApeTag *tag) {
+    uint32_t i;
+    uint32_t offset = 0;
+    uint32_t last_possible_offset = tag->size - APE_MINIMUM_TAG_SIZE - 
+                               APE_ITEM_MINIMUM_SIZE;
     
-    if (ApeTag__load_ID3_GENRES(tag) != 0) {
+    assert(tag != NULL);
+    
+    /* The database is kept open, so a reset tag reuses it */
+    if (ApeTag__empty_items(tag) != 0) {
         return -1;
     }
     
-    ret = ID3_GENRES->get(ID3_GENRES, &key_dbt, &value_dbt, 0);
-    if (ret != 0) {
-        if (ret == -1) {
-            tag->errcode = APETAG_INTERNALERR;
-            tag->error = "db->get";
+    for (i=0; i < tag->file_item_count; i++) {
+        if (offset > last_possible_offset) {
+            tag->errcode = APETAG_CORRUPTTAG;
+            tag->error = "end of tag reached but more items specified";
             return -1;
         }
-        *genre_id = '\377';
-    } else {
-        *genre_id = *(unsigned char *)(value_dbt.data);
+
+        if (ApeTag__parse_item(tag, &offset) != 0) {
+            return -1;
+        }
+    }
+    if (offset != tag->size - APE_MINIMUM_TAG_SIZE) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "data remaining after specified number of items parsed";
+        return -1;
     }
+    tag->flags |= APE_CHECKED_FIELDS;
     
     return 0;
 }
 
-/*
-Loads the ID3_GENRES global database with all 148 ID3 genres (including the 
-Winamp extensions).  This has a possible race condition in multi-threaded
-code, since it modifies a global variable, but the worst case scenario is
-minor memory leakage, and the window for the race condition is very small,
-since it can only occur if ID3_GENRES has not yet been initialized.
+/* 
+Parses a single item from the tag at the given offset from the start of the
+tag's data.
 
-Returns 0 on success, -1 on error.
+Returns 0 on success, <0 on error.
 */
-static int ApeTag__load_ID3_GENRES(struct ApeTag *tag) {
-    DB* genres;
-    DBT key_dbt, value_dbt;
-    value_dbt.size = 1;
+static int ApeTag__parse_item(struct ApeTag *tag, uint32_t *offset) {
+    struct ApeItem raw_item;
+    struct ApeItem *item = NULL;
+    uint32_t key_length;
     
-    assert(tag != NULL);
+    if (ApeTag__read_item(tag, offset, &raw_item) != 0) {
+        return -1;
+    }
+    key_length = (uint32_t)(raw_item.value - raw_item.key);
     
-    if (ID3_GENRES != NULL) {
+    /* The padding item is only space for the tag to grow into */
+    if (tag->padding_key != NULL && ApeTag__strncasecmp(raw_item.key, tag->padding_key, key_length) == 0) {
         return 0;
     }
-
-    if ((ID3_GENRES = genres = dbopen(NULL, O_RDWR|O_CREAT, 0777, DB_HASH, NULL)) == NULL) {
-        tag->errcode = APETAG_INTERNALERR;
-        tag->error = "dbopen";
+    
+    if ((item = ApeTag__malloc(tag, sizeof(struct ApeItem))) == NULL) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "malloc";
         return -1;
     }
+    item->size = raw_item.size;
+    item->flags = raw_item.flags;
+    item->key = NULL;
+    item->value = NULL;
     
-    #define ADD_TO_ID3_GENRES(GENRE, VALUE) do { \
-        key_dbt.data = (GENRE); \
-        key_dbt.size = strlen(GENRE); \
-        value_dbt.data = (VALUE); \
-        if (genres->put(genres, &key_dbt, &value_dbt, 0) == -1) { \
-            tag->errcode = APETAG_INTERNALERR; \
-            tag->error = "db->put"; \
-            goto load_genres_error; \
-        } \
-    } while (0)
+    /* Copy key and value from tag data to item */
+    if ((item->key = ApeTag__malloc(tag, key_length)) == NULL) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "malloc";
+        goto parse_error;
+    }
+    if ((item->value = ApeTag__malloc(tag, item->size)) == NULL) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "malloc";
+        goto parse_error;
+    }
+    memcpy(item->key, raw_item.key, key_length);
+    memcpy(item->value, raw_item.value, item->size);
     
+    /* Add item to the database */
+    if (ApeTag_add_item(tag, item) != 0) {
+        goto parse_error;
+    }
 
-    ADD_TO_ID3_GENRES("Blues", "\0");
-    ADD_TO_ID3_GENRES("Classic Rock", "\1");
-    ADD_TO_ID3_GENRES("Country", "\2");
-    ADD_TO_ID3_GENRES("Dance", "\3");
-    ADD_TO_ID3_GENRES("Disco", "\4");
-    ADD_TO_ID3_GENRES("Funk", "\5");
-    ADD_TO_ID3_GENRES("Grunge", "\6");
-    ADD_TO_ID3_GENRES("Hip-Hop", "\7");
-    ADD_TO_ID3_GENRES("Jazz", "\10");
-    ADD_TO_ID3_GENRES("Metal", "\11");
-    ADD_TO_ID3_GENRES("New Age", "\12");
-    ADD_TO_ID3_GENRES("Oldies", "\13");
-    ADD_TO_ID3_GENRES("Other", "\14");
-    ADD_TO_ID3_GENRES("Pop", "\15");
-    ADD_TO_ID3_GENRES("R & B", "\16");
-    ADD_TO_ID3_GENRES("Rap", "\17");
+    return 0;
+    
+    parse_error:
+    ApeTag__free(tag, item->key);
+    ApeTag__free(tag, item->value);
+    ApeTag__free(tag, item);
+    return -1;
+}
+
+/* 
+Reads the item at the given offset from the start of the tag's data into
+item, with the item's key and value pointing into the tag's data, and
+advances the offset past the item.  The item's validity is not checked.
+
+Returns 0 on success, <0 on error.
+*/
+static int ApeTag__read_item(struct ApeTag *tag, uint32_t *offset, struct ApeItem *item) {
+    char *data = tag->tag_data;
+    char *value_start = NULL;
+    char *key_start = data+(*offset)+8;
+    uint32_t data_size = tag->size - APE_MINIMUM_TAG_SIZE;
+    
+    memcpy(&item->size, data+(*offset), 4);
+    memcpy(&item->flags, data+(*offset)+4, 4);
+    item->size = LE2H32(item->size);
+    item->flags = BE2H32(item->flags);
+    
+    /* Find and check start of value */
+    if (item->size + *offset + APE_ITEM_MINIMUM_SIZE > data_size) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "impossible item length (greater than remaining space)";
+        return -1;
+    }
+    for (value_start=key_start; value_start < key_start+256 && \
+        *value_start != '\0'; value_start++) {
+        /* Left Blank */
+    }
+    if (*value_start != '\0') {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "invalid item key length (too long or no end)";
+        return -1;
+    }
+    value_start++;
+    *offset += 8 + (uint32_t)(value_start - key_start) + item->size;
+    if (*offset > data_size) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "invalid item length (longer than remaining data)";
+        return -1;
+    }
+    
+    item->key = key_start;
+    item->value = value_start;
+    return 0;
+}
+
+/* 
+Checks all items in the tag the same way ApeTag__parse_items does, without
+copying them or adding them to the database.  Duplicate keys are found by
+rereading the earlier items, since tags have few items.
+
+Returns 0 on success, <0 on error.
+*/
+static int ApeTag__verify_items(struct ApeTag *tag) {
+    uint32_t i;
+    uint32_t j;
+    uint32_t offset = 0;
+    uint32_t prev_offset;
+    uint32_t last_possible_offset = tag->size - APE_MINIMUM_TAG_SIZE - 
+                               APE_ITEM_MINIMUM_SIZE;
+    struct ApeItem item;
+    struct ApeItem prev_item;
+    
+    for (i=0; i < tag->file_item_count; i++) {
+        if (offset > last_possible_offset) {
+            tag->errcode = APETAG_CORRUPTTAG;
+            tag->error = "end of tag reached but more items specified";
+            return -1;
+        }
+        if (ApeTag__read_item(tag, &offset, &item) != 0) {
+            return -1;
+        }
+        if (ApeItem__check_validity(tag, &item) != 0) {
+            return -1;
+        }
+        for (j=0, prev_offset=0; j < i; j++) {
+            if (ApeTag__read_item(tag, &prev_offset, &prev_item) != 0) {
+                return -1;
+            }
+            if (item.value - item.key == prev_item.value - prev_item.key && 
+                ApeTag__strncasecmp(item.key, prev_item.key, (size_t)(item.value - item.key)) == 0) {
+                tag->errcode = APETAG_DUPLICATEITEM;
+                tag->error = "duplicate item in tag";
+                return -1;
+            }
+        }
+    }
+    if (offset != tag->size - APE_MINIMUM_TAG_SIZE) {
+        tag->errcode = APETAG_CORRUPTTAG;
+        tag->error = "data remaining after specified number of items parsed";
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* 
+Updates the id3 tag using the new ape tag values.  Does not merge it with a
+previous id3 tag, it overwrites it completely.
+
+Returns 0 on success, <0 on error.
+*/
+static int ApeTag__update_id3(struct ApeTag *tag) {
+    assert (tag != NULL);
+    
+    tag->flags &= ~APE_DISK_TAIL;
+    ApeTag__free(tag, tag->id3);
+    
+    if (!ApeTag__writes_id3(tag)) {
+        tag->id3 = NULL;
+        return 0;
+    }
+    
+    if ((tag->id3 = ApeTag__malloc(tag, 128)) == NULL) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "malloc";
+        return -1;
+    }
+    
+    return ApeTag__render_id3(tag, tag->id3);
+}
+
+/* 
+Fills the given 128 byte buffer with an id3 tag built from the ape tag values.
+
+Returns 0 on success, <0 on error.
+*/
+static int ApeTag__render_id3(struct ApeTag *tag, char *id3) {
+    struct ApeItem *item;
+    char *c;
+    char *end;
+    uint32_t size;
+    
+    assert (tag != NULL);
+    assert (id3 != NULL);
+    
+    /* Initialize id3 */
+    memcpy(id3, "TAG", 3);
+    memset(id3+3, 0, 124);
+    *(id3+127) = '\377';
+    
+    if (tag->items == NULL) {
+        return 0;
+    }
+
+    /* Easier to use a macro than a function in this case */
+    #define APE_FIELD_TO_ID3_FIELD(FIELD, LENGTH, OFFSET) do { \
+        if ((item = ApeTag__get_item(tag, FIELD)) != NULL) { \
+            size = (item->size < (uint32_t)LENGTH ? item->size : (uint32_t)LENGTH); \
+            end = id3 + OFFSET + size; \
+            memcpy(id3 + OFFSET, item->value, size); \
+            for (c=id3 + OFFSET; c < end; c++) { \
+                if (*c == '\0') { \
+                    *c = ','; \
+                } \
+            } \
+        } else if (tag->errcode != APETAG_NOTPRESENT) { \
+            return -1; \
+        } \
+    } while (0);
+
+    
+    /* 
+    ID3v1.1 tag offsets, lengths
+    title - 3, 30
+    artist - 33, 30
+    album - 63, 30
+    year - 93, 4
+    comment - 97, 28
+    track - 126, 1
+    genre - 127, 1
+    */
+    APE_FIELD_TO_ID3_FIELD("title", 30, 3);
+    APE_FIELD_TO_ID3_FIELD("artist", 30, 33);
+    APE_FIELD_TO_ID3_FIELD("album", 30, 63);
+    APE_FIELD_TO_ID3_FIELD("comment", 28, 97);
+    
+    if ((item = ApeTag__get_item(tag, "year")) != NULL) {
+      APE_FIELD_TO_ID3_FIELD("year", 4, 93);
+    } else if ((item = ApeTag__get_item(tag, "date")) != NULL) {
+      char *last;
+      int digits = 0;
+      for(c = item->value, last = c + item->size; c < last; c++) {
+        if(*c >= '0' && *c <= '9') {
+          digits++;
+          if (digits == 4) {
+            memcpy(id3 + 93, c-3, 4);
+            break;
+          }
+        } else if (digits) {
+          digits = 0;
+        }
+      }
+    }
+
+    #undef APE_FIELD_TO_ID3_FIELD
+    
+    /* Need to handle the track and genre differently, as they are just bytes */
+    if ((item = ApeTag__get_item(tag, "track")) != NULL) { 
+        *(id3+126) = (char)ApeItem__parse_track(item->size, item->value);
+    } else if (tag->errcode != APETAG_NOTPRESENT) {
+        return -1;
+    }
+
+    if ((item = ApeTag__get_item(tag, "genre")) != NULL) { 
+        if (ApeTag__lookup_genre(tag, item, (unsigned char *)(id3+127)) != 0) {
+            return -1;
+        }
+    } else if (tag->errcode != APETAG_NOTPRESENT) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* 
+Updates the internal ape tag strings using the value for the database.
+
+Returns 0 on success, <0 on error.
+*/
+static int ApeTag__update_ape(struct ApeTag *tag) {
+    uint32_t tag_size;
+    uint32_t num_items;
+    struct ApeItem **items;
+    
+    tag->flags &= ~APE_DISK_TAIL;
+    if (ApeTag__prepare_ape(tag, &items, &num_items, &tag_size) != 0) {
+        return -1;
+    }
+    tag->size = tag_size;
+    
+    if (ApeTag__alloc_buffers(tag, tag->size-64) != 0) {
+        return -1;
+    }
+    
+    return ApeTag__render_ape(tag, items, num_items, tag_size, tag->tag_header, 
+                              tag->tag_data, tag->tag_footer);
+}
+
+/* 
+Gets the items that will make up the new ape tag, sorted in the order they
+will be written, checks them for validity, and calculates the size of the
+resulting tag (including header and footer).
+
+The returned items are the tag's sorted item array, which should not be
+freed and is only valid until the tag's items are modified.
+
+Returns 0 on success, <0 on error.
+*/
+static int ApeTag__prepare_ape(struct ApeTag *tag, struct ApeItem ***items, uint32_t *num_items, uint32_t *tag_size) {
+    uint32_t i;
+    uint32_t size = 64 + 9 * tag->item_count;
+    
+    /* Check that the total number of items in the tag is ok */
+    if (tag->item_count > APE_MAXIMUM_ITEM_COUNT) {
+        tag->errcode = APETAG_LIMITEXCEEDED;
+        tag->error = "tag item count larger than allowed";
+        return -1;
+    }
+    
+    /* Get the sorted array of items */
+    *items = ApeTag__sort_items(tag);
+    *num_items = tag->item_count;
+
+    /* Check all of the items for validity and update the total size of the tag*/
+    for (i=0; i < *num_items; i++) {
+        if (ApeItem__check_validity(tag, (*items)[i]) != 0) {
+            return -1;
+        }
+        size += (*items)[i]->size + (uint32_t)strlen((*items)[i]->key);
+    }
+    
+    /* Check that the total size of the tag is ok */
+    if (size > APE_MAXIMUM_TAG_SIZE) {
+        tag->errcode = APETAG_LIMITEXCEEDED;
+        tag->error = "tag larger than maximum possible size";
+        return -1;
+    }
+    
+    *tag_size = ApeTag__padded_size(tag, size);
+    return 0;
+}
+
+/*
+Gets the size of the tag including the padding item, given its size without
+it.  If the tag has padding, the tag in the file is kept the same size if
+the padding item fits, leaving at most twice the padding size.  Otherwise
+the padding item gets the padding size, or as much as fits in the maximum
+tag size.  The padding item is left out if it doesn't fit at all, or if the
+tag has an item with the same key.
+
+Returns the size of the tag including the padding item.
+*/
+static uint32_t ApeTag__padded_size(struct ApeTag *tag, uint32_t size) {
+    enum ApeTag_errcode errcode = tag->errcode;
+    char *error = tag->error;
+    struct ApeItem *item;
+    uint32_t minimum;
+    
+    if (tag->padding_key == NULL || tag->item_count >= APE_MAXIMUM_ITEM_COUNT) {
+        return size;
+    }
+    item = ApeTag__get_item(tag, tag->padding_key);
+    tag->errcode = errcode;
+    tag->error = error;
+    minimum = size + 9 + (uint32_t)strlen(tag->padding_key);
+    if (item != NULL || minimum > APE_MAXIMUM_TAG_SIZE) {
+        return size;
+    }
+    
+    if ((tag->flags & APE_HAS_APE) && tag->size >= minimum && tag->size <= APE_MAXIMUM_TAG_SIZE &&
+        tag->size - minimum <= (uint64_t)tag->padding_size * 2) {
+        return tag->size;
+    }
+    return tag->padding_size < APE_MAXIMUM_TAG_SIZE - minimum ? minimum + tag->padding_size : APE_MAXIMUM_TAG_SIZE;
+}
+
+/* 
+Writes the 32 byte header, the item data, and the 32 byte footer for a tag
+containing the given sorted items, and the padding item filling any space
+left, into the given buffers.  tag_size is the
+size returned by ApeTag__prepare_ape, and data must have room for
+tag_size-64 bytes.  The buffers may be adjacent parts of a single buffer.
+
+Returns 0 on success, <0 on error.
+*/
+static int ApeTag__render_ape(struct ApeTag *tag, struct ApeItem **items, uint32_t num_items, uint32_t tag_size, char *header, char *data, char *footer) {
+    uint32_t i;
+    uint32_t key_size;
+    uint32_t size;
+    uint32_t padding;
+    uint32_t flags;
+    char *c;
+    
+    /* Write all of the tag items to the tag item string */
+    for (i=0, c=data; i < num_items; i++) {
+        key_size = (uint32_t)strlen(items[i]->key) + 1;
+        size = H2LE32(items[i]->size);
+        flags = H2BE32(items[i]->flags);
+        memcpy(c, &size, 4);
+        memcpy(c+=4, &flags, 4);
+        memcpy(c+=4, items[i]->key, key_size);
+        memcpy(c+=key_size, items[i]->value, items[i]->size);
+        c += items[i]->size;
+    }
+    
+    /* Fill any remaining space with the padding item, which is last so
+       that using the padding doesn't move the items before it */
+    if (tag->padding_key != NULL && (uint32_t)(c - data) < tag_size - 64) {
+        key_size = (uint32_t)strlen(tag->padding_key) + 1;
+        padding = tag_size - 64 - (uint32_t)(c - data) - 8 - key_size;
+        size = H2LE32(padding);
+        flags = H2BE32(APE_ITEM_BINARY);
+        memcpy(c, &size, 4);
+        memcpy(c+=4, &flags, 4);
+        memcpy(c+=4, tag->padding_key, key_size);
+        memset(c+=key_size, 0, padding);
+        c += padding;
+        num_items++;
+    }
+    if ((uint32_t)(c - data) != tag_size - 64) {
+        tag->errcode = APETAG_INTERNALERR;
+        tag->error = "internal inconsistancy in creating new tag data";
+        return -1;
+    }
+    
+    /* Update the tag header and footer strings */
+    tag_size = H2LE32(tag_size - 32);
+    num_items = H2LE32(num_items);
+    memcpy(header, APE_PREAMBLE, 12);
+    memcpy(footer, APE_PREAMBLE, 12);
+    memcpy(header+12, &tag_size, 4);
+    memcpy(footer+12, &tag_size, 4);
+    memcpy(header+16, &num_items, 4);
+    memcpy(footer+16, &num_items,  4);
+    *(header+20) = '\0';
+    *(footer+20) = '\0';
+    memcpy(header+21, APE_HEADER_FLAGS, 4);
+    memcpy(footer+21, APE_FOOTER_FLAGS, 4);
+    memset(header+24, 0, 8);
+    memset(footer+24, 0, 8);
+    
+    return 0;
+}
+
+/* 
+Writes the tag to the file using the internal tag strings.
+
+Returns 0 on success, <0 on error.
+*/
+static int ApeTag__write_tag(struct ApeTag *tag) {
+    if (ApeTag__write_tail(tag, tag->offset) != 0) {
+        return -1;
+    }
+    return ApeTag__truncate_tag(tag);
+}
+
+/* 
+Writes the internal tag strings, and the id3 tag if there is one to write,
+to the file at the given offset.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__write_tail(struct ApeTag *tag, off_t offset) {
+    assert(tag->tag_header != NULL);
+    assert(tag->tag_data != NULL);
+    assert(tag->tag_footer != NULL);
+    
+    if (ApeTag__write(tag, tag->tag_header, 32, offset) != 0) {
+        return -1;
+    }
+    if (ApeTag__write(tag, tag->tag_data, tag->size-64, offset+32) != 0) {
+        return -1;
+    }
+    if (ApeTag__write(tag, tag->tag_footer, 32, offset+tag->size-32) != 0) {
+        return -1;
+    }
+    if (tag->id3 != NULL && !(tag->flags & APE_NO_ID3)) {
+        if (ApeTag__write(tag, tag->id3, 128, offset+tag->size) != 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/* 
+Truncates the file to the end of the tag just written to it, and records
+that the file has the tag.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__truncate_tag(struct ApeTag *tag) {
+    if (ApeTag__truncate(tag, tag->offset + ApeTag__write_length(tag)) != 0) {
+        return -1;
+    }
+    ApeTag__wrote_tag(tag);
+    
+    return 0;
+}
+
+/* Records that the file has the tag just written to it. */
+static void ApeTag__wrote_tag(struct ApeTag *tag) {
+    if (tag->id3 != NULL && !(tag->flags & APE_NO_ID3)) {
+        tag->flags |= APE_HAS_ID3;
+    }
+    memcpy(&tag->file_item_count, tag->tag_footer+16, 4);
+    tag->file_item_count = LE2H32(tag->file_item_count);
+    tag->flags |= APE_HAS_APE | APE_DISK_TAIL;
+}
+
+/*
+Copies the APE and id3 tags in the file from the tag buffers, which hold
+what was read from or written to the file, to disk_tail.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__save_tail(struct ApeTag *tag) {
+    uint32_t length = 0;
+    
+    if (tag->flags & APE_HAS_APE) {
+        length += tag->size;
+    }
+    if ((tag->flags & APE_HAS_ID3) && !(tag->flags & APE_NO_ID3)) {
+        length += 128;
+    }
+    if (tag->disk_tail == NULL || tag->disk_capacity < length) {
+        ApeTag__free(tag, tag->disk_tail);
+        tag->disk_capacity = 0;
+        if ((tag->disk_tail = ApeTag__malloc(tag, length > 0 ? length : 1)) == NULL) {
+            tag->errcode = APETAG_MEMERR;
+            tag->error = "malloc";
+            return -1;
+        }
+        tag->disk_capacity = length;
+    }
+    
+    tag->disk_length = 0;
+    if (tag->flags & APE_HAS_APE) {
+        memcpy(tag->disk_tail, tag->tag_header, 32);
+        memcpy(tag->disk_tail+32, tag->tag_data, tag->size-64);
+        memcpy(tag->disk_tail+tag->size-32, tag->tag_footer, 32);
+        tag->disk_length = tag->size;
+    }
+    if ((tag->flags & APE_HAS_ID3) && !(tag->flags & APE_NO_ID3)) {
+        memcpy(tag->disk_tail+tag->disk_length, tag->id3, 128);
+        tag->disk_length += 128;
+    }
+    
+    return 0;
+}
+
+/*
+Writes the tag like ApeTag__write_tag, but only writes the bytes that differ
+from the tags in the file saved by ApeTag__save_tail, and only truncates the
+file if the length of the tags changed.  Items are sorted by size, so a
+change that keeps an item's size only changes the bytes of that item, and
+the id3 tag if the item is in it.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__write_delta(struct ApeTag *tag) {
+    struct ApeTag__delta delta;
+    const char *old = tag->disk_tail;
+    uint32_t old_length = tag->disk_length;
+    uint32_t length = ApeTag__write_length(tag);
+    uint32_t position = 0;
+    uint32_t i;
+    uint32_t j;
+    uint32_t k;
+    uint32_t block;
+    
+    memset(&delta, 0, sizeof(struct ApeTag__delta));
+    delta.pieces[0] = tag->tag_header;
+    delta.sizes[0] = 32;
+    delta.pieces[1] = tag->tag_data;
+    delta.sizes[1] = tag->size-64;
+    delta.pieces[2] = tag->tag_footer;
+    delta.sizes[2] = 32;
+    delta.pieces[3] = tag->id3;
+    delta.sizes[3] = 128;
+    delta.count = length > tag->size ? 4 : 3;
+    
+    /* Compare in blocks, only comparing bytes of blocks that differ */
+    for (i=0; i < delta.count; position += delta.sizes[i++]) {
+        for (j=0; j < delta.sizes[i]; j += block) {
+            if (position+j >= old_length) {
+                if (ApeTag__delta_mark(tag, &delta, position+j, position+delta.sizes[i]) != 0) {
+                    return -1;
+                }
+                break;
+            }
+            block = delta.sizes[i] - j;
+            block = block < APE_DELTA_GAP ? block : APE_DELTA_GAP;
+            block = block < old_length - position - j ? block : old_length - position - j;
+            if (memcmp(delta.pieces[i]+j, old+position+j, block) == 0) {
+                continue;
+            }
+            for (k=j; k < j+block; k++) {
+                if (delta.pieces[i][k] != old[position+k] &&
+                    ApeTag__delta_mark(tag, &delta, position+k, position+k+1) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    if (ApeTag__delta_flush(tag, &delta) != 0) {
+        return -1;
+    }
+    
+    if (length != old_length) {
+        return ApeTag__truncate_tag(tag);
+    }
+    ApeTag__wrote_tag(tag);
+    
+    return 0;
+}
+
+/*
+Adds the changed bytes from start to end to the delta's run of changed
+bytes if they are close enough to it, otherwise writes the run and starts a
+new one with them.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__delta_mark(struct ApeTag *tag, struct ApeTag__delta *delta, uint32_t start, uint32_t end) {
+    if (delta->start == delta->end || start > delta->end + APE_DELTA_GAP) {
+        if (ApeTag__delta_flush(tag, delta) != 0) {
+            return -1;
+        }
+        delta->start = start;
+    }
+    delta->end = end;
+    
+    return 0;
+}
+
+/*
+Writes the delta's run of changed bytes, if any, and empties it.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__delta_flush(struct ApeTag *tag, struct ApeTag__delta *delta) {
+    uint32_t position = 0;
+    uint32_t start;
+    uint32_t end;
+    uint32_t i;
+    
+    for (i=0; i < delta->count && position < delta->end; position += delta->sizes[i++]) {
+        start = delta->start > position ? delta->start - position : 0;
+        end = delta->end - position < delta->sizes[i] ? delta->end - position : delta->sizes[i];
+        if (start < end && ApeTag__write(tag, delta->pieces[i]+start, end-start,
+                                         tag->offset+position+start) != 0) {
+            return -1;
+        }
+    }
+    delta->start = delta->end = 0;
+    
+    return 0;
+}
+
+/* Length of the APE and id3 tags ApeTag__write_tail writes. */
+static uint32_t ApeTag__write_length(struct ApeTag *tag) {
+    return tag->size + (tag->id3 != NULL && !(tag->flags & APE_NO_ID3) ? 128 : 0);
+}
+
+/*
+Starts a journaled update by appending the journal footer to the file,
+after where the journal's copy of the new tag will go.  The copy starts at
+the end of the file, or the end of the new tag if that is further, so
+neither writing the copy nor writing the new tag overwrites the other.
+
+The footer is written before the copy, so a crash before the copy is
+complete leaves a footer whose checksum doesn't match, and the update is
+rolled back by truncating the file to its old size.  Once the copy is
+complete, the update is rolled forward by writing the copy over the old
+tag.  Either is done by ApeTag__journal_recover when the tag is next read.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__journal_begin(struct ApeTag *tag) {
+    char footer[APE_JOURNAL_FOOTER_SIZE];
+    uint32_t fields[10];
+    uint32_t length = ApeTag__write_length(tag);
+    uint32_t checksum;
+    off_t file_size;
+    off_t footer_offset;
+    
+    if ((file_size = tag->io->size(tag->io_ctx)) == -1) {
+        tag->errcode = APETAG_FILEERR;
+        tag->error = "size";
+        return -1;
+    }
+    tag->journal_end = file_size;
+    tag->journal_start = file_size > tag->offset + length ? file_size : tag->offset + length;
+    footer_offset = (tag->journal_start + length + APE_JOURNAL_FOOTER_SIZE - 1) /
+                    APE_JOURNAL_FOOTER_SIZE * APE_JOURNAL_FOOTER_SIZE;
+    
+    checksum = ApeTag__fnv1a(2166136261U, tag->tag_header, 32);
+    checksum = ApeTag__fnv1a(checksum, tag->tag_data, tag->size-64);
+    checksum = ApeTag__fnv1a(checksum, tag->tag_footer, 32);
+    if (length > tag->size) {
+        checksum = ApeTag__fnv1a(checksum, tag->id3, 128);
+    }
+    
+    /* Version, tag length, checksum of the new tag, checksum of the rest of
+       the footer, then the old file size, tag offset, and copy offset */
+    fields[0] = H2LE32(APE_JOURNAL_VERSION);
+    fields[1] = H2LE32(length);
+    fields[2] = H2LE32(checksum);
+    fields[4] = H2LE32((uint32_t)((uint64_t)tag->journal_end & 0xffffffff));
+    fields[5] = H2LE32((uint32_t)((uint64_t)tag->journal_end >> 32));
+    fields[6] = H2LE32((uint32_t)((uint64_t)tag->offset & 0xffffffff));
+    fields[7] = H2LE32((uint32_t)((uint64_t)tag->offset >> 32));
+    fields[8] = H2LE32((uint32_t)((uint64_t)tag->journal_start & 0xffffffff));
+    fields[9] = H2LE32((uint32_t)((uint64_t)tag->journal_start >> 32));
+    memset(footer, 0, APE_JOURNAL_FOOTER_SIZE);
+    memcpy(footer, fields, sizeof(fields));
+    memcpy(footer+APE_JOURNAL_FOOTER_SIZE-8, APE_JOURNAL_MAGIC, 8);
+    fields[3] = H2LE32(ApeTag__fnv1a(2166136261U, footer+16, APE_JOURNAL_FOOTER_SIZE-16));
+    memcpy(footer+12, &fields[3], 4);
+    
+    return ApeTag__write(tag, footer, APE_JOURNAL_FOOTER_SIZE, footer_offset);
+}
+
+/* Writes the journal's copy of the new tag. */
+static int ApeTag__journal_copy(struct ApeTag *tag) {
+    return ApeTag__write_tail(tag, tag->journal_start);
+}
+
+/* Writes the new tag over the old tag, once the journal's copy is complete. */
+static int ApeTag__journal_apply(struct ApeTag *tag) {
+    return ApeTag__write_tail(tag, tag->offset);
+}
+
+/* Whether the data read from the end of the file ends with a journal footer. */
+static int ApeTag__is_journal(const char *tail_end) {
+    return memcmp(tail_end - 8, APE_JOURNAL_MAGIC, 8) == 0;
+}
+
+/*
+Finishes an interrupted journaled update of a file that ends with a journal
+footer, rolling it forward if the journal's copy of the new tag is complete,
+and back otherwise, and sets file_size to the file's new size.  Files that
+only look like they end with a journal footer are left as they are.
+
+Read-only files are not changed, and are instead read as if the update had
+been finished: file_size is set to the size the file would have, and if
+the update would be rolled forward, view_shift is set so the tags are read
+from the journal's copy.
+
+Returns 1 if the update was finished or is being viewed, 0 if the file
+doesn't end with a journal footer, and -1 on error.
+*/
+static int ApeTag__journal_recover(struct ApeTag *tag, off_t *file_size) {
+    char footer[APE_JOURNAL_FOOTER_SIZE];
+    uint32_t fields[10];
+    uint32_t length;
+    uint64_t old_end;
+    uint64_t offset;
+    uint64_t start;
+    char *copy;
+    int complete;
+    int fd;
+    
+    if (*file_size < APE_MINIMUM_TAG_SIZE + APE_JOURNAL_FOOTER_SIZE) {
+        return 0;
+    }
+    if (ApeTag__read(tag, footer, APE_JOURNAL_FOOTER_SIZE, *file_size - APE_JOURNAL_FOOTER_SIZE) != 0) {
+        return -1;
+    }
+    memcpy(fields, footer, sizeof(fields));
+    length = LE2H32(fields[1]);
+    old_end = (uint64_t)LE2H32(fields[4]) | (uint64_t)LE2H32(fields[5]) << 32;
+    offset = (uint64_t)LE2H32(fields[6]) | (uint64_t)LE2H32(fields[7]) << 32;
+    start = (uint64_t)LE2H32(fields[8]) | (uint64_t)LE2H32(fields[9]) << 32;
+    if (!ApeTag__is_journal(footer + APE_JOURNAL_FOOTER_SIZE) ||
+        LE2H32(fields[0]) != APE_JOURNAL_VERSION ||
+        LE2H32(fields[3]) != ApeTag__fnv1a(2166136261U, footer+16, APE_JOURNAL_FOOTER_SIZE-16) ||
+        length < APE_MINIMUM_TAG_SIZE || length > APE_MAXIMUM_TAG_SIZE + 128 ||
+        offset > old_end || start < old_end || start < offset + length ||
+        start + length > (uint64_t)*file_size - APE_JOURNAL_FOOTER_SIZE) {
+        return 0;
+    }
+    
+    if ((copy = ApeTag__malloc(tag, length)) == NULL) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "malloc";
+        return -1;
+    }
+    if (ApeTag__read(tag, copy, length, (off_t)start) != 0) {
+        ApeTag__free(tag, copy);
+        return -1;
+    }
+    
+    complete = ApeTag__fnv1a(2166136261U, copy, length) == LE2H32(fields[2]);
+    if (ApeTag__read_only(tag)) {
+        ApeTag__free(tag, copy);
+        if (complete) {
+            tag->view_shift = (off_t)(start - offset);
+            old_end = offset + length;
+        }
+        tag->flags |= APE_JOURNAL_VIEW;
+        *file_size = (off_t)old_end;
+        return 1;
+    }
+    
+    /* The copy must be written before the journal is removed */
+    if (complete) {
+        if (ApeTag__write(tag, copy, length, (off_t)offset) != 0) {
+            ApeTag__free(tag, copy);
+            return -1;
+        }
+        if ((fd = ApeTag__fileno(tag)) >= 0) {
+            fsync(fd);
+        }
+        old_end = offset + length;
+    }
+    ApeTag__free(tag, copy);
+    if (ApeTag__truncate(tag, (off_t)old_end) != 0) {
+        return -1;
+    }
+    if ((fd = ApeTag__fileno(tag)) >= 0) {
+        fsync(fd);
+    }
+    *file_size = (off_t)old_end;
+    
+    return 1;
+}
+
+/*
+Whether the tag's file can't be written, either because the I/O backend
+doesn't support writing or the file descriptor was opened read-only.
+*/
+static int ApeTag__read_only(struct ApeTag *tag) {
+    int fd;
+    
+    if (tag->io->write == NULL || tag->io->truncate == NULL) {
+        return 1;
+    }
+    return (fd = ApeTag__fileno(tag)) >= 0 && (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY;
+}
+
+/*
+Flushes any buffered writes to the file descriptor of the tag's file, for
+the stdio and file descriptor backends.
+
+Returns the file descriptor, or -1 if it is not known or flushing failed.
+*/
+static int ApeTag__fileno(struct ApeTag *tag) {
+    if (tag->io == &ApeTag_stdio_io) {
+        return fflush(tag->io_ctx) == 0 ? fileno(tag->io_ctx) : -1;
+    } else if (tag->io == &ApeTag_fd_io) {
+        return *(int *)tag->io_ctx;
+    }
+    return -1;
+}
+
+/*
+Makes sure everything written to the tag's file so far is on disk.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__sync(struct ApeTag *tag) {
+    int fd;
+    
+    if ((fd = ApeTag__fileno(tag)) < 0 || fsync(fd) != 0) {
+        tag->errcode = APETAG_FILEERR;
+        tag->error = "fsync";
+        return -1;
+    }
+    return 0;
+}
+
+/*
+Makes sure everything written to the files of the group's members that
+haven't failed is on disk.  Where syncfs is available, it is called once for
+each filesystem instead of calling fsync for each file.  The members must be
+sorted by device.
+
+Returns 0 if all members were synced, -1 if any failed.
+*/
+static int ApeTag__group_sync(struct ApeTag_group *group) {
+    struct ApeTag__group_member *member;
+    size_t i;
+    int ret = 0;
+#ifdef HAVE_SYNCFS
+    size_t j;
+    
+    for (i=0; i < group->count; i = j) {
+        /* Flush all files on the device, then sync the device */
+        for (j=i; j < group->count && group->members[j].dev == group->members[i].dev; j++) {
+            member = &group->members[j];
+            if (!member->failed && ApeTag__fileno(member->tag) < 0) {
+                member->tag->errcode = APETAG_FILEERR;
+                member->tag->error = "fflush";
+                member->failed = 1;
+                ret = -1;
+            }
+        }
+        for (; i < j; i++) {
+            member = &group->members[i];
+            if (!member->failed) {
+                if (syncfs(ApeTag__fileno(member->tag)) == 0) {
+                    break;
+                }
+                member->tag->errcode = APETAG_FILEERR;
+                member->tag->error = "syncfs";
+                member->failed = 1;
+                ret = -1;
+            }
+        }
+    }
+#else
+    for (i=0; i < group->count; i++) {
+        member = &group->members[i];
+        if (!member->failed && ApeTag__sync(member->tag) != 0) {
+            member->failed = 1;
+            ret = -1;
+        }
+    }
+#endif
+    
+    return ret;
+}
+
+/*
+Calls the given step of a journaled update for each member of the group
+that hasn't failed, marking the members it fails for as failed.
+
+Returns 0 if the step succeeded for all members, -1 if any failed.
+*/
+static int ApeTag__group_phase(struct ApeTag_group *group, int phase(struct ApeTag *tag)) {
+    struct ApeTag__group_member *member;
+    size_t i;
+    int ret = 0;
+    
+    for (i=0; i < group->count; i++) {
+        member = &group->members[i];
+        if (!member->failed && ApeTag__timed(member->tag, phase, APE_STAT_PTR(member->tag, write_tag_ns)) != 0) {
+            member->failed = 1;
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/*
+Compares two struct ApeTag__group_member by device.
+
+Returns <0, 0, or >0 if the first device sorts before, the same as, or
+after the second.
+*/
+static int ApeTag__group_compare(const void *a, const void *b) {
+    dev_t dev_a = ((const struct ApeTag__group_member *)a)->dev;
+    dev_t dev_b = ((const struct ApeTag__group_member *)b)->dev;
+    
+    return dev_a < dev_b ? -1 : dev_a > dev_b;
+}
+
+/*
+Copies length bytes of the source's file from the start of its tags to the
+destination's file at the start of its tags with copy_file_range, so the
+data isn't copied through user space and may be shared on filesystems that
+support it.  The destination must use the file descriptor backend, as
+writing behind a stdio stream's back could leave it with stale buffers.
+
+Returns 0 on success, 1 if the bytes couldn't be copied this way, so they
+should be written from the source's tag buffers instead.
+*/
+static int ApeTag__copy_range(struct ApeTag *src, struct ApeTag *dst, uint32_t length) {
+#ifdef HAVE_COPY_FILE_RANGE
+    off_t in = src->offset + src->view_shift;
+    off_t out = dst->offset;
+    uint32_t done = 0;
+    ssize_t ret;
+    int src_fd;
+    
+    if (dst->io != &ApeTag_fd_io || (src_fd = ApeTag__fileno(src)) < 0) {
+        return 1;
+    }
+    while (done < length) {
+        if ((ret = copy_file_range(src_fd, &in, *(int *)dst->io_ctx, &out, length - done, 0)) <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            /* Unsupported between these files, or the source changed */
+            return 1;
+        }
+        done += (uint32_t)ret;
+        APE_STAT_ADD(dst, writes, 1);
+        APE_STAT_ADD(dst, bytes_written, (uint64_t)ret);
+    }
+    
+    return 0;
+#else
+    (void)src;
+    (void)dst;
+    (void)length;
+    return 1;
+#endif
+}
+
+/*
+Finishes the journaled updates of the group's members after the journals
+were started, doing the same steps as ApeTag_update_atomic, but doing each
+step for every file before syncing if sync is set.
+
+Returns 0 if the updates succeeded for all members, -1 if any failed.
+*/
+static int ApeTag__group_journal(struct ApeTag_group *group, int sync) {
+    if (sync) {
+        qsort(group->members, group->count, sizeof(struct ApeTag__group_member), ApeTag__group_compare);
+    }
+    if ((sync && ApeTag__group_sync(group) != 0) ||
+        ApeTag__group_phase(group, ApeTag__journal_copy) != 0 ||
+        (sync && ApeTag__group_sync(group) != 0) ||
+        ApeTag__group_phase(group, ApeTag__journal_apply) != 0 ||
+        (sync && ApeTag__group_sync(group) != 0) ||
+        ApeTag__group_phase(group, ApeTag__truncate_tag) != 0 ||
+        (sync && ApeTag__group_sync(group) != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef APE_URING
+/*
+Writes the tails of the group's members that use the file descriptor
+backend and haven't failed, submitting the writes to an io_uring so a batch
+of files is written with one system call.  Members whose tails were written
+completely are marked as written.  Others, including all members if the
+kernel doesn't support io_uring, are left to be written by the backend,
+which also reports any error.
+
+If io_uring_enter fails, nothing more is submitted, but the writes the
+kernel already took are still waited for, as they could otherwise land
+after the backend rewrites, truncates, or syncs the file.  If waiting fails
+too, the members with writes in flight are marked as failed.
+*/
+static void ApeTag__group_uring(struct ApeTag_group *group) {
+    struct ApeTag__uring ring;
+    struct ApeTag__group_member *member;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct iovec *iov;
+    struct ApeTag *tag;
+    size_t i = 0;
+    unsigned in_flight = 0;
+    unsigned unsubmitted = 0;
+    int stopped = 0;
+    int lost = 0;
+    unsigned head;
+    unsigned tail;
+    unsigned index;
+    
+    for (i = 0; i < group->count; i++) {
+        if (!group->members[i].failed && group->members[i].tag->io == &ApeTag_fd_io) {
+            break;
+        }
+    }
+    if (i == group->count) {
+        return;
+    }
+    i = 0;
+    if ((iov = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, group->count * 4 * sizeof(struct iovec))) == NULL) {
+        return;
+    }
+    if (ApeTag__uring_init(&ring, APE_URING_ENTRIES) != 0) {
+        APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, iov);
+        return;
+    }
+    
+    while (i < group->count || in_flight > unsubmitted) {
+        /* Queue writes while fewer are in flight than the submission ring
+           holds, which the completion ring always has room for */
+        tail = *ring.sq_tail;
+        for (; i < group->count && in_flight < ring.entries; i++) {
+            member = &group->members[i];
+            tag = member->tag;
+            if (member->failed || tag->io != &ApeTag_fd_io) {
+                continue;
+            }
+            iov[4*i].iov_base = tag->tag_header;
+            iov[4*i].iov_len = 32;
+            iov[4*i+1].iov_base = tag->tag_data;
+            iov[4*i+1].iov_len = tag->size - 64;
+            iov[4*i+2].iov_base = tag->tag_footer;
+            iov[4*i+2].iov_len = 32;
+            iov[4*i+3].iov_base = tag->id3;
+            iov[4*i+3].iov_len = 128;
+            
+            index = tail & *ring.sq_mask;
+            sqe = &ring.sqes[index];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = *(int *)tag->io_ctx;
+            sqe->addr = (uint64_t)(uintptr_t)&iov[4*i];
+            sqe->len = ApeTag__write_length(tag) > tag->size ? 4 : 3;
+            sqe->off = (uint64_t)tag->offset;
+            sqe->user_data = i;
+            ring.sq_array[index] = index;
+            member->queued = 1;
+            tail++;
+            in_flight++;
+        }
+        APE_STORE_RELEASE(ring.sq_tail, tail);
+        
+        /* Only members left that can't be written with the ring */
+        if (in_flight == 0) {
+            break;
+        }
+        if (syscall(__NR_io_uring_enter, ring.fd, stopped ? 0 : tail - APE_LOAD_ACQUIRE(ring.sq_head), 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            if (stopped) {
+                lost = 1;
+                break;
+            }
+            /* Writes the kernel didn't take never complete, and are left
+               to the backend along with the members not yet queued */
+            stopped = 1;
+            i = group->count;
+            unsubmitted = tail - APE_LOAD_ACQUIRE(ring.sq_head);
+        }
+        for (head = *ring.cq_head; head != APE_LOAD_ACQUIRE(ring.cq_tail); head++) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            member = &group->members[cqe->user_data];
+            if (cqe->res >= 0 && (uint32_t)cqe->res == ApeTag__write_length(member->tag)) {
+                member->written = 1;
+                APE_STAT_ADD(member->tag, writes, 1);
+                APE_STAT_ADD(member->tag, bytes_written, (uint32_t)cqe->res);
+            }
+            member->queued = 0;
+            in_flight--;
+        }
+        APE_STORE_RELEASE(ring.cq_head, head);
+    }
+    
+    for (i = 0; i < group->count; i++) {
+        member = &group->members[i];
+        if (member->queued && lost) {
+            member->failed = 1;
+            member->tag->errcode = APETAG_FILEERR;
+            member->tag->error = "io_uring_enter";
+        }
+        member->queued = 0;
+    }
+    ApeTag__uring_free(&ring);
+    APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, iov);
+}
+
+/*
+Sets up an io_uring with at least the given number of entries, and maps its
+rings.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__uring_init(struct ApeTag__uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    char *sq;
+    char *cq;
+    
+    memset(ring, 0, sizeof(struct ApeTag__uring));
+    memset(&params, 0, sizeof(struct io_uring_params));
+    ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+    if ((ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+        return -1;
+    }
+    
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if ((ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                              ring->fd, IORING_OFF_SQ_RING)) == MAP_FAILED ||
+        (ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                              ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED ||
+        (ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           ring->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        ApeTag__uring_free(ring);
+        return -1;
+    }
+    
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    
+    return 0;
+}
+
+/* Unmaps the rings of an io_uring and closes it. */
+static void ApeTag__uring_free(struct ApeTag__uring *ring) {
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+}
+#endif
+
+/*
+Allocates the tag header and footer buffers if they haven't been allocated,
+and makes sure the tag data buffer can hold data_size bytes.  Existing buffers
+are reused, so a tag reused with ApeTag_reset doesn't reallocate them for
+each file.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__alloc_buffers(struct ApeTag *tag, uint32_t data_size) {
+    if (tag->tag_header == NULL && (tag->tag_header = ApeTag__malloc(tag, 32)) == NULL) {
+        goto alloc_buffers_error;
+    }
+    if (tag->tag_footer == NULL && (tag->tag_footer = ApeTag__malloc(tag, 32)) == NULL) {
+        goto alloc_buffers_error;
+    }
+    if (tag->tag_data == NULL || tag->data_capacity < data_size) {
+        ApeTag__free(tag, tag->tag_data);
+        tag->data_capacity = 0;
+        /* Always allocate something, as the tag data is expected to be non-NULL */
+        if ((tag->tag_data = ApeTag__malloc(tag, data_size > 0 ? data_size : 1)) == NULL) {
+            goto alloc_buffers_error;
+        }
+        tag->data_capacity = data_size;
+    }
+    return 0;
+
+    alloc_buffers_error:
+    tag->errcode = APETAG_MEMERR;
+    tag->error = "malloc";
+    return -1;
+}
+
+/*
+Frees all items in the database and removes them from it, leaving the
+database open so it can be reused.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__empty_items(struct ApeTag *tag) {
+    DBT key_dbt, value_dbt;
+    
+    if (tag->items != NULL) {
+        while (tag->items->seq(tag->items, &key_dbt, &value_dbt, R_FIRST) == 0) {
+            ApeItem__free(tag, (struct ApeItem **)(value_dbt.data));
+            if (tag->items->del(tag->items, &key_dbt, R_CURSOR) != 0) {
+                tag->errcode = APETAG_INTERNALERR;
+                tag->error = "db->del";
+                return -1;
+            }
+        }
+    }
+    
+    tag->flags &= ~APE_CHECKED_FIELDS;
+    tag->item_count = 0;
+    return 0;
+}
+
+/*
+Frees the items and releases everything tied to the tag's file, closing
+its file descriptor if the tag owns it, then clears the tag's state so it
+can be used for another file with the given flags, for the ApeTag_reset
+functions.  The item database and the header, footer, and data buffers are
+kept for the next file.  The caller sets the tag's I/O backend.
+
+Returns 0 on success, 1 if the tag was reset but closing the old file
+descriptor failed, and -1 if the tag couldn't be reset.
+*/
+static int ApeTag__reset(struct ApeTag *tag, uint32_t flags) {
+    int ret = 0;
+    
+    /* Free the items but keep the database for the next file */
+    if (ApeTag__empty_items(tag) != 0) {
+        return -1;
+    }
+    ApeTag__flush_stats(tag);
+    
+    /* Release anything tied to the previous file */
+    ApeTag__free(tag, tag->id3);
+    tag->id3 = NULL;
+    ApeTag__global_free(tag->owned_io_ctx);
+    tag->owned_io_ctx = NULL;
+    if (tag->flags & APE_CLOSE_FD && close(tag->fd) != 0) {
+        ret = 1;
+    }
+    
+    tag->file = NULL;
+    tag->fd = 0;
+    tag->error = NULL;
+    tag->errcode = APETAG_NOERR;
+    tag->flags = flags | APE_DEFAULT_FLAGS;
+    tag->size = 0;
+    tag->file_item_count = 0;
+    tag->offset = 0;
+    
+    if (ret != 0) {
+        tag->errcode = APETAG_FILEERR;
+        tag->error = "close";
+    }
+    return ret;
+}
+
+/*
+Opens an existing file for ApeTag_open and ApeTag_reset_open, closing it
+on exec, and without updating its access time where that is permitted.
+
+Returns the file descriptor, or -1 and sets errno on error.
+*/
+static int ApeTag__open_path(const char *path, int oflag) {
+    int fd = -1;
+    
+    /* No mode is passed to open, so files can't be created */
+    if (path == NULL || (oflag & O_CREAT)) {
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef O_TMPFILE
+    if ((oflag & O_TMPFILE) == O_TMPFILE) {
+        errno = EINVAL;
+        return -1;
+    }
+#endif
+    
+#ifdef O_CLOEXEC
+    oflag |= O_CLOEXEC;
+#endif
+#ifdef O_NOATIME
+    /* O_NOATIME is only permitted for the file's owner, so retry without it */
+    if ((fd = open(path, oflag | O_NOATIME)) == -1 && errno != EPERM) {
+        return -1;
+    }
+#endif
+    if (fd == -1) {
+        fd = open(path, oflag);
+    }
+    
+    return fd;
+}
+
+/*
+Makes the tag use the file descriptor backend for fd.  The tag is read from
+the end of the file, so the kernel is told to start reading it in.
+*/
+static void ApeTag__use_fd(struct ApeTag *tag, int fd) {
+    struct stat sb;
+    
+    tag->io = &ApeTag_fd_io;
+    tag->fd = fd;
+    tag->io_ctx = &tag->fd;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+        ApeTag__fadvise(tag, sb.st_size > APE_TAIL_WINDOW ? sb.st_size - APE_TAIL_WINDOW : 0, 
+                        0, APE_FADV_WILLNEED);
+    }
+}
+
+/*
+Frees an struct ApeItem and it's key and value, given a pointer to a pointer to it.
+*/
+static void ApeItem__free(struct ApeTag *tag, struct ApeItem **item) {
+    assert(item != NULL);
+    if (*item == NULL) {
+        return;
+    }
+    
+    ApeTag__free(tag, (*item)->key);
+    (*item)->key = NULL;
+    ApeTag__free(tag, (*item)->value);
+    (*item)->value = NULL;
+    ApeTag__free(tag, *item);
+    *item = NULL;
+}
+
+/*
+Allocates space for a copy of src, copies src to the newly allocated space
+(for the given number of bytes), and converts the copy to lower case.  Size is
+an unsigned char because keys cannot be more than 256 bytes (including
+terminator).
+
+The caller is responsible for freeing the returned pointer.
+
+Returns pointer to copy on success, NULL pointer on error.
+*/
+static char* ApeTag__strcasecpy(struct ApeTag *tag, const char *src, size_t size) {
+    char *c, *dest;
+    
+    assert(src != NULL);
+    
+    if ((dest = ApeTag__malloc(tag, size)) == NULL) {
+        return NULL;
+    }
+    
+    memcpy(dest, src, size);
+    for (c = dest; size > 0; size--, c++) {
+        if (*c >= 'A' && *c <= 'Z') {
+            *c |= 0x20;
+        }
+    } 
+    
+    return dest;
+}
+
+/*
+This is a very simple atoi-like function that takes the size of the string, and
+a character pointer.  If the character pointer is a string between "0" and
+"255", the unsigned char equivalent is returned; otherwise, 0 is returned.
+
+Returns unsigned char.
+*/
+static unsigned char ApeItem__parse_track(uint32_t size, char *value) {
+    assert(value != NULL);
+    
+    if (size != 0 && size < 4) {
+        if (size == 3) {
+            if (*(value) >= '0' && *(value) <= '2' && 
+               *(value+1) >= '0' && *(value+1) <= '9' &&
+               *(value+2) >= '0' && *(value+2) <= '9') {
+                if (*(value) == '2' && ((*(value+1) > '5') ||
+                   (*(value+1) == '5' && *(value+2) > '5'))) {
+                    /* 3 digit number > 255 won't fit in a char */
+                    return 0;
+                }
+                return (unsigned char)(100 * (*(value) & ~0x30) + 
+                       (10 * (*(value+1) & ~0x30)) + 
+                       (*(value+2) & ~0x30));                        
+            }
+        } else if (size == 2) {
+            if (*(value) >= '0' && *(value) <= '9' && 
+               *(value+1) >= '0' && *(value+1) <= '9') {
+                return (unsigned char)(10 * (*(value) & ~0x30) + 
+                       (*(value+1) & ~0x30));
+            }
+        } else if (size == 1) {
+            if (*(value) >= '0' && *(value) <= '9') {
+                 return (unsigned char)(*(value) & ~0x30);
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+Checks the given struct ApeItem for validity (checking flags, key, and value).
+
+Returns 0 if valid, <0 otherwise.
+*/
+static int ApeItem__check_validity(struct ApeTag *tag, struct ApeItem *item) {
+    unsigned long key_length;
+    char *key_end;
+    char *c;
+    
+    assert(tag != NULL);
+    assert(item != NULL);
+    assert(item->key != NULL);
+    assert(item->value != NULL);
+    
+    /* Check valid flags */
+    if (item->flags > 7) {
+        tag->errcode = APETAG_INVALIDITEM;
+        tag->error = "invalid item flags";
+        return -1;
+    }
+    
+    /* Check valid key */
+    key_length = strlen(item->key);
+    key_end = item->key + (long)key_length;
+    if (key_length < 2) {
+        tag->errcode = APETAG_INVALIDITEM;
+        tag->error = "invalid item key (too short)";
+        return -1;
+    }
+    if (key_length > 255) {
+        tag->errcode = APETAG_INVALIDITEM;
+        tag->error = "invalid item key (too long)";
+        return -1;
+    }
+    if (key_length == 3 ? ApeTag__strncasecmp(item->key, "id3", 3) == 0 || 
+                         ApeTag__strncasecmp(item->key, "tag", 3) == 0 || 
+                         ApeTag__strncasecmp(item->key, "mp+", 3) == 0
+       : (key_length == 4 ? ApeTag__strncasecmp(item->key, "oggs", 4) == 0 : 0)) {
+        tag->errcode = APETAG_INVALIDITEM;
+        tag->error = "invalid item key (id3|tag|mp+|oggs)";
+        return -1;
+    }
+    for (c=item->key; c<key_end; c++) {
+        if ((unsigned char)(*c) < 0x20 || (unsigned char)(*c) > 0x7f) {
+            tag->errcode = APETAG_INVALIDITEM;
+            tag->error = "invalid item key character";
+            return -1;
+        }
+    }
+    
+    /* Check value is utf-8 if flags specify utf8 or external format*/
+    if (((item->flags & APE_ITEM_TYPE_FLAGS) & APE_ITEM_BINARY) == 0 && 
+        ApeTag__check_valid_utf8((unsigned char *)(item->value), item->size) != 0) {
+        tag->errcode = APETAG_INVALIDITEM;
+        tag->error = "invalid utf8 value";
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+Checks the given UTF8 string for validity.
+
+Returns 0 if valid, -1 if not.
+*/
+static int ApeTag__check_valid_utf8(unsigned char *utf8_string, uint32_t size) {
+    unsigned char *utf_last_char;
+    unsigned char *c = utf8_string;
+    
+    assert(utf8_string != NULL);
+    
+    for (; c < (utf8_string + size); c++) {
+        if ((*c & 128) != 0) {
+            /* Non ASCII */
+            if ((*c < 194) || (*c > 245)) {
+                /* Outside of UTF8 Range */
+                return -1;
+            }
+            if ((*c & 224) == 192) {
+                /* 2 byte UTF8 char */
+                utf_last_char = c + 1;
+            } else if ((*c & 240) == 224) {
+                /* 3 byte UTF8 char */
+                utf_last_char = c + 2;
+            } else if ((*c & 248) == 240) {
+                /* 4 byte UTF8 char */
+                utf_last_char = c + 3;
+            } else {
+                return -1;
+            }
+            
+            if (utf_last_char >= (utf8_string + size)) {
+                return -1;
+            }
+            /* Check remaining bytes of character */
+            for (; c + 1 <= utf_last_char;) {
+                c++;
+                if ((*c & 192) != 128) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* 
+Comparison function for quicksort.  Sorts first based on size and secondly
+based on key.  No two items have the same key, so this is a total order and
+re-sorting unchanged items always gives the same array, even though qsort is
+not stable.  Sorted cursors depend on that, as they walk the same array that
+ApeTag_serialize and ApeTag_update sort.
+
+Returns -1 or 1.  Could possibly return 0 if the database has been manually
+modified (don't do that!).
+*/
+static int ApeItem__compare(const void *a, const void *b) {
+    const struct ApeItem *ai_a = *(const struct ApeItem * const *)a;
+    const struct ApeItem *ai_b = *(const struct ApeItem * const *)b;
+    uint32_t size_a;
+    uint32_t size_b;
+    
+    size_a = ai_a->size + (uint32_t)strlen(ai_a->key);
+    size_b = ai_b->size + (uint32_t)strlen(ai_b->key);
+    if (size_a < size_b) {
+        return -1;
+    }
+    if (size_a > size_b) {
+        return 1;
+    }
+    return strcmp(ai_a->key, ai_b->key);
+}
+
+/*
+Looks up a genre for the correct ID3 genre code.  The genre string is passed
+in as the ApeItem's value, and pointer to the genre code is passed.  The ApeItem's
+size should not include a terminator for the value, as the entries in the genre
+database are not terminated.
+
+Returns 0 on success, -1 on error;
+*/
+static int ApeTag__lookup_genre(struct ApeTag *tag, struct ApeItem *item, unsigned char *genre_id) {
+    int ret = 0;
+    DBT key_dbt, value_dbt;
+
+    key_dbt.size = item->size;
+    key_dbt.data = item->value;
+    
+    if (ApeTag__load_ID3_GENRES(tag) != 0) {
+        return -1;
+    }
+    
+    ret = ID3_GENRES->get(ID3_GENRES, &key_dbt, &value_dbt, 0);
+    if (ret != 0) {
+        if (ret == -1) {
+            tag->errcode = APETAG_INTERNALERR;
+            tag->error = "db->get";
+            return -1;
+        }
+        *genre_id = '\377';
+    } else {
+        *genre_id = *(unsigned char *)(value_dbt.data);
+    }
+    
+    return 0;
+}
+
+/*
+Loads the ID3_GENRES global database with all 148 ID3 genres (including the 
+Winamp extensions).  This has a possible race condition in multi-threaded
+code, since it modifies a global variable, but the worst case scenario is
+minor memory leakage, and the window for the race condition is very small,
+since it can only occur if ID3_GENRES has not yet been initialized.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__load_ID3_GENRES(struct ApeTag *tag) {
+    DB* genres;
+    DBT key_dbt, value_dbt;
+    value_dbt.size = 1;
+    
+    assert(tag != NULL);
+    
+    if (ID3_GENRES != NULL) {
+        return 0;
+    }
+
+    if ((ID3_GENRES = genres = dbopen(NULL, O_RDWR|O_CREAT, 0777, DB_HASH, NULL)) == NULL) {
+        tag->errcode = APETAG_INTERNALERR;
+        tag->error = "dbopen";
+        return -1;
+    }
+    
+    #define ADD_TO_ID3_GENRES(GENRE, VALUE) do { \
+        key_dbt.data = (GENRE); \
+        key_dbt.size = strlen(GENRE); \
+        value_dbt.data = (VALUE); \
+        if (genres->put(genres, &key_dbt, &value_dbt, 0) == -1) { \
+            tag->errcode = APETAG_INTERNALERR; \
+            tag->error = "db->put"; \
+            goto load_genres_error; \
+        } \
+    } while (0)
+    
+
+    ADD_TO_ID3_GENRES("Blues", "\0");
+    ADD_TO_ID3_GENRES("Classic Rock", "\1");
+    ADD_TO_ID3_GENRES("Country", "\2");
+    ADD_TO_ID3_GENRES("Dance", "\3");
+    ADD_TO_ID3_GENRES("Disco", "\4");
+    ADD_TO_ID3_GENRES("Funk", "\5");
+    ADD_TO_ID3_GENRES("Grunge", "\6");
+    ADD_TO_ID3_GENRES("Hip-Hop", "\7");
+    ADD_TO_ID3_GENRES("Jazz", "\10");
+    ADD_TO_ID3_GENRES("Metal", "\11");
+    ADD_TO_ID3_GENRES("New Age", "\12");
+    ADD_TO_ID3_GENRES("Oldies", "\13");
+    ADD_TO_ID3_GENRES("Other", "\14");
+    ADD_TO_ID3_GENRES("Pop", "\15");
+    ADD_TO_ID3_GENRES("R & B", "\16");
+    ADD_TO_ID3_GENRES("Rap", "\17");
     ADD_TO_ID3_GENRES("Reggae", "\20");
     ADD_TO_ID3_GENRES("Rock", "\21");
     ADD_TO_ID3_GENRES("Techno", "\22");
@@ -1591,186 +4716,1365 @@ static int ApeTag__load_ID3_GENRES(struct ApeTag *tag) {
     ADD_TO_ID3_GENRES("Jpop", "\222");
     ADD_TO_ID3_GENRES("Synthpop", "\223");
     
-    #undef ADD_TO_ID3_GENRES
-
+    #undef ADD_TO_ID3_GENRES
+
+    return 0;
+    
+    load_genres_error:
+    if (genres != NULL){
+        if (genres->close(genres) == -1) {
+            tag->errcode = APETAG_INTERNALERR;
+            tag->error = "db->close";
+        }
+        genres = NULL;
+    }
+    return -1;
+}
+
+static uint32_t ApeTag__tag_length(struct ApeTag *tag) {
+    return tag->size + ApeTag__id3_length(tag);
+}
+
+static uint32_t ApeTag__id3_length(struct ApeTag *tag) {
+    if ((tag->flags & APE_HAS_ID3) && !(tag->flags & APE_NO_ID3)) {
+        return 128;
+    }
+    return 0;
+}
+
+/*
+Whether an id3 tag should be written when the tag is updated.  An id3 tag is
+not written if the APE_NO_ID3 flag is used or the file already has an ape
+tag but no id3 tag.
+*/
+static int ApeTag__writes_id3(struct ApeTag *tag) {
+    return !(tag->flags & APE_NO_ID3 || 
+            (tag->flags & APE_HAS_APE && !(tag->flags & APE_HAS_ID3)));
+}
+
+/* 
+Return an ApeItem * corresponding to the passed key, which the caller should not free.
+
+The caller is expected to have checked that tag->items is not NULL.
+
+Returns NULL on error.
+*/
+static struct ApeItem * ApeTag__get_item(struct ApeTag *tag, const char *key) {
+    int ret = 0;
+    DBT key_dbt, value_dbt;
+
+    if (tag->items == NULL) {
+        tag->errcode = APETAG_NOTPRESENT;
+        tag->error = "get_item"; 
+        return NULL; 
+    }
+
+    key_dbt.size = strlen(key) + 1; 
+    if (key_dbt.size > 256) {
+        tag->errcode = APETAG_ARGERR;
+        tag->error = "key is greater than 255 characters";
+        return NULL;
+    }
+    if ((key_dbt.data = ApeTag__strcasecpy(tag, key, (unsigned char)key_dbt.size)) == NULL) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "malloc";
+        return NULL;
+    }
+
+    ret = tag->items->get(tag->items, &key_dbt, &value_dbt, 0);
+    ApeTag__free(tag, key_dbt.data);
+    if (ret == -1) { 
+        tag->errcode = APETAG_INTERNALERR;
+        tag->error = "db->get"; 
+        return NULL; 
+    } else if (ret != 0) { 
+        tag->errcode = APETAG_NOTPRESENT;
+        tag->error = "get_item"; 
+        return NULL; 
+    } else {
+        return *(struct ApeItem **)(value_dbt.data);
+    } 
+}
+
+/* 
+Return an array of ApeItem * for all items in the tag database,
+which the caller is responsible for freeing.
+
+Returns NULL on error.
+*/
+static struct ApeItem ** ApeTag__get_items(struct ApeTag *tag, uint32_t *num_items) {
+    uint32_t nitems = tag->item_count;
+    struct ApeItem **is;
+
+    if (num_items) {
+        *num_items = 0;
+    }
+
+    if ((is = ApeTag__malloc(tag, (nitems + 1) * sizeof(struct ApeItem *))) == NULL) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "malloc";
+        return NULL;
+    }
+
+    if (nitems > 0) {
+        memcpy(is, tag->item_order, nitems * sizeof(struct ApeItem *));
+    }
+    is[nitems] = NULL;
+
+    if (num_items) {
+        *num_items = nitems;
+    }
+
+    return is;
+}
+
+/* 
+Iterate over all items in the database, calling the iterator function
+with the given tag, the current item, and the given data pointer.
+
+Returns 0 if iteration completes successfully, 1 if iteration is stopped
+early, -1 on error.
+*/
+static int ApeTag__iter_items(struct ApeTag *tag, int iterator(struct ApeTag *tag, struct ApeItem *item, void *data), void *data) {
+    uint32_t i;
+
+    for (i=0; i < tag->item_count; i++) {
+        if (iterator(tag, tag->item_order[i], data) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+Makes sure the item order arrays have room for count items, growing them
+geometrically so adding items one at a time doesn't reallocate every time.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__reserve_items(struct ApeTag *tag, uint32_t count) {
+    uint32_t capacity;
+    struct ApeItem **order;
+    struct ApeItem **sorted;
+
+    if (count <= tag->item_capacity) {
+        return 0;
+    }
+
+    for (capacity = tag->item_capacity ? tag->item_capacity : 16; capacity < count; capacity *= 2) {
+        /* Left Blank */
+    }
+
+    if ((order = ApeTag__realloc(tag, tag->item_order, capacity * sizeof(struct ApeItem *))) == NULL) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "realloc";
+        return -1;
+    }
+    tag->item_order = order;
+    if ((sorted = ApeTag__realloc(tag, tag->sorted_items, capacity * sizeof(struct ApeItem *))) == NULL) {
+        tag->errcode = APETAG_MEMERR;
+        tag->error = "realloc";
+        return -1;
+    }
+    tag->sorted_items = sorted;
+    tag->item_capacity = capacity;
+
+    return 0;
+}
+
+/*
+Removes the given item from the item order array, keeping the order of the
+remaining items.
+*/
+static void ApeTag__unorder_item(struct ApeTag *tag, struct ApeItem *item) {
+    uint32_t i;
+
+    for (i=0; i < tag->item_count; i++) {
+        if (tag->item_order[i] == item) {
+            memmove(tag->item_order + i, tag->item_order + i + 1, 
+                    (tag->item_count - i - 1) * sizeof(struct ApeItem *));
+            tag->item_count--;
+            return;
+        }
+    }
+}
+
+/*
+Sorts the items into the order they are written to the tag, using the
+tag's sorted item array.  The items are sorted each time, since callers are
+allowed to modify items in place.  This never allocates, as the sorted
+array is grown along with the item order array.
+
+Returns the sorted array, which has tag->item_count entries.
+*/
+static struct ApeItem ** ApeTag__sort_items(struct ApeTag *tag) {
+    if (tag->item_count > 0) {
+        memcpy(tag->sorted_items, tag->item_order, tag->item_count * sizeof(struct ApeItem *));
+        qsort(tag->sorted_items, tag->item_count, sizeof(struct ApeItem *), ApeItem__compare);
+    }
+    return tag->sorted_items;
+}
+
+/* 
+Local ASCII-only version of strncasecmp, since default strncasecmp may
+depend on the locale, and this version is only called with APE item keys
+(which are limited to ASCII).
+*/
+static int ApeTag__strncasecmp(const char *s1, const char *s2, size_t n) {
+    if (n != 0) {
+        const unsigned char *cm = charmap;
+        const unsigned char *us1 = (const unsigned char *)s1;
+        const unsigned char *us2 = (const unsigned char *)s2;
+
+        do {
+            if (cm[*us1] != cm[*us2++])
+                return (cm[*us1] - cm[*--us2]);
+            if (*us1++ == '\0')
+                break;
+        } while (--n != 0);
+    }
+    return (0);
+}
+
+/*
+Reads exactly size bytes at the given offset in the tag's file.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__read(struct ApeTag *tag, void *buf, size_t size, off_t offset) {
+    ssize_t ret;
+
+#ifndef APE_NO_STATS
+    if (offset != tag->stats_position) {
+        tag->stats.seeks++;
+    }
+    tag->stats.reads++;
+#endif
+    if ((ret = tag->io->read(tag->io_ctx, buf, size, offset)) < 0 || (size_t)ret != size) {
+        tag->errcode = APETAG_FILEERR;
+        tag->error = "read";
+        return -1;
+    }
+#ifndef APE_NO_STATS
+    tag->stats.bytes_read += size;
+    tag->stats_position = offset + (off_t)size;
+#endif
+    return 0;
+}
+
+/*
+Writes exactly size bytes at the given offset in the tag's file.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__write(struct ApeTag *tag, const void *buf, size_t size, off_t offset) {
+    ssize_t ret;
+
+    if (tag->io->write == NULL) {
+        tag->errcode = APETAG_FILEERR;
+        tag->error = "write not supported";
+        return -1;
+    }
+#ifndef APE_NO_STATS
+    if (offset != tag->stats_position) {
+        tag->stats.seeks++;
+    }
+    tag->stats.writes++;
+#endif
+    if ((ret = tag->io->write(tag->io_ctx, buf, size, offset)) < 0 || (size_t)ret != size) {
+        tag->errcode = APETAG_FILEERR;
+        tag->error = "write";
+        return -1;
+    }
+#ifndef APE_NO_STATS
+    tag->stats.bytes_written += size;
+    tag->stats_position = offset + (off_t)size;
+#endif
+    return 0;
+}
+
+/*
+Truncates the tag's file to the given length.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__truncate(struct ApeTag *tag, off_t length) {
+    if (tag->io->truncate == NULL) {
+        tag->errcode = APETAG_FILEERR;
+        tag->error = "truncate not supported";
+        return -1;
+    }
+    if (tag->io->truncate(tag->io_ctx, length) != 0) {
+        tag->errcode = APETAG_FILEERR;
+        tag->error = "truncate";
+        return -1;
+    }
+    return 0;
+}
+
+/*
+stdio backend, ctx is a FILE *.  Reads and writes seek to the offset first,
+and truncation flushes any buffered writes before truncating.
+*/
+static ssize_t ApeTag__stdio_read(void *ctx, void *buf, size_t size, off_t offset) {
+    FILE *file = ctx;
+    size_t ret;
+
+    if (fseeko(file, offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    ret = fread(buf, 1, size, file);
+    if (ret < size && ferror(file)) {
+        return -1;
+    }
+    return (ssize_t)ret;
+}
+
+static ssize_t ApeTag__stdio_write(void *ctx, const void *buf, size_t size, off_t offset) {
+    FILE *file = ctx;
+
+    if (fseeko(file, offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    return (ssize_t)fwrite(buf, 1, size, file);
+}
+
+static int ApeTag__stdio_truncate(void *ctx, off_t length) {
+    FILE *file = ctx;
+
+    if (fflush(file) != 0) {
+        return -1;
+    }
+    return ftruncate(fileno(file), length);
+}
+
+static off_t ApeTag__stdio_size(void *ctx) {
+    FILE *file = ctx;
+
+    if (fseeko(file, 0, SEEK_END) == -1) {
+        return -1;
+    }
+    return ftello(file);
+}
+
+/*
+File descriptor backend, ctx is an int * pointing to the file descriptor.
+Reads and writes use pread/pwrite, retrying on short transfers and EINTR, and
+never move the descriptor's file offset.
+*/
+static ssize_t ApeTag__fd_read(void *ctx, void *buf, size_t size, off_t offset) {
+    int fd = *(int *)ctx;
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < size) {
+        ret = pread(fd, (char *)buf + done, size - done, offset + (off_t)done);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        done += (size_t)ret;
+    }
+    return (ssize_t)done;
+}
+
+static ssize_t ApeTag__fd_write(void *ctx, const void *buf, size_t size, off_t offset) {
+    int fd = *(int *)ctx;
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < size) {
+        ret = pwrite(fd, (const char *)buf + done, size - done, offset + (off_t)done);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)ret;
+    }
+    return (ssize_t)done;
+}
+
+static int ApeTag__fd_truncate(void *ctx, off_t length) {
+    return ftruncate(*(int *)ctx, length);
+}
+
+static off_t ApeTag__fd_size(void *ctx) {
+    struct stat sb;
+
+    if (fstat(*(int *)ctx, &sb) == -1) {
+        return -1;
+    }
+    return sb.st_size;
+}
+
+/*
+Read only backend used by ApeTag_new_from_ranges, ctx is a struct
+ApeTag__ranges *.  Reads of bytes not contained in any range are short.
+*/
+static ssize_t ApeTag__ranges_read(void *ctx, void *buf, size_t size, off_t offset) {
+    struct ApeTag__ranges *r = ctx;
+    size_t done = 0;
+    size_t i;
+    size_t n;
+    off_t pos;
+    char *data;
+    
+    while (done < size) {
+        pos = offset + (off_t)done;
+        for (i=0, data=r->data; i < r->count; data += r->ranges[i].size, i++) {
+            if (pos >= r->ranges[i].offset && 
+                pos < r->ranges[i].offset + (off_t)r->ranges[i].size) {
+                break;
+            }
+        }
+        if (i == r->count) {
+            break;
+        }
+        n = (size_t)(r->ranges[i].offset + (off_t)r->ranges[i].size - pos);
+        if (n > size - done) {
+            n = size - done;
+        }
+        memcpy((char *)buf + done, data + (pos - r->ranges[i].offset), n);
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+static off_t ApeTag__ranges_size(void *ctx) {
+    return ((struct ApeTag__ranges *)ctx)->file_size;
+}
+
+/*
+Read only backend used by ApeTag_new for tags without a file, which are
+treated as an empty file without a tag.  As the file is empty, nothing is
+ever read.
+*/
+static ssize_t ApeTag__empty_read(void *ctx, void *buf, size_t size, off_t offset) {
+    (void)ctx;
+    (void)buf;
+    (void)size;
+    (void)offset;
+    return 0;
+}
+
+static off_t ApeTag__empty_size(void *ctx) {
+    (void)ctx;
+    return 0;
+}
+
+/*
+Gives the kernel a caching hint for the given range of the tag's file, if the
+tag was created with ApeTag_new_fd.  A length of 0 means to the end of the
+file.  Hints are advisory, so failures are ignored.
+*/
+static void ApeTag__fadvise(struct ApeTag *tag, off_t offset, off_t length, int advice) {
+    if (!(tag->flags & APE_FD_HINTS)) {
+        return;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    (void)posix_fadvise(tag->fd, offset, length, advice);
+#else
+    (void)offset;
+    (void)length;
+    (void)advice;
+#endif
+}
+
+/*
+Allocates memory for the tag, counting the allocation in the tag's stats.
+
+Returns pointer on success, NULL pointer on error.
+*/
+static void *ApeTag__malloc(struct ApeTag *tag, size_t size) {
+    APE_STAT_ADD(tag, allocations, 1);
+    return tag->allocator.malloc(tag->allocator.ctx, size);
+}
+
+/*
+Reallocates memory for the tag, counting the allocation in the tag's stats.
+
+Returns pointer on success, NULL pointer on error.
+*/
+static void *ApeTag__realloc(struct ApeTag *tag, void *ptr, size_t size) {
+    APE_STAT_ADD(tag, allocations, 1);
+    return tag->allocator.realloc(tag->allocator.ctx, ptr, size);
+}
+
+/*
+Frees memory allocated for the tag.  Like free, does nothing if ptr is NULL.
+*/
+static void ApeTag__free(struct ApeTag *tag, void *ptr) {
+    if (ptr != NULL) {
+        tag->allocator.free(tag->allocator.ctx, ptr);
+    }
+}
+
+/*
+Frees memory allocated with the global allocator.  Like free, does nothing
+if ptr is NULL.
+*/
+static void ApeTag__global_free(void *ptr) {
+    if (ptr != NULL) {
+        APE_ALLOCATOR.free(APE_ALLOCATOR.ctx, ptr);
+    }
+}
+
+/*
+Default allocator hooks, using the C library's allocator.
+*/
+static void *ApeTag__default_malloc(void *ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void *ApeTag__default_realloc(void *ctx, void *ptr, size_t size) {
+    (void)ctx;
+    return realloc(ptr, size);
+}
+
+static void ApeTag__default_free(void *ctx, void *ptr) {
+    (void)ctx;
+    free(ptr);
+}
+
+/*
+Calls the given phase function for the tag, adding the time it took in
+nanoseconds to *ns.  If ns is NULL (when stats are compiled out), the phase
+function is just called.
+
+Returns the return value of the phase function.
+*/
+static int ApeTag__timed(struct ApeTag *tag, int phase(struct ApeTag *tag), uint64_t *ns) {
+    struct timespec start, end;
+    int ret;
+
+    if (ns == NULL || clock_gettime(CLOCK_MONOTONIC, &start) != 0) {
+        return phase(tag);
+    }
+    ret = phase(tag);
+    if (clock_gettime(CLOCK_MONOTONIC, &end) == 0) {
+        *ns += (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 + 
+               (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+    }
+    return ret;
+}
+
+/*
+Adds the tag's counters to the process-wide totals and zeroes them, so they
+are only counted once.  All fields of struct ApeTag_stats are uint64_t.
+*/
+static void ApeTag__flush_stats(struct ApeTag *tag) {
+#ifndef APE_NO_STATS
+    uint64_t *src = (uint64_t *)(void *)&tag->stats;
+    uint64_t *dst = (uint64_t *)(void *)&APE_GLOBAL_STATS;
+    size_t i;
+
+    for (i=0; i < sizeof(struct ApeTag_stats)/sizeof(uint64_t); i++) {
+        if (src[i] != 0) {
+            APE_ATOMIC_ADD(&dst[i], src[i]);
+        }
+    }
+    memset(&tag->stats, 0, sizeof(struct ApeTag_stats));
+    tag->stats_position = 0;
+#else
+    (void)tag;
+#endif
+}
+
+/*
+Gets the identity of the tag's file, if the tag was created with ApeTag_new,
+ApeTag_new_fd, or ApeTag_reset.  Files accessed through other backends have
+no identity and are never cached.
+
+Returns 0 on success, -1 if the file has no identity.
+*/
+static int ApeTag__file_identity(struct ApeTag *tag, struct stat *sb) {
+    int fd;
+    
+    if (tag->io == &ApeTag_stdio_io) {
+        fd = fileno(tag->file);
+    } else if (tag->io == &ApeTag_fd_io) {
+        fd = tag->fd;
+    } else {
+        return -1;
+    }
+    if (fd < 0 || fstat(fd, sb) != 0 || !S_ISREG(sb->st_mode)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+Checks the records in the cache's map, setting *count to the number of
+records.  Records after the first invalid record are ignored, as they can
+only be from an append torn by a crash.  If the cache is writable, the file
+is truncated to remove them, which requires the caller to hold the lock on
+the file.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__cache_scan(struct ApeTag_cache *cache, size_t *count) {
+    struct ApeTag__cache_record record;
+    size_t offset = APE_CACHE_HEADER_SIZE;
+    size_t length;
+    
+    *count = 0;
+    while (cache->map_size - offset >= sizeof(record)) {
+        memcpy(&record, cache->map + offset, sizeof(record));
+        length = ((record.flags & APE_HAS_APE) ? (size_t)record.tag_size : 0) + 
+                 ((record.flags & APE_HAS_ID3) ? 128 : 0);
+        if (record.length > cache->map_size - offset - sizeof(record) ||
+            (record.flags & ~(uint32_t)APE_CACHE_RECORD_FLAGS) ||
+            ((record.flags & APE_HAS_APE) && record.tag_size < APE_MINIMUM_TAG_SIZE) ||
+            record.length != ((length + 7) & ~(size_t)7) ||
+            ApeTag__fnv1a(ApeTag__fnv1a(2166136261U, cache->map + offset + 8, sizeof(record) - 8),
+                          cache->map + offset + sizeof(record), record.length) != record.checksum) {
+            break;
+        }
+        offset += sizeof(record) + record.length;
+        (*count)++;
+    }
+    
+    if (offset != cache->map_size && cache->writable) {
+        if (ftruncate(cache->fd, (off_t)offset) != 0) {
+            return -1;
+        }
+    }
+    cache->map_size = offset;
+    return 0;
+}
+
+/*
+Builds the cache's index of the given number of records.  The index is an
+open addressing hash table of record offsets + 1, with at most half of the
+slots used.  Records are added in file order and later records for the same
+file replace earlier ones.  The index is not modified after this, so lookups
+do not need to lock the cache.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__cache_index(struct ApeTag_cache *cache, size_t count) {
+    struct ApeTag__cache_record record;
+    struct ApeTag__cache_record existing;
+    size_t offset = APE_CACHE_HEADER_SIZE;
+    size_t slots = 16;
+    size_t slot;
+    
+    while (slots < count * 2) {
+        if (slots > SIZE_MAX / 2 / sizeof(size_t)) {
+            return -1;
+        }
+        slots *= 2;
+    }
+    if ((cache->index = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, slots * sizeof(size_t))) == NULL) {
+        return -1;
+    }
+    memset(cache->index, 0, slots * sizeof(size_t));
+    cache->index_mask = slots - 1;
+    
+    while (offset < cache->map_size) {
+        memcpy(&record, cache->map + offset, sizeof(record));
+        slot = ApeTag__cache_slot(cache, record.dev, record.ino, record.flags);
+        for (; cache->index[slot] != 0; slot = (slot + 1) & cache->index_mask) {
+            memcpy(&existing, cache->map + cache->index[slot] - 1, sizeof(existing));
+            if (existing.dev == record.dev && existing.ino == record.ino && 
+                (existing.flags & APE_NO_ID3) == (record.flags & APE_NO_ID3)) {
+                break;
+            }
+        }
+        cache->index[slot] = offset + 1;
+        offset += sizeof(record) + record.length;
+    }
+    
+    return 0;
+}
+
+/*
+Returns the first index slot to check for records for the given file.
+*/
+static size_t ApeTag__cache_slot(struct ApeTag_cache *cache, uint64_t dev, uint64_t ino, uint32_t flags) {
+    uint64_t hash = (dev * UINT64_C(0x9e3779b97f4a7c15)) ^ ino ^ (flags & APE_NO_ID3);
+    
+    hash *= UINT64_C(0xff51afd7ed558ccd);
+    return (size_t)(hash ^ (hash >> 32)) & cache->index_mask;
+}
+
+/*
+Looks up the tag's file in the tag's cache, setting the tag information from
+the cached tag if the file's size and modification time are unchanged.
+
+Returns 0 on a cache hit, 1 on a cache miss, -1 on error.
+*/
+static int ApeTag__cache_lookup(struct ApeTag *tag, const struct stat *sb) {
+    struct ApeTag_cache *cache = tag->cache;
+    struct ApeTag__cache_record record;
+    struct ApeTag__cache_record expected;
+    const char *data;
+    size_t slot;
+    
+    ApeTag__cache_identity(&expected, sb, tag->flags & APE_NO_ID3);
+    slot = ApeTag__cache_slot(cache, expected.dev, expected.ino, expected.flags);
+    for (; cache->index[slot] != 0; slot = (slot + 1) & cache->index_mask) {
+        memcpy(&record, cache->map + cache->index[slot] - 1, sizeof(record));
+        if (record.dev == expected.dev && record.ino == expected.ino &&
+            (record.flags & APE_NO_ID3) == expected.flags) {
+            break;
+        }
+    }
+    if (cache->index[slot] == 0 || record.size != expected.size || 
+        record.mtime != expected.mtime || record.mtime_nsec != expected.mtime_nsec ||
+        ((record.flags & APE_HAS_APE) && record.tag_size > APE_MAXIMUM_TAG_SIZE)) {
+        return 1;
+    }
+    data = cache->map + cache->index[slot] - 1 + sizeof(record);
+    
+    tag->flags &= ~(APE_HAS_APE | APE_HAS_ID3);
+    tag->flags |= APE_CHECKED_APE | APE_CHECKED_OFFSET | 
+                  (record.flags & (APE_HAS_APE | APE_HAS_ID3));
+    tag->offset = (off_t)record.size - ((record.flags & APE_HAS_ID3) ? 128 : 0);
+    tag->size = 0;
+    tag->file_item_count = 0;
+    
+    if (record.flags & APE_HAS_APE) {
+        tag->size = record.tag_size;
+        tag->file_item_count = record.item_count;
+        tag->offset -= record.tag_size;
+        if (ApeTag__alloc_buffers(tag, tag->size-64) != 0) {
+            return -1;
+        }
+        memcpy(tag->tag_header, data, 32);
+        memcpy(tag->tag_data, data+32, tag->size-64);
+        memcpy(tag->tag_footer, data+tag->size-32, 32);
+        data += tag->size;
+    }
+    if (record.flags & APE_HAS_ID3) {
+        ApeTag__free(tag, tag->id3);
+        if ((tag->id3 = ApeTag__malloc(tag, 128)) == NULL) {
+            tag->errcode = APETAG_MEMERR;
+            tag->error = "malloc";
+            return -1;
+        }
+        memcpy(tag->id3, data, 128);
+    }
+    
+    return 0;
+}
+
+/*
+Appends a record for the tag's file to the tag's cache, if the cache is
+writable.  The record is written with a single write to a file opened for
+appending while holding the lock on the file, so concurrent appends from
+other processes are not interleaved.  The cache is only an optimization, so
+errors are ignored.
+*/
+static void ApeTag__cache_store(struct ApeTag *tag, const struct stat *sb) {
+    struct ApeTag_cache *cache = tag->cache;
+    struct ApeTag__cache_record record;
+    struct iovec iov[6];
+    static const char padding[8];
+    int iovcnt = 0;
+    size_t length = 0;
+    
+    if (!cache->writable) {
+        return;
+    }
+    
+    ApeTag__cache_identity(&record, sb, tag->flags & APE_CACHE_RECORD_FLAGS);
+    iov[iovcnt].iov_base = &record;
+    iov[iovcnt++].iov_len = sizeof(record);
+    if (tag->flags & APE_HAS_APE) {
+        record.tag_size = tag->size;
+        record.item_count = tag->file_item_count;
+        iov[iovcnt].iov_base = tag->tag_header;
+        iov[iovcnt++].iov_len = 32;
+        iov[iovcnt].iov_base = tag->tag_data;
+        iov[iovcnt++].iov_len = tag->size-64;
+        iov[iovcnt].iov_base = tag->tag_footer;
+        iov[iovcnt++].iov_len = 32;
+        length += tag->size;
+    }
+    if (tag->flags & APE_HAS_ID3) {
+        iov[iovcnt].iov_base = tag->id3;
+        iov[iovcnt++].iov_len = 128;
+        length += 128;
+    }
+    record.length = (uint32_t)((length + 7) & ~(size_t)7);
+    if (record.length != length) {
+        iov[iovcnt].iov_base = (void *)(uintptr_t)padding;
+        iov[iovcnt++].iov_len = record.length - length;
+    }
+    
+    record.checksum = ApeTag__fnv1a(2166136261U, (char *)&record + 8, sizeof(record) - 8);
+    for (length = 1; length < (size_t)iovcnt; length++) {
+        record.checksum = ApeTag__fnv1a(record.checksum, iov[length].iov_base, iov[length].iov_len);
+    }
+    
+    if (pthread_mutex_lock(&cache->lock) != 0) {
+        return;
+    }
+    if (flock(cache->fd, LOCK_EX) == 0) {
+        (void)writev(cache->fd, iov, iovcnt);
+        flock(cache->fd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+Fills in the identity fields of a cache record from the file's status, and
+zeroes the other fields.
+*/
+static void ApeTag__cache_identity(struct ApeTag__cache_record *record, const struct stat *sb, uint32_t flags) {
+    memset(record, 0, sizeof(struct ApeTag__cache_record));
+    record->dev = (uint64_t)sb->st_dev;
+    record->ino = (uint64_t)sb->st_ino;
+    record->size = (uint64_t)sb->st_size;
+    record->mtime = (int64_t)sb->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+    record->mtime_nsec = (uint32_t)sb->st_mtim.tv_nsec;
+#endif
+    record->flags = flags;
+}
+
+/*
+Continues an FNV-1a hash of the given data.  Start with 2166136261.
+
+Returns the updated hash.
+*/
+static uint32_t ApeTag__fnv1a(uint32_t hash, const void *data, size_t size) {
+    const unsigned char *c = data;
+    const unsigned char *end = c + size;
+    
+    for (; c < end; c++) {
+        hash = (hash ^ *c) * 16777619U;
+    }
+    return hash;
+}
+
+/*
+ApeTag_iter_items callback adding the item to the index writer given as data.
+The key is interned both as is and case folded, and the case folded key is
+added to the key table if it is new.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__index_add_item(struct ApeTag *tag, struct ApeItem *item, void *data) {
+    struct ApeTag_index_writer *writer = data;
+    struct ApeTag__index_item *record;
+    struct ApeTag__index_string *string;
+    char folded[256];
+    size_t length = strlen(item->key);
+    
+    (void)tag;
+    if (writer->key_count >= APE_INDEX_NO_KEY || length > 255 ||
+        ApeTag__index_grow((void **)&writer->items, &writer->item_capacity, 
+                           writer->item_count + 1, sizeof(struct ApeTag__index_item)) != 0) {
+        return -1;
+    }
+    record = &writer->items[writer->item_count];
+    memset(record, 0, sizeof(struct ApeTag__index_item));
+    record->size = item->size;
+    record->flags = item->flags;
+    
+    if ((string = ApeTag__index_intern(writer, item->key, length)) == NULL) {
+        return -1;
+    }
+    record->key = string->offset - 1;
+    ApeTag__index_fold(folded, item->key, length);
+    if ((string = ApeTag__index_intern(writer, folded, length)) == NULL) {
+        return -1;
+    }
+    if (string->key_id == APE_INDEX_NO_KEY) {
+        if (ApeTag__index_grow((void **)&writer->keys, &writer->key_capacity, 
+                               writer->key_count + 1, sizeof(uint64_t)) != 0) {
+            return -1;
+        }
+        writer->keys[writer->key_count] = string->offset - 1;
+        string->key_id = (uint32_t)writer->key_count++;
+    }
+    record->key_id = string->key_id;
+    
+    if (ApeTag__index_append(writer, item->value, item->size, &record->value) != 0) {
+        return -1;
+    }
+    writer->item_count++;
+    
     return 0;
+}
+
+/*
+Makes sure the array has room for count elements of the given size, growing
+it geometrically.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__index_grow(void **array, size_t *capacity, size_t count, size_t element_size) {
+    size_t new_capacity = *capacity;
+    void *new_array;
     
-    load_genres_error:
-    if (genres != NULL){
-        if (genres->close(genres) == -1) {
-            tag->errcode = APETAG_INTERNALERR;
-            tag->error = "db->close";
-        }
-        genres = NULL;
+    if (count <= *capacity) {
+        return 0;
     }
-    return -1;
+    
+    while (new_capacity < count) {
+        new_capacity = new_capacity < 16 ? 16 : new_capacity * 2;
+    }
+    if (new_capacity > SIZE_MAX / element_size ||
+        (new_array = APE_ALLOCATOR.realloc(APE_ALLOCATOR.ctx, *array, new_capacity * element_size)) == NULL) {
+        return -1;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    
+    return 0;
 }
 
-static uint32_t ApeTag__tag_length(struct ApeTag *tag) {
-    return tag->size + ApeTag__id3_length(tag);
-}
+/*
+Appends the given data to the writer's string table, setting *offset to its
+offset in the string table.
 
-static uint32_t ApeTag__id3_length(struct ApeTag *tag) {
-    if ((tag->flags & APE_HAS_ID3) && !(tag->flags & APE_NO_ID3)) {
-        return 128;
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__index_append(struct ApeTag_index_writer *writer, const char *data, size_t size, uint64_t *offset) {
+    if (ApeTag__index_grow((void **)&writer->strings, &writer->strings_capacity, 
+                           writer->strings_size + size, 1) != 0) {
+        return -1;
     }
+    
+    memcpy(writer->strings + writer->strings_size, data, size);
+    *offset = writer->strings_size;
+    writer->strings_size += size;
+    
     return 0;
 }
 
-/* 
-Return an ApeItem * corresponding to the passed key, which the caller should not free.
+/*
+Finds the given key of the given length in the writer's interned keys,
+adding it to the string table with a NUL terminator if it isn't there.  Keys
+are interned so each distinct key is only stored once, however many files
+have it.  The returned pointer is only valid until the next key is interned.
 
-The caller is expected to have checked that tag->items is not NULL.
+Returns pointer on success, NULL pointer on error.
+*/
+static struct ApeTag__index_string * ApeTag__index_intern(struct ApeTag_index_writer *writer, const char *key, size_t length) {
+    struct ApeTag__index_string *interned;
+    struct ApeTag__index_string *string;
+    uint32_t hash = ApeTag__fnv1a(2166136261U, key, length);
+    size_t slots;
+    size_t i;
+    size_t slot;
+    
+    /* Keep at most half of the slots used */
+    if (writer->interned_count * 2 >= writer->interned_mask) {
+        slots = writer->interned == NULL ? 64 : (writer->interned_mask + 1) * 2;
+        if (slots > SIZE_MAX / sizeof(struct ApeTag__index_string) ||
+            (interned = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, slots * sizeof(struct ApeTag__index_string))) == NULL) {
+            return NULL;
+        }
+        memset(interned, 0, slots * sizeof(struct ApeTag__index_string));
+        for (i=0; writer->interned != NULL && i <= writer->interned_mask; i++) {
+            if (writer->interned[i].offset != 0) {
+                for (slot = writer->interned[i].hash & (slots - 1); interned[slot].offset != 0;
+                     slot = (slot + 1) & (slots - 1));
+                interned[slot] = writer->interned[i];
+            }
+        }
+        ApeTag__global_free(writer->interned);
+        writer->interned = interned;
+        writer->interned_mask = slots - 1;
+    }
+    
+    for (slot = hash & writer->interned_mask; writer->interned[slot].offset != 0;
+         slot = (slot + 1) & writer->interned_mask) {
+        string = &writer->interned[slot];
+        if (string->hash == hash && string->length == length &&
+            memcmp(writer->strings + string->offset - 1, key, length) == 0) {
+            return string;
+        }
+    }
+    
+    string = &writer->interned[slot];
+    if (ApeTag__index_append(writer, key, length + 1, &string->offset) != 0) {
+        return NULL;
+    }
+    string->offset++;
+    string->hash = hash;
+    string->key_id = APE_INDEX_NO_KEY;
+    string->length = length;
+    writer->interned_count++;
+    
+    return string;
+}
 
-Returns NULL on error.
+/*
+qsort comparison function for struct ApeTag__index_sort.
 */
-static struct ApeItem * ApeTag__get_item(struct ApeTag *tag, const char *key) {
-    int ret = 0;
-    DBT key_dbt, value_dbt;
+static int ApeTag__index_compare(const void *a, const void *b) {
+    return strcmp(((const struct ApeTag__index_sort *)a)->string, 
+                  ((const struct ApeTag__index_sort *)b)->string);
+}
 
-    if (tag->items == NULL) {
-        tag->errcode = APETAG_NOTPRESENT;
-        tag->error = "get_item"; 
-        return NULL; 
+/*
+Writes the writer's files and items to the file as a snapshot, sorting the
+files by filename and the key table by key.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__index_write(struct ApeTag_index_writer *writer, FILE *file) {
+    struct ApeTag__index_header header;
+    struct ApeTag__index_sort *files = NULL;
+    struct ApeTag__index_sort *keys = NULL;
+    struct ApeTag__index_item item;
+    uint32_t *key_ids = NULL;
+    size_t i;
+    int ret = -1;
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, APE_INDEX_MAGIC, 8);
+    header.version = APE_INDEX_VERSION;
+    header.byte_order = APE_INDEX_BYTE_ORDER;
+    header.file_count = (uint32_t)writer->file_count;
+    header.key_count = (uint32_t)writer->key_count;
+    header.item_count = writer->item_count;
+    header.files_offset = sizeof(header);
+    header.keys_offset = header.files_offset + writer->file_count * sizeof(struct ApeTag__index_file);
+    header.items_offset = header.keys_offset + writer->key_count * sizeof(uint64_t);
+    header.strings_offset = header.items_offset + writer->item_count * sizeof(struct ApeTag__index_item);
+    header.strings_size = writer->strings_size;
+    
+    if ((files = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, (writer->file_count + 1) * sizeof(struct ApeTag__index_sort))) == NULL ||
+        (keys = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, (writer->key_count + 1) * sizeof(struct ApeTag__index_sort))) == NULL ||
+        (key_ids = APE_ALLOCATOR.malloc(APE_ALLOCATOR.ctx, (writer->key_count + 1) * sizeof(uint32_t))) == NULL) {
+        errno = ENOMEM;
+        goto index_write_error;
+    }
+    for (i=0; i < writer->file_count; i++) {
+        files[i].string = writer->strings + writer->files[i].filename;
+        files[i].index = i;
+    }
+    qsort(files, writer->file_count, sizeof(struct ApeTag__index_sort), ApeTag__index_compare);
+    for (i=0; i < writer->key_count; i++) {
+        keys[i].string = writer->strings + writer->keys[i];
+        keys[i].index = i;
+    }
+    qsort(keys, writer->key_count, sizeof(struct ApeTag__index_sort), ApeTag__index_compare);
+    for (i=0; i < writer->key_count; i++) {
+        key_ids[keys[i].index] = (uint32_t)i;
+    }
+    
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        goto index_write_error;
+    }
+    for (i=0; i < writer->file_count; i++) {
+        if (fwrite(&writer->files[files[i].index], sizeof(struct ApeTag__index_file), 1, file) != 1) {
+            goto index_write_error;
+        }
+    }
+    for (i=0; i < writer->key_count; i++) {
+        if (fwrite(&writer->keys[keys[i].index], sizeof(uint64_t), 1, file) != 1) {
+            goto index_write_error;
+        }
+    }
+    for (i=0; i < writer->item_count; i++) {
+        item = writer->items[i];
+        item.key_id = key_ids[item.key_id];
+        if (fwrite(&item, sizeof(item), 1, file) != 1) {
+            goto index_write_error;
+        }
+    }
+    if (writer->strings_size > 0 && fwrite(writer->strings, writer->strings_size, 1, file) != 1) {
+        goto index_write_error;
     }
+    ret = 0;
+    
+    index_write_error:
+    ApeTag__global_free(files);
+    ApeTag__global_free(keys);
+    ApeTag__global_free(key_ids);
+    return ret;
+}
 
-    key_dbt.size = strlen(key) + 1; 
-    if (key_dbt.size > 256) {
-        tag->errcode = APETAG_ARGERR;
-        tag->error = "key is greater than 255 characters";
-        return NULL;
+/*
+Copies the given file's record from the index's file table, checking that
+its items are in the item table.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__index_file(struct ApeTag_index *index, uint32_t file, struct ApeTag__index_file *record) {
+    if (index == NULL || file >= index->header.file_count) {
+        return -1;
     }
-    if ((key_dbt.data = ApeTag__strcasecpy(key, (unsigned char)key_dbt.size)) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "malloc";
-        return NULL;
+    
+    memcpy(record, index->map + index->header.files_offset + file * sizeof(struct ApeTag__index_file), 
+           sizeof(struct ApeTag__index_file));
+    if (record->first_item > index->header.item_count || 
+        record->item_count > index->header.item_count - record->first_item) {
+        return -1;
     }
+    
+    return 0;
+}
 
-    ret = tag->items->get(tag->items, &key_dbt, &value_dbt, 0);
-    free(key_dbt.data);
-    if (ret == -1) { 
-        tag->errcode = APETAG_INTERNALERR;
-        tag->error = "db->get"; 
-        return NULL; 
-    } else if (ret != 0) { 
-        tag->errcode = APETAG_NOTPRESENT;
-        tag->error = "get_item"; 
-        return NULL; 
-    } else {
-        return *(struct ApeItem **)(value_dbt.data);
-    } 
+/*
+Fills in view from the given item in the index's item table, with the key and
+value pointing into the index's string table.
+
+Returns 0 on success, -1 on error.
+*/
+static int ApeTag__index_item(struct ApeTag_index *index, uint64_t item, struct ApeItem *view) {
+    struct ApeTag__index_item record;
+    
+    memcpy(&record, index->map + index->header.items_offset + item * sizeof(struct ApeTag__index_item), 
+           sizeof(struct ApeTag__index_item));
+    if ((view->key = ApeTag__index_string(index, record.key)) == NULL ||
+        record.value > index->header.strings_size || 
+        record.size > index->header.strings_size - record.value) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    view->value = index->map + index->header.strings_offset + record.value;
+    view->size = record.size;
+    view->flags = record.flags;
+    
+    return 0;
 }
 
-/* 
-Return an array of ApeItem * for all items in the tag database,
-which the caller is responsible for freeing.
+/*
+Returns the NUL terminated string at the given offset in the index's string
+table, or a NULL pointer if the string isn't in the string table.
+*/
+static char * ApeTag__index_string(struct ApeTag_index *index, uint64_t offset) {
+    char *string = index->map + index->header.strings_offset + offset;
+    
+    if (offset >= index->header.strings_size ||
+        memchr(string, '\0', index->header.strings_size - offset) == NULL) {
+        return NULL;
+    }
+    
+    return string;
+}
 
-Returns NULL on error.
+/*
+Copies the key of the given length to dest with ASCII letters lowercased, the
+same case folding used for the tag's item database, and NUL terminates it.
 */
-static struct ApeItem ** ApeTag__get_items(struct ApeTag *tag, uint32_t *num_items) {
-    uint32_t nitems = tag->item_count;
-    struct ApeItem **is;
+static void ApeTag__index_fold(char *dest, const char *src, size_t length) {
+    size_t i;
+    
+    for (i=0; i < length; i++) {
+        dest[i] = (src[i] >= 'A' && src[i] <= 'Z') ? (char)(src[i] | 0x20) : src[i];
+    }
+    dest[length] = '\0';
+}
 
-    if (num_items) {
-        *num_items = 0;
+/*
+Copies the tag's raw APE and ID3 tags to raw, which must have room for
+ApeTag__tag_length bytes.
+*/
+static void ApeTag__copy_raw(struct ApeTag *tag, char *raw) {
+    if (tag->flags & APE_HAS_APE) {
+        memcpy(raw, tag->tag_header, 32);
+        memcpy(raw+32, tag->tag_data, tag->size-64);
+        memcpy(raw+tag->size-32, tag->tag_footer, 32);
     }
 
-    if ((is = calloc(nitems + 1, sizeof(struct ApeItem *))) == NULL) {
-        tag->errcode = APETAG_MEMERR;
-        tag->error = "calloc";
-        return NULL;
+    if (tag->flags & APE_HAS_ID3 && !(tag->flags & APE_NO_ID3)) {
+        memcpy(raw+tag->size, tag->id3, ApeTag__id3_length(tag));
     }
+}
 
-    if (nitems > 0) {
-        uint32_t i = 0;
-        DBT key_dbt, value_dbt;
+/*
+Compares two ApeItem ** by key, case insensitively.
 
-        if (tag->items == NULL) {
-            tag->errcode = APETAG_INTERNALERR;
-            tag->error = "internal consistency error: item_count > 0 but items is NULL";
-            free(is);
-            return NULL;
+Returns <0 if the first key sorts first, >0 if the second key sorts first,
+and 0 if they are the same.
+*/
+static int ApeItem__compare_keys(const void *a, const void *b) {
+    return ApeTag__strncasecmp((*(struct ApeItem * const *)a)->key,
+                               (*(struct ApeItem * const *)b)->key, 256);
+}
+
+/*
+Parses the tag of the file at path into a new snapshot, and fills in the
+identity of the file that was parsed.  Errors are stored in errcode and
+error if they are not NULL.
+
+Returns the snapshot, or NULL on error.
+*/
+static struct ApeTag_snapshot * ApeTag__lru_parse(const char *path, uint32_t flags, struct ApeTag__cache_record *identity, enum ApeTag_errcode *errcode, const char **error) {
+    struct ApeTag *tag;
+    struct ApeTag_snapshot *snapshot;
+    struct stat sb;
+    int fd;
+    
+    if ((fd = ApeTag__open_path(path, O_RDONLY)) == -1) {
+        if (errcode != NULL) {
+            *errcode = APETAG_FILEERR;
         }
-        
-        /* Get all ape items from the database */
-        if (tag->items->seq(tag->items, &key_dbt, &value_dbt, R_FIRST) == 0) {
-            is[i++] = *(struct ApeItem **)(value_dbt.data);
-            while (tag->items->seq(tag->items, &key_dbt, &value_dbt, R_NEXT) == 0) {
-                if (i >= nitems) {
-                    tag->errcode = APETAG_INTERNALERR;
-                    tag->error = "internal consistency error: more items in database than item_count";
-                    free(is);
-                    return NULL;
-                }
-                is[i++] = *(struct ApeItem **)(value_dbt.data);
-            }
+        if (error != NULL) {
+            *error = "open";
         }
-        if (i != nitems) {
-            tag->errcode = APETAG_INTERNALERR;
-            tag->error = "internal consistency error: fewer items in database than item_count";
-            free(is);
-            return NULL;
+        return NULL;
+    }
+    if ((tag = ApeTag_new_fd(fd, flags)) == NULL) {
+        close(fd);
+        if (errcode != NULL) {
+            *errcode = APETAG_MEMERR;
         }
+        if (error != NULL) {
+            *error = "malloc";
+        }
+        return NULL;
     }
-
-    if (num_items) {
-        *num_items = nitems;
+    
+    if ((snapshot = ApeTag_snapshot(tag)) == NULL) {
+        if (errcode != NULL) {
+            *errcode = tag->errcode;
+        }
+        if (error != NULL) {
+            *error = tag->error;
+        }
+    } else if (fstat(fd, &sb) == 0) {
+        ApeTag__cache_identity(identity, &sb, flags);
+    } else {
+        memset(identity, 0, sizeof(struct ApeTag__cache_record));
     }
-
-    return is;
+    
+    ApeTag_free(tag);
+    close(fd);
+    return snapshot;
 }
 
-/* 
-Iterate over all items in the database, calling the iterator function
-with the given tag, the current item, and the given data pointer.
+/*
+Finds the entry for path in the shard, which must be locked.
 
-Returns 0 if iteration completes successfully, 1 if iteration is stopped
-early, -1 on error.
+Returns a pointer to the link to the entry in its hash chain, or NULL if
+the path is not in the shard.
 */
-static int ApeTag__iter_items(struct ApeTag *tag, int iterator(struct ApeTag *tag, struct ApeItem *item, void *data), void *data) {
-    if (tag->item_count > 0) {
-        DBT key_dbt, value_dbt;
-
-        if (tag->items == NULL) {
-            tag->errcode = APETAG_INTERNALERR;
-            tag->error = "internal consistency error: item_count > 0 but items is NULL";
-            return -1;
-        }
-        
-        /* Call iterator with each item in the database */
-        if (tag->items->seq(tag->items, &key_dbt, &value_dbt, R_FIRST) == 0) {
-            if (iterator(tag, *(struct ApeItem **)(value_dbt.data), data) != 0) {
-                return 1;
-            }
-            while (tag->items->seq(tag->items, &key_dbt, &value_dbt, R_NEXT) == 0) {
-                if (iterator(tag, *(struct ApeItem **)(value_dbt.data), data) != 0) {
-                    return 1;
-                }
-            }
+static struct ApeTag__lru_entry ** ApeTag__lru_find(struct ApeTag__lru_shard *shard, const char *path, uint32_t hash) {
+    struct ApeTag__lru_entry **link;
+    
+    if (shard->buckets == NULL) {
+        return NULL;
+    }
+    for (link = &shard->buckets[hash & shard->bucket_mask]; *link != NULL; link = &(*link)->next) {
+        if ((*link)->hash == hash && strcmp((*link)->path, path) == 0) {
+            return link;
         }
     }
+    return NULL;
+}
 
-    return 0;
+/*
+Adds the entry to the locked shard as the most recently used, replacing any
+entry for the same path, then evicts the least recently used entries until
+the shard is within its budget.  If the hash table can't be allocated, the
+entry is freed instead.
+*/
+static void ApeTag__lru_insert(struct ApeTag_lru *lru, struct ApeTag__lru_shard *shard, struct ApeTag__lru_entry *entry) {
+    struct ApeTag__lru_entry **link;
+    
+    if ((link = ApeTag__lru_find(shard, entry->path, entry->hash)) != NULL) {
+        ApeTag__lru_remove(lru, shard, link);
+    }
+    if (shard->count >= shard->bucket_mask) {
+        ApeTag__lru_grow(lru, shard);
+        if (shard->buckets == NULL) {
+            ApeTag_snapshot_unref(entry->snapshot);
+            lru->allocator.free(lru->allocator.ctx, entry);
+            return;
+        }
+    }
+    
+    entry->next = shard->buckets[entry->hash & shard->bucket_mask];
+    shard->buckets[entry->hash & shard->bucket_mask] = entry;
+    ApeTag__lru_push(shard, entry);
+    shard->count++;
+    shard->bytes += entry->size;
+    
+    while (shard->bytes > lru->max_bytes && shard->oldest != entry) {
+        link = ApeTag__lru_find(shard, shard->oldest->path, shard->oldest->hash);
+        ApeTag__lru_remove(lru, shard, link);
+        shard->stats.evictions++;
+    }
 }
 
-/* 
-Local ASCII-only version of strncasecmp, since default strncasecmp may
-depend on the locale, and this version is only called with APE item keys
-(which are limited to ASCII).
+/*
+Removes the entry at the given hash chain link from the locked shard, and
+drops the cache's reference to its snapshot.
 */
-static int ApeTag__strncasecmp(const char *s1, const char *s2, size_t n) {
-    if (n != 0) {
-        const unsigned char *cm = charmap;
-        const unsigned char *us1 = (const unsigned char *)s1;
-        const unsigned char *us2 = (const unsigned char *)s2;
+static void ApeTag__lru_remove(struct ApeTag_lru *lru, struct ApeTag__lru_shard *shard, struct ApeTag__lru_entry **link) {
+    struct ApeTag__lru_entry *entry = *link;
+    
+    *link = entry->next;
+    ApeTag__lru_unlink(shard, entry);
+    shard->count--;
+    shard->bytes -= entry->size;
+    ApeTag_snapshot_unref(entry->snapshot);
+    lru->allocator.free(lru->allocator.ctx, entry);
+}
 
-        do {
-            if (cm[*us1] != cm[*us2++])
-                return (cm[*us1] - cm[*--us2]);
-            if (*us1++ == '\0')
-                break;
-        } while (--n != 0);
+/* Removes the entry from the shard's list of entries by recency. */
+static void ApeTag__lru_unlink(struct ApeTag__lru_shard *shard, struct ApeTag__lru_entry *entry) {
+    if (entry->newer == NULL) {
+        shard->newest = entry->older;
+    } else {
+        entry->newer->older = entry->older;
     }
-    return (0);
+    if (entry->older == NULL) {
+        shard->oldest = entry->newer;
+    } else {
+        entry->older->newer = entry->newer;
+    }
+}
+
+/* Adds the entry to the shard's list of entries as the most recently used. */
+static void ApeTag__lru_push(struct ApeTag__lru_shard *shard, struct ApeTag__lru_entry *entry) {
+    entry->newer = NULL;
+    entry->older = shard->newest;
+    if (shard->newest == NULL) {
+        shard->oldest = entry;
+    } else {
+        shard->newest->newer = entry;
+    }
+    shard->newest = entry;
 }
 
+/*
+Doubles the number of hash buckets in the locked shard.  If there is no
+memory for more buckets, the existing buckets are kept, unless there were
+none, in which case buckets is left NULL.
+*/
+static void ApeTag__lru_grow(struct ApeTag_lru *lru, struct ApeTag__lru_shard *shard) {
+    struct ApeTag__lru_entry **buckets;
+    struct ApeTag__lru_entry *entry;
+    struct ApeTag__lru_entry *next;
+    size_t bucket_count = shard->buckets == NULL ? APE_LRU_MINIMUM_BUCKETS : (shard->bucket_mask + 1) * 2;
+    size_t i;
+    
+    if ((buckets = lru->allocator.malloc(lru->allocator.ctx, bucket_count * sizeof(struct ApeTag__lru_entry *))) == NULL) {
+        return;
+    }
+    memset(buckets, 0, bucket_count * sizeof(struct ApeTag__lru_entry *));
+    
+    if (shard->buckets != NULL) {
+        for (i=0; i <= shard->bucket_mask; i++) {
+            for (entry = shard->buckets[i]; entry != NULL; entry = next) {
+                next = entry->next;
+                entry->next = buckets[entry->hash & (bucket_count - 1)];
+                buckets[entry->hash & (bucket_count - 1)] = entry;
+            }
+        }
+        lru->allocator.free(lru->allocator.ctx, shard->buckets);
+    }
+    shard->buckets = buckets;
+    shard->bucket_mask = bucket_count - 1;
+}
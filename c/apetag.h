@@ -6,7 +6,14 @@
 #include <stdio.h>
 
 /* Specify not to check for or write an ID3 tag */
-#define APE_NO_ID3             1 << 5
+#define APE_NO_ID3             (1 << 5)
+
+/* Specify to only write the bytes of the tag that changed when updating */
+#define APE_DELTA_WRITES       (1 << 8)
+
+/* Flags for ApeTag_update_many */
+#define APE_UPDATE_SYNC        (1 << 0)
+#define APE_UPDATE_ATOMIC      (1 << 1)
 
 /* Mask used for struct ApeItem flags for read-only value */
 #define APE_ITEM_READ_FLAGS    1
@@ -26,6 +33,27 @@
 
 struct ApeTag; 
 
+/* Opaque structure for an on-disk cache of tags, see ApeTag_cache_open */
+
+struct ApeTag_cache;
+
+/* Opaque structures for library index snapshots, see ApeTag_index_open */
+
+struct ApeTag_index;
+struct ApeTag_index_writer;
+
+/* Opaque structure for immutable copies of tags, see ApeTag_snapshot */
+
+struct ApeTag_snapshot;
+
+/* Opaque structure for batches of journaled updates, see ApeTag_group_new */
+
+struct ApeTag_group;
+
+/* Opaque structure for in-process caches of snapshots, see ApeTag_lru_new */
+
+struct ApeTag_lru;
+
 /* Public structure for individual items in tag */
 
 struct ApeItem {
@@ -35,6 +63,93 @@ struct ApeItem {
     char *value;          /* Unterminated string */
 };
 
+/* I/O callbacks used to access the file containing a tag.  read and write
+   are positional (like pread/pwrite) and return the number of bytes
+   transferred or -1 on error.  write and truncate may be NULL for read only
+   backends. */
+
+struct ApeTag_io {
+    ssize_t (*read)(void *ctx, void *buf, size_t size, off_t offset);
+    ssize_t (*write)(void *ctx, const void *buf, size_t size, off_t offset);
+    int (*truncate)(void *ctx, off_t length);
+    off_t (*size)(void *ctx);
+};
+
+/* Backends shipped with the library, ctx is a FILE * and an int * respectively */
+extern const struct ApeTag_io ApeTag_stdio_io;
+extern const struct ApeTag_io ApeTag_fd_io;
+
+/* A byte range of a file, used by the range planning functions */
+
+struct ApeTag_range {
+    off_t offset;
+    size_t size;
+};
+
+/* Cursor over a tag's items, initialized by ApeTag_item_cursor_first.
+   A cursor is invalidated by adding, removing, or clearing items, and a
+   sorted cursor also by changing an item's key or value size in place.
+   Serializing or updating the tag does not invalidate a cursor. */
+
+#define APE_CURSOR_FILE_ORDER 0
+#define APE_CURSOR_SORTED 1
+
+struct ApeTag_item_cursor {
+    struct ApeTag *tag;
+    struct ApeItem **items;
+    uint32_t count;
+    uint32_t index;
+};
+
+/* Instrumentation counters, see ApeTag_get_stats.  Seeks are reads and
+   writes that do not start where the previous one ended, and times are
+   in nanoseconds. */
+
+struct ApeTag_stats {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t reads;
+    uint64_t seeks;
+    uint64_t writes;
+    uint64_t allocations;
+    uint64_t get_tag_information_ns;
+    uint64_t parse_items_ns;
+    uint64_t update_ape_ns;
+    uint64_t update_id3_ns;
+    uint64_t write_tag_ns;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+};
+
+/* When journaled updates are synced to disk, see ApeTag_update_atomic */
+
+enum ApeTag_sync {
+    APE_SYNC_NONE = 0,
+    APE_SYNC_FILE,
+    APE_SYNC_GROUP
+};
+
+/* Snapshot cache counters, see ApeTag_lru_get_stats */
+
+struct ApeTag_lru_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+/* Allocator hooks, see ApeTag_set_allocator.  ctx is passed to each
+   function unchanged. */
+
+struct ApeTag_allocator {
+    void *(*malloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t size);
+    void (*free)(void *ctx, void *ptr);
+    void *ctx;
+};
+
 /* Possible error types for the library */
 
 enum ApeTag_errcode {
@@ -53,23 +168,45 @@ enum ApeTag_errcode {
 /* Public functions */
 
 struct ApeTag * ApeTag_new(FILE *file, uint32_t flags);
+struct ApeTag * ApeTag_new_fd(int fd, uint32_t flags);
+struct ApeTag * ApeTag_open(const char *path, int oflag, uint32_t flags);
+struct ApeTag * ApeTag_new_io(const struct ApeTag_io *io, void *ctx, uint32_t flags);
+struct ApeTag * ApeTag_new_from_ranges(off_t file_size, uint32_t flags, const struct ApeTag_range *ranges, const void * const *data, size_t count);
 int ApeTag_free(struct ApeTag *tag);
+int ApeTag_reset(struct ApeTag *tag, FILE *file, uint32_t flags);
+int ApeTag_reset_fd(struct ApeTag *tag, int fd, uint32_t flags);
+int ApeTag_reset_open(struct ApeTag *tag, const char *path, int oflag, uint32_t flags);
+
+void ApeTag_plan_tail(off_t file_size, uint32_t flags, struct ApeTag_range *tail);
+int ApeTag_plan_body(off_t file_size, uint32_t flags, const struct ApeTag_range *tail, const void *tail_data, struct ApeTag_range *body, enum ApeTag_errcode *errcode, const char **error);
 
 int ApeTag_exists(struct ApeTag *tag);
 int ApeTag_exists_id3(struct ApeTag *tag);
 int ApeTag_remove(struct ApeTag *tag);
 int ApeTag_raw(struct ApeTag *tag, char **raw, uint32_t *raw_size);
 int ApeTag_parse(struct ApeTag *tag);
+int ApeTag_verify(struct ApeTag *tag);
 
 int ApeTag_add_item(struct ApeTag *tag, struct ApeItem *item);
 int ApeTag_replace_item(struct ApeTag *tag, struct ApeItem *item);
 int ApeTag_remove_item(struct ApeTag *tag, const char *key);
 int ApeTag_clear_items(struct ApeTag *tag);
 int ApeTag_update(struct ApeTag *tag);
+int ApeTag_update_atomic(struct ApeTag *tag, enum ApeTag_sync sync, struct ApeTag_group *group);
+int ApeTag_update_many(struct ApeTag **tags, size_t count, uint32_t flags, int *results);
+uint32_t ApeTag_serialized_size(struct ApeTag *tag);
+int ApeTag_serialize(struct ApeTag *tag, void *buf, size_t cap);
+int ApeTag_set_padding(struct ApeTag *tag, const char *key, uint32_t size);
+int ApeTag_copy_tag(struct ApeTag *src, struct ApeTag *dst);
 
 struct ApeItem * ApeTag_get_item(struct ApeTag *tag, const char *key);
 struct ApeItem ** ApeTag_get_items(struct ApeTag *tag, uint32_t *item_count);
 int ApeTag_iter_items(struct ApeTag *tag, int iterator(struct ApeTag *tag, struct ApeItem *item, void *data), void *data);
+struct ApeItem * ApeTag_item_cursor_first(struct ApeTag_item_cursor *cursor, struct ApeTag *tag, uint32_t order);
+struct ApeItem * ApeTag_item_cursor_next(struct ApeTag_item_cursor *cursor);
+
+uint32_t ApeItem_value_count(const struct ApeItem *item);
+int ApeItem_next_value(const struct ApeItem *item, uint32_t *cursor, const char **value, uint32_t *length);
 
 uint32_t ApeTag_size(struct ApeTag *tag);
 uint32_t ApeTag_item_count(struct ApeTag *tag);
@@ -79,10 +216,56 @@ enum ApeTag_errcode ApeTag_error_code(struct ApeTag *tag);
 
 int ApeTag_mt_init(void);
 
+struct ApeTag_cache * ApeTag_cache_open(const char *path);
+int ApeTag_cache_close(struct ApeTag_cache *cache);
+int ApeTag_set_cache(struct ApeTag *tag, struct ApeTag_cache *cache);
+
+struct ApeTag_index_writer * ApeTag_index_writer_new(void);
+int ApeTag_index_writer_add(struct ApeTag_index_writer *writer, const char *filename, struct ApeTag *tag);
+int ApeTag_index_writer_write(struct ApeTag_index_writer *writer, const char *path);
+void ApeTag_index_writer_free(struct ApeTag_index_writer *writer);
+struct ApeTag_index * ApeTag_index_open(const char *path);
+int ApeTag_index_close(struct ApeTag_index *index);
+uint32_t ApeTag_index_file_count(struct ApeTag_index *index);
+const char * ApeTag_index_filename(struct ApeTag_index *index, uint32_t file);
+int ApeTag_index_find_file(struct ApeTag_index *index, const char *filename, uint32_t *file);
+uint32_t ApeTag_index_item_count(struct ApeTag_index *index, uint32_t file);
+int ApeTag_index_get_item(struct ApeTag_index *index, uint32_t file, uint32_t item, struct ApeItem *view);
+int ApeTag_index_lookup(struct ApeTag_index *index, uint32_t file, const char *key, struct ApeItem *view);
+uint32_t ApeTag_index_key_count(struct ApeTag_index *index);
+const char * ApeTag_index_key(struct ApeTag_index *index, uint32_t key);
+
+struct ApeTag_snapshot * ApeTag_snapshot(struct ApeTag *tag);
+struct ApeTag_snapshot * ApeTag_snapshot_ref(struct ApeTag_snapshot *snapshot);
+void ApeTag_snapshot_unref(struct ApeTag_snapshot *snapshot);
+uint32_t ApeTag_snapshot_item_count(const struct ApeTag_snapshot *snapshot);
+const struct ApeItem * ApeTag_snapshot_item(const struct ApeTag_snapshot *snapshot, uint32_t index);
+const struct ApeItem * ApeTag_snapshot_get_item(const struct ApeTag_snapshot *snapshot, const char *key);
+int ApeTag_snapshot_iter_items(const struct ApeTag_snapshot *snapshot, int iterator(const struct ApeItem *item, void *data), void *data);
+const char * ApeTag_snapshot_raw(const struct ApeTag_snapshot *snapshot, uint32_t *raw_size);
+
+struct ApeTag_lru * ApeTag_lru_new(size_t max_bytes, uint32_t shards);
+void ApeTag_lru_free(struct ApeTag_lru *lru);
+struct ApeTag_snapshot * ApeTag_lru_get(struct ApeTag_lru *lru, const char *path, uint32_t flags, enum ApeTag_errcode *errcode, const char **error);
+int ApeTag_lru_invalidate(struct ApeTag_lru *lru, const char *path);
+int ApeTag_lru_get_stats(struct ApeTag_lru *lru, struct ApeTag_lru_stats *stats);
+
+struct ApeTag_group * ApeTag_group_new(void);
+int ApeTag_group_commit(struct ApeTag_group *group);
+void ApeTag_group_free(struct ApeTag_group *group);
+
+int ApeTag_get_stats(struct ApeTag *tag, struct ApeTag_stats *stats);
+int ApeTag_get_global_stats(struct ApeTag_stats *stats);
+
 /* Get/set library limits */
 size_t ApeTag_get_max_size(void);
 size_t ApeTag_get_max_item_count(void);
 void ApeTag_set_max_size(uint32_t size);
 void ApeTag_set_max_item_count(uint32_t item_count);
 
+/* Get/set allocator hooks */
+int ApeTag_set_allocator(const struct ApeTag_allocator *allocator);
+int ApeTag_set_tag_allocator(struct ApeTag *tag, const struct ApeTag_allocator *allocator);
+void ApeTag_get_allocator(struct ApeTag *tag, struct ApeTag_allocator *allocator);
+
 #endif /* !_APETAG_H_ */
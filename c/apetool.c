@@ -0,0 +1,44 @@
+#include <apetool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Returns a newly allocated copy of the value with the escapes used by
+apeinfo --format=tsv replaced, setting size to the length of the copy.
+\0 separates multiple values.
+*/
+char *ApeTool_unescape(const char *value, u_int32_t *size) {
+    char *unescaped;
+    const char *c;
+    char *d;
+
+    if ((unescaped = malloc(strlen(value) + 1)) == NULL) {
+        return NULL;
+    }
+    for (c = value, d = unescaped; *c != '\0'; c++) {
+        if (*c != '\\' || c[1] == '\0') {
+            *d++ = *c;
+            continue;
+        }
+        switch (*++c) {
+        case 't':
+            *d++ = '\t';
+            break;
+        case 'n':
+            *d++ = '\n';
+            break;
+        case 'r':
+            *d++ = '\r';
+            break;
+        case '0':
+            *d++ = '\0';
+            break;
+        default:
+            *d++ = *c;
+            break;
+        }
+    }
+    *size = (u_int32_t)(d - unescaped);
+
+    return unescaped;
+}
@@ -0,0 +1,10 @@
+#ifndef _APETOOL_H_
+#define _APETOOL_H_
+
+#include <sys/types.h>
+
+/* Functions shared by apeedit and apewatch */
+
+char *ApeTool_unescape(const char *value, u_int32_t *size);
+
+#endif /* !_APETOOL_H_ */
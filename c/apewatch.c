@@ -0,0 +1,889 @@
+#include <apetag.h>
+#include <apetool.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* Events watched on each directory.  Any event for a file queues it to be
+   parsed again, or removed if it no longer exists. */
+#define APEWATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | \
+                         IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/* Default time in milliseconds without events before queued files are parsed */
+#define APEWATCH_DEFAULT_DELAY 200
+
+/* Queued files are parsed after this many delays even if events keep arriving */
+#define APEWATCH_MAX_DELAYS 10
+
+/* Maximum number of clients, and maximum length of a query */
+#define APEWATCH_MAX_CLIENTS 64
+#define APEWATCH_MAX_LINE 8192
+
+/* Parsed tag of a single file, in the hash of all files */
+struct ApeWatch_file {
+    char *path;
+    struct ApeItem *items;      /* Items, followed by their keys and values */
+    uint32_t num_items;
+    char *error;                /* Why the file couldn't be parsed, if it couldn't */
+    int parsed;
+    int queued;
+    struct ApeWatch_file *next;
+};
+
+/* Connection on the query socket, with buffered input and output */
+struct ApeWatch_client {
+    int fd;
+    char in[APEWATCH_MAX_LINE];
+    size_t in_size;
+    char *out;
+    size_t out_size;
+    size_t out_sent;
+    size_t out_capacity;
+};
+
+/* Item sizes, and where to copy the items, when copying a tag's items */
+struct ApeWatch_copy {
+    struct ApeItem *items;
+    char *data;
+    uint32_t num_items;
+    size_t data_size;
+};
+
+void ApeWatch_scan(const char *dir);
+int ApeWatch_walk(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf);
+void ApeWatch_watch(const char *dir);
+void ApeWatch_unwatch(const char *dir);
+void ApeWatch_queue_tree(const char *dir);
+void ApeWatch_queue(struct ApeWatch_file *file);
+int ApeWatch_is_under(const char *path, const char *dir);
+void ApeWatch_read_events(void);
+void ApeWatch_event(struct inotify_event *event);
+void ApeWatch_flush(void);
+void ApeWatch_parse(struct ApeWatch_file *file);
+int ApeWatch_copy_size(struct ApeTag *tag, struct ApeItem *item, void *data);
+int ApeWatch_copy_item(struct ApeTag *tag, struct ApeItem *item, void *data);
+size_t ApeWatch_hash(const char *path);
+struct ApeWatch_file *ApeWatch_file_get(const char *path, int create);
+void ApeWatch_file_remove(struct ApeWatch_file *file);
+int ApeWatch_listen(const char *path);
+void ApeWatch_accept(int listen_fd);
+int ApeWatch_client_read(struct ApeWatch_client *client);
+int ApeWatch_client_write(struct ApeWatch_client *client);
+void ApeWatch_client_close(size_t i);
+void ApeWatch_query(struct ApeWatch_client *client, char *line);
+int ApeWatch_matches(struct ApeWatch_file *file, const char *key, const char *value, u_int32_t size);
+void ApeWatch_out(struct ApeWatch_client *client, const char *data, size_t size);
+void ApeWatch_out_str(struct ApeWatch_client *client, const char *str);
+void ApeWatch_out_tsv(struct ApeWatch_client *client, const char *data, size_t size);
+void ApeWatch_out_count(struct ApeWatch_client *client, const char *label, unsigned long count);
+double ApeWatch_now(void);
+void ApeWatch_signal(int sig);
+
+/* Hash of all files by path, with chaining */
+static struct ApeWatch_file **files = NULL;
+static size_t files_mask = 0;
+static size_t num_files = 0;
+
+/* Files queued to be parsed when events stop arriving */
+static struct ApeWatch_file **queue = NULL;
+static size_t queue_size = 0;
+static size_t queue_capacity = 0;
+static double first_queued = 0;
+static double last_event = 0;
+static long delay = APEWATCH_DEFAULT_DELAY;
+
+/* Watched directory as given, and all watched directories indexed by watch
+   descriptor */
+static char *root = NULL;
+static char **dirs = NULL;
+static size_t dirs_capacity = 0;
+static int inotify_fd = -1;
+
+/* Tag reused for parsing each file */
+static struct ApeTag *tag = NULL;
+
+/* Query clients */
+static struct ApeWatch_client *clients[APEWATCH_MAX_CLIENTS];
+static size_t num_clients = 0;
+
+/* Counters reported by the stats query */
+static unsigned long num_items = 0;
+static unsigned long num_dirs = 0;
+static unsigned long parses = 0;
+static unsigned long batches = 0;
+
+static volatile sig_atomic_t done = 0;
+
+/* Watch the directory, answering queries on the socket until signaled */
+int main(int argc, char *argv[]) {
+    struct pollfd pfds[APEWATCH_MAX_CLIENTS + 2];
+    struct sigaction sa;
+    const char *socket_path = NULL;
+    char *end;
+    double flush_at;
+    size_t length;
+    size_t i;
+    int listen_fd;
+    int timeout;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "d:s:")) != -1) {
+        switch (ch) {
+        case 'd':
+            delay = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || delay < 0 || delay > 3600000) {
+                errx(1, "invalid delay: %s", optarg);
+            }
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc != optind + 1 || socket_path == NULL) {
+        printf("usage: %s [-d delay] -s socket directory\n", argv[0]);
+        return 1;
+    }
+
+    /* Paths are reported relative to the directory as given, without a
+       trailing slash */
+    if ((root = strdup(argv[optind])) == NULL) {
+        err(1, NULL);
+    }
+    for (length = strlen(root); length > 1 && root[length-1] == '/'; length--) {
+        root[length-1] = '\0';
+    }
+
+    if (ApeTag_mt_init() != 0) {
+        errx(1, "unable to initialize genre table");
+    }
+    if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        err(1, "inotify_init1");
+    }
+
+    /* Directories are watched before they are scanned, so files written
+       during the initial scan are not missed */
+    ApeWatch_scan(root);
+    ApeWatch_flush();
+    listen_fd = ApeWatch_listen(socket_path);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ApeWatch_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    while (!done) {
+        timeout = -1;
+        if (queue_size > 0) {
+            flush_at = last_event + delay / 1000.0;
+            if (flush_at > first_queued + APEWATCH_MAX_DELAYS * delay / 1000.0) {
+                flush_at = first_queued + APEWATCH_MAX_DELAYS * delay / 1000.0;
+            }
+            timeout = flush_at <= ApeWatch_now() ? 0 : (int)((flush_at - ApeWatch_now()) * 1000) + 1;
+        }
+
+        pfds[0].fd = inotify_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = listen_fd;
+        pfds[1].events = num_clients < APEWATCH_MAX_CLIENTS ? POLLIN : 0;
+        for (i=0; i < num_clients; i++) {
+            pfds[i+2].fd = clients[i]->fd;
+            pfds[i+2].events = clients[i]->out_sent < clients[i]->out_size ? POLLOUT : POLLIN;
+        }
+        if (poll(pfds, num_clients + 2, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err(1, "poll");
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            ApeWatch_read_events();
+        }
+        if (queue_size > 0) {
+            flush_at = last_event + delay / 1000.0;
+            if (flush_at <= ApeWatch_now() ||
+                first_queued + APEWATCH_MAX_DELAYS * delay / 1000.0 <= ApeWatch_now()) {
+                ApeWatch_flush();
+            }
+        }
+
+        /* Clients are processed from the end, as closing a client moves the
+           last client into its place */
+        for (i=num_clients; i > 0; i--) {
+            if (pfds[i+1].revents & (POLLERR | POLLHUP | POLLNVAL) && !(pfds[i+1].revents & POLLIN)) {
+                ApeWatch_client_close(i-1);
+            } else if ((pfds[i+1].revents & POLLOUT && ApeWatch_client_write(clients[i-1]) != 0) ||
+                       (pfds[i+1].revents & POLLIN && ApeWatch_client_read(clients[i-1]) != 0)) {
+                ApeWatch_client_close(i-1);
+            }
+        }
+        if (pfds[1].revents & POLLIN) {
+            ApeWatch_accept(listen_fd);
+        }
+    }
+
+    while (num_clients > 0) {
+        ApeWatch_client_close(num_clients - 1);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    if (tag != NULL) {
+        ApeTag_free(tag);
+    }
+
+    return 0;
+}
+
+/*
+Watches the directory and all directories under it, and queues all files
+under it to be parsed.
+*/
+void ApeWatch_scan(const char *dir) {
+    if (nftw(dir, ApeWatch_walk, 64, FTW_PHYS) != 0) {
+        warn("%s", dir);
+    }
+}
+
+/* nftw callback for ApeWatch_scan */
+int ApeWatch_walk(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)ftwbuf;
+
+    if (typeflag == FTW_D) {
+        ApeWatch_watch(path);
+    } else if (typeflag == FTW_DNR || typeflag == FTW_NS) {
+        warnx("%s: unable to read", path);
+    } else if (typeflag == FTW_F && S_ISREG(sb->st_mode)) {
+        ApeWatch_queue(ApeWatch_file_get(path, 1));
+    }
+    return 0;
+}
+
+/*
+Adds an inotify watch for the directory, recording its path so event paths
+can be built from the watch descriptor.  Watching an already watched
+directory returns the same descriptor, which updates its path.
+*/
+void ApeWatch_watch(const char *dir) {
+    size_t capacity;
+    int wd;
+
+    if ((wd = inotify_add_watch(inotify_fd, dir, APEWATCH_EVENTS)) == -1) {
+        warn("%s", dir);
+        return;
+    }
+    if ((size_t)wd >= dirs_capacity) {
+        for (capacity = dirs_capacity ? dirs_capacity : 64; capacity <= (size_t)wd; capacity *= 2) {
+            /* Left Blank */
+        }
+        if ((dirs = realloc(dirs, capacity * sizeof(char *))) == NULL) {
+            err(1, NULL);
+        }
+        memset(dirs + dirs_capacity, 0, (capacity - dirs_capacity) * sizeof(char *));
+        dirs_capacity = capacity;
+    }
+    if (dirs[wd] == NULL) {
+        num_dirs++;
+    }
+    free(dirs[wd]);
+    if ((dirs[wd] = strdup(dir)) == NULL) {
+        err(1, NULL);
+    }
+}
+
+/*
+Removes the watches for the directory and all directories under it, used
+when a directory is moved away, as its watch would otherwise report events
+under its old path.
+*/
+void ApeWatch_unwatch(const char *dir) {
+    size_t wd;
+
+    for (wd=0; wd < dirs_capacity; wd++) {
+        if (dirs[wd] != NULL && ApeWatch_is_under(dirs[wd], dir)) {
+            inotify_rm_watch(inotify_fd, (int)wd);
+            free(dirs[wd]);
+            dirs[wd] = NULL;
+            num_dirs--;
+        }
+    }
+}
+
+/* Queues all known files under the directory, so those now missing are removed */
+void ApeWatch_queue_tree(const char *dir) {
+    struct ApeWatch_file *file;
+    size_t i;
+
+    for (i=0; files != NULL && i <= files_mask; i++) {
+        for (file = files[i]; file != NULL; file = file->next) {
+            if (ApeWatch_is_under(file->path, dir)) {
+                ApeWatch_queue(file);
+            }
+        }
+    }
+}
+
+/* Queues the file to be parsed when events stop arriving, if it isn't already */
+void ApeWatch_queue(struct ApeWatch_file *file) {
+    if (file->queued) {
+        return;
+    }
+    if (queue_size == queue_capacity) {
+        queue_capacity = queue_capacity ? queue_capacity * 2 : 256;
+        if ((queue = realloc(queue, queue_capacity * sizeof(struct ApeWatch_file *))) == NULL) {
+            err(1, NULL);
+        }
+    }
+    if (queue_size == 0) {
+        first_queued = ApeWatch_now();
+    }
+    queue[queue_size++] = file;
+    file->queued = 1;
+}
+
+/* Whether the path is the directory or under it */
+int ApeWatch_is_under(const char *path, const char *dir) {
+    size_t length = strlen(dir);
+
+    return strncmp(path, dir, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+/* Reads and handles all pending inotify events */
+void ApeWatch_read_events(void) {
+    char buf[65536];
+    struct inotify_event *event;
+    ssize_t size;
+    ssize_t offset;
+
+    while ((size = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (offset = 0; offset < size; offset += (ssize_t)sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)(void *)(buf + offset);
+            ApeWatch_event(event);
+        }
+    }
+    if (size == -1 && errno != EAGAIN && errno != EINTR) {
+        err(1, "inotify");
+    }
+    last_event = ApeWatch_now();
+}
+
+/*
+Handles a single inotify event.  File events queue the file, new directories
+are scanned, and directories moved or deleted have their files queued so they
+are removed.  If the event queue overflowed, the whole tree is rescanned once
+from the root, which rewatches every directory under it.
+*/
+void ApeWatch_event(struct inotify_event *event) {
+    char *path;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        warnx("event queue overflowed, rescanning");
+        ApeWatch_queue_tree(root);
+        ApeWatch_scan(root);
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        if (event->wd >= 0 && (size_t)event->wd < dirs_capacity && dirs[event->wd] != NULL) {
+            free(dirs[event->wd]);
+            dirs[event->wd] = NULL;
+            num_dirs--;
+        }
+        return;
+    }
+    if (event->len == 0 || event->wd < 0 || (size_t)event->wd >= dirs_capacity || dirs[event->wd] == NULL) {
+        return;
+    }
+
+    if ((path = malloc(strlen(dirs[event->wd]) + strlen(event->name) + 2)) == NULL) {
+        err(1, NULL);
+    }
+    sprintf(path, "%s/%s", dirs[event->wd], event->name);
+    if (!(event->mask & IN_ISDIR)) {
+        ApeWatch_queue(ApeWatch_file_get(path, 1));
+    } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        ApeWatch_scan(path);
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        ApeWatch_unwatch(path);
+        ApeWatch_queue_tree(path);
+    }
+    free(path);
+}
+
+/* Parses all queued files, removing those that are no longer regular files */
+void ApeWatch_flush(void) {
+    struct ApeWatch_file *file;
+    struct stat sb;
+    size_t i;
+
+    for (i=0; i < queue_size; i++) {
+        file = queue[i];
+        file->queued = 0;
+        if (lstat(file->path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+            ApeWatch_file_remove(file);
+        } else {
+            ApeWatch_parse(file);
+        }
+    }
+    queue_size = 0;
+    batches++;
+}
+
+/*
+Parses the file's tag, copying its items into a single allocation so the
+tag can be reused for the next file.  The tag is reset to have no file
+afterward, so the last file parsed isn't kept open.
+*/
+void ApeWatch_parse(struct ApeWatch_file *file) {
+    struct ApeWatch_copy copy;
+    const char *error = NULL;
+
+    num_items -= file->num_items;
+    free(file->items);
+    free(file->error);
+    file->items = NULL;
+    file->num_items = 0;
+    file->error = NULL;
+    file->parsed = 1;
+    parses++;
+
+    if (tag == NULL && (tag = ApeTag_new(NULL, 0)) == NULL) {
+        err(1, NULL);
+    }
+    if (ApeTag_reset_open(tag, file->path, O_RDONLY, 0) != 0) {
+        error = ApeTag_error_code(tag) == APETAG_FILEERR ? strerror(errno) : ApeTag_error(tag);
+    } else if (ApeTag_parse(tag) != 0) {
+        error = ApeTag_error(tag);
+    } else {
+        memset(&copy, 0, sizeof(copy));
+        ApeTag_iter_items(tag, ApeWatch_copy_size, &copy);
+        if ((copy.items = malloc(copy.num_items * sizeof(struct ApeItem) + copy.data_size + 1)) == NULL) {
+            err(1, NULL);
+        }
+        copy.data = (char *)(copy.items + copy.num_items);
+        copy.num_items = 0;
+        ApeTag_iter_items(tag, ApeWatch_copy_item, &copy);
+        file->items = copy.items;
+        file->num_items = copy.num_items;
+        num_items += file->num_items;
+    }
+
+    if (error != NULL && (file->error = strdup(error)) == NULL) {
+        err(1, NULL);
+    }
+    if (ApeTag_reset(tag, NULL, 0) != 0) {
+        warnx("%s: %s", file->path, ApeTag_error(tag));
+    }
+}
+
+/* ApeTag_iter_items callback adding up the space needed to copy the items */
+int ApeWatch_copy_size(struct ApeTag *t, struct ApeItem *item, void *data) {
+    struct ApeWatch_copy *copy = data;
+    (void)t;
+
+    copy->num_items++;
+    copy->data_size += strlen(item->key) + 1 + item->size;
+    return 0;
+}
+
+/* ApeTag_iter_items callback copying the item */
+int ApeWatch_copy_item(struct ApeTag *t, struct ApeItem *item, void *data) {
+    struct ApeWatch_copy *copy = data;
+    struct ApeItem *dest = &copy->items[copy->num_items++];
+    size_t length = strlen(item->key) + 1;
+    (void)t;
+
+    dest->size = item->size;
+    dest->flags = item->flags;
+    dest->key = memcpy(copy->data, item->key, length);
+    dest->value = memcpy(copy->data + length, item->value, item->size);
+    copy->data += length + item->size;
+    return 0;
+}
+
+/* FNV-1a hash of the path */
+size_t ApeWatch_hash(const char *path) {
+    size_t hash = 2166136261U;
+
+    for (; *path != '\0'; path++) {
+        hash = (hash ^ (unsigned char)*path) * 16777619U;
+    }
+    return hash;
+}
+
+/*
+Returns the file with the given path, adding it if create is true, in which
+case it isn't visible to queries until it has been parsed.  The hash is
+doubled when it has as many files as buckets.
+*/
+struct ApeWatch_file *ApeWatch_file_get(const char *path, int create) {
+    struct ApeWatch_file **new_files;
+    struct ApeWatch_file *file;
+    struct ApeWatch_file *next;
+    size_t i;
+
+    if (files != NULL) {
+        for (file = files[ApeWatch_hash(path) & files_mask]; file != NULL; file = file->next) {
+            if (strcmp(file->path, path) == 0) {
+                return file;
+            }
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    if (files == NULL || num_files > files_mask) {
+        if ((new_files = calloc(files == NULL ? 1024 : (files_mask + 1) * 2, sizeof(struct ApeWatch_file *))) == NULL) {
+            err(1, NULL);
+        }
+        for (i=0; files != NULL && i <= files_mask; i++) {
+            for (file = files[i]; file != NULL; file = next) {
+                next = file->next;
+                file->next = new_files[ApeWatch_hash(file->path) & (files_mask * 2 + 1)];
+                new_files[ApeWatch_hash(file->path) & (files_mask * 2 + 1)] = file;
+            }
+        }
+        files_mask = files == NULL ? 1023 : files_mask * 2 + 1;
+        free(files);
+        files = new_files;
+    }
+
+    if ((file = calloc(1, sizeof(struct ApeWatch_file))) == NULL ||
+        (file->path = strdup(path)) == NULL) {
+        err(1, NULL);
+    }
+    file->next = files[ApeWatch_hash(path) & files_mask];
+    files[ApeWatch_hash(path) & files_mask] = file;
+    num_files++;
+
+    return file;
+}
+
+/* Removes the file from the hash and frees it */
+void ApeWatch_file_remove(struct ApeWatch_file *file) {
+    struct ApeWatch_file **prev;
+
+    for (prev = &files[ApeWatch_hash(file->path) & files_mask]; *prev != file; prev = &(*prev)->next) {
+        /* Left Blank */
+    }
+    *prev = file->next;
+    num_files--;
+    num_items -= file->num_items;
+
+    free(file->path);
+    free(file->items);
+    free(file->error);
+    free(file);
+}
+
+/* Listens on the Unix socket at the path, replacing any existing socket */
+int ApeWatch_listen(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errx(1, "%s: socket path too long", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        err(1, "socket");
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)(void *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        err(1, "%s", path);
+    }
+    return fd;
+}
+
+/* Accepts a new client, which is read from without blocking */
+void ApeWatch_accept(int listen_fd) {
+    struct ApeWatch_client *client;
+    int fd;
+
+    if ((fd = accept(listen_fd, NULL, NULL)) == -1) {
+        if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+            warn("accept");
+        }
+        return;
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        warn("fcntl");
+        close(fd);
+        return;
+    }
+    if ((client = calloc(1, sizeof(struct ApeWatch_client))) == NULL) {
+        err(1, NULL);
+    }
+    client->fd = fd;
+    clients[num_clients++] = client;
+}
+
+/*
+Reads from the client, answering each complete query line.
+
+Returns 0 to keep the client, -1 to close it.
+*/
+int ApeWatch_client_read(struct ApeWatch_client *client) {
+    ssize_t size;
+    char *line;
+    char *newline;
+    size_t remaining;
+
+    size = read(client->fd, client->in + client->in_size, sizeof(client->in) - client->in_size);
+    if (size == -1) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    } else if (size == 0) {
+        return -1;
+    }
+    client->in_size += (size_t)size;
+
+    line = client->in;
+    remaining = client->in_size;
+    while ((newline = memchr(line, '\n', remaining)) != NULL) {
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        ApeWatch_query(client, line);
+        remaining -= (size_t)(newline + 1 - line);
+        line = newline + 1;
+    }
+    if (remaining == sizeof(client->in)) {
+        ApeWatch_out_str(client, "ERR query too long\n");
+        remaining = 0;
+    }
+    memmove(client->in, line, remaining);
+    client->in_size = remaining;
+
+    return ApeWatch_client_write(client);
+}
+
+/*
+Writes as much of the client's pending output as it will take.
+
+Returns 0 to keep the client, -1 to close it.
+*/
+int ApeWatch_client_write(struct ApeWatch_client *client) {
+    ssize_t size;
+
+    while (client->out_sent < client->out_size) {
+        size = write(client->fd, client->out + client->out_sent, client->out_size - client->out_sent);
+        if (size == -1) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        client->out_sent += (size_t)size;
+    }
+    client->out_size = client->out_sent = 0;
+    return 0;
+}
+
+/* Closes the client, moving the last client into its place */
+void ApeWatch_client_close(size_t i) {
+    close(clients[i]->fd);
+    free(clients[i]->out);
+    free(clients[i]);
+    clients[i] = clients[--num_clients];
+}
+
+/*
+Answers a query, which has the command and its arguments separated by tabs.
+Responses start with "OK count", followed by count lines, or with "ERR" and
+a message.  Fields in responses are separated by tabs, and escaped as in
+apeinfo --format=tsv.
+*/
+void ApeWatch_query(struct ApeWatch_client *client, char *line) {
+    struct ApeWatch_file *file;
+    char *fields[3];
+    size_t num_fields = 0;
+    char *value = NULL;
+    char *c = line;
+    unsigned long count;
+    u_int32_t size = 0;
+    size_t i;
+    uint32_t j;
+    int pass;
+
+    while (num_fields < 3) {
+        fields[num_fields++] = c;
+        if ((c = strchr(c, '\t')) == NULL) {
+            break;
+        }
+        *c++ = '\0';
+    }
+
+    if (num_fields == 2 && strcmp(fields[0], "GET") == 0) {
+        if ((file = ApeWatch_file_get(fields[1], 0)) == NULL || !file->parsed) {
+            ApeWatch_out_str(client, "ERR no such file\n");
+        } else if (file->error != NULL) {
+            ApeWatch_out_str(client, "ERR ");
+            ApeWatch_out_tsv(client, file->error, strlen(file->error));
+            ApeWatch_out_str(client, "\n");
+        } else {
+            ApeWatch_out_count(client, "OK", file->num_items);
+            for (j=0; j < file->num_items; j++) {
+                ApeWatch_out_tsv(client, file->items[j].key, strlen(file->items[j].key));
+                ApeWatch_out_str(client, "\t");
+                ApeWatch_out_tsv(client, file->items[j].value, file->items[j].size);
+                ApeWatch_out_str(client, "\n");
+            }
+        }
+    } else if ((num_fields == 3 && strcmp(fields[0], "FIND") == 0) ||
+               (num_fields <= 2 && strcmp(fields[0], "LIST") == 0)) {
+        /* The first pass counts the matching files, the second prints them */
+        if (num_fields == 3 && (value = ApeTool_unescape(fields[2], &size)) == NULL) {
+            err(1, NULL);
+        }
+        for (pass = 0, count = 0; pass < 2; pass++) {
+            for (i=0; files != NULL && i <= files_mask; i++) {
+                for (file = files[i]; file != NULL; file = file->next) {
+                    if (!file->parsed || (num_fields == 2 && !ApeWatch_is_under(file->path, fields[1])) ||
+                        (num_fields == 3 && !ApeWatch_matches(file, fields[1], value, size))) {
+                        continue;
+                    }
+                    if (pass == 0) {
+                        count++;
+                    } else {
+                        ApeWatch_out_tsv(client, file->path, strlen(file->path));
+                        ApeWatch_out_str(client, "\n");
+                    }
+                }
+            }
+            if (pass == 0) {
+                ApeWatch_out_count(client, "OK", count);
+            }
+        }
+        free(value);
+    } else if (num_fields == 1 && strcmp(fields[0], "STATS") == 0) {
+        ApeWatch_out_count(client, "OK", 6);
+        ApeWatch_out_count(client, "files", (unsigned long)num_files);
+        ApeWatch_out_count(client, "items", num_items);
+        ApeWatch_out_count(client, "directories", num_dirs);
+        ApeWatch_out_count(client, "queued", (unsigned long)queue_size);
+        ApeWatch_out_count(client, "parses", parses);
+        ApeWatch_out_count(client, "batches", batches);
+    } else {
+        ApeWatch_out_str(client, "ERR invalid query\n");
+    }
+}
+
+/*
+Whether the file has an item with the key, compared case insensitively, and
+the value, which is compared to the whole item value and to each of its
+values.
+*/
+int ApeWatch_matches(struct ApeWatch_file *file, const char *key, const char *value, u_int32_t size) {
+    const char *item_value;
+    uint32_t length;
+    uint32_t cursor;
+    uint32_t i;
+
+    for (i=0; i < file->num_items; i++) {
+        if (strcasecmp(file->items[i].key, key) != 0) {
+            continue;
+        }
+        if (file->items[i].size == size && memcmp(file->items[i].value, value, size) == 0) {
+            return 1;
+        }
+        for (cursor = 0; ApeItem_next_value(&file->items[i], &cursor, &item_value, &length) == 1; ) {
+            if (length == size && memcmp(item_value, value, size) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Appends the data to the client's pending output */
+void ApeWatch_out(struct ApeWatch_client *client, const char *data, size_t size) {
+    if (client->out_size + size > client->out_capacity) {
+        while (client->out_size + size > client->out_capacity) {
+            client->out_capacity = client->out_capacity ? client->out_capacity * 2 : 4096;
+        }
+        if ((client->out = realloc(client->out, client->out_capacity)) == NULL) {
+            err(1, NULL);
+        }
+    }
+    memcpy(client->out + client->out_size, data, size);
+    client->out_size += size;
+}
+
+void ApeWatch_out_str(struct ApeWatch_client *client, const char *str) {
+    ApeWatch_out(client, str, strlen(str));
+}
+
+/* Appends the data escaped as in apeinfo --format=tsv */
+void ApeWatch_out_tsv(struct ApeWatch_client *client, const char *data, size_t size) {
+    const char *end = data + size;
+    const char *start;
+    char escape[2] = {'\\', '\\'};
+
+    while (data < end) {
+        for (start = data; data < end && *data != '\t' && *data != '\n' && *data != '\r' && *data != '\0' && *data != '\\'; data++) {
+            /* Left Blank */
+        }
+        ApeWatch_out(client, start, (size_t)(data - start));
+        if (data == end) {
+            break;
+        }
+        switch (*data++) {
+        case '\t':
+            escape[1] = 't';
+            break;
+        case '\n':
+            escape[1] = 'n';
+            break;
+        case '\r':
+            escape[1] = 'r';
+            break;
+        case '\0':
+            escape[1] = '0';
+            break;
+        default:
+            escape[1] = '\\';
+            break;
+        }
+        ApeWatch_out(client, escape, 2);
+    }
+}
+
+/* Appends a line with the label and count */
+void ApeWatch_out_count(struct ApeWatch_client *client, const char *label, unsigned long count) {
+    char line[64];
+
+    snprintf(line, sizeof(line), "%s %lu\n", label, count);
+    ApeWatch_out_str(client, line);
+}
+
+double ApeWatch_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void ApeWatch_signal(int sig) {
+    (void)sig;
+    done = 1;
+}
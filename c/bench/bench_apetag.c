@@ -0,0 +1,337 @@
+#include <apetag.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Maximum tag size, matching gen_corpus */
+#define BENCH_MAXIMUM_TAG_SIZE (1 << 18)
+
+/* Result of running a benchmark */
+struct bench_result {
+    unsigned long ops;
+    unsigned long allocations;
+    double seconds;
+};
+
+/* State shared by the benchmarks for a single corpus file */
+struct bench_file {
+    const char *dir;
+    const char *name;
+    char path[4096];
+    char copy_path[4096];
+    char *contents;
+    long size;
+};
+
+typedef int (*bench_function)(struct bench_file *bf, struct bench_result *result);
+
+int bench_dir(const char *dir);
+int bench_run_file(struct bench_file *bf);
+void bench_report(const char *benchmark, struct bench_file *bf, struct bench_result *result);
+int bench_exists(struct bench_file *bf, struct bench_result *result);
+int bench_parse(struct bench_file *bf, struct bench_result *result);
+int bench_get_item(struct bench_file *bf, struct bench_result *result);
+int bench_update(struct bench_file *bf, struct bench_result *result);
+int bench_remove(struct bench_file *bf, struct bench_result *result);
+int bench_restore(struct bench_file *bf, FILE *file);
+double bench_now(void);
+void *bench_malloc(void *ctx, size_t size);
+void *bench_realloc(void *ctx, void *ptr, size_t size);
+void bench_free(void *ctx, void *ptr);
+
+/* Minimum time to run each benchmark for each file, in seconds */
+static double bench_time = 0.05;
+
+/* Allocations made by the library, counted by its allocator hooks */
+static unsigned long allocations = 0;
+static const struct ApeTag_allocator bench_allocator = {
+    bench_malloc, bench_realloc, bench_free, &allocations
+};
+
+/*
+Runs the benchmarks on every file in the given corpus directories, printing
+one JSON object per line for each benchmark and file.
+*/
+int main(int argc, char *argv[]) {
+    int ch;
+    int i;
+    int ret = 0;
+    char *end;
+
+    while ((ch = getopt(argc, argv, "t:")) != -1) {
+        switch (ch) {
+        case 't':
+            bench_time = strtod(optarg, &end);
+            if (*optarg == '\0' || *end != '\0' || bench_time <= 0) {
+                errx(1, "invalid time: %s", optarg);
+            }
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc <= optind) {
+        printf("usage: %s [-t seconds] corpus-directory [...]\n", argv[0]);
+        return 1;
+    }
+
+    ApeTag_set_max_size(BENCH_MAXIMUM_TAG_SIZE);
+    ApeTag_set_allocator(&bench_allocator);
+    if (ApeTag_mt_init() != 0) {
+        errx(1, "unable to initialize genre table");
+    }
+    for (i=optind; i < argc; i++) {
+        if (bench_dir(argv[i]) != 0) {
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+
+int bench_dir(const char *dir) {
+    struct bench_file bf;
+    struct dirent **entries;
+    FILE *file;
+    int num_entries;
+    int i;
+    int ret = 0;
+    size_t length;
+
+    if ((num_entries = scandir(dir, &entries, NULL, alphasort)) < 0) {
+        warn("%s", dir);
+        return 1;
+    }
+
+    for (i=0; i < num_entries; i++) {
+        length = strlen(entries[i]->d_name);
+        if (length < 4 || strcmp(entries[i]->d_name + length - 4, ".tag") != 0) {
+            free(entries[i]);
+            continue;
+        }
+
+        memset(&bf, 0, sizeof(bf));
+        bf.dir = dir;
+        bf.name = entries[i]->d_name;
+        snprintf(bf.path, sizeof(bf.path), "%s/%s", dir, bf.name);
+        snprintf(bf.copy_path, sizeof(bf.copy_path), "%s/%s.bench", dir, bf.name);
+        if ((file = fopen(bf.path, "r")) == NULL || fseek(file, 0, SEEK_END) != 0 ||
+            (bf.size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0 ||
+            (bf.contents = malloc((size_t)bf.size + 1)) == NULL ||
+            fread(bf.contents, 1, (size_t)bf.size, file) != (size_t)bf.size) {
+            warn("%s", bf.path);
+            ret = 1;
+        } else if (bench_run_file(&bf) != 0) {
+            ret = 1;
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        unlink(bf.copy_path);
+        free(bf.contents);
+        free(entries[i]);
+    }
+    free(entries);
+
+    return ret;
+}
+
+int bench_run_file(struct bench_file *bf) {
+    static const char *names[] = {"exists", "parse", "get_item", "update", "remove"};
+    static const bench_function functions[] = {bench_exists, bench_parse, bench_get_item, bench_update, bench_remove};
+    struct bench_result result;
+    size_t i;
+
+    for (i=0; i < sizeof(functions)/sizeof(functions[0]); i++) {
+        memset(&result, 0, sizeof(result));
+        if (functions[i](bf, &result) != 0) {
+            warnx("%s: %s failed", bf->path, names[i]);
+            return 1;
+        }
+        bench_report(names[i], bf, &result);
+    }
+
+    return 0;
+}
+
+void bench_report(const char *benchmark, struct bench_file *bf, struct bench_result *result) {
+    printf("{\"benchmark\":\"%s\",\"dir\":\"%s\",\"file\":\"%s\",\"ops\":%lu,"
+           "\"ops_per_sec\":%.1f,\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f}\n",
+           benchmark, bf->dir, bf->name, result->ops,
+           result->ops / result->seconds, result->seconds * 1e9 / result->ops,
+           (double)result->allocations / result->ops);
+    fflush(stdout);
+}
+
+/*
+Each benchmark runs its operation until bench_time has passed, timing and
+counting allocations for only the operation itself.  Setup that must be
+repeated for each operation, such as restoring a file that was modified,
+is excluded from the time and allocation counts.
+*/
+
+#define BENCH_LOOP(SETUP, OPERATION) \
+    while (result->seconds < bench_time) { \
+        SETUP; \
+        start = bench_now(); \
+        start_allocations = allocations; \
+        OPERATION; \
+        result->allocations += allocations - start_allocations; \
+        result->seconds += bench_now() - start; \
+        result->ops++; \
+    }
+
+/* Creates a tag and checks for an APE tag, which reads the footer */
+int bench_exists(struct bench_file *bf, struct bench_result *result) {
+    struct ApeTag *tag;
+    FILE *file;
+    double start;
+    unsigned long start_allocations;
+    int ret = 0;
+
+    if ((file = fopen(bf->path, "r")) == NULL) {
+        return -1;
+    }
+    BENCH_LOOP((void)0,
+        if ((tag = ApeTag_new(file, 0)) == NULL || ApeTag_exists(tag) < 0) { ret = -1; }
+        ApeTag_free(tag));
+    fclose(file);
+
+    return ret;
+}
+
+/* Creates a tag and parses all items */
+int bench_parse(struct bench_file *bf, struct bench_result *result) {
+    struct ApeTag *tag;
+    FILE *file;
+    double start;
+    unsigned long start_allocations;
+    int ret = 0;
+
+    if ((file = fopen(bf->path, "r")) == NULL) {
+        return -1;
+    }
+    BENCH_LOOP((void)0,
+        if ((tag = ApeTag_new(file, 0)) == NULL || ApeTag_parse(tag) != 0) { ret = -1; }
+        ApeTag_free(tag));
+    fclose(file);
+
+    return ret;
+}
+
+/* Looks up each item in turn in an already parsed tag, using a lowercase key */
+int bench_get_item(struct bench_file *bf, struct bench_result *result) {
+    struct ApeTag *tag;
+    struct ApeItem **items;
+    char key[256];
+    FILE *file;
+    double start;
+    unsigned long start_allocations;
+    uint32_t num_items;
+    uint32_t i = 0;
+    char *c;
+
+    if ((file = fopen(bf->path, "r")) == NULL) {
+        return -1;
+    }
+    if ((tag = ApeTag_new(file, 0)) == NULL || ApeTag_parse(tag) != 0 ||
+        (items = ApeTag_get_items(tag, &num_items)) == NULL) {
+        return -1;
+    }
+    if (num_items == 0) {
+        strcpy(key, "title");
+    }
+    BENCH_LOOP(
+        if (num_items > 0) {
+            strcpy(key, items[i++ % num_items]->key);
+            for (c = key; *c != '\0'; c++) {
+                *c = (char)tolower((unsigned char)*c);
+            }
+        },
+        ApeTag_get_item(tag, key));
+    free(items);
+    ApeTag_free(tag);
+    fclose(file);
+
+    return 0;
+}
+
+/* Rewrites the tag of an already parsed tag on a copy of the file */
+int bench_update(struct bench_file *bf, struct bench_result *result) {
+    struct ApeTag *tag;
+    FILE *file;
+    double start;
+    unsigned long start_allocations;
+    int ret = 0;
+
+    if ((file = fopen(bf->copy_path, "w+")) == NULL || bench_restore(bf, file) != 0) {
+        return -1;
+    }
+    if ((tag = ApeTag_new(file, 0)) == NULL || ApeTag_parse(tag) != 0) {
+        return -1;
+    }
+    BENCH_LOOP((void)0,
+        if (ApeTag_update(tag) != 0) { ret = -1; });
+    ApeTag_free(tag);
+    fclose(file);
+
+    return ret;
+}
+
+/* Creates a tag and removes it from a copy of the file, which is restored each time */
+int bench_remove(struct bench_file *bf, struct bench_result *result) {
+    struct ApeTag *tag;
+    FILE *file;
+    double start;
+    unsigned long start_allocations;
+    int ret = 0;
+
+    if ((file = fopen(bf->copy_path, "w+")) == NULL) {
+        return -1;
+    }
+    BENCH_LOOP(
+        if (bench_restore(bf, file) != 0) { ret = -1; break; },
+        if ((tag = ApeTag_new(file, 0)) == NULL || ApeTag_remove(tag) < 0) { ret = -1; }
+        ApeTag_free(tag));
+    fclose(file);
+
+    return ret;
+}
+
+/* Replaces the contents of the file with the original corpus file */
+int bench_restore(struct bench_file *bf, FILE *file) {
+    if (fseek(file, 0, SEEK_SET) != 0 ||
+        fwrite(bf->contents, 1, (size_t)bf->size, file) != (size_t)bf->size ||
+        fflush(file) != 0 || ftruncate(fileno(file), bf->size) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+double bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void *bench_malloc(void *ctx, size_t size) {
+    (*(unsigned long *)ctx)++;
+    return malloc(size);
+}
+
+void *bench_realloc(void *ctx, void *ptr, size_t size) {
+    (*(unsigned long *)ctx)++;
+    return realloc(ptr, size);
+}
+
+void bench_free(void *ctx, void *ptr) {
+    (void)ctx;
+    free(ptr);
+}
@@ -0,0 +1,134 @@
+#include <apetag.h>
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Size of the fake audio data before the tag */
+#define GEN_AUDIO_SIZE 4096
+
+/* Maximum tag size, large enough for the largest tag in the corpus */
+#define GEN_MAXIMUM_TAG_SIZE (1 << 18)
+
+int gen_file(const char *dir, uint32_t item_count, uint32_t value_size, int mixed, int id3);
+int gen_add_item(struct ApeTag *tag, uint32_t i, uint32_t value_size, int binary);
+uint32_t gen_random(void);
+
+static uint32_t seed = 1;
+
+/*
+Generates a synthetic corpus of tagged files in the given directory, for
+use by bench_apetag.  Files are named after how they were generated, for
+example items8_value256_mixed_id3.tag has 8 items with 256 byte values,
+half of which are binary, followed by an ID3v1 tag.  notag.tag has no tag.
+*/
+int main(int argc, char *argv[]) {
+    static const uint32_t item_counts[] = {1, 8, 64};
+    static const uint32_t value_sizes[] = {16, 256, 2048};
+    char path[4096];
+    FILE *file;
+    size_t i;
+    size_t j;
+    int mixed;
+    int id3;
+
+    if (argc != 2) {
+        printf("usage: %s directory\n", argv[0]);
+        return 1;
+    }
+    if (mkdir(argv[1], 0777) != 0 && errno != EEXIST) {
+        err(1, "%s", argv[1]);
+    }
+
+    ApeTag_set_max_size(GEN_MAXIMUM_TAG_SIZE);
+    for (i=0; i < sizeof(item_counts)/sizeof(item_counts[0]); i++) {
+        for (j=0; j < sizeof(value_sizes)/sizeof(value_sizes[0]); j++) {
+            for (mixed=0; mixed < 2; mixed++) {
+                for (id3=0; id3 < 2; id3++) {
+                    if (gen_file(argv[1], item_counts[i], value_sizes[j], mixed, id3) != 0) {
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/notag.tag", argv[1]);
+    if ((file = fopen(path, "w")) == NULL || fseek(file, GEN_AUDIO_SIZE - 1, SEEK_SET) != 0 || 
+        fputc('\0', file) == EOF || fclose(file) != 0) {
+        err(1, "%s", path);
+    }
+
+    return 0;
+}
+
+int gen_file(const char *dir, uint32_t item_count, uint32_t value_size, int mixed, int id3) {
+    char path[4096];
+    struct ApeTag *tag;
+    FILE *file;
+    uint32_t i;
+
+    snprintf(path, sizeof(path), "%s/items%u_value%u_%s_%s.tag", dir, (unsigned)item_count, 
+             (unsigned)value_size, mixed ? "mixed" : "utf8", id3 ? "id3" : "noid3");
+    if ((file = fopen(path, "w+")) == NULL || fseek(file, GEN_AUDIO_SIZE - 1, SEEK_SET) != 0 || 
+        fputc('\0', file) == EOF || fflush(file) != 0) {
+        warn("%s", path);
+        return -1;
+    }
+    if ((tag = ApeTag_new(file, id3 ? 0 : APE_NO_ID3)) == NULL) {
+        warn("%s", path);
+        return -1;
+    }
+
+    for (i=0; i < item_count; i++) {
+        if (gen_add_item(tag, i, value_size, mixed && i % 2 == 1) != 0) {
+            warnx("%s: %s", path, ApeTag_error(tag));
+            return -1;
+        }
+    }
+    if (ApeTag_update(tag) != 0) {
+        warnx("%s: %s", path, ApeTag_error(tag));
+        return -1;
+    }
+    if (ApeTag_free(tag) != 0 || fclose(file) != 0) {
+        warn("%s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+Adds an item with a pseudo-random value.  The first items use common key
+names so the ID3v1 tag has something in it, the rest are numbered.
+*/
+int gen_add_item(struct ApeTag *tag, uint32_t i, uint32_t value_size, int binary) {
+    static const char *keys[] = {"Title", "Artist", "Album", "Year", "Comment", "Track", "Genre"};
+    struct ApeItem *item;
+    uint32_t j;
+
+    if ((item = malloc(sizeof(struct ApeItem))) == NULL || 
+        (item->key = malloc(16)) == NULL || (item->value = malloc(value_size)) == NULL) {
+        err(1, NULL);
+    }
+    if (i < sizeof(keys)/sizeof(keys[0]) && !binary) {
+        snprintf(item->key, 16, "%s", keys[i]);
+    } else {
+        snprintf(item->key, 16, "Key%03u", (unsigned)i);
+    }
+    item->size = value_size;
+    item->flags = binary ? APE_ITEM_BINARY : APE_ITEM_UTF8;
+    for (j=0; j < value_size; j++) {
+        item->value[j] = binary ? (char)(gen_random() & 0xff) : (char)('a' + gen_random() % 26);
+    }
+
+    return ApeTag_add_item(tag, item);
+}
+
+/* Small deterministic generator, so corpora are the same on every run */
+uint32_t gen_random(void) {
+    seed = seed * 1103515245U + 12345U;
+    return seed >> 16;
+}
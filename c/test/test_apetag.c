@@ -17,7 +17,25 @@ int test_ApeTag_remove(void);
 int test_ApeTag_raw(void);
 int test_ApeTag_parse(void);
 int test_ApeTag_update(void);
+int test_ApeTag_serialize(void);
+int test_ApeTag_new_io(void);
+int test_ApeTag_ranges(void);
+int test_ApeTag_open(void);
+int test_ApeTag_reset(void);
+int test_ApeTag_item_cursor(void);
+int test_ApeItem_values(void);
+int test_ApeTag_stats(void);
+int test_ApeTag_allocator(void);
 int test_ApeTag_add_remove_clear_items_update(void);
+int test_ApeTag_cache(void);
+int test_ApeTag_index(void);
+int test_ApeTag_snapshot(void);
+int test_ApeTag_lru(void);
+int test_ApeTag_update_atomic(void);
+int test_ApeTag_update_many(void);
+int test_ApeTag_delta_writes(void);
+int test_ApeTag_padding(void);
+int test_ApeTag_copy_tag(void);
 int test_ApeTag_filesizes(void);
 int test_ApeItem_validity(void);
 int test_bad_tags(void);
@@ -27,6 +45,45 @@ int test_ApeItem__parse_track(void);
 int test_ApeItem__compare(void);
 int test_ApeTag__lookup_genre(void);
 int test_ApeTag_iter_items(struct ApeTag *tag, struct ApeItem *item, void *data);
+int test_ApeTag_snapshot_iter_items(const struct ApeItem *item, void *data);
+void *test_ApeTag_snapshot_thread(void *data);
+
+/* In-memory I/O backend used to test ApeTag_new_io */
+struct mem_file {
+    char data[8192];
+    off_t size;
+};
+
+static ssize_t mem_read(void *ctx, void *buf, size_t size, off_t offset);
+static ssize_t mem_write(void *ctx, const void *buf, size_t size, off_t offset);
+static int mem_truncate(void *ctx, off_t length);
+static off_t mem_size(void *ctx);
+
+static const struct ApeTag_io mem_io = {mem_read, mem_write, mem_truncate, mem_size};
+static const struct ApeTag_io mem_read_only_io = {mem_read, NULL, NULL, mem_size};
+
+/* Stand-in for a remote store serving byte ranges, counting requests */
+struct range_server {
+    char data[4096];
+    off_t size;
+    int requests;
+};
+
+static const void *range_fetch(struct range_server *rs, const struct ApeTag_range *range);
+
+/* Allocator used to test ApeTag_set_allocator, counting live allocations.
+   Allocations fail once budget allocations have been made, unless budget
+   is negative. */
+struct counting_allocator {
+    long live;
+    long allocations;
+    long budget;
+    long null_frees;
+};
+
+static void *counting_malloc(void *ctx, size_t size);
+static void *counting_realloc(void *ctx, void *ptr, size_t size);
+static void counting_free(void *ctx, void *ptr);
 
 #ifndef TEST_TAGS_DIR
 #  define TEST_TAGS_DIR "test/tags"
@@ -69,6 +126,24 @@ int run_tests(void) {
     CHECK_FAILURE(test_ApeTag_raw);
     CHECK_FAILURE(test_ApeTag_parse);
     CHECK_FAILURE(test_ApeTag_update);
+    CHECK_FAILURE(test_ApeTag_serialize);
+    CHECK_FAILURE(test_ApeTag_new_io);
+    CHECK_FAILURE(test_ApeTag_ranges);
+    CHECK_FAILURE(test_ApeTag_open);
+    CHECK_FAILURE(test_ApeTag_reset);
+    CHECK_FAILURE(test_ApeTag_item_cursor);
+    CHECK_FAILURE(test_ApeItem_values);
+    CHECK_FAILURE(test_ApeTag_stats);
+    CHECK_FAILURE(test_ApeTag_allocator);
+    CHECK_FAILURE(test_ApeTag_cache);
+    CHECK_FAILURE(test_ApeTag_index);
+    CHECK_FAILURE(test_ApeTag_snapshot);
+    CHECK_FAILURE(test_ApeTag_lru);
+    CHECK_FAILURE(test_ApeTag_update_atomic);
+    CHECK_FAILURE(test_ApeTag_update_many);
+    CHECK_FAILURE(test_ApeTag_delta_writes);
+    CHECK_FAILURE(test_ApeTag_padding);
+    CHECK_FAILURE(test_ApeTag_copy_tag);
     CHECK_FAILURE(test_ApeTag_filesizes);
     CHECK_FAILURE(test_ApeItem_validity);
     CHECK_FAILURE(test_bad_tags);
@@ -88,7 +163,6 @@ int test_ApeTag_new_free(void) {
     struct ApeTag *tag;
     FILE *file;
     
-    CHECK(ApeTag_new(NULL, 0) == NULL);
     CHECK(file = fopen("example1.tag", "r+"));
     CHECK(tag = ApeTag_new(file, 0));
     CHECK(tag->file == file && tag->items == NULL && tag->tag_header == NULL && \
@@ -377,6 +451,1769 @@ int test_ApeTag_update(void) {
     return 0;
 }
 
+/*
+Allocates an item with copies of the key and value, for ApeTag_add_item or
+ApeTag_replace_item to take ownership of.  If value is NULL, the value is
+size 'x' bytes.
+
+Returns the item, or NULL if it couldn't be allocated.
+*/
+static struct ApeItem *new_test_item(const char *key, const char *value, uint32_t size) {
+    struct ApeItem *item;
+
+    if ((item = malloc(sizeof(struct ApeItem))) == NULL) {
+        return NULL;
+    }
+    item->key = malloc(strlen(key) + 1);
+    item->value = malloc(size + 1);
+    if (item->key == NULL || item->value == NULL) {
+        free(item->key);
+        free(item->value);
+        free(item);
+        return NULL;
+    }
+    memcpy(item->key, key, strlen(key) + 1);
+    if (value != NULL) {
+        memcpy(item->value, value, size);
+    } else {
+        memset(item->value, 'x', size);
+    }
+    item->size = size;
+    item->flags = 0;
+    return item;
+}
+
+/*
+Parses the tag and makes the change the update tests write, adding a 100
+byte Blah item and removing the title.
+
+Returns 0 on success, -1 on error.
+*/
+static int modify_example_tag(struct ApeTag *tag) {
+    if (ApeTag_parse(tag) != 0 ||
+        ApeTag_add_item(tag, new_test_item("Blah", NULL, 100)) != 0 ||
+        ApeTag_remove_item(tag, "Title") != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int test_ApeTag_serialize(void) {
+    struct ApeTag *tag;
+    FILE *file;
+    char *before;
+    char *buf;
+    char *empty_ape_id3;
+    
+    #define TEST_SERIALIZE(FILENAME, SIZE, CHANGED, ID3) \
+        CHECK(file = fopen(FILENAME, "r")); \
+        CHECK(before = malloc(SIZE)); \
+        CHECK(SIZE == fread(before, 1, SIZE, file)); \
+        CHECK(tag = ApeTag_new(file, 0)); \
+        CHECK(ApeTag_parse(tag) == 0); \
+        CHECK(ApeTag_serialized_size(tag) == (CHANGED ? 192 : SIZE)); \
+        CHECK(buf = malloc(ApeTag_serialized_size(tag))); \
+        CHECK(ApeTag_serialize(tag, buf, ApeTag_serialized_size(tag) - 1) == -1); \
+        CHECK(ApeTag_error_code(tag) == APETAG_ARGERR); \
+        CHECK(ApeTag_serialize(tag, NULL, ApeTag_serialized_size(tag)) == -1); \
+        CHECK(ApeTag_error_code(tag) == APETAG_ARGERR); \
+        CHECK(ApeTag_serialize(tag, buf, ApeTag_serialized_size(tag)) == 0); \
+        CHECK(memcmp(CHANGED ? empty_ape_id3 : before, buf, ApeTag_serialized_size(tag)) == 0); \
+        CHECK(ID3 == 0 || memcmp(buf + ApeTag_serialized_size(tag) - ID3, "TAG", 3) == 0); \
+        CHECK(memcmp(buf + ApeTag_serialized_size(tag) - ID3 - 32, "APETAGEX", 8) == 0); \
+        CHECK(fseek(file, 0, SEEK_END) == 0); \
+        CHECK(ftell(file) == SIZE); \
+        CHECK(ApeTag_free(tag) == 0); \
+        CHECK(fclose(file) == 0); \
+        free(before); \
+        free(buf);
+    
+    CHECK(file = fopen("empty_ape_id3.tag", "r"));
+    CHECK(empty_ape_id3 = malloc(192));
+    CHECK(192 == fread(empty_ape_id3, 1, 192, file));
+    CHECK(fclose(file) == 0);
+    
+    CHECK(ApeTag_serialized_size(NULL) == 0);
+    CHECK(ApeTag_serialize(NULL, empty_ape_id3, 192) == -1);
+    TEST_SERIALIZE("empty_ape.tag", 64, 0, 0);
+    TEST_SERIALIZE("empty_ape_id3.tag", 192, 0, 128);
+    TEST_SERIALIZE("empty_id3.tag", 128, 1, 128);
+    TEST_SERIALIZE("example1.tag", 208, 0, 0);
+    TEST_SERIALIZE("example1_id3.tag", 336, 0, 128);
+    TEST_SERIALIZE("example2.tag", 185, 0, 0);
+    TEST_SERIALIZE("example2_id3.tag", 313, 0, 128);
+    TEST_SERIALIZE("empty_file.tag", 0, 1, 128);
+    
+    #undef TEST_SERIALIZE
+    
+    /* Tags without a file are treated as an empty file, so a tag built in
+       memory serializes to the same bytes as one written to a new file */
+    CHECK(file = fopen("example1_id3.tag", "r"));
+    CHECK(before = malloc(336));
+    CHECK(336 == fread(before, 1, 336, file));
+    CHECK(fclose(file) == 0);
+    CHECK(tag = ApeTag_new(NULL, 0));
+    CHECK(ApeTag_exists(tag) == 0);
+    CHECK(ApeTag_add_item(tag, new_test_item("Track", "1", 1)) == 0);
+    CHECK(ApeTag_add_item(tag, new_test_item("Date", "2007", 4)) == 0);
+    CHECK(ApeTag_add_item(tag, new_test_item("Comment", "XXXX-0000", 9)) == 0);
+    CHECK(ApeTag_add_item(tag, new_test_item("Title", "Love Cheese", 11)) == 0);
+    CHECK(ApeTag_add_item(tag, new_test_item("Artist", "Test Artist", 11)) == 0);
+    CHECK(ApeTag_add_item(tag, new_test_item("Album", "Test Album\0Other Album", 22)) == 0);
+    CHECK(ApeTag_serialized_size(tag) == 336);
+    CHECK(buf = malloc(336));
+    CHECK(ApeTag_serialize(tag, buf, 336) == 0);
+    CHECK(memcmp(before, buf, 336) == 0);
+    CHECK(ApeTag_update(tag) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_FILEERR);
+    CHECK(ApeTag_free(tag) == 0);
+    free(before);
+    free(buf);
+    
+    free(empty_ape_id3);
+    return 0;
+}
+
+static void *counting_malloc(void *ctx, size_t size) {
+    struct counting_allocator *ca = ctx;
+    void *ptr;
+    if (ca->budget >= 0 && ca->allocations >= ca->budget) {
+        return NULL;
+    }
+    if ((ptr = malloc(size)) != NULL) {
+        ca->allocations++;
+        ca->live++;
+    }
+    return ptr;
+}
+
+static void *counting_realloc(void *ctx, void *ptr, size_t size) {
+    struct counting_allocator *ca = ctx;
+    if (ptr == NULL) {
+        return counting_malloc(ctx, size);
+    }
+    if (ca->budget >= 0 && ca->allocations >= ca->budget) {
+        return NULL;
+    }
+    ca->allocations++;
+    return realloc(ptr, size);
+}
+
+static void counting_free(void *ctx, void *ptr) {
+    struct counting_allocator *ca = ctx;
+    if (ptr != NULL) {
+        ca->live--;
+        free(ptr);
+    } else {
+        ca->null_frees++;
+    }
+}
+
+static ssize_t mem_read(void *ctx, void *buf, size_t size, off_t offset) {
+    struct mem_file *mf = ctx;
+    if (offset > mf->size) {
+        return -1;
+    }
+    if ((off_t)size > mf->size - offset) {
+        size = (size_t)(mf->size - offset);
+    }
+    memcpy(buf, mf->data + offset, size);
+    return (ssize_t)size;
+}
+
+static ssize_t mem_write(void *ctx, const void *buf, size_t size, off_t offset) {
+    struct mem_file *mf = ctx;
+    if (offset + (off_t)size > (off_t)sizeof(mf->data)) {
+        return -1;
+    }
+    memcpy(mf->data + offset, buf, size);
+    if (offset + (off_t)size > mf->size) {
+        mf->size = offset + (off_t)size;
+    }
+    return (ssize_t)size;
+}
+
+static int mem_truncate(void *ctx, off_t length) {
+    struct mem_file *mf = ctx;
+    if (length > (off_t)sizeof(mf->data)) {
+        return -1;
+    }
+    mf->size = length;
+    return 0;
+}
+
+static off_t mem_size(void *ctx) {
+    return ((struct mem_file *)ctx)->size;
+}
+
+int test_ApeTag_new_io(void) {
+    struct ApeTag *tag;
+    struct ApeItem *item;
+    struct mem_file mf;
+    FILE *file;
+    int fd;
+    char example1_id3[336];
+    char example2_id3[313];
+    char buf[336];
+    char *raw;
+    uint32_t raw_size;
+    
+    CHECK(file = fopen("example1_id3.tag", "r"));
+    CHECK(336 == fread(example1_id3, 1, 336, file));
+    CHECK(fclose(file) == 0);
+    CHECK(file = fopen("example2_id3.tag", "r"));
+    CHECK(313 == fread(example2_id3, 1, 313, file));
+    CHECK(fclose(file) == 0);
+    
+    CHECK(ApeTag_new_io(NULL, &mf, 0) == NULL);
+    CHECK(ApeTag_new_io(&mem_io, &mf, 0) != NULL);
+    
+    /* In-memory backend */
+    memcpy(mf.data, example1_id3, 336);
+    mf.size = 336;
+    CHECK(tag = ApeTag_new_io(&mem_io, &mf, 0));
+    CHECK(ApeTag_exists(tag) == 1);
+    CHECK(ApeTag_exists_id3(tag) == 1);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_remove_item(tag, "Title") == 0);
+    CHECK(ApeTag_remove_item(tag, "Track") == 0);
+    CHECK(item = malloc(sizeof(struct ApeItem)));
+    CHECK(item->key = malloc(5));
+    CHECK(item->value = malloc(4));
+    item->size = 4;
+    item->flags = 0;
+    memcpy(item->key, "Blah", 5);
+    memcpy(item->value, "Blah", 4);
+    CHECK(ApeTag_add_item(tag, item) == 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(mf.size == 313);
+    CHECK(memcmp(mf.data, example2_id3, 313) == 0);
+    CHECK(ApeTag_remove(tag) == 0);
+    CHECK(mf.size == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    /* Read only backend can parse but not write */
+    memcpy(mf.data, example1_id3, 336);
+    mf.size = 336;
+    CHECK(tag = ApeTag_new_io(&mem_read_only_io, &mf, 0));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_update(tag) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_FILEERR);
+    CHECK(ApeTag_remove(tag) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_FILEERR);
+    CHECK(mf.size == 336);
+    CHECK(memcmp(mf.data, example1_id3, 336) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    /* File descriptor backend */
+    system("cp example2_id3.tag example2_id3.tag.0");
+    CHECK((fd = open("example2_id3.tag.0", O_RDWR)) != -1);
+    system("rm example2_id3.tag.0");
+    CHECK(tag = ApeTag_new_io(&ApeTag_fd_io, &fd, 0));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 5);
+    CHECK(ApeTag_clear_items(tag) == 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(lseek(fd, 0, SEEK_END) == 192);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(tag = ApeTag_new_io(&ApeTag_fd_io, &fd, 0));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 0);
+    CHECK(ApeTag_exists_id3(tag) == 1);
+    CHECK(ApeTag_raw(tag, &raw, &raw_size) == 0);
+    CHECK(raw_size == 192);
+    CHECK(pread(fd, buf, 192, 0) == 192);
+    CHECK(memcmp(buf, raw, 192) == 0);
+    free(raw);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(close(fd) == 0);
+    
+    return 0;
+}
+
+static const void *range_fetch(struct range_server *rs, const struct ApeTag_range *range) {
+    rs->requests++;
+    return rs->data + range->offset;
+}
+
+int test_ApeTag_ranges(void) {
+    struct ApeTag *tag;
+    struct ApeItem *item;
+    struct range_server rs;
+    struct ApeTag_range ranges[2];
+    const void *data[2];
+    enum ApeTag_errcode errcode;
+    const char *error;
+    FILE *file;
+    char *raw;
+    uint32_t raw_size;
+    
+    /* Fills the whole buffer with spaces rather than just the padding, so
+       the fill length is never a zero constant */
+    #define LOAD_SERVER(FILENAME, SIZE, PADDING) \
+        memset(rs.data, ' ', sizeof(rs.data)); \
+        CHECK(file = fopen(FILENAME, "r")); \
+        CHECK(SIZE == fread(rs.data + PADDING, 1, SIZE, file)); \
+        CHECK(fclose(file) == 0); \
+        rs.size = PADDING + SIZE; \
+        rs.requests = 0;
+    
+    #define PLAN_FETCH(FLAGS, BODY) \
+        ApeTag_plan_tail(rs.size, FLAGS, &ranges[0]); \
+        data[0] = range_fetch(&rs, &ranges[0]); \
+        CHECK(ApeTag_plan_body(rs.size, FLAGS, &ranges[0], data[0], &ranges[1], &errcode, &error) == BODY); \
+        if (ranges[1].size > 0) { \
+            data[1] = range_fetch(&rs, &ranges[1]); \
+        }
+    
+    /* Tag with id3 after audio data, fetched in two requests */
+    LOAD_SERVER("example1_id3.tag", 336, 1000);
+    PLAN_FETCH(0, 1);
+    CHECK(ranges[0].offset == 1176 && ranges[0].size == 160);
+    CHECK(ranges[1].offset == 1000 && ranges[1].size == 176);
+    CHECK(rs.requests == 2);
+    CHECK(tag = ApeTag_new_from_ranges(rs.size, 0, ranges, data, 2));
+    memset(rs.data, 0, sizeof(rs.data));
+    CHECK(ApeTag_exists_id3(tag) == 1);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(item = ApeTag_get_item(tag, "title"));
+    CHECK(item->size == 11 && memcmp(item->value, "Love Cheese", 11) == 0);
+    CHECK(ApeTag_raw(tag, &raw, &raw_size) == 0);
+    CHECK(raw_size == 336);
+    LOAD_SERVER("example1_id3.tag", 336, 1000);
+    CHECK(memcmp(raw, rs.data + 1000, 336) == 0);
+    free(raw);
+    CHECK(ApeTag_update(tag) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_FILEERR);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    /* Ignoring id3 only requires the footer in the tail */
+    LOAD_SERVER("example1.tag", 208, 1000);
+    PLAN_FETCH(APE_NO_ID3, 1);
+    CHECK(ranges[0].offset == 1176 && ranges[0].size == 32);
+    CHECK(ranges[1].offset == 1000 && ranges[1].size == 176);
+    CHECK(tag = ApeTag_new_from_ranges(rs.size, APE_NO_ID3, ranges, data, 2));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    /* A larger tail that already covers the tag needs a single request */
+    LOAD_SERVER("example2_id3.tag", 313, 100);
+    ranges[0].offset = 0;
+    ranges[0].size = (size_t)rs.size;
+    data[0] = range_fetch(&rs, &ranges[0]);
+    CHECK(ApeTag_plan_body(rs.size, 0, &ranges[0], data[0], &ranges[1], NULL, NULL) == 1);
+    CHECK(ranges[1].size == 0);
+    CHECK(rs.requests == 1);
+    CHECK(tag = ApeTag_new_from_ranges(rs.size, 0, ranges, data, 1));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 5);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    /* Files without an ape tag */
+    LOAD_SERVER("empty_id3.tag", 128, 1000);
+    PLAN_FETCH(0, 0);
+    CHECK(ranges[1].size == 0);
+    CHECK(tag = ApeTag_new_from_ranges(rs.size, 0, ranges, data, 1));
+    CHECK(ApeTag_exists(tag) == 0);
+    CHECK(ApeTag_exists_id3(tag) == 1);
+    CHECK(ApeTag_free(tag) == 0);
+    LOAD_SERVER("empty_file.tag", 0, 10);
+    PLAN_FETCH(0, 0);
+    CHECK(ranges[0].size == 0);
+    CHECK(tag = ApeTag_new_from_ranges(rs.size, 0, ranges, data, 1));
+    CHECK(ApeTag_exists(tag) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    /* Footer is checked the same way as when reading from a file */
+    LOAD_SERVER("example1_id3.tag", 336, 0);
+    rs.data[336-128-32+20] = '\2';
+    PLAN_FETCH(0, -1);
+    CHECK(errcode == APETAG_CORRUPTTAG);
+    CHECK(strcmp(error, "bad tag footer flags") == 0);
+    LOAD_SERVER("example1_id3.tag", 336, 0);
+    rs.data[336-128-32+16] = '\101';
+    PLAN_FETCH(0, -1);
+    CHECK(errcode == APETAG_LIMITEXCEEDED);
+    CHECK(strcmp(error, "tag item count larger than allowed") == 0);
+    LOAD_SERVER("example1_id3.tag", 336, 0);
+    rs.data[336-128-32+13] = '\1';
+    PLAN_FETCH(0, -1);
+    CHECK(errcode == APETAG_CORRUPTTAG);
+    CHECK(strcmp(error, "tag larger than possible size") == 0);
+    
+    /* Header is checked when the tag is parsed */
+    LOAD_SERVER("example1_id3.tag", 336, 0);
+    rs.data[0] = 'X';
+    PLAN_FETCH(0, 1);
+    CHECK(tag = ApeTag_new_from_ranges(rs.size, 0, ranges, data, 2));
+    CHECK(ApeTag_parse(tag) == -1);
+    CHECK(strcmp(ApeTag_error(tag), "missing APE header") == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    /* Bad arguments */
+    ApeTag_plan_tail(rs.size, 0, &ranges[0]);
+    ranges[0].size = 100;
+    CHECK(ApeTag_plan_body(rs.size, 0, &ranges[0], rs.data, &ranges[1], &errcode, &error) == -1);
+    CHECK(errcode == APETAG_ARGERR);
+    ranges[0].offset = rs.size - 100;
+    CHECK(ApeTag_plan_body(rs.size, 0, &ranges[0], rs.data, &ranges[1], &errcode, &error) == -1);
+    CHECK(errcode == APETAG_ARGERR);
+    CHECK(ApeTag_plan_body(rs.size, 0, NULL, rs.data, &ranges[1], &errcode, &error) == -1);
+    CHECK(errcode == APETAG_ARGERR);
+    ranges[0].offset = rs.size;
+    CHECK(ApeTag_new_from_ranges(rs.size, 0, ranges, data, 1) == NULL);
+    CHECK(ApeTag_new_from_ranges(rs.size, 0, NULL, NULL, 1) == NULL);
+    
+    #undef PLAN_FETCH
+    #undef LOAD_SERVER
+    
+    return 0;
+}
+
+int test_ApeTag_open(void) {
+    struct ApeTag *tag;
+    int fd;
+    char buf[192];
+    char empty_ape_id3[192];
+    
+    CHECK((fd = open("empty_ape_id3.tag", O_RDONLY)) != -1);
+    CHECK(pread(fd, empty_ape_id3, 192, 0) == 192);
+    CHECK(close(fd) == 0);
+    
+    CHECK(ApeTag_new_fd(-1, 0) == NULL);
+    CHECK(ApeTag_open(NULL, O_RDONLY, 0) == NULL);
+    CHECK(ApeTag_open("does-not-exist.tag", O_RDONLY, 0) == NULL);
+    CHECK(errno == ENOENT);
+    
+    /* Files can't be created, since no mode is given for them */
+    CHECK(ApeTag_open("does-not-exist.tag", O_RDWR | O_CREAT, 0) == NULL);
+    CHECK(errno == EINVAL);
+#ifdef O_TMPFILE
+    CHECK(ApeTag_open(".", O_RDWR | O_TMPFILE, 0) == NULL);
+    CHECK(errno == EINVAL);
+#endif
+    CHECK(access("does-not-exist.tag", F_OK) == -1);
+    
+    /* ApeTag_open owns and closes the descriptor */
+    CHECK(tag = ApeTag_open("example1_id3.tag", O_RDONLY, 0));
+    CHECK((tag->flags & (APE_FD_HINTS|APE_CLOSE_FD)) == (APE_FD_HINTS|APE_CLOSE_FD));
+    fd = tag->fd;
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_exists_id3(tag) == 1);
+    CHECK(ApeTag_update(tag) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_FILEERR);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(fcntl(fd, F_GETFD) == -1);
+    
+    CHECK(tag = ApeTag_open("example2.tag", O_RDONLY, APE_NO_ID3));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 5);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    /* ApeTag_new_fd leaves the descriptor open */
+    system("cp example2_id3.tag example2_id3.tag.0");
+    CHECK((fd = open("example2_id3.tag.0", O_RDWR)) != -1);
+    system("rm example2_id3.tag.0");
+    CHECK(tag = ApeTag_new_fd(fd, 0));
+    CHECK((tag->flags & (APE_FD_HINTS|APE_CLOSE_FD)) == APE_FD_HINTS);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 5);
+    CHECK(ApeTag_clear_items(tag) == 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(fcntl(fd, F_GETFD) != -1);
+    CHECK(lseek(fd, 0, SEEK_END) == 192);
+    CHECK(pread(fd, buf, 192, 0) == 192);
+    CHECK(memcmp(buf, empty_ape_id3, 192) == 0);
+    CHECK(close(fd) == 0);
+    
+    return 0;
+}
+
+int test_ApeTag_reset(void) {
+    struct ApeTag *tag;
+    struct ApeItem *item;
+    FILE *file;
+    FILE *file2;
+    DB *items;
+    char *tag_data;
+    char *tag_header;
+    char *tag_footer;
+    int fd;
+    
+    CHECK(ApeTag_reset(NULL, NULL, 0) == -1);
+    
+    CHECK(file = fopen("example1_id3.tag", "r"));
+    CHECK(tag = ApeTag_new(file, 0));
+    
+    /* Resetting without a file releases the file, leaving an empty tag */
+    CHECK(ApeTag_reset(tag, NULL, 0) == 0);
+    CHECK(tag->file == NULL && ApeTag_exists(tag) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 0);
+    CHECK(ApeTag_reset(tag, file, 0) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    items = tag->items;
+    tag_data = tag->tag_data;
+    tag_header = tag->tag_header;
+    tag_footer = tag->tag_footer;
+    CHECK(ApeTag_get_item(tag, "notthere") == NULL);
+    CHECK(ApeTag_error_code(tag) == APETAG_NOTPRESENT);
+    
+    /* Smaller tag reuses the buffers and database */
+    CHECK(file2 = fopen("example2.tag", "r"));
+    CHECK(ApeTag_reset(tag, file2, APE_NO_ID3) == 0);
+    CHECK(tag->file == file2 && tag->flags == (APE_DEFAULT_FLAGS | APE_NO_ID3));
+    CHECK(ApeTag_error_code(tag) == APETAG_NOERR && ApeTag_error(tag) == NULL);
+    CHECK(ApeTag_item_count(tag) == 0 && ApeTag_file_item_count(tag) == 0 && ApeTag_size(tag) == 0);
+    CHECK(ApeTag_get_item(tag, "album") == NULL);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 5);
+    CHECK(ApeTag_size(tag) == 185);
+    CHECK(item = ApeTag_get_item(tag, "blah"));
+    CHECK(item->size == 4 && memcmp(item->value, "Blah", 4) == 0);
+    CHECK(ApeTag_get_item(tag, "track") == NULL);
+    CHECK(tag->items == items);
+    CHECK(tag->tag_data == tag_data);
+    CHECK(tag->tag_header == tag_header);
+    CHECK(tag->tag_footer == tag_footer);
+    
+    /* File without a tag */
+    CHECK(ApeTag_reset(tag, file, 0) == 0);
+    CHECK(fclose(file2) == 0);
+    CHECK(file2 = fopen("empty_file.tag", "r"));
+    CHECK(ApeTag_reset(tag, file2, 0) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_exists(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 0);
+    CHECK(ApeTag_get_item(tag, "album") == NULL);
+    CHECK(ApeTag_error_code(tag) == APETAG_NOTPRESENT);
+    
+    /* Back to the original file.  Clearing the old items when parsing
+       must not clear the tag information, or it is read again */
+    CHECK(ApeTag_reset(tag, file, 0) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(tag->flags & APE_CHECKED_APE);
+    CHECK(ApeTag_clear_items(tag) == 0);
+    CHECK((tag->flags & (APE_CHECKED_APE | APE_CHECKED_FIELDS)) == APE_CHECKED_APE);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_exists_id3(tag) == 1);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    /* Resetting a tag from ApeTag_open closes the descriptor */
+    CHECK(tag = ApeTag_open("example1.tag", O_RDONLY, 0));
+    fd = tag->fd;
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_reset(tag, file2, 0) == 0);
+    CHECK(fcntl(fd, F_GETFD) == -1);
+    CHECK(!(tag->flags & (APE_CLOSE_FD|APE_FD_HINTS)));
+    CHECK(ApeTag_exists(tag) == 0);
+    
+    /* Tags can be reset to a descriptor, or to a path they open and own */
+    CHECK(ApeTag_reset_fd(tag, -1, 0) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    CHECK(ApeTag_reset_fd(tag, fileno(file), 0) == 0);
+    CHECK(tag->io == &ApeTag_fd_io && tag->file == NULL);
+    CHECK((tag->flags & (APE_CLOSE_FD|APE_FD_HINTS)) == APE_FD_HINTS);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_reset_open(tag, NULL, O_RDONLY, 0) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    CHECK(ApeTag_reset_open(tag, "does-not-exist.tag", O_RDONLY, 0) == -1);
+    CHECK(errno == ENOENT && ApeTag_error_code(tag) == APETAG_FILEERR);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_reset_open(tag, "example2.tag", O_RDONLY, APE_NO_ID3) == 0);
+    CHECK(fcntl(fileno(file), F_GETFD) != -1);
+    CHECK((tag->flags & (APE_CLOSE_FD|APE_FD_HINTS)) == (APE_CLOSE_FD|APE_FD_HINTS));
+    fd = tag->fd;
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 5);
+    CHECK(ApeTag_reset_open(tag, "example1.tag", O_RDONLY, 0) == 0);
+    CHECK(fcntl(fd, F_GETFD) == -1);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    fd = tag->fd;
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(fcntl(fd, F_GETFD) == -1);
+    
+    CHECK(fclose(file) == 0);
+    CHECK(fclose(file2) == 0);
+    
+    return 0;
+}
+
+int test_ApeTag_item_cursor(void) {
+    struct ApeTag *tag;
+    struct ApeTag_item_cursor cursor;
+    struct ApeItem *item;
+    FILE *file;
+    const char *file_order[] = {"Track", "Date", "Comment", "Title", "Artist", "Album"};
+    const char *new_file_order[] = {"Date", "Comment", "Title", "Artist", "Album", "Track"};
+    const char *sorted_order[] = {"Track", "Date", "Comment", "Title", "Artist", "Album"};
+    struct ApeItem **sorted;
+    int i;
+    
+    CHECK(file = fopen("example1.tag", "r"));
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_item_cursor_first(NULL, tag, APE_CURSOR_FILE_ORDER) == NULL);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    CHECK(ApeTag_item_cursor_first(&cursor, tag, 2) == NULL);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    CHECK(cursor.count == 0 && ApeTag_item_cursor_next(&cursor) == NULL);
+    CHECK(ApeTag_parse(tag) == 0);
+    
+    #define CHECK_CURSOR(ORDER, KEYS) \
+        i = 0; \
+        for (item = ApeTag_item_cursor_first(&cursor, tag, ORDER); item != NULL; item = ApeTag_item_cursor_next(&cursor)) { \
+            CHECK(i < 6); \
+            CHECK(strcmp(item->key, KEYS[i++]) == 0); \
+        } \
+        CHECK(i == 6); \
+        CHECK(ApeTag_error_code(tag) == APETAG_NOTPRESENT); \
+        CHECK(ApeTag_item_cursor_next(&cursor) == NULL);
+    
+    /* Parsed items are in file order, which is already sorted */
+    CHECK_CURSOR(APE_CURSOR_FILE_ORDER, file_order);
+    CHECK_CURSOR(APE_CURSOR_SORTED, file_order);
+    
+    /* Replaced items move to the end of the file order, but not the sorted order */
+    CHECK(item = malloc(sizeof(struct ApeItem)));
+    item->size = 2;
+    item->flags = 0;
+    CHECK(item->key = malloc(6));
+    CHECK(item->value = malloc(2));
+    memcpy(item->key, "Track", 6);
+    memcpy(item->value, "12", 2);
+    CHECK(ApeTag_replace_item(tag, item) == 1);
+    CHECK(tag->item_order[5] == item);
+    CHECK_CURSOR(APE_CURSOR_FILE_ORDER, new_file_order);
+    CHECK_CURSOR(APE_CURSOR_SORTED, sorted_order);
+    
+    /* Sorting doesn't allocate and reuses the same array */
+    sorted = tag->sorted_items;
+    CHECK(ApeTag_serialized_size(tag) == 209);
+    CHECK(tag->sorted_items == sorted);
+    
+    #undef CHECK_CURSOR
+    
+    /* Sorting while a sorted cursor is live keeps its order, including
+       for keys that are prefixes of each other with the same total size */
+    CHECK(ApeTag_clear_items(tag) == 0);
+    CHECK(ApeTag_add_item(tag, new_test_item("Key12", "12", 2)) == 0);
+    CHECK(ApeTag_add_item(tag, new_test_item("Key1", "123", 3)) == 0);
+    CHECK(ApeTag_add_item(tag, new_test_item("Key123", "1", 1)) == 0);
+    CHECK(ApeTag_add_item(tag, new_test_item("Key", "1234", 4)) == 0);
+    CHECK(item = ApeTag_item_cursor_first(&cursor, tag, APE_CURSOR_SORTED));
+    CHECK(strcmp(item->key, "Key") == 0);
+    CHECK(ApeTag_serialized_size(tag) > 0);
+    CHECK(item = ApeTag_item_cursor_next(&cursor));
+    CHECK(strcmp(item->key, "Key1") == 0);
+    CHECK(item = ApeTag_item_cursor_next(&cursor));
+    CHECK(strcmp(item->key, "Key12") == 0);
+    CHECK(ApeTag_serialized_size(tag) > 0);
+    CHECK(item = ApeTag_item_cursor_next(&cursor));
+    CHECK(strcmp(item->key, "Key123") == 0);
+    CHECK(ApeTag_item_cursor_next(&cursor) == NULL);
+    
+    /* Empty tags return no items */
+    CHECK(ApeTag_clear_items(tag) == 0);
+    CHECK(ApeTag_item_cursor_first(&cursor, tag, APE_CURSOR_SORTED) == NULL);
+    CHECK(ApeTag_error_code(tag) == APETAG_NOTPRESENT);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(fclose(file) == 0);
+    
+    return 0;
+}
+
+int test_ApeItem_values(void) {
+    struct ApeItem item;
+    uint32_t cursor;
+    uint32_t length;
+    const char *value;
+    char multi[] = "Artist 1\0\0Artist 3\0";
+    
+    item.flags = 0;
+    item.key = "Artist";
+    item.value = multi;
+    
+    #define CHECK_VALUE(VALUE, LENGTH) \
+        CHECK(ApeItem_next_value(&item, &cursor, &value, &length) == 1); \
+        CHECK(length == LENGTH); \
+        CHECK(memcmp(value, VALUE, LENGTH) == 0);
+    
+    /* Empty values, including a trailing one, are returned */
+    item.size = sizeof(multi) - 1;
+    CHECK(ApeItem_value_count(&item) == 4);
+    cursor = 0;
+    CHECK_VALUE("Artist 1", 8);
+    CHECK(value == multi);
+    CHECK_VALUE("", 0);
+    CHECK_VALUE("Artist 3", 8);
+    CHECK_VALUE("", 0);
+    CHECK(value == multi + item.size);
+    CHECK(ApeItem_next_value(&item, &cursor, &value, &length) == 0);
+    CHECK(ApeItem_next_value(&item, &cursor, &value, &length) == 0);
+    
+    /* Values without a separator are returned as a single value */
+    item.size = 8;
+    CHECK(ApeItem_value_count(&item) == 1);
+    cursor = 0;
+    CHECK_VALUE("Artist 1", 8);
+    CHECK(ApeItem_next_value(&item, &cursor, &value, &length) == 0);
+    
+    #undef CHECK_VALUE
+    
+    /* Empty items have no values */
+    item.size = 0;
+    CHECK(ApeItem_value_count(&item) == 0);
+    cursor = 0;
+    CHECK(ApeItem_next_value(&item, &cursor, &value, &length) == 0);
+    
+    CHECK(ApeItem_next_value(NULL, &cursor, &value, &length) == -1);
+    CHECK(ApeItem_next_value(&item, NULL, &value, &length) == -1);
+    CHECK(ApeItem_next_value(&item, &cursor, NULL, &length) == -1);
+    CHECK(ApeItem_next_value(&item, &cursor, &value, NULL) == -1);
+    
+    return 0;
+}
+
+int test_ApeTag_stats(void) {
+    struct ApeTag *tag;
+    struct ApeTag_stats stats;
+    struct ApeTag_stats global_before;
+    struct ApeTag_stats global_after;
+    struct mem_file mf;
+    FILE *file;
+    
+    CHECK(file = fopen("example1_id3.tag", "r"));
+    CHECK(336 == fread(mf.data, 1, 336, file));
+    CHECK(fclose(file) == 0);
+    mf.size = 336;
+    
+    CHECK(tag = ApeTag_new_io(&mem_io, &mf, 0));
+    CHECK(ApeTag_get_stats(tag, NULL) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    CHECK(ApeTag_get_global_stats(NULL) == -1);
+    
+#ifndef APE_NO_STATS
+    CHECK(ApeTag_get_stats(tag, &stats) == 0);
+    CHECK(stats.reads == 0);
+    CHECK(stats.allocations == 1);
+    
+    /* Reads the id3 tag, the footer, then the header and data together */
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_get_stats(tag, &stats) == 0);
+    CHECK(stats.reads == 4);
+    CHECK(stats.seeks == 3);
+    CHECK(stats.bytes_read == 336);
+    CHECK(stats.writes == 0);
+    CHECK(stats.allocations > 1);
+    
+    /* Writes the whole tag sequentially from the start of the ape tag */
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_get_stats(tag, &stats) == 0);
+    CHECK(stats.writes == 4);
+    CHECK(stats.seeks == 4);
+    CHECK(stats.bytes_written == 336);
+    
+    /* Counters are added to the global totals when the tag is freed */
+    CHECK(ApeTag_get_global_stats(&global_before) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(ApeTag_get_global_stats(&global_after) == 0);
+    CHECK(global_after.bytes_read == global_before.bytes_read + 336);
+    CHECK(global_after.bytes_written == global_before.bytes_written + 336);
+    CHECK(global_after.writes == global_before.writes + 4);
+    CHECK(global_after.allocations == global_before.allocations + stats.allocations);
+    
+    /* And when it is reset, which also zeroes them */
+    CHECK(file = fopen("example1_id3.tag", "r"));
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_reset(tag, file, 0) == 0);
+    CHECK(ApeTag_get_stats(tag, &stats) == 0);
+    CHECK(stats.reads == 0);
+    CHECK(stats.bytes_read == 0);
+    CHECK(ApeTag_get_global_stats(&global_before) == 0);
+    CHECK(global_before.bytes_read == global_after.bytes_read + 336);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(fclose(file) == 0);
+#else
+    CHECK(ApeTag_get_stats(tag, &stats) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_NOTPRESENT);
+    CHECK(ApeTag_get_global_stats(&global_before) == -1);
+    CHECK(ApeTag_free(tag) == 0);
+    (void)file;
+    (void)global_after;
+#endif
+    
+    return 0;
+}
+
+int test_ApeTag_allocator(void) {
+    struct ApeTag *tag;
+    struct ApeTag_allocator allocator = {counting_malloc, counting_realloc, counting_free, NULL};
+    struct ApeTag_allocator bad = {counting_malloc, NULL, counting_free, NULL};
+    struct ApeTag_allocator current;
+    struct counting_allocator ca = {0, 0, -1, 0};
+    struct ApeItem **items;
+    uint32_t num_items;
+    FILE *file;
+    
+    allocator.ctx = &ca;
+    CHECK(ApeTag_set_allocator(&bad) == -1);
+    ApeTag_get_allocator(NULL, &current);
+    CHECK(current.malloc != counting_malloc);
+    
+    /* The process-wide allocator is used for the tag and everything in it */
+    CHECK(ApeTag_set_allocator(&allocator) == 0);
+    CHECK(file = fopen("example1_id3.tag", "r"));
+    CHECK(tag = ApeTag_new(file, 0));
+    ApeTag_get_allocator(tag, &current);
+    CHECK(current.ctx == &ca);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(items = ApeTag_get_items(tag, &num_items));
+    CHECK(num_items == 6);
+    counting_free(&ca, items);
+    CHECK(ca.live > 0);
+    CHECK(ApeTag_reset(tag, file, 0) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(ca.live == 0);
+    CHECK(ca.null_frees == 0);
+    CHECK(ApeTag_set_allocator(NULL) == 0);
+    ApeTag_get_allocator(NULL, &current);
+    CHECK(current.ctx == NULL);
+    
+    /* A tag's allocator can be set before it is used, and can enforce a budget */
+    ca.allocations = 0;
+    ca.budget = 5;
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_set_tag_allocator(tag, &bad) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    CHECK(ApeTag_set_tag_allocator(tag, &allocator) == 0);
+    CHECK(ApeTag_parse(tag) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_MEMERR);
+    CHECK(ca.allocations == 5);
+    CHECK(ApeTag_set_tag_allocator(tag, NULL) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(ca.live == 0);
+    
+    /* Without a budget, the same tag parses */
+    ca.budget = -1;
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_set_tag_allocator(tag, &allocator) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(ca.live == 0);
+    CHECK(ca.null_frees == 0);
+    CHECK(fclose(file) == 0);
+    
+    return 0;
+}
+
+int test_ApeTag_cache(void) {
+    struct ApeTag *tag;
+    struct ApeTag_cache *cache;
+    struct ApeTag_stats stats;
+    struct ApeItem *item;
+    struct stat sb;
+    off_t cache_size;
+    FILE *file;
+    
+    CHECK(ApeTag_cache_open(NULL) == NULL);
+    CHECK(ApeTag_set_cache(NULL, NULL) == -1);
+    system("cp example1_id3.tag cache.tag.0");
+    system("rm -f test.cache");
+    
+    /* The first scan reads the file and adds it to the cache */
+    CHECK(cache = ApeTag_cache_open("test.cache"));
+    CHECK(file = fopen("cache.tag.0", "r+"));
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_set_cache(tag, cache) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+#ifndef APE_NO_STATS
+    CHECK(ApeTag_get_stats(tag, &stats) == 0);
+    CHECK(stats.cache_misses == 1);
+    CHECK(stats.cache_hits == 0);
+    CHECK(stats.reads > 0);
+#endif
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(ApeTag_cache_close(cache) == 0);
+    CHECK(stat("test.cache", &sb) == 0);
+    CHECK(sb.st_size > 16 + 336);
+    cache_size = sb.st_size;
+    
+    /* Later scans of the unmodified file don't read it */
+    CHECK(cache = ApeTag_cache_open("test.cache"));
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_set_cache(tag, cache) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_exists_id3(tag) == 1);
+#ifndef APE_NO_STATS
+    CHECK(ApeTag_get_stats(tag, &stats) == 0);
+    CHECK(stats.cache_hits == 1);
+    CHECK(stats.reads == 0);
+#endif
+    
+    /* Modifying the file invalidates its cached tag */
+    CHECK(item = malloc(sizeof(struct ApeItem)));
+    CHECK(item->key = malloc(5));
+    CHECK(item->value = malloc(4));
+    item->size = 4;
+    item->flags = 0;
+    memcpy(item->key, "Blah", 5);
+    memcpy(item->value, "Blah", 4);
+    CHECK(ApeTag_add_item(tag, item) == 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_set_cache(tag, cache) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 7);
+#ifndef APE_NO_STATS
+    CHECK(ApeTag_get_stats(tag, &stats) == 0);
+    CHECK(stats.cache_misses == 1);
+#endif
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(ApeTag_cache_close(cache) == 0);
+    
+    /* Records torn by a crash are removed when the cache is opened, keeping
+       the records before them */
+    CHECK(stat("test.cache", &sb) == 0);
+    cache_size = sb.st_size;
+    system("printf garbage >> test.cache");
+    CHECK(cache = ApeTag_cache_open("test.cache"));
+    CHECK(stat("test.cache", &sb) == 0);
+    CHECK(sb.st_size == cache_size);
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_set_cache(tag, cache) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 7);
+#ifndef APE_NO_STATS
+    CHECK(ApeTag_get_stats(tag, &stats) == 0);
+    CHECK(stats.cache_hits == 1);
+#endif
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(ApeTag_cache_close(cache) == 0);
+    CHECK(fclose(file) == 0);
+    system("rm cache.tag.0");
+    
+    /* Files that aren't caches are rejected */
+    system("printf 'not a cache file' > test.cache");
+    CHECK(ApeTag_cache_open("test.cache") == NULL);
+    CHECK(errno == EINVAL);
+    system("rm test.cache");
+    (void)stats;
+    
+    return 0;
+}
+
+int test_ApeTag_index(void) {
+    struct ApeTag *tag;
+    struct ApeTag_index_writer *writer;
+    struct ApeTag_index *index;
+    struct ApeTag_allocator allocator = {counting_malloc, counting_realloc, counting_free, NULL};
+    struct counting_allocator ca = {0, 0, -1, 0};
+    struct ApeItem view;
+    struct ApeItem *item;
+    uint64_t offset;
+    uint32_t file;
+    uint32_t i;
+    FILE *file1;
+    FILE *file2;
+    
+    CHECK(writer = ApeTag_index_writer_new());
+    CHECK(file1 = fopen("example1_id3.tag", "r"));
+    CHECK(file2 = fopen("empty_file.tag", "r"));
+    CHECK(tag = ApeTag_new(file1, 0));
+    CHECK(ApeTag_index_writer_add(writer, NULL, tag) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_index_writer_add(writer, "z/example1_id3.tag", tag) == 0);
+    CHECK(ApeTag_index_writer_add(writer, "example1_id3.tag", tag) == 0);
+    CHECK(ApeTag_reset(tag, file2, 0) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_index_writer_add(writer, "empty_file.tag", tag) == 0);
+    CHECK(ApeTag_index_writer_write(writer, "test.idx") == 0);
+    ApeTag_index_writer_free(writer);
+    CHECK(ApeTag_reset(tag, file1, 0) == 0);
+    CHECK(ApeTag_parse(tag) == 0);
+    
+    /* Files are sorted by filename */
+    CHECK(ApeTag_index_open(NULL) == NULL);
+    CHECK(index = ApeTag_index_open("test.idx"));
+    CHECK(ApeTag_index_file_count(index) == 3);
+    CHECK(strcmp(ApeTag_index_filename(index, 0), "empty_file.tag") == 0);
+    CHECK(strcmp(ApeTag_index_filename(index, 1), "example1_id3.tag") == 0);
+    CHECK(strcmp(ApeTag_index_filename(index, 2), "z/example1_id3.tag") == 0);
+    CHECK(ApeTag_index_filename(index, 3) == NULL);
+    CHECK(ApeTag_index_find_file(index, "empty_file.tag", &file) == 0);
+    CHECK(file == 0);
+    CHECK(ApeTag_index_item_count(index, file) == 0);
+    CHECK(ApeTag_index_find_file(index, "missing.tag", &file) == 1);
+    CHECK(ApeTag_index_find_file(index, "z/example1_id3.tag", &file) == 0);
+    CHECK(file == 2);
+    
+    /* Items are views of the items in the tag, in file order */
+    CHECK(ApeTag_index_item_count(index, file) == 6);
+    for (i=0; i < 6; i++) {
+        CHECK(ApeTag_index_get_item(index, file, i, &view) == 0);
+        CHECK(item = ApeTag_get_item(tag, view.key));
+        CHECK(strcmp(item->key, view.key) == 0);
+        CHECK(item->size == view.size);
+        CHECK(item->flags == view.flags);
+        CHECK(memcmp(item->value, view.value, view.size) == 0);
+    }
+    CHECK(ApeTag_index_get_item(index, file, 6, &view) == -1);
+    CHECK(ApeTag_index_get_item(index, file, 0, &view) == 0);
+    CHECK(strcmp(view.key, "Track") == 0);
+    
+    /* Keys are looked up case insensitively, using the sorted key table */
+    CHECK(ApeTag_index_key_count(index) == 6);
+    for (i=1; i < 6; i++) {
+        CHECK(strcmp(ApeTag_index_key(index, i-1), ApeTag_index_key(index, i)) < 0);
+    }
+    CHECK(ApeTag_index_key(index, 6) == NULL);
+    CHECK(ApeTag_index_lookup(index, file, "tITLE", &view) == 0);
+    CHECK(strcmp(view.key, "Title") == 0);
+    CHECK(view.size == 11);
+    CHECK(memcmp(view.value, "Love Cheese", 11) == 0);
+    CHECK(ApeTag_index_lookup(index, 1, "title", &view) == 0);
+    CHECK(ApeTag_index_lookup(index, 0, "title", &view) == 1);
+    CHECK(ApeTag_index_lookup(index, 1, "missing", &view) == 1);
+    CHECK(ApeTag_index_lookup(index, 3, "title", &view) == -1);
+    CHECK(ApeTag_index_close(index) == 0);
+    
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(fclose(file1) == 0);
+    CHECK(fclose(file2) == 0);
+    
+    /* Files that aren't snapshots are rejected */
+    CHECK(ApeTag_index_open("example1.tag") == NULL);
+    CHECK(errno == EINVAL);
+    
+    /* Keys whose hashes collide are interned separately, and a longer key
+       isn't compared past the end of a shorter one */
+    CHECK(writer = ApeTag_index_writer_new());
+    CHECK(offset = ApeTag__index_intern(writer, "VfT", 3)->offset);
+    CHECK(ApeTag__fnv1a(2166136261U, "VfT", 3) == ApeTag__fnv1a(2166136261U, "OiaDa", 5));
+    CHECK(ApeTag__index_intern(writer, "OiaDa", 5)->offset != offset);
+    CHECK(ApeTag__index_intern(writer, "VfT", 3)->offset == offset);
+    CHECK(writer->interned_count == 2);
+    ApeTag_index_writer_free(writer);
+    
+    /* Writers that never allocated their tables don't free NULL pointers */
+    allocator.ctx = &ca;
+    CHECK(ApeTag_set_allocator(&allocator) == 0);
+    CHECK(writer = ApeTag_index_writer_new());
+    CHECK(ApeTag_index_writer_write(writer, "test.idx") == 0);
+    ApeTag_index_writer_free(writer);
+    CHECK(writer = ApeTag_index_writer_new());
+    ApeTag_index_writer_free(writer);
+    CHECK(ApeTag_set_allocator(NULL) == 0);
+    CHECK(ca.live == 0 && ca.null_frees == 0);
+    CHECK(index = ApeTag_index_open("test.idx"));
+    CHECK(ApeTag_index_file_count(index) == 0);
+    CHECK(ApeTag_index_close(index) == 0);
+    system("rm test.idx");
+    
+    return 0;
+}
+
+int test_ApeTag_snapshot(void) {
+    struct ApeTag *tag;
+    struct ApeTag_snapshot *snapshot;
+    const struct ApeItem *item;
+    pthread_t threads[4];
+    void *ret;
+    char *raw_tag;
+    const char *snapshot_raw;
+    uint32_t raw_size;
+    uint32_t snapshot_raw_size;
+    uint32_t count = 0;
+    int i;
+    FILE *file;
+    
+    CHECK(file = fopen("example1_id3.tag", "r"));
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(snapshot = ApeTag_snapshot(tag));
+    CHECK(ApeTag_raw(tag, &raw_tag, &raw_size) == 0);
+    
+    /* The snapshot has the parsed items in file order and the raw tag */
+    CHECK(ApeTag_snapshot_item_count(snapshot) == 6);
+    CHECK(item = ApeTag_snapshot_item(snapshot, 0));
+    CHECK(strcmp(item->key, "Track") == 0);
+    CHECK(ApeTag_snapshot_item(snapshot, 6) == NULL);
+    CHECK(snapshot_raw = ApeTag_snapshot_raw(snapshot, &snapshot_raw_size));
+    CHECK(snapshot_raw_size == 336 && raw_size == 336);
+    CHECK(memcmp(snapshot_raw, raw_tag, raw_size) == 0);
+    free(raw_tag);
+    
+    /* It is unaffected by changes to the tag or freeing it */
+    CHECK(ApeTag_remove_item(tag, "Title") == 0);
+    CHECK(ApeTag_clear_items(tag) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(fclose(file) == 0);
+    CHECK(ApeTag_snapshot_item_count(snapshot) == 6);
+    CHECK(item = ApeTag_snapshot_get_item(snapshot, "tITLE"));
+    CHECK(strcmp(item->key, "Title") == 0);
+    CHECK(item->size == 11 && memcmp(item->value, "Love Cheese", 11) == 0);
+    CHECK(item = ApeTag_snapshot_get_item(snapshot, "album"));
+    CHECK(item->size == 22 && memcmp(item->value, "Test Album\0Other Album", 22) == 0);
+    CHECK(ApeTag_snapshot_get_item(snapshot, "missing") == NULL);
+    CHECK(ApeTag_snapshot_get_item(snapshot, NULL) == NULL);
+    CHECK(ApeTag_snapshot_iter_items(snapshot, test_ApeTag_snapshot_iter_items, &count) == 0);
+    CHECK(count == 6);
+    count = 4;
+    CHECK(ApeTag_snapshot_iter_items(snapshot, test_ApeTag_snapshot_iter_items, &count) == 1);
+    CHECK(count == 7);
+    CHECK(ApeTag_snapshot_iter_items(snapshot, NULL, NULL) == -1);
+    
+    /* Threads holding references can use it after the creator drops its own */
+    for (i=0; i < 4; i++) {
+        CHECK(pthread_create(&threads[i], NULL, test_ApeTag_snapshot_thread, ApeTag_snapshot_ref(snapshot)) == 0);
+    }
+    ApeTag_snapshot_unref(snapshot);
+    for (i=0; i < 4; i++) {
+        CHECK(pthread_join(threads[i], &ret) == 0);
+        CHECK(ret == NULL);
+    }
+    ApeTag_snapshot_unref(NULL);
+    
+    /* Tags without items have empty snapshots */
+    CHECK(file = fopen("empty_file.tag", "r"));
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(snapshot = ApeTag_snapshot(tag));
+    CHECK(ApeTag_snapshot_item_count(snapshot) == 0);
+    CHECK(ApeTag_snapshot_get_item(snapshot, "title") == NULL);
+    CHECK(ApeTag_snapshot_raw(snapshot, &snapshot_raw_size) != NULL && snapshot_raw_size == 0);
+    ApeTag_snapshot_unref(snapshot);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(fclose(file) == 0);
+    
+    return 0;
+}
+
+int test_ApeTag_snapshot_iter_items(const struct ApeItem *item, void *data) {
+    (void)item;
+    return ++*(uint32_t *)data > 6;
+}
+
+/* Looks up every item of the snapshot many times, then drops its reference */
+void *test_ApeTag_snapshot_thread(void *data) {
+    struct ApeTag_snapshot *snapshot = data;
+    const struct ApeItem *item;
+    void *ret = NULL;
+    uint32_t i;
+    int j;
+    
+    for (j=0; j < 1000; j++) {
+        for (i=0; i < ApeTag_snapshot_item_count(snapshot); i++) {
+            item = ApeTag_snapshot_item(snapshot, i);
+            if (ApeTag_snapshot_get_item(snapshot, item->key) != item) {
+                ret = snapshot;
+            }
+        }
+    }
+    ApeTag_snapshot_unref(snapshot);
+    
+    return ret;
+}
+
+int test_ApeTag_lru(void) {
+    struct ApeTag *tag;
+    struct ApeTag_lru *lru;
+    struct ApeTag_lru_stats stats;
+    struct ApeTag_snapshot *snapshot;
+    struct ApeTag_snapshot *snapshot2;
+    enum ApeTag_errcode errcode;
+    const char *error;
+    uint64_t entry_size;
+    uint32_t raw_size;
+    FILE *file;
+    
+    CHECK(ApeTag_lru_new(0, 0) == NULL);
+    CHECK(errno == EINVAL);
+    CHECK(ApeTag_lru_get(NULL, "lru.tag.0", 0, &errcode, &error) == NULL);
+    CHECK(errcode == APETAG_ARGERR);
+    system("cp example1_id3.tag lru.tag.0");
+    system("cp example1_id3.tag lru.tag.1");
+    system("cp example1_id3.tag lru.tag.2");
+    
+    /* Snapshots are reused until the file changes */
+    CHECK(lru = ApeTag_lru_new(1 << 20, 0));
+    CHECK(snapshot = ApeTag_lru_get(lru, "lru.tag.0", 0, NULL, NULL));
+    CHECK(ApeTag_snapshot_item_count(snapshot) == 6);
+    CHECK(snapshot2 = ApeTag_lru_get(lru, "lru.tag.0", 0, NULL, NULL));
+    CHECK(snapshot == snapshot2);
+    ApeTag_snapshot_unref(snapshot2);
+    CHECK(ApeTag_lru_get_stats(lru, &stats) == 0);
+    CHECK(stats.hits == 1 && stats.misses == 1 && stats.entries == 1);
+    entry_size = stats.bytes;
+    CHECK(entry_size > 336);
+    
+    CHECK(file = fopen("lru.tag.0", "r+"));
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_remove_item(tag, "Title") == 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(fclose(file) == 0);
+    CHECK(snapshot2 = ApeTag_lru_get(lru, "lru.tag.0", 0, NULL, NULL));
+    CHECK(snapshot != snapshot2);
+    CHECK(ApeTag_snapshot_item_count(snapshot2) == 5);
+    CHECK(ApeTag_snapshot_item_count(snapshot) == 6);
+    ApeTag_snapshot_unref(snapshot);
+    ApeTag_snapshot_unref(snapshot2);
+    CHECK(ApeTag_lru_get_stats(lru, &stats) == 0);
+    CHECK(stats.hits == 1 && stats.misses == 2 && stats.invalidations == 1 && stats.entries == 1);
+    
+    /* Flags are part of the identity */
+    CHECK(snapshot = ApeTag_lru_get(lru, "lru.tag.1", APE_NO_ID3, NULL, NULL));
+    CHECK(ApeTag_snapshot_item_count(snapshot) == 0);
+    CHECK(ApeTag_snapshot_raw(snapshot, &raw_size) && raw_size == 0);
+    ApeTag_snapshot_unref(snapshot);
+    CHECK(snapshot = ApeTag_lru_get(lru, "lru.tag.1", 0, NULL, NULL));
+    ApeTag_snapshot_unref(snapshot);
+    CHECK(ApeTag_lru_get_stats(lru, &stats) == 0);
+    CHECK(stats.misses == 4 && stats.invalidations == 2 && stats.entries == 2);
+    
+    /* Explicit invalidation */
+    CHECK(ApeTag_lru_invalidate(lru, "lru.tag.1") == 0);
+    CHECK(ApeTag_lru_invalidate(lru, "lru.tag.1") == 1);
+    CHECK(ApeTag_lru_invalidate(lru, NULL) == -1);
+    CHECK(ApeTag_lru_get_stats(lru, &stats) == 0);
+    CHECK(stats.invalidations == 3 && stats.entries == 1);
+    
+    /* Missing files are errors */
+    CHECK(ApeTag_lru_get(lru, "lru.tag.missing", 0, &errcode, &error) == NULL);
+    CHECK(errcode == APETAG_FILEERR);
+    CHECK(strcmp(error, "stat") == 0);
+    
+    /* Snapshots outlive the cache */
+    CHECK(snapshot = ApeTag_lru_get(lru, "lru.tag.0", 0, NULL, NULL));
+    ApeTag_lru_free(lru);
+    CHECK(ApeTag_snapshot_item_count(snapshot) == 5);
+    ApeTag_snapshot_unref(snapshot);
+    ApeTag_lru_free(NULL);
+    
+    /* The least recently used snapshot is evicted when over budget */
+    CHECK(lru = ApeTag_lru_new(entry_size * 5 / 2, 1));
+    CHECK(snapshot = ApeTag_lru_get(lru, "lru.tag.1", 0, NULL, NULL));
+    ApeTag_snapshot_unref(snapshot);
+    CHECK(snapshot = ApeTag_lru_get(lru, "lru.tag.2", 0, NULL, NULL));
+    ApeTag_snapshot_unref(snapshot);
+    CHECK(snapshot = ApeTag_lru_get(lru, "lru.tag.1", 0, NULL, NULL));
+    ApeTag_snapshot_unref(snapshot);
+    CHECK(snapshot = ApeTag_lru_get(lru, "lru.tag.0", 0, NULL, NULL));
+    ApeTag_snapshot_unref(snapshot);
+    CHECK(ApeTag_lru_get_stats(lru, &stats) == 0);
+    CHECK(stats.hits == 1 && stats.misses == 3 && stats.evictions == 1 && stats.entries == 2);
+    CHECK(stats.bytes <= entry_size * 5 / 2);
+    CHECK(snapshot = ApeTag_lru_get(lru, "lru.tag.1", 0, NULL, NULL));
+    ApeTag_snapshot_unref(snapshot);
+    CHECK(ApeTag_lru_invalidate(lru, "lru.tag.2") == 1);
+    ApeTag_lru_free(lru);
+    
+    /* Snapshots larger than a shard's budget are not cached */
+    CHECK(lru = ApeTag_lru_new(entry_size - 1, 1));
+    CHECK(snapshot = ApeTag_lru_get(lru, "lru.tag.1", 0, NULL, NULL));
+    ApeTag_snapshot_unref(snapshot);
+    CHECK(ApeTag_lru_get_stats(lru, &stats) == 0);
+    CHECK(stats.misses == 1 && stats.entries == 0 && stats.bytes == 0);
+    ApeTag_lru_free(lru);
+    
+    system("rm lru.tag.0 lru.tag.1 lru.tag.2");
+    
+    return 0;
+}
+
+int test_ApeTag_update_atomic(void) {
+    struct ApeTag *tag;
+    struct ApeTag *tags[3];
+    struct ApeTag_group *group;
+    struct ApeTag_allocator allocator = {counting_malloc, counting_realloc, counting_free, NULL};
+    struct counting_allocator ca = {0, 0, -1, 0};
+    struct mem_file mf;
+    struct stat sb;
+    off_t size;
+    FILE *file;
+    FILE *files[3];
+    char name[16];
+    char command[64];
+    int i;
+    
+    #define ATOMIC_OPEN(NAME) \
+        system("cp example1_id3.tag " NAME); \
+        CHECK(file = fopen(NAME, "r+")); \
+        CHECK(tag = ApeTag_new(file, 0)); \
+        CHECK(modify_example_tag(tag) == 0);
+    #define ATOMIC_CLOSE \
+        CHECK(ApeTag_free(tag) == 0); \
+        CHECK(fclose(file) == 0);
+    
+    /* Journaled updates write the same file as ApeTag_update */
+    ATOMIC_OPEN("atomic.ref");
+    CHECK(ApeTag_update(tag) == 0);
+    ATOMIC_CLOSE;
+    ATOMIC_OPEN("atomic.0");
+    CHECK(ApeTag_update_atomic(tag, APE_SYNC_NONE, NULL) == 0);
+    ATOMIC_CLOSE;
+    CHECK(system("cmp -s atomic.0 atomic.ref") == 0);
+    ATOMIC_OPEN("atomic.0");
+    CHECK(ApeTag_update_atomic(tag, APE_SYNC_FILE, NULL) == 0);
+    CHECK(ApeTag_item_count(tag) == 6 && ApeTag_file_item_count(tag) == 6);
+    ATOMIC_CLOSE;
+    CHECK(system("cmp -s atomic.0 atomic.ref") == 0);
+    system("cp example1_id3.tag atomic.0");
+    CHECK(tag = ApeTag_open("atomic.0", O_RDWR, 0));
+    CHECK(modify_example_tag(tag) == 0);
+    CHECK(ApeTag_update_atomic(tag, APE_SYNC_FILE, NULL) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(system("cmp -s atomic.0 atomic.ref") == 0);
+    
+    /* Syncing needs a file descriptor, and groups are only for group commits */
+    CHECK(group = ApeTag_group_new());
+    ATOMIC_OPEN("atomic.0");
+    CHECK(ApeTag_update_atomic(tag, APE_SYNC_GROUP, NULL) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    CHECK(ApeTag_update_atomic(tag, APE_SYNC_FILE, group) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    ATOMIC_CLOSE;
+    memset(&mf, 0, sizeof(mf));
+    CHECK(tag = ApeTag_new_io(&mem_io, &mf, 0));
+    CHECK(ApeTag_update_atomic(tag, APE_SYNC_FILE, NULL) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_ARGERR);
+    CHECK(strcmp(ApeTag_error(tag), "sync not supported by I/O backend") == 0);
+    CHECK(ApeTag_update_atomic(tag, APE_SYNC_NONE, NULL) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(mf.size == 64 + 128);
+    
+    /* Group commits leave each file's journal in place until committed */
+    for (i=0; i < 3; i++) {
+        snprintf(name, sizeof(name), "atomic.%d", i+1);
+        snprintf(command, sizeof(command), "cp example1_id3.tag %s", name);
+        system(command);
+        CHECK(files[i] = fopen(name, "r+"));
+        CHECK(tags[i] = ApeTag_new(files[i], 0));
+        CHECK(modify_example_tag(tags[i]) == 0);
+        CHECK(ApeTag_update_atomic(tags[i], APE_SYNC_GROUP, group) == 0);
+        CHECK(fflush(files[i]) == 0 && stat(name, &sb) == 0);
+        CHECK(sb.st_size > 336 + 336);
+    }
+    CHECK(ApeTag_group_commit(group) == 0);
+    CHECK(ApeTag_group_commit(group) == 0);
+    CHECK(ApeTag_group_commit(NULL) == -1);
+    ApeTag_group_free(group);
+    ApeTag_group_free(NULL);
+    allocator.ctx = &ca;
+    CHECK(ApeTag_set_allocator(&allocator) == 0);
+    CHECK(group = ApeTag_group_new());
+    ApeTag_group_free(group);
+    CHECK(ApeTag_set_allocator(NULL) == 0);
+    CHECK(ca.live == 0 && ca.null_frees == 0);
+    for (i=0; i < 3; i++) {
+        CHECK(ApeTag_free(tags[i]) == 0);
+        CHECK(fclose(files[i]) == 0);
+    }
+    CHECK(system("cmp -s atomic.1 atomic.ref") == 0);
+    CHECK(system("cmp -s atomic.2 atomic.ref") == 0);
+    CHECK(system("cmp -s atomic.3 atomic.ref") == 0);
+    
+    /* A crash after the journal's copy is written is rolled forward, even
+       if the tag was partly overwritten */
+    ATOMIC_OPEN("atomic.0");
+    CHECK(ApeTag__update_id3(tag) == 0);
+    CHECK(ApeTag__update_ape(tag) == 0);
+    CHECK(ApeTag__journal_begin(tag) == 0);
+    CHECK(ApeTag__journal_copy(tag) == 0);
+    CHECK(ApeTag__write(tag, "torn", 4, tag->offset + 40) == 0);
+    ATOMIC_CLOSE;
+    CHECK(stat("atomic.0", &sb) == 0);
+    size = sb.st_size;
+    CHECK(file = fopen("atomic.0", "r"));
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_get_item(tag, "blah") != NULL);
+    ATOMIC_CLOSE;
+    CHECK(stat("atomic.0", &sb) == 0 && sb.st_size == size);
+    CHECK(file = fopen("atomic.0", "r+"));
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_item_count(tag) == 6);
+    CHECK(ApeTag_get_item(tag, "blah") != NULL);
+    ATOMIC_CLOSE;
+    CHECK(system("cmp -s atomic.0 atomic.ref") == 0);
+    
+    /* A crash before then is rolled back.  Read-only files are read as
+       they would be afterward, and are left for a writer to finish */
+    ATOMIC_OPEN("atomic.0");
+    CHECK(ApeTag__update_id3(tag) == 0);
+    CHECK(ApeTag__update_ape(tag) == 0);
+    CHECK(ApeTag__journal_begin(tag) == 0);
+    ATOMIC_CLOSE;
+    CHECK(stat("atomic.0", &sb) == 0);
+    size = sb.st_size;
+    CHECK(file = fopen("atomic.0", "r"));
+    CHECK(tag = ApeTag_new(file, 0));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_get_item(tag, "Title") != NULL && ApeTag_get_item(tag, "blah") == NULL);
+    ATOMIC_CLOSE;
+    CHECK(tag = ApeTag_open("atomic.0", O_RDONLY, 0));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_get_item(tag, "Title") != NULL && ApeTag_get_item(tag, "blah") == NULL);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(stat("atomic.0", &sb) == 0 && sb.st_size == size);
+    CHECK(tag = ApeTag_open("atomic.0", O_RDWR, APE_NO_ID3));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(system("cmp -s atomic.0 example1_id3.tag") == 0);
+    
+    system("rm atomic.ref atomic.0 atomic.1 atomic.2 atomic.3");
+    
+    #undef ATOMIC_OPEN
+    #undef ATOMIC_CLOSE
+    return 0;
+}
+
+int test_ApeTag_update_many(void) {
+    struct ApeTag *tags[4];
+    struct mem_file mf;
+    struct ApeTag_allocator allocator = {counting_malloc, counting_realloc, counting_free, NULL};
+    struct counting_allocator ca = {0, 0, -1, 0};
+#ifndef APE_NO_STATS
+    struct ApeTag_stats stats;
+#endif
+    FILE *file;
+    int results[4];
+    int i;
+    
+    #define MANY_OPEN \
+        system("cp example1_id3.tag many.0"); \
+        system("cp example1_id3.tag many.1"); \
+        CHECK(tags[0] = ApeTag_open("many.0", O_RDWR, 0)); \
+        CHECK(file = fopen("many.1", "r+")); \
+        CHECK(tags[1] = ApeTag_new(file, 0)); \
+        CHECK(modify_example_tag(tags[0]) == 0); \
+        CHECK(modify_example_tag(tags[1]) == 0);
+    #define MANY_CLOSE \
+        CHECK(ApeTag_free(tags[0]) == 0); \
+        CHECK(ApeTag_free(tags[1]) == 0); \
+        CHECK(fclose(file) == 0); \
+        CHECK(system("cmp -s many.0 many.ref") == 0); \
+        CHECK(system("cmp -s many.1 many.ref") == 0);
+    
+    system("cp example1_id3.tag many.ref");
+    CHECK(tags[0] = ApeTag_open("many.ref", O_RDWR, 0));
+    CHECK(modify_example_tag(tags[0]) == 0);
+    CHECK(ApeTag_update(tags[0]) == 0);
+    CHECK(ApeTag_free(tags[0]) == 0);
+    
+    /* Each tag is updated independently of the others failing */
+    MANY_OPEN;
+    tags[2] = NULL;
+    memset(&mf, 0, sizeof(mf));
+    CHECK(tags[3] = ApeTag_new_io(&mem_io, &mf, 0));
+    CHECK(ApeTag_update_many(tags, 4, 0, results) == -1);
+    CHECK(results[0] == 0 && results[1] == 0 && results[2] == -1 && results[3] == 0);
+    CHECK(mf.size == 64 + 128);
+#if defined(APE_URING) && !defined(APE_NO_STATS)
+    /* Tails of files opened by the library are written with one writev */
+    CHECK(ApeTag_get_stats(tags[0], &stats) == 0);
+    CHECK(stats.writes == 1);
+#endif
+    MANY_CLOSE;
+    
+    /* Syncing needs a file descriptor */
+    MANY_OPEN;
+    tags[2] = tags[3];
+    CHECK(ApeTag_update_many(tags, 3, APE_UPDATE_SYNC, results) == -1);
+    CHECK(results[0] == 0 && results[1] == 0 && results[2] == -1);
+    CHECK(ApeTag_error_code(tags[2]) == APETAG_ARGERR);
+    CHECK(ApeTag_update_many(tags, 2, APE_UPDATE_SYNC, NULL) == 0);
+    MANY_CLOSE;
+    CHECK(ApeTag_free(tags[3]) == 0);
+    
+    /* A batch with no tags using the file descriptor backend */
+    MANY_OPEN;
+    CHECK(ApeTag_update_many(tags + 1, 1, 0, results) == 0);
+    CHECK(results[0] == 0);
+    CHECK(ApeTag_update(tags[0]) == 0);
+    MANY_CLOSE;
+    
+    /* Journaled updates */
+    for (i=0; i < 2; i++) {
+        MANY_OPEN;
+        CHECK(ApeTag_update_many(tags, 2, APE_UPDATE_ATOMIC | (i ? APE_UPDATE_SYNC : 0), results) == 0);
+        CHECK(results[0] == 0 && results[1] == 0);
+        CHECK(ApeTag_item_count(tags[0]) == 6 && ApeTag_file_item_count(tags[0]) == 6);
+        MANY_CLOSE;
+    }
+    
+    errno = 0;
+    CHECK(ApeTag_update_many(NULL, 1, 0, NULL) == -1 && errno == EINVAL);
+    CHECK(ApeTag_update_many(tags, 1, 1 << 2, NULL) == -1 && errno == EINVAL);
+    allocator.ctx = &ca;
+    CHECK(ApeTag_set_allocator(&allocator) == 0);
+    CHECK(ApeTag_update_many(NULL, 0, 0, NULL) == 0);
+    CHECK(ApeTag_set_allocator(NULL) == 0);
+    CHECK(ca.null_frees == 0);
+    
+    system("rm many.ref many.0 many.1");
+    
+    #undef MANY_OPEN
+    #undef MANY_CLOSE
+    return 0;
+}
+
+int test_ApeTag_delta_writes(void) {
+    struct ApeTag *tag;
+    struct ApeTag *ref;
+    struct ApeItem *item;
+#ifndef APE_NO_STATS
+    struct ApeTag_stats stats;
+    struct ApeTag_stats before;
+#endif
+    struct stat sb;
+    
+    /* Each change is made to a tag using delta writes, and to a tag
+       written normally, which must give the same file */
+    #define DELTA_CHANGE(CHANGE) \
+        CHECK(item = ApeTag_get_item(tag, "comment")); \
+        CHANGE; \
+        CHECK(item = ApeTag_get_item(ref, "comment")); \
+        CHANGE; \
+        CHECK(ApeTag_update(tag) == 0); \
+        CHECK(ApeTag_update(ref) == 0); \
+        CHECK(system("cmp -s delta.0 delta.ref") == 0);
+    #define DELTA_STATS(WRITES, BYTES) \
+        CHECK(ApeTag_get_stats(tag, &stats) == 0); \
+        CHECK(stats.writes - before.writes == (WRITES)); \
+        CHECK(stats.bytes_written - before.bytes_written == (BYTES)); \
+        before = stats;
+    
+    system("cp example1_id3.tag delta.0");
+    system("cp example1_id3.tag delta.ref");
+    CHECK(tag = ApeTag_open("delta.0", O_RDWR, APE_DELTA_WRITES));
+    CHECK(ref = ApeTag_open("delta.ref", O_RDWR, 0));
+    CHECK(ApeTag_parse(tag) == 0);
+    CHECK(ApeTag_parse(ref) == 0);
+#ifndef APE_NO_STATS
+    CHECK(ApeTag_get_stats(tag, &before) == 0);
+#endif
+    
+    /* Changing a value keeping its size only writes the changed bytes,
+       here in the item and the id3 comment */
+    DELTA_CHANGE(item->value[8] = '1');
+#ifndef APE_NO_STATS
+    DELTA_STATS(2, 2);
+#endif
+    CHECK(ApeTag_update(tag) == 0);
+#ifndef APE_NO_STATS
+    DELTA_STATS(0, 0);
+#endif
+    
+    /* Nearby changes are written together */
+    DELTA_CHANGE(item->value[0] = 'Y'; item->value[8] = '2');
+#ifndef APE_NO_STATS
+    DELTA_STATS(2, 18);
+#endif
+    
+    /* Changing the tag's length also truncates the file */
+    CHECK(ApeTag_remove_item(tag, "Track") == 0);
+    CHECK(ApeTag_remove_item(ref, "Track") == 0);
+    DELTA_CHANGE((void)0);
+    CHECK(stat("delta.0", &sb) == 0 && sb.st_size == (off_t)ApeTag_serialized_size(tag));
+    
+    /* Updates after a failed update write the whole tag, as the tag
+       buffers no longer match the file */
+    CHECK(ApeTag__update_ape(tag) == 0);
+#ifndef APE_NO_STATS
+    CHECK(ApeTag_get_stats(tag, &before) == 0);
+#endif
+    DELTA_CHANGE(item->value[8] = '3');
+#ifndef APE_NO_STATS
+    DELTA_STATS(4, (uint64_t)sb.st_size);
+#endif
+    
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(ApeTag_free(ref) == 0);
+    
+    /* Files without tags */
+    system("cp empty_file.tag delta.0");
+    CHECK(tag = ApeTag_open("delta.0", O_RDWR, APE_DELTA_WRITES));
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(system("cmp -s delta.0 empty_ape_id3.tag") == 0);
+    
+    system("rm delta.0 delta.ref");
+    
+    #undef DELTA_CHANGE
+    #undef DELTA_STATS
+    return 0;
+}
+
+int test_ApeTag_padding(void) {
+    struct ApeTag *tag;
+    struct ApeItem *item;
+    struct ApeItem **items;
+    struct stat sb;
+    uint32_t num_items;
+    off_t size;
+    
+    #define PADDING_OPEN(FLAGS, PADDING) \
+        CHECK(tag = ApeTag_open("padding.0", O_RDWR, FLAGS)); \
+        CHECK(ApeTag_set_padding(tag, PADDING, 256) == 0); \
+        CHECK(ApeTag_parse(tag) == 0);
+    
+    /* Padding is added after the items, and hidden when parsed */
+    system("cp example1_id3.tag padding.0");
+    PADDING_OPEN(0, "Padding");
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_size(tag) == 208 + 9 + 7 + 256);
+    CHECK(ApeTag_item_count(tag) == 6 && ApeTag_file_item_count(tag) == 7);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(stat("padding.0", &sb) == 0);
+    size = sb.st_size;
+    PADDING_OPEN(0, "PADDING");
+    CHECK(ApeTag_item_count(tag) == 6 && ApeTag_file_item_count(tag) == 7);
+    CHECK(ApeTag_get_item(tag, "padding") == NULL);
+    CHECK(items = ApeTag_get_items(tag, &num_items));
+    CHECK(num_items == 6);
+    free(items);
+    CHECK(ApeTag_free(tag) == 0);
+    PADDING_OPEN(0, NULL);
+    CHECK(ApeTag_item_count(tag) == 7);
+    CHECK(item = ApeTag_get_item(tag, "padding"));
+    CHECK(item->size == 256 && item->flags == APE_ITEM_BINARY);
+    CHECK(ApeTag_set_padding(tag, "Padding", 256) == 0);
+    CHECK(ApeTag_item_count(tag) == 7 - 1);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    /* Growing and shrinking the items uses the padding, keeping the tag
+       the same size */
+    PADDING_OPEN(APE_DELTA_WRITES, "Padding");
+    CHECK(ApeTag_replace_item(tag, new_test_item("Blah", NULL, 200)) >= 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_size(tag) == 208 + 9 + 7 + 256);
+    CHECK(ApeTag_remove_item(tag, "Blah") == 0);
+    CHECK(ApeTag_remove_item(tag, "Title") == 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_free(tag) == 0);
+    CHECK(stat("padding.0", &sb) == 0 && sb.st_size == size);
+    
+    /* Growing past the padding adds new padding, and shrinking so more
+       than twice the padding is left removes the extra */
+    PADDING_OPEN(0, "Padding");
+    CHECK(ApeTag_replace_item(tag, new_test_item("Blah", NULL, 400)) >= 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_size(tag) == 208 - 25 + 400 + 13 + 9 + 7 + 256);
+    CHECK(ApeTag_remove_item(tag, "Blah") == 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_size(tag) == 208 - 25 + 9 + 7 + 256);
+    CHECK(ApeTag_set_padding(tag, "Padding", 100) == 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_size(tag) == 208 - 25 + 9 + 7 + 100);
+    
+    /* Removing the padding */
+    CHECK(ApeTag_replace_item(tag, new_test_item("Blah", NULL, 0)) >= 0);
+    CHECK(ApeTag_remove_item(tag, "Blah") == 0);
+    CHECK(ApeTag_set_padding(tag, NULL, 0) == 0);
+    CHECK(ApeTag_update(tag) == 0);
+    CHECK(ApeTag_size(tag) == 208 - 25);
+    CHECK(ApeTag_item_count(tag) == 5 && ApeTag_file_item_count(tag) == 5);
+    
+    CHECK(ApeTag_set_padding(tag, "id3", 256) == -1);
+    CHECK(ApeTag_error_code(tag) == APETAG_INVALIDITEM);
+    CHECK(ApeTag_set_padding(tag, "x", 256) == -1);
+    CHECK(ApeTag_set_padding(NULL, "Padding", 256) == -1);
+    CHECK(ApeTag_free(tag) == 0);
+    
+    system("rm padding.0");
+    
+    #undef PADDING_OPEN
+    return 0;
+}
+
+int test_ApeTag_copy_tag(void) {
+    struct ApeTag *src;
+    struct ApeTag *dst;
+#ifndef APE_NO_STATS
+    struct ApeTag_stats stats;
+#endif
+    FILE *file;
+    FILE *dst_file;
+    
+    system("dd if=/dev/zero of=copy.audio bs=1000 count=1 2>/dev/null");
+    system("cat copy.audio example1_id3.tag > copy.ref");
+    CHECK(file = fopen("example1_id3.tag", "r"));
+    CHECK(src = ApeTag_new(file, 0));
+    
+    /* Tags are copied over the destination's tags, which are replaced */
+    system("cat copy.audio example2_id3.tag > copy.0");
+    CHECK(dst = ApeTag_open("copy.0", O_RDWR, 0));
+    CHECK(ApeTag_parse(dst) == 0);
+    CHECK(ApeTag_item_count(dst) == 5);
+    CHECK(ApeTag_copy_tag(src, dst) == 0);
+    CHECK(system("cmp -s copy.0 copy.ref") == 0);
+#if defined(HAVE_COPY_FILE_RANGE) && !defined(APE_NO_STATS)
+    CHECK(ApeTag_get_stats(dst, &stats) == 0);
+    CHECK(stats.writes == 1 && stats.bytes_written == 336);
+#endif
+    CHECK(ApeTag_item_count(dst) == 0);
+    CHECK(ApeTag_parse(dst) == 0);
+    CHECK(ApeTag_item_count(dst) == 6);
+    CHECK(ApeTag_get_item(dst, "title") != NULL);
+    CHECK(ApeTag_free(dst) == 0);
+    
+    /* To a file without tags, and through stdio */
+    system("cp copy.audio copy.0");
+    CHECK(dst = ApeTag_open("copy.0", O_RDWR, 0));
+    CHECK(ApeTag_copy_tag(src, dst) == 0);
+    CHECK(ApeTag_free(dst) == 0);
+    CHECK(system("cmp -s copy.0 copy.ref") == 0);
+    system("cat copy.audio example1.tag > copy.0");
+    CHECK(ApeTag_reset(src, file, 0) == 0);
+    CHECK(dst_file = fopen("copy.0", "r+"));
+    CHECK(dst = ApeTag_new(dst_file, 0));
+    CHECK(ApeTag_copy_tag(src, dst) == 0);
+    CHECK(ApeTag_free(dst) == 0);
+    CHECK(fclose(dst_file) == 0);
+    CHECK(system("cmp -s copy.0 copy.ref") == 0);
+    CHECK(ApeTag_free(src) == 0);
+    CHECK(fclose(file) == 0);
+    
+    /* Rendered tags are read again, and copying no tags removes them */
+    CHECK(file = fopen("empty_file.tag", "r"));
+    CHECK(src = ApeTag_new(file, 0));
+    CHECK(ApeTag_serialized_size(src) == 64 + 128);
+    CHECK(ApeTag__update_ape(src) == 0);
+    CHECK(dst = ApeTag_open("copy.0", O_RDWR, 0));
+    CHECK(ApeTag_copy_tag(src, dst) == 0);
+    CHECK(ApeTag_copy_tag(dst, dst) == -1);
+    CHECK(ApeTag_error_code(dst) == APETAG_ARGERR);
+    CHECK(ApeTag_copy_tag(NULL, dst) == -1);
+    CHECK(ApeTag_free(dst) == 0);
+    CHECK(ApeTag_free(src) == 0);
+    CHECK(fclose(file) == 0);
+    CHECK(system("cmp -s copy.0 copy.audio") == 0);
+    
+    system("rm copy.audio copy.ref copy.0");
+    
+    return 0;
+}
+
 int test_ApeTag_filesizes(void) {
     struct ApeTag *tag;
     FILE *file;
@@ -456,7 +2293,7 @@ int test_ApeItem_validity(void) {
     CHECK_VALIDITY(-1);
     item.key="ID3";
     CHECK_VALIDITY(-1);
-    item.key=malloc(260);
+    item.key=calloc(1, 260);
     memcpy(item.key, "TAGS", 5);
     CHECK_VALIDITY(0);
     for (i=0; i < 0x20; i++) {
@@ -512,6 +2349,7 @@ int test_bad_tags(void) {
     unsigned char c;
     int i;
     uint32_t raw_size;
+    const char *error;
     
     #define OPEN_FILE(FILE, RAW, FILENAME) \
         system("cp " FILENAME " " FILENAME ".0"); \
@@ -537,6 +2375,13 @@ int test_bad_tags(void) {
         CHECK(tag = ApeTag_new(FILE, 0)); \
         CHECK(ApeTag_parse(tag) == VALUE); \
         CHECK(ApeTag_error_code(tag) == ERROR); \
+        error = ApeTag_error(tag); \
+        CHECK(ApeTag_free(tag) == 0); \
+        CHECK(tag = ApeTag_new(FILE, 0)); \
+        CHECK(ApeTag_verify(tag) == VALUE); \
+        CHECK(ApeTag_error_code(tag) == ERROR); \
+        CHECK(ApeTag_error(tag) == error); \
+        CHECK(tag->items == NULL); \
         CHECK(ApeTag_free(tag) == 0);
     
     /* Open files check good parse */
@@ -908,9 +2753,13 @@ int test_no_id3(void) {
 int test_ApeTag__strcasecpy(void) {
     int i;
     char s[11];
+    struct ApeTag tag;
+    
+    memset(&tag, 0, sizeof(struct ApeTag));
+    ApeTag_get_allocator(NULL, &tag.allocator);
     
     #define TEST_STRCASECPY(STRING, LENGTH) \
-        CHECK(strcasecmp(ApeTag__strcasecpy(STRING, 6), STRING) == 0);
+        CHECK(strcasecmp(ApeTag__strcasecpy(&tag, STRING, 6), STRING) == 0);
     
     TEST_STRCASECPY("album", 6);
     TEST_STRCASECPY("Album", 6);
@@ -918,7 +2767,7 @@ int test_ApeTag__strcasecpy(void) {
     
     for (i=1; i <= 255; i++) {
         snprintf(s, 10, "0%caZ9", i);
-        CHECK(strcasecmp(ApeTag__strcasecpy(s, 6), s) == 0);
+        CHECK(strcasecmp(ApeTag__strcasecpy(&tag, s, 6), s) == 0);
     }
 
     return 0;
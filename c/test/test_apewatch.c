@@ -0,0 +1,290 @@
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+int assertions = 0;
+
+#define CHECK(RESULT) assertions++; if (!(RESULT)) { return __LINE__; }
+
+int run_tests(void);
+int test_ApeWatch_query(void);
+int test_ApeWatch_events(void);
+int test_ApeWatch_overflow(void);
+
+int start_apewatch(void);
+int query(const char *line, char *response, size_t size);
+int wait_for(const char *line, const char *expect);
+int copy_tag(const char *path);
+void sleep_ms(long ms);
+
+#ifndef TEST_TAGS_DIR
+#  define TEST_TAGS_DIR "tags"
+#endif
+#ifndef APEWATCH
+#  define APEWATCH "../apewatch"
+#endif
+
+/* The example tag, copied into the watched tree */
+static char tag_data[4096];
+static size_t tag_size = 0;
+
+/* Temporary directory with the watched tree and the socket */
+static char tmp_dir[] = "/tmp/test_apewatch.XXXXXX";
+static pid_t pid = -1;
+
+int main(void) {
+    int num_failures = 0;
+    char command[64];
+    FILE *file;
+
+    if ((file = fopen(TEST_TAGS_DIR "/example1.tag", "r")) == NULL) {
+        err(1, "%s", TEST_TAGS_DIR "/example1.tag");
+    }
+    tag_size = fread(tag_data, 1, sizeof(tag_data), file);
+    fclose(file);
+    if (mkdtemp(tmp_dir) == NULL || chdir(tmp_dir) != 0) {
+        err(1, "%s", tmp_dir);
+    }
+
+    num_failures = run_tests();
+
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    snprintf(command, sizeof(command), "rm -rf %s", tmp_dir);
+    system(command);
+    if (num_failures == 0) {
+        printf("\nAll Tests Successful (%i assertions).\n", assertions);
+    } else {
+        printf("\n%i Failed Tests (%i assertions).\n", num_failures, assertions);
+        return 1;
+    }
+    return 0;
+}
+
+int run_tests(void) {
+    int failures = 0;
+    int line = 0;
+
+    #define CHECK_FAILURE(FUNCTION) \
+        if ((line = FUNCTION())) { \
+            failures ++; \
+            printf(#FUNCTION " failed on line %i\n", line) ; \
+        }
+
+    CHECK_FAILURE(test_ApeWatch_query);
+    CHECK_FAILURE(test_ApeWatch_events);
+    CHECK_FAILURE(test_ApeWatch_overflow);
+
+    return failures;
+}
+
+int test_ApeWatch_query(void) {
+    char response[4096];
+
+    CHECK(mkdir("tree", 0755) == 0);
+    CHECK(mkdir("tree/a", 0755) == 0);
+    CHECK(mkdir("tree/a/b", 0755) == 0);
+    CHECK(copy_tag("tree/one.tag") == 0);
+    CHECK(copy_tag("tree/a/b/two.tag") == 0);
+    CHECK(start_apewatch() == 0);
+
+    /* Files are parsed before the socket is listening */
+    CHECK(query("GET\ttree/a/b/two.tag\n", response, sizeof(response)) == 0);
+    CHECK(strncmp(response, "OK 6\nTrack\t1\nDate\t2007\n", 23) == 0);
+    CHECK(strstr(response, "Album\tTest Album\\0Other Album\n") != NULL);
+    CHECK(query("GET\ttree/missing.tag\n", response, sizeof(response)) == 0);
+    CHECK(strcmp(response, "ERR no such file\n") == 0);
+    CHECK(query("FIND\ttitle\tLove Cheese\n", response, sizeof(response)) == 0);
+    CHECK(strncmp(response, "OK 2\n", 5) == 0);
+    CHECK(query("FIND\tAlbum\tOther Album\n", response, sizeof(response)) == 0);
+    CHECK(strncmp(response, "OK 2\n", 5) == 0);
+    CHECK(query("LIST\ttree/a\n", response, sizeof(response)) == 0);
+    CHECK(strcmp(response, "OK 1\ntree/a/b/two.tag\n") == 0);
+    CHECK(query("STATS\n", response, sizeof(response)) == 0);
+    CHECK(strncmp(response, "OK 6\nfiles 2\nitems 12\ndirectories 3\n", 36) == 0);
+    CHECK(query("BLAH\n", response, sizeof(response)) == 0);
+    CHECK(strcmp(response, "ERR invalid query\n") == 0);
+
+    return 0;
+}
+
+int test_ApeWatch_events(void) {
+    char response[4096];
+
+    /* New files and directories are picked up, and removed files dropped */
+    CHECK(mkdir("tree/c", 0755) == 0);
+    CHECK(copy_tag("tree/c/three.tag") == 0);
+    CHECK(wait_for("GET\ttree/c/three.tag\n", "OK 6\n") == 0);
+    CHECK(unlink("tree/one.tag") == 0);
+    CHECK(wait_for("GET\ttree/one.tag\n", "ERR no such file\n") == 0);
+    CHECK(query("STATS\n", response, sizeof(response)) == 0);
+    CHECK(strncmp(response, "OK 6\nfiles 2\nitems 12\ndirectories 4\n", 36) == 0);
+
+    return 0;
+}
+
+int test_ApeWatch_overflow(void) {
+    char response[4096];
+    FILE *file;
+    int max_events;
+    int i;
+    int fd;
+
+    if ((file = fopen("/proc/sys/fs/inotify/max_queued_events", "r")) == NULL) {
+        return 0;
+    }
+    i = fscanf(file, "%d", &max_events);
+    fclose(file);
+    if (i != 1 || max_events > 1000000) {
+        return 0;
+    }
+
+    /* While apewatch is stopped, alternating writes to two files fill its
+       event queue, and the events for the file written afterward are lost */
+    CHECK(kill(pid, SIGSTOP) == 0);
+    for (i=0; i <= max_events; i++) {
+        CHECK((fd = open(i % 2 ? "tree/a/b/two.tag" : "tree/c/three.tag", O_WRONLY)) != -1);
+        CHECK(close(fd) == 0);
+    }
+    CHECK(copy_tag("tree/a/four.tag") == 0);
+    CHECK(kill(pid, SIGCONT) == 0);
+
+    /* The rescan finds the new file, without watching any directory twice */
+    CHECK(wait_for("GET\ttree/a/four.tag\n", "OK 6\n") == 0);
+    CHECK(wait_for("STATS\n", "OK 6\nfiles 3\nitems 18\ndirectories 4\nqueued 0\n") == 0);
+    CHECK(query("LIST\n", response, sizeof(response)) == 0);
+    CHECK(strncmp(response, "OK 3\n", 5) == 0);
+
+    return 0;
+}
+
+/*
+Starts apewatch on the tree, and waits for its socket to accept connections.
+
+Returns 0 on success, -1 on error.
+*/
+int start_apewatch(void) {
+    char response[256];
+    int i;
+
+    if ((pid = fork()) == -1) {
+        return -1;
+    }
+    if (pid == 0) {
+        execl(APEWATCH, APEWATCH, "-d", "10", "-s", "sock", "tree", (char *)NULL);
+        _exit(127);
+    }
+    for (i=0; i < 500; i++) {
+        if (query("STATS\n", response, sizeof(response)) == 0) {
+            return 0;
+        }
+        sleep_ms(10);
+    }
+    return -1;
+}
+
+/*
+Sends a query to apewatch, and reads the whole response as a string.
+
+Returns 0 on success, -1 on error.
+*/
+int query(const char *line, char *response, size_t size) {
+    struct sockaddr_un addr;
+    unsigned long count;
+    size_t length = 0;
+    size_t lines = 0;
+    ssize_t bytes;
+    char *c;
+    int fd;
+    int ret = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, "sock");
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        write(fd, line, strlen(line)) != (ssize_t)strlen(line)) {
+        goto query_error;
+    }
+
+    /* The response is complete after the first line and as many lines as
+       it gives */
+    while (length < size - 1 && (bytes = read(fd, response + length, size - 1 - length)) > 0) {
+        length += (size_t)bytes;
+        response[length] = '\0';
+        for (lines = 0, c = response; (c = strchr(c, '\n')) != NULL; c++) {
+            lines++;
+        }
+        if (lines > 0 && (strncmp(response, "ERR", 3) == 0 ||
+            (sscanf(response, "OK %lu", &count) == 1 && lines > count))) {
+            ret = 0;
+            break;
+        }
+    }
+
+query_error:
+    close(fd);
+    return ret;
+}
+
+/*
+Repeats the query until the response starts with the expected string, giving
+apewatch five seconds to handle the events.
+
+Returns 0 on success, -1 on error.
+*/
+int wait_for(const char *line, const char *expect) {
+    char response[4096];
+    int i;
+
+    for (i=0; i < 500; i++) {
+        if (query(line, response, sizeof(response)) == 0 &&
+            strncmp(response, expect, strlen(expect)) == 0) {
+            return 0;
+        }
+        sleep_ms(10);
+    }
+    return -1;
+}
+
+/*
+Writes a copy of the example tag to the path.
+
+Returns 0 on success, -1 on error.
+*/
+int copy_tag(const char *path) {
+    FILE *file;
+    int ret = 0;
+
+    if ((file = fopen(path, "w")) == NULL) {
+        return -1;
+    }
+    if (fwrite(tag_data, 1, tag_size, file) != tag_size) {
+        ret = -1;
+    }
+    if (fclose(file) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+void sleep_ms(long ms) {
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}